@@ -3,18 +3,18 @@
 
 #include "block.h"
 
-Block::Block() : data(0), length(0), lastaccessed(-1), dirty(false)
+Block::Block() : data(0), length(0), lastaccessed(-1), dirty(false), lsn(0)
 {}
 
 
-Block::Block(const SIZE_T s) : data(0), length(0), lastaccessed(-1), dirty(false)
+Block::Block(const SIZE_T s) : data(0), length(0), lastaccessed(-1), dirty(false), lsn(0)
 {
   Resize(s);
 }
 
 
 
-Block::Block(const Block &rhs) : data(0), length(0), lastaccessed(rhs.lastaccessed), dirty(rhs.dirty)
+Block::Block(const Block &rhs) : data(0), length(0), lastaccessed(rhs.lastaccessed), dirty(rhs.dirty), lsn(rhs.lsn)
 {
   if (Resize(rhs.length)!=ERROR_NOERROR) { 
     throw GenericException();
@@ -22,7 +22,7 @@ Block::Block(const Block &rhs) : data(0), length(0), lastaccessed(rhs.lastaccess
   memcpy(data,rhs.data,rhs.length);
 }
 
-Block::Block(const char * str) : data(0), length(0), lastaccessed(-1), dirty(false)
+Block::Block(const char * str) : data(0), length(0), lastaccessed(-1), dirty(false), lsn(0)
 {
   if (Resize(strlen(str))!=ERROR_NOERROR) { 
     throw GenericException();
@@ -36,11 +36,23 @@ Block::~Block()
   length=0;
   lastaccessed=-1;
   dirty=false;
+  lsn=0;
 }
 
+// Keeps the buffer if it is already the right size
 Block & Block::operator=(const Block &rhs)
 {
-  return *(new (this) Block(rhs));
+  if (this==&rhs) { 
+    return *this;
+  }
+  if (Resize(rhs.length,false)!=ERROR_NOERROR) { 
+    throw GenericException();
+  }
+  memcpy(data,rhs.data,rhs.length);
+  lastaccessed=rhs.lastaccessed;
+  dirty=rhs.dirty;
+  lsn=rhs.lsn;
+  return *this;
 }
 
 
@@ -50,6 +62,11 @@ Block & Block::operator=(const Block &rhs)
 ERROR_T Block::Resize(const SIZE_T newlen, const bool copy)
 {
   BYTE_T *d;
+
+  if (data && newlen==length) { 
+    // searches read key after key into the same block
+    return ERROR_NOERROR;
+  }
   
   try {
     d = new BYTE_T [newlen];
@@ -86,17 +103,17 @@ static char low2hex(BYTE_T x)
 
 
 
-#define MAX(x,y) ((x)>(y) ? (x) : (y))
-
+// Lexicographic, so a block that is a prefix of another sorts first
 bool Block::operator<(const Block &rhs) const
 {
-  return memcmp(data,rhs.data,MAX(length,rhs.length))<0;
+  int c=memcmp(data,rhs.data,MIN(length,rhs.length));
+  return c<0 || (c==0 && length<rhs.length);
 }
 
 
 bool Block::operator==(const Block &rhs) const
 {
-  return memcmp(data,rhs.data,MAX(length,rhs.length))==0;
+  return length==rhs.length && memcmp(data,rhs.data,length)==0;
 }
 
 ostream & Block::Print(ostream &os) const
@@ -105,7 +122,7 @@ ostream & Block::Print(ostream &os) const
   for (SIZE_T i=0;i<length;i++) { 
     os << high2hex(data[i]) << low2hex(data[i]);
   }
-  os << ", lastaccessed="<<lastaccessed<<", dirty="<<dirty<<")";
+  os << ", lastaccessed="<<lastaccessed<<", dirty="<<dirty<<", lsn="<<lsn<<")";
   return os;
 }
 
@@ -12,6 +12,7 @@ struct Block {
   SIZE_T 	length;
   double        lastaccessed;  // for use in buffercache only
   bool          dirty;         // for use in buffercahce only
+  LSN_T         lsn;           // for use in buffercache only, log record of last write
 
   Block();
   Block(const SIZE_T size);
@@ -0,0 +1,198 @@
+#include <string.h>
+
+#include "bloom.h"
+
+
+BloomFilter::BloomFilter(BufferCache *c) :
+  cache(c),
+  firstblock(0),
+  numblocks(0),
+  bitsperblock(0),
+  numprobes(0),
+  numnegatives(0),
+  numfalsepositives(0)
+{
+  NodeMetadata m;
+  m.nodetype=BTREE_BLOOM_BLOCK;
+  m.format=BTREE_FIXED_FORMAT;
+  m.blocksize=c->GetBlockSize();
+  bitsperblock=m.GetNumDataBytes()*8;
+}
+
+
+BloomFilter::~BloomFilter()
+{
+}
+
+
+SIZE_T BloomFilter::GetNumBlocks(const SIZE_T blocksize, const SIZE_T numkeys)
+{
+  NodeMetadata m;
+  m.nodetype=BTREE_BLOOM_BLOCK;
+  m.format=BTREE_FIXED_FORMAT;
+  m.blocksize=blocksize;
+  SIZE_T bits=m.GetNumDataBytes()*8;
+  SIZE_T n=numkeys*BLOOM_BITS_PER_KEY;
+  return n/bits + (n%bits != 0);
+}
+
+
+// Double hashing: the i-th bit of a key is h1+i*h2.  h1 is FNV-1a
+// over the key, and h2 an odd mix of it, so the probes never repeat
+// before they have been all the way round.
+void BloomFilter::Hash(const KEY_T &key, unsigned long long &h1, unsigned long long &h2) const
+{
+  h1=14695981039346656037ULL;
+  for (SIZE_T i=0;i<key.length;i++) {
+    h1^=key.data[i];
+    h1*=1099511628211ULL;
+  }
+  h2=h1;
+  h2^=h2>>33;
+  h2*=0xff51afd7ed558ccdULL;
+  h2^=h2>>33;
+  h2*=0xc4ceb9fe1a85ec53ULL;
+  h2^=h2>>33;
+  h2|=1;
+}
+
+
+ERROR_T BloomFilter::WriteBlock(const SIZE_T i, const bool open)
+{
+  BTreeNode b(BTREE_BLOOM_BLOCK,0,0,cache->GetBlockSize());
+  SIZE_T bytes=bitsperblock/8;
+
+  if (i==0) {
+    b.info.numkeys=numblocks;
+    b.info.level=open;
+  }
+  memcpy(b.data,&bits[i*bytes],bytes);
+  return b.Serialize(cache,firstblock+i);
+}
+
+
+ERROR_T BloomFilter::Format(const SIZE_T first, const SIZE_T n)
+{
+  ERROR_T rc;
+
+  firstblock=first;
+  numblocks=n;
+  bits.assign(numblocks*bitsperblock/8,0);
+  for (SIZE_T i=0;i<numblocks;i++) {
+    if ((rc=WriteBlock(i,false))) {
+      return rc;
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BloomFilter::Load(const SIZE_T first, bool &clean)
+{
+  SIZE_T bytes=bitsperblock/8;
+  ERROR_T rc;
+
+  firstblock=first;
+  numblocks=1;
+  for (SIZE_T i=0;i<numblocks;i++) {
+    BTreeNode b;
+    if ((rc=b.Unserialize(cache,first+i))) {
+      return rc;
+    }
+    if (b.info.nodetype!=BTREE_BLOOM_BLOCK ||
+	(i==0 && (b.info.numkeys<1 || first+b.info.numkeys>cache->GetNumBlocks()))) {
+      return ERROR_INSANE;
+    }
+    if (i==0) {
+      numblocks=b.info.numkeys;
+      clean=(b.info.level==0);
+      bits.assign(numblocks*bytes,0);
+    }
+    memcpy(&bits[i*bytes],b.data,bytes);
+  }
+
+  // until Save(), anything found on disk may be missing keys
+  return WriteBlock(0,true);
+}
+
+
+ERROR_T BloomFilter::Save()
+{
+  ERROR_T rc;
+
+  // the first block last, since it says the rest are current
+  for (SIZE_T i=1;i<numblocks;i++) {
+    if ((rc=WriteBlock(i,false))) {
+      return rc;
+    }
+  }
+  return WriteBlock(0,false);
+}
+
+
+void BloomFilter::Clear()
+{
+  bits.assign(bits.size(),0);
+}
+
+
+void BloomFilter::Add(const KEY_T &key)
+{
+  unsigned long long h1, h2;
+  SIZE_T numbits=GetNumBits();
+
+  Hash(key,h1,h2);
+  for (SIZE_T i=0;i<BLOOM_NUM_HASHES;i++) {
+    SIZE_T bit=(h1+i*h2)%numbits;
+    // lookups read the bits without a lock
+    __sync_fetch_and_or(&bits[bit/8],(BYTE_T)(0x1 << (bit%8)));
+  }
+}
+
+
+bool BloomFilter::MayContain(const KEY_T &key)
+{
+  unsigned long long h1, h2;
+  SIZE_T numbits=GetNumBits();
+
+  __sync_fetch_and_add(&numprobes,1);
+  Hash(key,h1,h2);
+  for (SIZE_T i=0;i<BLOOM_NUM_HASHES;i++) {
+    SIZE_T bit=(h1+i*h2)%numbits;
+    if (!((bits[bit/8] >> (bit%8)) & 0x1)) {
+      __sync_fetch_and_add(&numnegatives,1);
+      return false;
+    }
+  }
+  return true;
+}
+
+
+void BloomFilter::NoteFalsePositive()
+{
+  __sync_fetch_and_add(&numfalsepositives,1);
+}
+
+
+SIZE_T BloomFilter::GetNumBitsSet() const
+{
+  SIZE_T n=0;
+  for (SIZE_T i=0;i<bits.size();i++) {
+    n+=__builtin_popcount(bits[i]);
+  }
+  return n;
+}
+
+
+ostream & BloomFilter::Print(ostream &os) const
+{
+  os << "BloomFilter(firstblock="<<firstblock
+     << ", numblocks="<<numblocks
+     << ", numbits="<<GetNumBits()
+     << ", numbitsset="<<GetNumBitsSet()
+     << ", numprobes="<<numprobes
+     << ", numnegatives="<<numnegatives
+     << ", numfalsepositives="<<numfalsepositives
+     << ")";
+  return os;
+}
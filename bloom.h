@@ -0,0 +1,86 @@
+#ifndef _bloom
+#define _bloom
+
+#include <iostream>
+#include <vector>
+
+#include "global.h"
+#include "buffercache.h"
+#include "btree_ds.h"
+
+using namespace std;
+
+// Bits of filter per key the index is expected to hold, and the
+// number of bits each key sets.  Together they give a false positive
+// rate of about 1%.
+#define BLOOM_BITS_PER_KEY 10
+#define BLOOM_NUM_HASHES   7
+
+//
+// Bloom filter over the keys of an index
+//
+// Every key ever inserted sets BLOOM_NUM_HASHES bits, so a key with
+// any of its bits clear is certainly not in the index and a lookup
+// for it can skip the descent.  Keys are never taken out again, so
+// the filter stays correct, just less selective, if keys go away.
+//
+// The bits live in memory and are persisted in a run of
+// BTREE_BLOOM_BLOCK blocks that are only written by Save().  The
+// first block's numkeys is the number of blocks in the run, and its
+// level is nonzero while an index has the filter open.  A filter
+// found open by Load() was not saved after its last changes, so the
+// index has to Clear() it and add its keys again.
+//
+class BloomFilter {
+ private:
+  BufferCache *cache;
+  SIZE_T firstblock;
+  SIZE_T numblocks;
+  SIZE_T bitsperblock;
+  vector<BYTE_T> bits;
+  volatile SIZE_T numprobes;
+  volatile SIZE_T numnegatives;
+  volatile SIZE_T numfalsepositives;
+
+  void    Hash(const KEY_T &key, unsigned long long &h1, unsigned long long &h2) const;
+  ERROR_T WriteBlock(const SIZE_T i, const bool open);
+
+ public:
+  BloomFilter(BufferCache *cache);
+  BloomFilter() { throw GenericException(); }
+  BloomFilter(const BloomFilter &rhs) { throw GenericException(); }
+  BloomFilter & operator=(const BloomFilter &rhs) { throw GenericException(); return *this; }
+  virtual ~BloomFilter();
+
+  // Number of blocks a filter for numkeys keys takes up
+  static SIZE_T GetNumBlocks(const SIZE_T blocksize, const SIZE_T numkeys);
+
+  // Writes an empty filter of numblocks blocks starting at firstblock
+  ERROR_T Format(const SIZE_T firstblock, const SIZE_T numblocks);
+  // Reads the filter starting at firstblock and marks it open.  clean
+  // says whether it was saved after its last changes.
+  ERROR_T Load(const SIZE_T firstblock, bool &clean);
+  // Writes the bits back and marks the filter closed
+  ERROR_T Save();
+
+  void    Clear();
+  void    Add(const KEY_T &key);
+  // false if key is certainly not in the index
+  bool    MayContain(const KEY_T &key);
+  // Called when a key the filter let through was not found after all
+  void    NoteFalsePositive();
+
+  SIZE_T  GetFirstBlock() const { return firstblock; }
+  SIZE_T  GetNumBlocks() const { return numblocks; }
+  SIZE_T  GetNumBits() const { return numblocks*bitsperblock; }
+  SIZE_T  GetNumBitsSet() const;
+  SIZE_T  GetNumProbes() const { return numprobes; }
+  SIZE_T  GetNumNegatives() const { return numnegatives; }
+  SIZE_T  GetNumFalsePositives() const { return numfalsepositives; }
+
+  ostream & Print(ostream &os) const;
+};
+
+inline ostream & operator<< (ostream &os, const BloomFilter &rhs) { return rhs.Print(os);}
+
+#endif
@@ -1,9 +1,13 @@
 #include <assert.h>
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "btree.h"
 
+// Bytes of log between automatic checkpoints
+static const SIZE_T DEFAULT_CHECKPOINT_INTERVAL = 256*1024;
+
 KeyValuePair::KeyValuePair()
 {}
 
@@ -34,13 +38,50 @@ BTreeIndex::BTreeIndex(SIZE_T keysize,
 {
   superblock.info.keysize=keysize;
   superblock.info.valuesize=valuesize;
+  superblock.info.format=unique ? BTREE_FIXED_FORMAT : BTREE_POSTING_FORMAT;
+  superblock.info.search=BTREE_SEARCH_BINARY;
   buffercache=cache;
-  // note: ignoring unique now
+  latchmode=BTREE_LATCH_OPTIMISTIC;
+  restarts=0;
+  splits=0;
+  searchprobes=0;
+  synccommit=true;
+  checkpointinterval=DEFAULT_CHECKPOINT_INTERVAL;
+  freespace=0;
+  bloom=0;
+  bloomkeys=0;
+  resultcache=0;
+  copyonwrite=false;
+  epoch=0;
+  defragnext=0;
+  pthread_mutex_init(&oplock,0);
+  pthread_mutex_init(&checkpointlock,0);
+  pthread_mutex_init(&writelock,0);
+  pthread_mutex_init(&epochlock,0);
 }
 
 BTreeIndex::BTreeIndex()
 {
   // shouldn't have to do anything
+  superblock.info.format=BTREE_FIXED_FORMAT;
+  superblock.info.search=BTREE_SEARCH_BINARY;
+  latchmode=BTREE_LATCH_OPTIMISTIC;
+  restarts=0;
+  splits=0;
+  searchprobes=0;
+  synccommit=true;
+  checkpointinterval=DEFAULT_CHECKPOINT_INTERVAL;
+  freespace=0;
+  bloom=0;
+  bloomkeys=0;
+  resultcache=0;
+  copyonwrite=false;
+  epoch=0;
+  defragnext=0;
+  pthread_mutex_init(&oplock,0);
+  pthread_mutex_init(&checkpointlock,0);
+  pthread_mutex_init(&writelock,0);
+  pthread_mutex_init(&epochlock,0);
 }
 
 
@@ -52,10 +93,34 @@ BTreeIndex::BTreeIndex(const BTreeIndex &rhs)
   buffercache=rhs.buffercache;
   superblock_index=rhs.superblock_index;
   superblock=rhs.superblock;
+  latchmode=rhs.latchmode;
+  restarts=0;
+  splits=0;
+  searchprobes=0;
+  synccommit=rhs.synccommit;
+  checkpointinterval=rhs.checkpointinterval;
+  freespace=0;
+  bloom=0;
+  bloomkeys=rhs.bloomkeys;
+  resultcache=rhs.resultcache ? new ResultCache(rhs.resultcache->GetMaxBytes()) : 0;
+  copyonwrite=rhs.copyonwrite;
+  epoch=0;
+  defragnext=0;
+  pthread_mutex_init(&oplock,0);
+  pthread_mutex_init(&checkpointlock,0);
+  pthread_mutex_init(&writelock,0);
+  pthread_mutex_init(&epochlock,0);
 }
 
 BTreeIndex::~BTreeIndex()
 {
+  pthread_mutex_destroy(&oplock);
+  pthread_mutex_destroy(&checkpointlock);
+  pthread_mutex_destroy(&writelock);
+  pthread_mutex_destroy(&epochlock);
+  delete freespace;
+  delete bloom;
+  delete resultcache;
 }
 
 
@@ -65,52 +130,27 @@ BTreeIndex & BTreeIndex::operator=(const BTreeIndex &rhs)
 }
 
 
-ERROR_T BTreeIndex::AllocateNode(SIZE_T &n)
+ERROR_T BTreeIndex::AllocateNode(SIZE_T &n, const SIZE_T hint)
 {
-  n=superblock.info.freelist;
+  ERROR_T rc;
 
-  if (n==0) { 
-    return ERROR_NOSPACE;
+  if ((rc=freespace->Allocate(hint,n))) { 
+    return rc;
   }
 
-  BTreeNode node;
-
-  node.Unserialize(buffercache,n);
-
-  assert(node.info.nodetype==BTREE_UNALLOCATED_BLOCK);
-
-  superblock.info.freelist=node.info.freelist;
-
-  superblock.Serialize(buffercache,superblock_index);
-
-  buffercache->NotifyAllocateBlock(n);
-
-  return ERROR_NOERROR;
+  return buffercache->NotifyAllocateBlock(n);
 }
 
 
 ERROR_T BTreeIndex::DeallocateNode(const SIZE_T &n)
 {
-  BTreeNode node;
-
-  node.Unserialize(buffercache,n);
-
-  assert(node.info.nodetype!=BTREE_UNALLOCATED_BLOCK);
-
-  node.info.nodetype=BTREE_UNALLOCATED_BLOCK;
-
-  node.info.freelist=superblock.info.freelist;
-
-  node.Serialize(buffercache,n);
-
-  superblock.info.freelist=n;
-
-  superblock.Serialize(buffercache,superblock_index);
-
-  buffercache->NotifyDeallocateBlock(n);
+  ERROR_T rc;
 
-  return ERROR_NOERROR;
+  if ((rc=freespace->Free(n))) { 
+    return rc;
+  }
 
+  return buffercache->NotifyDeallocateBlock(n);
 }
 
 ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
@@ -120,18 +160,63 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
   superblock_index=initblock;
   assert(superblock_index==0);
 
+  // a trace of the cache can tell what kind of node each block is
+  buffercache->SetBlockTyper(BTreeNode::GetBlockType);
+
+  delete freespace;
+  freespace=new FreeSpaceMap(buffercache);
+  delete bloom;
+  bloom=0;
+  if (resultcache) { 
+    resultcache->Clear();
+  }
+
   if (create) {
-    // build a super block, root node, and a free space list
+    // build a super block, root node, and a free space bitmap
     //
     // Superblock at superblock_index
     // root node at superblock_index+1
-    // free space list for rest
+    // free space bitmap from superblock_index+2 on
+    // Bloom filter, if any, right after the bitmap
+    SIZE_T bloomfirst=superblock_index+2+
+      FreeSpaceMap::GetNumBitmapBlocks(buffercache->GetBlockSize(),buffercache->GetNumBlocks());
+    SIZE_T bloomblocks=bloomkeys ? BloomFilter::GetNumBlocks(buffercache->GetBlockSize(),bloomkeys) : 0;
+
+    if (bloomfirst+bloomblocks>buffercache->GetNumBlocks()) { 
+      return ERROR_NOSPACE;
+    }
     BTreeNode newsuperblock(BTREE_SUPERBLOCK,
 			    superblock.info.keysize,
 			    superblock.info.valuesize,
-			    buffercache->GetBlockSize());
+			    buffercache->GetBlockSize(),
+			    superblock.info.format);
+
+    if (newsuperblock.info.GetNumDiskDataBytes()>BTREE_MAX_SLOTTED_BYTES) {
+      // interior nodes could not say where their separators are
+      return ERROR_SIZE;
+    }
+    if (newsuperblock.info.IsSlotted() &&
+	(newsuperblock.info.GetMaxInlineValue()==0 || newsuperblock.info.keysize==0)) { 
+      // the keys (or the values of a list) are too long for the blocks
+      return ERROR_SIZE;
+    }
+    if (newsuperblock.info.IsSlotted() && 
+	newsuperblock.info.GetNumDataBytes()>BTREE_MAX_SLOTTED_BYTES) { 
+      // nor could the leaves say where their keys (and lists) are
+      return ERROR_SIZE;
+    }
+    if (newsuperblock.info.format==BTREE_COMPRESSED_FORMAT &&
+	4*newsuperblock.info.GetMaxCompressedGrowth()+4*newsuperblock.info.keysize+2*sizeof(SIZE_T)
+	>newsuperblock.info.GetNumDiskDataBytes()) { 
+      // a leaf that has just split might not have room for a change
+      return ERROR_SIZE;
+    }
     newsuperblock.info.rootnode=superblock_index+1;
-    newsuperblock.info.freelist=superblock_index+2;
+    newsuperblock.info.freespace=superblock_index+2;
+    newsuperblock.info.bloom=bloomblocks ? bloomfirst : 0;
+    newsuperblock.info.search=superblock.info.search;
+    newsuperblock.info.counted=superblock.info.counted;
+    newsuperblock.info.copyonwrite=copyonwrite;
     newsuperblock.info.numkeys=0;
 
     buffercache->NotifyAllocateBlock(superblock_index);
@@ -145,10 +230,12 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
     BTreeNode newrootnode(BTREE_ROOT_NODE,
 			  superblock.info.keysize,
 			  superblock.info.valuesize,
-			  buffercache->GetBlockSize());
+			  buffercache->GetBlockSize(),
+			  superblock.info.format);
     newrootnode.info.rootnode=superblock_index+1;
-    newrootnode.info.freelist=superblock_index+2;
     newrootnode.info.numkeys=0;
+    // every interior node is split off the root, so it gets the counts too
+    newrootnode.info.counted=superblock.info.counted;
 
     buffercache->NotifyAllocateBlock(superblock_index+1);
 
@@ -158,452 +245,2087 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
       return rc;
     }
 
-    for (SIZE_T i=superblock_index+2; i<buffercache->GetNumBlocks();i++) { 
-      BTreeNode newfreenode(BTREE_UNALLOCATED_BLOCK,
-			    superblock.info.keysize,
-			    superblock.info.valuesize,
-			    buffercache->GetBlockSize());
-      newfreenode.info.rootnode=superblock_index+1;
-      newfreenode.info.freelist= ((i+1)==buffercache->GetNumBlocks()) ? 0: i+1;
-      
-      rc = newfreenode.Serialize(buffercache,i);
+    if ((rc=freespace->Format(superblock_index+2)) ||
+	(rc=freespace->MarkAllocated(superblock_index)) ||
+	(rc=freespace->MarkAllocated(superblock_index+1))) { 
+      return rc;
+    }
+    for (SIZE_T i=0;i<freespace->GetNumBitmapBlocks();i++) { 
+      buffercache->NotifyAllocateBlock(superblock_index+2+i);
+    }
 
-      if (rc) {
+    if (bloomblocks) { 
+      for (SIZE_T i=bloomfirst;i<bloomfirst+bloomblocks;i++) { 
+	if ((rc=freespace->MarkAllocated(i))) { 
+	  return rc;
+	}
+	buffercache->NotifyAllocateBlock(i);
+      }
+      bloom=new BloomFilter(buffercache);
+      if ((rc=bloom->Format(bloomfirst,bloomblocks))) { 
 	return rc;
       }
+      delete bloom;
+      bloom=0;
+    }
+  }
 
+  if (!create && buffercache->GetLog()) { 
+    if ((rc=Recover())) { 
+      return rc;
     }
   }
 
   // OK, now, mounting the btree is simply a matter of reading the superblock 
+  // and the free space bitmap
+
+  if ((rc=superblock.Unserialize(buffercache,initblock))) { 
+    return rc;
+  }
+  if (superblock.info.nodetype!=BTREE_SUPERBLOCK) { 
+    return ERROR_NOTANINDEX;
+  }
+  // its nodes may not be linked up, so it has to stay that way
+  copyonwrite=(superblock.info.copyonwrite!=0);
+  if ((rc=freespace->Load(superblock.info.freespace))) { 
+    return rc;
+  }
+
+  // The disk only saves its own allocation bitmap when it shuts down
+  // cleanly, so after a crash it has to be brought back in line
+  for (SIZE_T i=0;!create && i<buffercache->GetNumBlocks();i++) { 
+    bool allocated=freespace->IsAllocated(i);
+    if (allocated!=buffercache->IsBlockAllocated(i) &&
+	(rc=allocated ? buffercache->NotifyAllocateBlock(i) : buffercache->NotifyDeallocateBlock(i))) { 
+      return rc;
+    }
+  }
 
-  return superblock.Unserialize(buffercache,initblock);
+  if (superblock.info.bloom) { 
+    bool clean;
+    bloom=new BloomFilter(buffercache);
+    if ((rc=bloom->Load(superblock.info.bloom,clean))) { 
+      return rc;
+    }
+    if (!clean) { 
+      bloom->Clear();
+      if ((rc=RebuildBloomFilter(superblock.info.rootnode))) { 
+	return rc;
+      }
+    }
+  }
+  return ERROR_NOERROR;
 }
     
 
 ERROR_T BTreeIndex::Detach(SIZE_T &initblock)
 {
+  ERROR_T rc;
+
+  if (superblock.info.nodetype!=BTREE_SUPERBLOCK) { 
+    // never attached, say because the blocks were too big to index
+    return ERROR_NOTANINDEX;
+  }
+  if (bloom && (rc=bloom->Save())) { 
+    return rc;
+  }
   return superblock.Serialize(buffercache,superblock_index);
 }
- 
 
-ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node,
-					   const BTreeOp op,
-					   const KEY_T &key,
-					   VALUE_T &value)
+
+ERROR_T BTreeIndex::RebuildBloomFilter(const SIZE_T node)
 {
   BTreeNode b;
+  SIZE_T offset, ptr;
+  KEY_T key;
   ERROR_T rc;
-  SIZE_T offset;
-  KEY_T testkey;
-  SIZE_T ptr;
-
-  rc= b.Unserialize(buffercache,node);
 
-  if (rc!=ERROR_NOERROR) { 
+  if ((rc=b.Unserialize(buffercache,node))) { 
     return rc;
   }
-
-  switch (b.info.nodetype) { 
-  case BTREE_ROOT_NODE:
-  case BTREE_INTERIOR_NODE:
-    // Scan through key/ptr pairs
-    //and recurse if possible
+  if (b.info.nodetype==BTREE_LEAF_NODE) { 
     for (offset=0;offset<b.info.numkeys;offset++) { 
-      rc=b.GetKey(offset,testkey);
-      if (rc) {  return rc; }
-      if (key<testkey) {
-      	// OK, so we now have the first key that's larger
-      	// so we ned to recurse on the ptr immediately previous to 
-      	// this one, if it exists
-      	rc=b.GetPtr(offset,ptr);
-      	if (rc) { return rc; }
-      	return LookupOrUpdateInternal(ptr,op,key,value);
+      if ((rc=b.GetKey(offset,key))) { 
+	return rc;
       }
+      bloom->Add(key);
     }
-    // if we got here, we need to go to the next pointer, if it exists
-    if (b.info.numkeys>0) { 
-      rc=b.GetPtr(b.info.numkeys,ptr);
-      if (rc) { return rc; }
-      return LookupOrUpdateInternal(ptr,op,key,value);
-    } else {
-      // There are no keys at all on this node, so nowhere to go
-      return ERROR_NONEXISTENT;
-    }
-    break;
-  case BTREE_LEAF_NODE:
-    // Scan through keys looking for matching value
-    for (offset=0;offset<b.info.numkeys;offset++) { 
-      rc=b.GetKey(offset,testkey);
-      if (rc) {  return rc; }
-      if (testkey==key) { 
-	if (op==BTREE_OP_LOOKUP) { 
-	  return b.GetVal(offset,value);
-	} else { 
-	  // BTREE_OP_UPDATE
-	  // WRITE ME
-        rc = b.SetVal(offset, value);
-        if(rc) {return rc;}
-        rc = b.Serialize(buffercache, node);
-        return rc;
-	}
-      }
+    return ERROR_NOERROR;
+  }
+  // an empty root is an empty tree
+  for (offset=0;b.info.numkeys>0 && offset<=b.info.numkeys;offset++) { 
+    if ((rc=b.GetPtr(offset,ptr)) ||
+	(rc=RebuildBloomFilter(ptr))) { 
+      return rc;
     }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::GetBloomFilterStats(BTreeBloomStats &stats) const
+{
+  if (!bloom) { 
     return ERROR_NONEXISTENT;
-    break;
-  default:
-    // We can't be looking at anything other than a root, internal, or leaf
-    return ERROR_INSANE;
-    break;
-  }  
+  }
+  stats.numbits=bloom->GetNumBits();
+  stats.numbitsset=bloom->GetNumBitsSet();
+  stats.numprobes=bloom->GetNumProbes();
+  stats.numnegatives=bloom->GetNumNegatives();
+  stats.numfalsepositives=bloom->GetNumFalsePositives();
+  return ERROR_NOERROR;
+}
+ 
+
+ERROR_T BTreeIndex::SearchNode(const BTreeNode &b, const KEY_T &key, SIZE_T &offset, bool &found) const
+{
+  SIZE_T probes=0;
+  ERROR_T rc=b.Search(key,superblock.info.search,offset,found,probes);
 
-  return ERROR_INSANE;
+  __sync_fetch_and_add(&searchprobes,probes);
+  return rc;
 }
 
 
-static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplayType dt)
+ERROR_T BTreeIndex::ChooseChildOffset(const BTreeNode &b, const KEY_T &key, SIZE_T &offset) const
+{
+  bool found;
+  ERROR_T rc;
+
+  if (b.info.numkeys==0) { 
+    // There are no keys at all on this node, so nowhere to go
+    return ERROR_NONEXISTENT;
+  }
+  // the pointer after the last key that's not larger
+  if ((rc=SearchNode(b,key,offset,found))) { 
+    return rc;
+  }
+  if (found) { 
+    offset++;
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::ChooseChild(const BTreeNode &b, const KEY_T &key, SIZE_T &ptr) const
 {
-  KEY_T key;
-  VALUE_T value;
-  SIZE_T ptr;
   SIZE_T offset;
   ERROR_T rc;
-  unsigned i;
 
-  if (dt==BTREE_DEPTH_DOT) { 
-    os << nodenum << " [ label=\""<<nodenum<<": ";
-  } else if (dt==BTREE_DEPTH) {
-    os << nodenum << ": ";
-  } else {
+  if ((rc=ChooseChildOffset(b,key,offset))) { 
+    return rc;
   }
+  return b.GetPtr(offset,ptr);
+}
 
-  switch (b.info.nodetype) { 
-  case BTREE_ROOT_NODE:
-  case BTREE_INTERIOR_NODE:
-    if (dt==BTREE_SORTED_KEYVAL) {
-    } else {
-      if (dt==BTREE_DEPTH_DOT) { 
-      } else { 
-	os << "Interior: ";
+
+ERROR_T BTreeIndex::FindLeaf(const KEY_T &key,
+			     const bool forwrite,
+			     SIZE_T &node,
+			     BTreeNode &b)
+{
+  SIZE_T next;
+  SIZE_T version;
+  ERROR_T rc;
+
+  // Splits are visible to readers through the rightlinks, so a
+  // reader never needs its parent to stay put.  It only has to see a
+  // consistent copy of each node and move right when the key is at or
+  // beyond the node's high key.
+  node=superblock.info.rootnode;
+
+  if (latchmode==BTREE_LATCH_OPTIMISTIC) { 
+    while (1) { 
+      version=buffercache->GetFrameVersion(node);
+      rc=b.Unserialize(buffercache,node);
+      if (!buffercache->ValidateFrameVersion(node,version)) { 
+	return ERROR_RESTART;
       }
-      for (offset=0;offset<=b.info.numkeys;offset++) { 
-	rc=b.GetPtr(offset,ptr);
-	if (rc) { return rc; }
-	os << "*" << ptr << " ";
-	// Last pointer
-	if (offset==b.info.numkeys) break;
-	rc=b.GetKey(offset,key);
-	if (rc) {  return rc; }
-	for (i=0;i<b.info.keysize;i++) { 
-	  os << key.data[i];
-	}
-	os << " ";
+      if (rc) { return rc; }
+      if (b.MustMoveRight(key)) { 
+	node=b.info.rightlink;
+	continue;
       }
-    }
-    break;
-  case BTREE_LEAF_NODE:
-    if (dt==BTREE_DEPTH_DOT || dt==BTREE_SORTED_KEYVAL) { 
-    } else {
-      os << "Leaf: ";
-    }
-    for (offset=0;offset<b.info.numkeys;offset++) { 
-      if (offset==0) { 
-	// special case for first pointer
-	rc=b.GetPtr(offset,ptr);
+      switch (b.info.nodetype) { 
+      case BTREE_ROOT_NODE:
+      case BTREE_INTERIOR_NODE:
+	rc=ChooseChild(b,key,node);
 	if (rc) { return rc; }
-	if (dt!=BTREE_SORTED_KEYVAL) { 
-	  os << "*" << ptr << " ";
+	break;
+      case BTREE_LEAF_NODE:
+	if (forwrite && !buffercache->UpgradeFrameLatch(node,version)) { 
+	  return ERROR_RESTART;
 	}
+	return ERROR_NOERROR;
+	break;
+      default:
+	// We can't be looking at anything other than a root, internal, or leaf
+	return ERROR_INSANE;
       }
-      if (dt==BTREE_SORTED_KEYVAL) { 
-	os << "(";
-      }
-      rc=b.GetKey(offset,key);
-      if (rc) {  return rc; }
-      for (i=0;i<b.info.keysize;i++) { 
-	os << key.data[i];
-      }
-      if (dt==BTREE_SORTED_KEYVAL) { 
-	os << ",";
-      } else {
-	os << " ";
-      }
-      rc=b.GetVal(offset,value);
-      if (rc) {  return rc; }
-      for (i=0;i<b.info.valuesize;i++) { 
-	os << value.data[i];
+    }
+  } else {
+    // Shared latch coupling: the next node is latched before the
+    // current one is released
+    buffercache->LatchFrameShared(node);
+    while (1) { 
+      rc=b.Unserialize(buffercache,node);
+      if (rc) { 
+	buffercache->UnlatchFrameShared(node);
+	return rc;
       }
-      if (dt==BTREE_SORTED_KEYVAL) { 
-	os << ")\n";
+      if (b.MustMoveRight(key)) { 
+	next=b.info.rightlink;
       } else {
-	os << " ";
+	switch (b.info.nodetype) { 
+	case BTREE_ROOT_NODE:
+	case BTREE_INTERIOR_NODE:
+	  rc=ChooseChild(b,key,next);
+	  if (rc) { 
+	    buffercache->UnlatchFrameShared(node);
+	    return rc;
+	  }
+	  break;
+	case BTREE_LEAF_NODE:
+	  if (forwrite) { 
+	    // Whoever gets the leaf between these two calls may split
+	    // it, so look again and move right if we have to
+	    buffercache->UnlatchFrameShared(node);
+	    return LatchAndMoveRight(key,node,b);
+	  }
+	  return ERROR_NOERROR;
+	  break;
+	default:
+	  buffercache->UnlatchFrameShared(node);
+	  return ERROR_INSANE;
+	}
       }
+      buffercache->LatchFrameShared(next);
+      buffercache->UnlatchFrameShared(node);
+      node=next;
     }
-    break;
-  default:
-    if (dt==BTREE_DEPTH_DOT) { 
-      os << "Unknown("<<b.info.nodetype<<")";
-    } else {
-      os << "Unsupported Node Type " << b.info.nodetype ;
-    }
-  }
-  if (dt==BTREE_DEPTH_DOT) { 
-    os << "\" ]";
   }
-  return ERROR_NOERROR;
 }
-  
-ERROR_T BTreeIndex::Lookup(const KEY_T &key, VALUE_T &value)
+
+
+bool BTreeIndex::IsValidKey(const KEY_T &key) const
 {
-  return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, value);
+  if (superblock.info.IsSlotted()) { 
+    return key.length>0 && key.length<=superblock.info.keysize;
+  }
+  return key.length==superblock.info.keysize;
 }
 
 
+bool BTreeIndex::IsValidValue(const VALUE_T &value) const
+{
+  if (superblock.info.format==BTREE_VARIABLE_FORMAT) { 
+    return value.length<=superblock.info.valuesize && value.length<0x80000000u;
+  }
+  return value.length==superblock.info.valuesize;
+}
 
-bool BTreeIndex::IsNodeFull(const SIZE_T node)
+
+// Overflow chains
+//
+// Every block but the last is full, and each block's rightlink is the
+// next one.  The chain is written before the leaf that points to it
+// and freed after the leaf stops pointing to it, so a crash at any
+// point can leak a chain but never leave a dangling pointer.  Appends
+// to a posting list write the chain before the leaf too, so a crash
+// can leave bytes past the end of the list that the leaf knows of.
+// They are never read, and the next append writes over them.
+
+static ERROR_T ReadOverflow(BufferCache *cache, SIZE_T block, const SIZE_T length, VALUE_T &value)
 {
-    BTreeNode b;
-    b.Unserialize(buffercache, node);
+  BTreeNode o;
+  SIZE_T pos, n;
+  ERROR_T rc;
 
-    switch (b.info.nodetype) {
-        case BTREE_ROOT_NODE:
-        case BTREE_INTERIOR_NODE:
-            return (b.info.GetNumSlotsAsInterior() == b.info.numkeys);
-        case BTREE_LEAF_NODE:
-            return (b.info.GetNumSlotsAsLeaf() == b.info.numkeys);
+  value.Resize(length,false);
+  for (pos=0;pos<length;pos+=n) { 
+    if ((rc=o.Unserialize(cache,block))) { 
+      return rc;
     }
-    cout << "No such node type in btree!" << endl;
-    return false;
+    n=o.info.numkeys;
+    if (o.info.nodetype!=BTREE_OVERFLOW_BLOCK || n>o.info.GetNumDataBytes() || n==0) { 
+      return ERROR_INSANE;
+    }
+    if (n>length-pos) { 
+      // the start of a value, or the end of an interrupted append
+      n=length-pos;
+    }
+    memcpy(value.data+pos,o.data,n);
+    block=o.info.rightlink;
+  }
+  return ERROR_NOERROR;
 }
 
 
-/// Mechanism to Split a full btree Node into two
-/// Places the correct set of keys to the correct left and right nodes
-ERROR_T BTreeIndex::SplitNode(const SIZE_T node, SIZE_T &newNode, KEY_T &splitKey)
+// The value of a leaf entry, wherever it is, up to maxlength bytes
+static ERROR_T GetLeafValue(BufferCache *cache, const BTreeNode &b, const SIZE_T offset, VALUE_T &value,
+			    const SIZE_T maxlength=(SIZE_T)-1)
 {
-    BTreeNode left;
-    SIZE_T numLeftKeys, numRightKeys;
-    ERROR_T rc;
-    left.Unserialize(buffercache, node);
-    BTreeNode right = left;
-
-    if ((rc = AllocateNode(newNode)))
-        return rc;
-    if ((rc = right.Serialize(buffercache, newNode)))
-        return rc;
-    
-    if (left.info.nodetype == BTREE_LEAF_NODE) {
-        numLeftKeys = (left.info.numkeys + 2) / 2;
-        numRightKeys = left.info.numkeys - numLeftKeys;
+  SIZE_T first, last, length;
+  ERROR_T rc;
 
-        left.GetKey(numLeftKeys - 1, splitKey);
+  if (b.GetOverflow(offset,first,last,length)) { 
+    return ReadOverflow(cache,first,length<maxlength ? length : maxlength,value);
+  }
+  if ((rc=b.GetVal(offset,value))) { 
+    return rc;
+  }
+  if (value.length>maxlength) { 
+    return value.Resize(maxlength);
+  }
+  return ERROR_NOERROR;
+}
 
-        char *src = left.ResolveKeyVal(numLeftKeys); 
-        char *dest = right.ResolveKeyVal(0);
 
-        memcpy(dest, src, numRightKeys * (left.info.keysize + left.info.valuesize));
-    } else {
-        numLeftKeys = left.info.numkeys / 2;
-        numRightKeys = left.info.numkeys - numLeftKeys - 1;
-        
-        left.GetKey(numLeftKeys, splitKey);
+ERROR_T BTreeIndex::WriteOverflow(const VALUE_T &value, const SIZE_T hint, SIZE_T &first, SIZE_T &last)
+{
+  BTreeNode o(BTREE_OVERFLOW_BLOCK,
+	      superblock.info.keysize,
+	      superblock.info.valuesize,
+	      buffercache->GetBlockSize(),
+	      superblock.info.format);
+  SIZE_T perblock=o.info.GetNumDataBytes();
+  SIZE_T num=value.length/perblock + (value.length%perblock != 0);
+  vector<SIZE_T> blocks;
+  SIZE_T i, n;
+  ERROR_T rc;
 
-        char *src = left.ResolvePtr(numLeftKeys + 1);
-        char *dest = right.ResolvePtr(0);
-        
-        memcpy(dest, src, numRightKeys * (left.info.keysize + sizeof(SIZE_T)) + sizeof(SIZE_T));
+  if (num==0) { 
+    num=1;
+  }
+  // each block near the one before it
+  for (i=0;i<num;i++) { 
+    blocks.push_back(0);
+    if ((rc=AllocateNode(blocks[i], i>0 ? blocks[i-1] : hint))) { 
+      for (n=0;n<i;n++) { 
+	DeallocateNode(blocks[n]);
+      }
+      return rc;
     }
-    left.info.numkeys = numLeftKeys;
-    right.info.numkeys = numRightKeys;
-
-    if ((rc = left.Serialize(buffercache, node)))
-        return rc;
-    return right.Serialize(buffercache, newNode);
+  }
+  for (i=0;i<num;i++) { 
+    n=value.length-i*perblock;
+    o.info.numkeys=n<perblock ? n : perblock;
+    o.info.rightlink=(i+1<num) ? blocks[i+1] : 0;
+    memcpy(o.data,value.data+i*perblock,o.info.numkeys);
+    if ((rc=o.Serialize(buffercache,blocks[i]))) { 
+      return rc;
+    }
+  }
+  first=blocks[0];
+  last=blocks[num-1];
+  return ERROR_NOERROR;
 }
 
-/// PLaces the new key valaue pair at a new node
-ERROR_T BTreeIndex::AddKeyValuePair(const SIZE_T node, const KEY_T &key, const VALUE_T &value, SIZE_T newNode)
-{
-    BTreeNode b;
-    b.Unserialize(buffercache, node);
-    KEY_T testkey;
-    SIZE_T entriesToCopy;
-    SIZE_T numkeys = b.info.numkeys;
-    SIZE_T i;
-    ERROR_T rc;
-    SIZE_T entrySize;
+
+ERROR_T BTreeIndex::FreeOverflow(SIZE_T block)
+{
+  BTreeNode o;
+  ERROR_T rc;
+
+  while (block) { 
+    if ((rc=o.Unserialize(buffercache,block))) { 
+      return rc;
+    }
+    if (o.info.nodetype!=BTREE_OVERFLOW_BLOCK) { 
+      return ERROR_INSANE;
+    }
+    if ((rc=DeallocateNode(block))) { 
+      return rc;
+    }
+    block=o.info.rightlink;
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::LatchSharedAndMoveRight(const KEY_T &key, SIZE_T &node, BTreeNode &b)
+{
+  SIZE_T next;
+  ERROR_T rc;
+
+  buffercache->LatchFrameShared(node);
+  while ((rc=b.Unserialize(buffercache,node))==ERROR_NOERROR && b.MustMoveRight(key)) { 
+    // split since we looked
+    next=b.info.rightlink;
+    buffercache->LatchFrameShared(next);
+    buffercache->UnlatchFrameShared(node);
+    node=next;
+  }
+  if (rc) { 
+    buffercache->UnlatchFrameShared(node);
+  }
+  return rc;
+}
+
+
+ERROR_T BTreeIndex::ReadOverflowLatched(const KEY_T &key, SIZE_T node, VALUE_T &value,
+					const SIZE_T maxlength)
+{
+  BTreeNode b;
+  SIZE_T offset;
+  bool found;
+  ERROR_T rc;
+
+  if ((rc=LatchSharedAndMoveRight(key,node,b))) { 
+    return rc;
+  }
+  if (!(rc=SearchNode(b,key,offset,found))) { 
+    rc=found ? GetLeafValue(buffercache,b,offset,value,maxlength) : ERROR_NONEXISTENT;
+  }
+  buffercache->UnlatchFrameShared(node);
+  return rc;
+}
+
+
+ERROR_T BTreeIndex::SetValue(BTreeNode &b, const SIZE_T node, const SIZE_T offset, const VALUE_T &value)
+{
+  SIZE_T oldfirst, oldlast, first, last, length;
+  bool overflowed=b.GetOverflow(offset,oldfirst,oldlast,length);
+  ERROR_T rc;
+
+  if (!b.info.IsSlotted()) { 
+    if ((rc=b.SetVal(offset,value))) { 
+      return rc;
+    }
+    return b.Serialize(buffercache,node);
+  }
+
+  BTreeNode t=b;
+  if (b.IsOverflowValue(value) || t.SetVal(offset,value) || t.IsFull()) { 
+    // an insert must always find room in a leaf that isn't full
+    if ((rc=WriteOverflow(value,node,first,last)) ||
+	(rc=b.SetOverflow(offset,first,last,value.length))) { 
+      return rc;
+    }
+  } else {
+    b=t;
+  }
+  if ((rc=b.Serialize(buffercache,node))) { 
+    return rc;
+  }
+  return overflowed ? FreeOverflow(oldfirst) : ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::AppendValue(BTreeNode &b, const SIZE_T node, const SIZE_T offset, const VALUE_T &value)
+{
+  SIZE_T first, last, length, used, n, next;
+  VALUE_T list;
+  ERROR_T rc;
+
+  if (!b.GetOverflow(offset,first,last,length)) { 
+    // still in the leaf, which may have to give it up now
+    if ((rc=b.GetVal(offset,list)) ||
+	(rc=list.Resize(list.length+value.length))) { 
+      return rc;
+    }
+    memcpy(list.data+list.length-value.length,value.data,value.length);
+    return SetValue(b,node,offset,list);
+  }
+
+  if (length+value.length>=0x80000000u) { 
+    return ERROR_SIZE;
+  }
+
+  // Every block but the last is full, so the leaf's length says where
+  // the list ends in the last one, whatever an interrupted append may
+  // have left after that
+  BTreeNode t;
+  if ((rc=t.Unserialize(buffercache,last))) { 
+    return rc;
+  }
+  SIZE_T perblock=t.info.GetNumDataBytes();
+  if (t.info.nodetype!=BTREE_OVERFLOW_BLOCK || length==0) { 
+    return ERROR_INSANE;
+  }
+  used=length-((length-1)/perblock)*perblock;
+  n=perblock-used<value.length ? perblock-used : value.length;
+  memcpy(t.data+used,value.data,n);
+  t.info.numkeys=used+n;
+  t.info.rightlink=0;
+
+  next=last;
+  if (n<value.length) { 
+    // the rest starts a new last block; values are never longer than
+    // a quarter of a leaf, so one is enough
+    BTreeNode o=t;
+    if ((rc=AllocateNode(next,last))) { 
+      return rc;
+    }
+    o.info.numkeys=value.length-n;
+    memcpy(o.data,value.data+n,o.info.numkeys);
+    if ((rc=o.Serialize(buffercache,next))) { 
+      return rc;
+    }
+    t.info.rightlink=next;
+  }
+  if ((rc=t.Serialize(buffercache,last)) ||
+      (rc=b.SetOverflow(offset,first,next,length+value.length))) { 
+    return rc;
+  }
+  return b.Serialize(buffercache,node);
+}
+
+
+ERROR_T BTreeIndex::LookupOrUpdateInternal(const BTreeOp op,
+					   const KEY_T &key,
+					   VALUE_T &value)
+{
+  BTreeNode b;
+  ERROR_T rc;
+  SIZE_T node;
+  SIZE_T offset, first, last, length;
+  bool found;
+  bool forwrite = (op==BTREE_OP_UPDATE);
+  // a lookup in a non-unique index only wants the first value
+  SIZE_T maxlength = GetUnique() ? (SIZE_T)-1 : superblock.info.valuesize;
+
+  if (!IsValidKey(key) || (forwrite && !IsValidValue(value))) { 
+    return ERROR_SIZE;
+  }
+  if (forwrite && !GetUnique()) { 
+    // which of the values?
+    return ERROR_UNIMPL;
+  }
+  if (bloom && !bloom->MayContain(key)) { 
+    return ERROR_NONEXISTENT;
+  }
+
+  if (copyonwrite) { 
+    if (forwrite) { 
+      return CopyOnWriteInternal(op,key,value);
+    }
+    // a snapshot never changes, so there is nothing to latch
+    BTreeSnapshot snap;
+    OpenSnapshot(snap);
+    node=snap.rootnode;
+    while (1) { 
+      if ((rc=b.Unserialize(buffercache,node))) { 
+	break;
+      }
+      if (b.info.nodetype==BTREE_LEAF_NODE) { 
+	break;
+      }
+      if ((rc=ChooseChild(b,key,node))) { 
+	break;
+      }
+    }
+    CloseSnapshot(snap);
+    if (rc) { 
+      return rc;
+    }
+  } else while ((rc=FindLeaf(key,forwrite,node,b))==ERROR_RESTART) { 
+    __sync_fetch_and_add(&restarts,1);
+  }
+
+  if (rc!=ERROR_NOERROR) { 
+    return rc;
+  }
+
+  // Search the keys for the matching value
+  if (!(rc=SearchNode(b,key,offset,found)) && !found) { 
+    rc=ERROR_NONEXISTENT;
+  }
+  if (!rc) { 
+    if (op==BTREE_OP_LOOKUP) { 
+      if (b.GetOverflow(offset,first,last,length) &&
+	  latchmode==BTREE_LATCH_OPTIMISTIC && !copyonwrite) { 
+	// b is only a copy, and the chain may be going away
+	rc=ReadOverflowLatched(key,node,value,maxlength);
+      } else {
+	rc=GetLeafValue(buffercache,b,offset,value,maxlength);
+      }
+    } else { 
+      // BTREE_OP_UPDATE
+      rc = SetValue(b, node, offset, value);
+      if (!rc) { 
+	rc = LogOperation(op, key, value, 0);
+      }
+    }
+  }
+
+  if (forwrite) { 
+    if (!rc && superblock.info.format==BTREE_COMPRESSED_FORMAT) { 
+      // the new value may not compress as well as the old one did
+      vector<SIZE_T> path;
+      rc=SplitFullNodes(node,path);
+    } else {
+      buffercache->UnlatchFrameExclusive(node);
+    }
+    if (!rc) { 
+      rc=CommitOperation();
+    }
+  } else if (latchmode==BTREE_LATCH_PESSIMISTIC && !copyonwrite) { 
+    buffercache->UnlatchFrameShared(node);
+  }
+
+  if (bloom && rc==ERROR_NONEXISTENT) { 
+    bloom->NoteFalsePositive();
+  }
+  return rc;
+}
+
+
+//
+// Layout of a WAL_OPERATION payload:
+//
+// OP DELTA KEYLEN VALUELEN KEY VALUE
+//
+ERROR_T BTreeIndex::LogOperation(const BTreeOp op,
+				 const KEY_T &key,
+				 const VALUE_T &value,
+				 const int delta)
+{
+  WriteAheadLog *log=buffercache->GetLog();
+  SIZE_T header[4];
+  LSN_T lsn;
+  ERROR_T rc=ERROR_NOERROR;
+
+  pthread_mutex_lock(&oplock);
+
+  if (log) { 
+    if (!log->HasCheckpoint()) { 
+      // First operation since the log was emptied.  Recovery needs a
+      // key count to start from before any record changes it.
+      map<SIZE_T, LSN_T, cache_compare_lessthan> dpt;
+      LSN_T snapshot;
+      if ((rc=buffercache->GetDirtyPageTable(dpt,snapshot)) ||
+	  (rc=WriteCheckpoint(superblock.info.numkeys,snapshot,dpt))) { 
+	pthread_mutex_unlock(&oplock);
+	return rc;
+      }
+    }
+
+    header[0]=op;
+    header[1]=(SIZE_T)delta;
+    header[2]=key.length;
+    header[3]=value.length;
+
+    Block payload(sizeof(header)+key.length+value.length);
+    memcpy(payload.data,header,sizeof(header));
+    memcpy(payload.data+sizeof(header),key.data,key.length);
+    if (value.length>0) { 
+      memcpy(payload.data+sizeof(header)+key.length,value.data,value.length);
+    }
+
+    rc=log->Append(WAL_OPERATION,0,payload.data,payload.length,lsn);
+  }
+
+  if (!rc) { 
+    superblock.info.numkeys+=delta;
+  }
+
+  pthread_mutex_unlock(&oplock);
+
+  return rc;
+}
+
+
+ERROR_T BTreeIndex::CommitOperation()
+{
+  WriteAheadLog *log=buffercache->GetLog();
+  ERROR_T rc;
+
+  if (!log) { 
+    return ERROR_NOERROR;
+  }
+  // covers any splits posted after the operation record, too
+  if (synccommit && (rc=log->Commit(log->GetAppendedLSN()))) { 
+    return rc;
+  }
+  if (log->HasCheckpoint() &&
+      log->GetAppendedLSN()-log->GetCheckpointLSN()>checkpointinterval) { 
+    return Checkpoint();
+  }
+  return ERROR_NOERROR;
+}
+
+
+// Layout of a WAL_CHECKPOINT payload, all LSN_T:
+//
+// NUMKEYS SNAPSHOT REDO NUMDIRTY (BLOCKNUM RECLSN)*
+//
+// NUMKEYS counts the operation records before SNAPSHOT.  REDO is
+// where replay has to start.  Page images before SNAPSHOT can be
+// skipped unless their block was dirty at the snapshot and the image
+// is no older than the block's RECLSN.
+ERROR_T BTreeIndex::WriteCheckpoint(const SIZE_T numkeys,
+				    const LSN_T snapshot,
+				    const map<SIZE_T, LSN_T, cache_compare_lessthan> &dpt)
+{
+  vector<LSN_T> payload;
+  LSN_T redo=snapshot;
+  LSN_T lsn;
+  ERROR_T rc;
+
+  // blocks written back before the snapshot must really be on disk
+  // before the log says they no longer need redo
+  if ((rc=buffercache->Sync())) { 
+    return rc;
+  }
+
+  payload.push_back(numkeys);
+  payload.push_back(snapshot);
+  payload.push_back(0);
+  payload.push_back(dpt.size());
+  for (map<SIZE_T, LSN_T, cache_compare_lessthan>::const_iterator i=dpt.begin();
+       i!=dpt.end();
+       ++i) { 
+    payload.push_back((*i).first);
+    payload.push_back((*i).second);
+    if ((*i).second<redo) { 
+      redo=(*i).second;
+    }
+  }
+  payload[2]=redo;
+
+  if ((rc=buffercache->GetLog()->Checkpoint((BYTE_T*)&payload[0],
+					    payload.size()*sizeof(LSN_T),
+					    lsn))) { 
+    return rc;
+  }
+  // recovery starts at REDO, which is never past the checkpoint
+  // record itself, so nothing before it will be read again
+  return buffercache->GetLog()->Truncate(redo);
+}
+
+
+ERROR_T BTreeIndex::Checkpoint()
+{
+  WriteAheadLog *log=buffercache->GetLog();
+  map<SIZE_T, LSN_T, cache_compare_lessthan> dpt;
+  LSN_T snapshot;
+  SIZE_T numkeys;
+  ERROR_T rc;
+
+  if (!log) { 
+    return ERROR_NOERROR;
+  }
+  if (pthread_mutex_trylock(&checkpointlock)) { 
+    // someone else is already taking one
+    return ERROR_NOERROR;
+  }
+
+  if (log->HasCheckpoint() &&
+      (rc=buffercache->WriteBackDirtyBlocks(log->GetCheckpointLSN()))) { 
+    pthread_mutex_unlock(&checkpointlock);
+    return rc;
+  }
+
+  // the only point at which writers wait for us
+  pthread_mutex_lock(&oplock);
+  rc=buffercache->GetDirtyPageTable(dpt,snapshot);
+  numkeys=superblock.info.numkeys;
+  pthread_mutex_unlock(&oplock);
+
+  if (!rc) { 
+    rc=WriteCheckpoint(numkeys,snapshot,dpt);
+  }
+
+  pthread_mutex_unlock(&checkpointlock);
+  return rc;
+}
+
+
+// Redo only.  The log holds after-images, and every prefix of an
+// operation's page writes leaves a valid B-link tree, so replaying
+// the images in order is enough; an operation cut short by the crash
+// is simply either there or not.  The key count is rebuilt from the
+// checkpoint plus the deltas of the operation records after it.
+ERROR_T BTreeIndex::Recover()
+{
+  WriteAheadLog *log=buffercache->GetLog();
+  map<SIZE_T, LSN_T, cache_compare_lessthan> dpt;
+  WALRecordHeader h;
+  Block payload;
+  BTreeNode sb;
+  LSN_T pos, snapshot;
+  SIZE_T numkeys;
+  ERROR_T rc;
+
+  pos=log->GetBaseLSN();
+  if (log->GetAppendedLSN()==pos) { 
+    // clean shutdown
+    return ERROR_NOERROR;
+  }
+
+  if ((rc=sb.Unserialize(buffercache,superblock_index))) { 
+    return rc;
+  }
+  numkeys=sb.info.numkeys;
+  snapshot=pos;
+
+  if (log->HasCheckpoint()) { 
+    pos=log->GetCheckpointLSN();
+    if ((rc=log->ReadRecord(pos,h,payload))) { 
+      return rc;
+    }
+    LSN_T *c=(LSN_T*)payload.data;
+    if (h.type!=WAL_CHECKPOINT || payload.length<4*sizeof(LSN_T) ||
+	payload.length!=(4+2*c[3])*sizeof(LSN_T)) { 
+      return ERROR_INSANE;
+    }
+    numkeys=c[0];
+    snapshot=c[1];
+    pos=c[2];
+    for (LSN_T i=0;i<c[3];i++) { 
+      dpt[c[4+2*i]]=c[5+2*i];
+    }
+  }
+
+  while (1) { 
+    LSN_T start=pos;
+    if (log->ReadRecord(pos,h,payload)) { 
+      break;
+    }
+    if (h.type==WAL_PAGE) { 
+      if (start<snapshot) { 
+	map<SIZE_T, LSN_T, cache_compare_lessthan>::const_iterator d=dpt.find(h.blocknum);
+	if (d==dpt.end() || start<(*d).second) { 
+	  // already on disk
+	  continue;
+	}
+      }
+      if ((rc=buffercache->RedoBlock(h.blocknum,payload))) { 
+	return rc;
+      }
+    } else if (h.type==WAL_OPERATION && start>=snapshot) { 
+      numkeys+=(int)((SIZE_T*)payload.data)[1];
+    }
+  }
+
+  if ((rc=sb.Unserialize(buffercache,superblock_index))) { 
+    return rc;
+  }
+  sb.info.numkeys=numkeys;
+  if ((rc=sb.Serialize(buffercache,superblock_index))) { 
+    return rc;
+  }
+
+  // an insert's count changes span several pages, so a crash can
+  // leave some of them behind
+  if (sb.info.counted && (rc=RebuildCounts(sb.info.rootnode,numkeys))) { 
+    return rc;
+  }
+
+  // the disk is now current, so the log can go
+  return buffercache->Flush();
+}
+
+
+static ERROR_T PrintNode(ostream &os, BufferCache *cache, SIZE_T nodenum, BTreeNode &b, BTreeDisplayType dt)
+{
+  KEY_T key;
+  VALUE_T value;
+  SIZE_T ptr;
+  SIZE_T offset;
+  ERROR_T rc;
+  unsigned i;
+
+  if (dt==BTREE_DEPTH_DOT) { 
+    os << nodenum << " [ label=\""<<nodenum<<": ";
+  } else if (dt==BTREE_DEPTH) {
+    os << nodenum << ": ";
+  } else {
+  }
+
+  switch (b.info.nodetype) { 
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    if (dt==BTREE_SORTED_KEYVAL) {
+    } else {
+      if (dt==BTREE_DEPTH_DOT) { 
+      } else { 
+	os << "Interior: ";
+      }
+      for (offset=0;offset<=b.info.numkeys;offset++) { 
+	rc=b.GetPtr(offset,ptr);
+	if (rc) { return rc; }
+	os << "*" << ptr << " ";
+	// Last pointer
+	if (offset==b.info.numkeys) break;
+	rc=b.GetKey(offset,key);
+	if (rc) {  return rc; }
+	for (i=0;i<key.length;i++) { 
+	  os << key.data[i];
+	}
+	os << " ";
+      }
+    }
+    break;
+  case BTREE_LEAF_NODE:
+    if (dt==BTREE_DEPTH_DOT || dt==BTREE_SORTED_KEYVAL) { 
+    } else {
+      os << "Leaf: ";
+    }
+    for (offset=0;offset<b.info.numkeys;offset++) { 
+      if (offset==0) { 
+	// special case for first pointer
+	rc=b.GetPtr(offset,ptr);
+	if (rc) { return rc; }
+	if (dt!=BTREE_SORTED_KEYVAL) { 
+	  os << "*" << ptr << " ";
+	}
+      }
+      rc=b.GetKey(offset,key);
+      if (rc) {  return rc; }
+      rc=GetLeafValue(cache,b,offset,value);
+      if (rc) {  return rc; }
+      // a posting list is shown as a pair per value
+      SIZE_T n=(b.info.format==BTREE_POSTING_FORMAT) ? b.info.valuesize : value.length;
+      SIZE_T pos=0;
+      do {
+	if (dt==BTREE_SORTED_KEYVAL || pos==0) { 
+	  if (dt==BTREE_SORTED_KEYVAL) { 
+	    os << "(";
+	  }
+	  for (i=0;i<key.length;i++) { 
+	    os << key.data[i];
+	  }
+	  if (dt==BTREE_SORTED_KEYVAL) { 
+	    os << ",";
+	  } else {
+	    os << " ";
+	  }
+	}
+	for (i=0;i<n;i++) { 
+	  os << value.data[pos+i];
+	}
+	if (dt==BTREE_SORTED_KEYVAL) { 
+	  os << ")\n";
+	} else {
+	  os << " ";
+	}
+	pos+=n;
+      } while (pos<value.length);
+    }
+    break;
+  default:
+    if (dt==BTREE_DEPTH_DOT) { 
+      os << "Unknown("<<b.info.nodetype<<")";
+    } else {
+      os << "Unsupported Node Type " << b.info.nodetype ;
+    }
+  }
+  if (dt==BTREE_DEPTH_DOT) { 
+    os << "\" ]";
+  }
+  return ERROR_NOERROR;
+}
+  
+ERROR_T BTreeIndex::Lookup(const KEY_T &key, VALUE_T &value)
+{
+  SIZE_T ticket;
+  ERROR_T rc;
+
+  if (!resultcache) { 
+    return LookupOrUpdateInternal(BTREE_OP_LOOKUP, key, value);
+  }
+  if (resultcache->Get(key,value,ticket)) { 
+    return ERROR_NOERROR;
+  }
+  if ((rc=LookupOrUpdateInternal(BTREE_OP_LOOKUP, key, value))) { 
+    return rc;
+  }
+  resultcache->Put(key,value,ticket);
+  return ERROR_NOERROR;
+}
+
+
+void BTreeIndex::SetResultCacheSize(const SIZE_T bytes)
+{
+  delete resultcache;
+  resultcache = bytes ? new ResultCache(bytes) : 0;
+}
+
+
+// Hands the values of a leaf entry to callback, one list block at a
+// time.  A value can straddle two blocks of a chain.
+static ERROR_T StreamValues(BufferCache *cache, const BTreeNode &b, const SIZE_T offset,
+			    BTreeValueCallback callback, void *arg)
+{
+  SIZE_T first, last, length, block, pos, n, i;
+  SIZE_T valuesize=b.info.valuesize;
+  VALUE_T list, value;
+  BTreeNode o;
+  ERROR_T rc;
+
+  if (b.info.format!=BTREE_POSTING_FORMAT) { 
+    // a unique index has just the one
+    if ((rc=GetLeafValue(cache,b,offset,value))) { 
+      return rc;
+    }
+    return callback(value,arg);
+  }
+
+  if (!b.GetOverflow(offset,first,last,length)) { 
+    if ((rc=b.GetVal(offset,list))) { 
+      return rc;
+    }
+    for (pos=0;pos+valuesize<=list.length;pos+=valuesize) { 
+      value.Resize(valuesize,false);
+      memcpy(value.data,list.data+pos,valuesize);
+      if ((rc=callback(value,arg))) { 
+	return rc;
+      }
+    }
+    return ERROR_NOERROR;
+  }
+
+  value.Resize(valuesize,false);
+  i=0;
+  for (block=first,pos=0;pos<length;pos+=n,block=o.info.rightlink) { 
+    if ((rc=o.Unserialize(cache,block))) { 
+      return rc;
+    }
+    n=o.info.numkeys;
+    if (o.info.nodetype!=BTREE_OVERFLOW_BLOCK || n>o.info.GetNumDataBytes() || n==0) { 
+      return ERROR_INSANE;
+    }
+    if (n>length-pos) { 
+      n=length-pos;
+    }
+    for (SIZE_T j=0;j<n;) { 
+      SIZE_T m=valuesize-i<n-j ? valuesize-i : n-j;
+      memcpy(value.data+i,o.data+j,m);
+      i+=m;
+      j+=m;
+      if (i==valuesize) { 
+	if ((rc=callback(value,arg))) { 
+	  return rc;
+	}
+	i=0;
+      }
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::LookupAll(const KEY_T &key, BTreeValueCallback callback, void *arg)
+{
+  BTreeNode b;
+  SIZE_T node, offset;
+  bool found;
+  ERROR_T rc;
+
+  if (!IsValidKey(key)) { 
+    return ERROR_SIZE;
+  }
+
+  if (copyonwrite) { 
+    // always unique, so this is just a lookup
+    VALUE_T value;
+    if ((rc=Lookup(key,value))) { 
+      return rc;
+    }
+    return callback(value,arg);
+  }
+  if (bloom && !bloom->MayContain(key)) { 
+    return ERROR_NONEXISTENT;
+  }
+
+  while ((rc=FindLeaf(key,false,node,b))==ERROR_RESTART) { 
+    __sync_fetch_and_add(&restarts,1);
+  }
+  if (rc) { 
+    return rc;
+  }
+  // Keep the leaf latched while the list is read.  An optimistic
+  // descent got there without latches, so take one now; the leaf
+  // may have split in the meantime.
+  if (latchmode==BTREE_LATCH_OPTIMISTIC && (rc=LatchSharedAndMoveRight(key,node,b))) { 
+    return rc;
+  }
+
+  if (!(rc=SearchNode(b,key,offset,found))) { 
+    rc=found ? StreamValues(buffercache,b,offset,callback,arg) : ERROR_NONEXISTENT;
+  }
+  buffercache->UnlatchFrameShared(node);
+  if (bloom && rc==ERROR_NONEXISTENT) { 
+    bloom->NoteFalsePositive();
+  }
+  return rc;
+}
+
+
+
+bool BTreeIndex::IsNodeFull(const SIZE_T node)
+{
+    BTreeNode b;
+    b.Unserialize(buffercache, node);
 
     switch (b.info.nodetype) {
+        case BTREE_ROOT_NODE:
         case BTREE_INTERIOR_NODE:
-            entrySize = b.info.keysize + sizeof(SIZE_T);
+        case BTREE_LEAF_NODE:
+            return b.IsFull();
+    }
+    cout << "No such node type in btree!" << endl;
+    return false;
+}
+
+
+/// Mechanism to Split a full btree Node into two
+/// Places the correct set of keys to the correct left and right nodes
+///
+/// The new right node takes over the old rightlink and high key, and
+/// the left node links to it with splitKey as its new high key.  The
+/// right node is written first, so a reader that reaches it through
+/// the rightlink always finds it complete.  The caller holds the latch
+/// on node and still has to post splitKey to the parent.
+ERROR_T BTreeIndex::SplitNode(const SIZE_T node, SIZE_T &newNode, KEY_T &splitKey, SIZE_T &newCount)
+{
+    BTreeNode left;
+    ERROR_T rc;
+    left.Unserialize(buffercache, node);
+    BTreeNode right = left;
+
+    // the new right sibling goes next to the node it splits from
+    if ((rc = AllocateNode(newNode, node)))
+        return rc;
+    
+    if ((rc = left.Split(right, splitKey)))
+        return rc;
+    __sync_fetch_and_add(&splits, 1);
+
+    if (copyonwrite) {
+        // versions are never searched sideways, and old siblings may
+        // be gone by the time a link to them would be followed
+        right.info.rightlink = 0;
+        left.info.rightlink = 0;
+    } else {
+        right.info.rightlink = left.info.rightlink;
+        left.info.rightlink = newNode;
+    }
+    newCount = right.GetNumKeysBelow();
+
+    if ((rc = right.Serialize(buffercache, newNode)))
+        return rc;
+    return left.Serialize(buffercache, node);
+}
+
+/// PLaces the new key valaue pair at a new node
+///
+/// In a counted interior node, newCount of the keys counted under the
+/// pointer before the new one are now under newNode instead.
+ERROR_T BTreeIndex::AddKeyValuePair(const SIZE_T node, const KEY_T &key, const VALUE_T &value, SIZE_T newNode,
+                                    const SIZE_T newCount)
+{
+    BTreeNode b;
+    b.Unserialize(buffercache, node);
+    SIZE_T i, count;
+    bool found;
+    ERROR_T rc;
+
+    // after any key equal to it
+    if ((rc = SearchNode(b, key, i, found)))
+        return rc;
+    if (found)
+        i++;
+
+    switch (b.info.nodetype) {
+        case BTREE_ROOT_NODE:
+        case BTREE_INTERIOR_NODE:
+            rc = b.InsertKeyPtr(i, key, newNode);
+            if (!rc && b.info.counted && !(rc = b.GetCount(i, count))) {
+                b.SetCount(i, count - newCount);
+                b.SetCount(i + 1, newCount);
+            }
             break;
         case BTREE_LEAF_NODE:
-            entrySize = b.info.keysize + b.info.valuesize;
+            if (b.IsOverflowValue(value)) {
+                SIZE_T first, last;
+                if ((rc = WriteOverflow(value, node, first, last)))
+                    return rc;
+                rc = b.InsertKeyOverflow(i, key, first, last, value.length);
+            } else {
+                rc = b.InsertKeyVal(i, key, value);
+            }
             break;
-        case BTREE_ROOT_NODE:
         default:
             return ERROR_INSANE;
     }
+    if (rc)
+        return rc;
+    return b.Serialize(buffercache, node);
+}
 
-    b.info.numkeys++;
-    if (numkeys > 0) {
-        for (i=0, entriesToCopy = numkeys;i < numkeys; i++, entriesToCopy--) {
-            if ((rc = b.GetKey(i, testkey)))
-                return rc;
-            if (key < testkey) {
-                void *src = b.ResolveKey(i);
-                void *dest = b.ResolveKey(i + 1);
-                memmove(dest, src, entriesToCopy * entrySize);
-                if (b.info.nodetype == BTREE_LEAF_NODE) {
-                    if ((rc = b.SetKey(i, key)) || (rc = b.SetVal(i, value)))
-                        return rc;
-                } else {
-                    if ((rc = b.SetKey(i, key)) || (rc = b.SetPtr(i + 1, newNode)))
-                        return rc;
-                }
-                break;
+/// Builds the first two leaves under an empty root
+/// The caller holds the root latch
+ERROR_T BTreeIndex::GrowFirstLeaves(const SIZE_T rootNode, const KEY_T &key)
+{
+    ERROR_T error;
+    BTreeNode root;
+    if ((error = root.Unserialize(buffercache, rootNode)))
+        return error;
+    if (root.info.numkeys > 0)
+        return ERROR_NOERROR;
+
+    BTreeNode leaf(BTREE_LEAF_NODE, 
+        superblock.info.keysize,
+        superblock.info.valuesize,
+        buffercache->GetBlockSize(),
+        superblock.info.format);
+    
+    SIZE_T leftNode;
+    SIZE_T rightNode;
+    if ((error = AllocateNode(leftNode, rootNode)) != ERROR_NOERROR) return error;
+    if ((error = AllocateNode(rightNode, leftNode)) != ERROR_NOERROR) return error;
+    leaf.info.fences = BTREE_LOW_FENCE;
+    leaf.SetLowKey(key);
+    leaf.Serialize(buffercache, rightNode);
+    leaf.info.fences = BTREE_HIGH_FENCE;
+    leaf.info.rightlink = copyonwrite ? 0 : rightNode;
+    leaf.SetHighKey(key);
+    leaf.Serialize(buffercache, leftNode); 
+    root.info.numkeys = 1;
+    root.info.level = 1;
+    root.SetKey(0, key);
+    root.SetPtr(0, leftNode);
+    root.SetPtr(1, rightNode);
+    if (root.info.counted) {
+        root.SetCount(0, 0);
+        root.SetCount(1, 0);
+    }
+    return root.Serialize(buffercache, rootNode);
+}
+
+/// Splits the root in place
+///
+/// The root stays where it is.  Its contents move down into two new
+/// interior nodes and the root is rewritten to point at them, one
+/// level higher, all under the root latch alone.
+ERROR_T BTreeIndex::SplitRoot(const SIZE_T rootNode)
+{
+    ERROR_T error;
+    BTreeNode root, left;
+    SIZE_T leftNode, rightNode, total, rightCount;
+    KEY_T splitKey;
+
+    if ((error = root.Unserialize(buffercache, rootNode)))
+        return error;
+    if ((error = AllocateNode(leftNode, rootNode)))
+        return error;
+    left = root;
+    left.info.nodetype = BTREE_INTERIOR_NODE;
+    if ((error = left.Serialize(buffercache, leftNode)))
+        return error;
+    if ((error = SplitNode(leftNode, rightNode, splitKey, rightCount)))
+        return error;
+
+    total = root.GetNumKeysBelow();
+    root.info.numkeys = 1;
+    root.info.level++;
+    root.SetKey(0, splitKey);
+    root.SetPtr(0, leftNode);
+    root.SetPtr(1, rightNode);
+    if (root.info.counted) {
+        root.SetCount(0, total - rightCount);
+        root.SetCount(1, rightCount);
+    }
+    return root.Serialize(buffercache, rootNode);
+}
+
+/// Latches node exclusively and follows rightlinks until it covers key
+/// Only one latch is held at any time; node and b are updated
+ERROR_T BTreeIndex::LatchAndMoveRight(const KEY_T &key, SIZE_T &node, BTreeNode &b)
+{
+    ERROR_T rc;
+
+    buffercache->LatchFrameExclusive(node);
+    while (1) {
+        if ((rc = b.Unserialize(buffercache, node))) {
+            buffercache->UnlatchFrameExclusive(node);
+            return rc;
+        }
+        if (!b.MustMoveRight(key))
+            return ERROR_NOERROR;
+        // nodes never go away, so it is safe to let go before moving on
+        buffercache->UnlatchFrameExclusive(node);
+        node = b.info.rightlink;
+        buffercache->LatchFrameExclusive(node);
+    }
+}
+
+/// Finds and latches the node at level that covers key, starting
+/// from a node remembered on the way down.  If the root has split
+/// since then, the remembered node is now above level and we descend.
+ERROR_T BTreeIndex::LatchNodeAtLevel(const KEY_T &key, const SIZE_T level, SIZE_T &node, BTreeNode &b)
+{
+    ERROR_T rc;
+
+    while (1) {
+        if ((rc = LatchAndMoveRight(key, node, b)))
+            return rc;
+        if (b.info.level == level)
+            return ERROR_NOERROR;
+        buffercache->UnlatchFrameExclusive(node);
+        if (b.info.level < level)
+            return ERROR_INSANE;
+        if ((rc = ChooseChild(b, key, node)))
+            return rc;
+    }
+}
+
+/// Inserting a key value pair in the btree
+ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
+{
+    ERROR_T error;
+
+    if (!IsValidKey(key) || !IsValidValue(value))
+        return ERROR_SIZE;
+
+    // Before the key can be found in its leaf, so that no lookup
+    // misses it in the filter afterwards.  If the insert fails, the
+    // key is only a false positive.
+    if (bloom)
+        bloom->Add(key);
+
+    if (copyonwrite)
+        return CopyOnWriteInternal(BTREE_OP_INSERT, key, value);
+    if (!superblock.info.counted)
+        return InsertInternal(key, value);
+
+    pthread_mutex_lock(&writelock);
+    error = InsertInternal(key, value);
+    pthread_mutex_unlock(&writelock);
+    return error;
+}
+
+/// Lehman-Yao style: the descent takes no latches and remembers the
+/// interior nodes it passed through.  The leaf is latched, and if it
+/// splits, the latch is released before the separator is posted to
+/// the parent, so an insert never holds more than one latch.  Anyone
+/// who reaches a node between the split and the post moves right.
+ERROR_T BTreeIndex::InsertInternal(const KEY_T &key, const VALUE_T &value)
+{
+    ERROR_T error;
+    vector<SIZE_T> path;
+    BTreeNode b;
+    SIZE_T node, i;
+    bool found, counted = false;
+
+    while (1) {
+        node = superblock.info.rootnode;
+        path.clear();
+        while (1) {
+            if ((error = b.Unserialize(buffercache, node)))
+                return error;
+            if (b.MustMoveRight(key)) {
+                node = b.info.rightlink;
+                continue;
             }
-            if (i == numkeys - 1) {
-                if (b.info.nodetype == BTREE_LEAF_NODE) {
-                    if ((rc = b.SetKey(numkeys, key)) || (rc = b.SetVal(numkeys, value)))
-                        return rc;
-                } else {
-                    if ((rc = b.SetKey(numkeys, key)) || (rc = b.SetPtr(numkeys+1, newNode)))
-                        return rc;
-                }
+            if (b.info.nodetype == BTREE_LEAF_NODE || b.info.numkeys == 0)
                 break;
-            }
+            path.push_back(node);
+            if ((error = ChooseChild(b, key, node)))
+                return error;
         }
-    } else if ((rc = b.SetKey(0, key)) || (rc = b.SetVal(0, value))) return rc;
-    return b.Serialize(buffercache, node);
+        if (b.info.nodetype == BTREE_LEAF_NODE)
+            break;
+        // empty tree
+        buffercache->LatchFrameExclusive(node);
+        error = GrowFirstLeaves(node, key);
+        buffercache->UnlatchFrameExclusive(node);
+        if (error)
+            return error;
+    }
+
+    if ((error = LatchAndMoveRight(key, node, b)))
+        return error;
+
+    // In a unique index the key must not already be in its leaf.
+    // Otherwise the value joins the key's list if it has one.
+    error = SearchNode(b, key, i, found);
+    if (!error && !found && superblock.info.counted) {
+        // The counts on the way down go up first, and any splits then
+        // divide them between the halves.  Writers are serialized, so
+        // the key is still missing once the leaf is latched again.
+        buffercache->UnlatchFrameExclusive(node);
+        if ((error = AddToCounts(key, 1)))
+            return error;
+        counted = true;
+        if ((error = LatchAndMoveRight(key, node, b))) {
+            AddToCounts(key, -1);
+            return error;
+        }
+    }
+    if (!error && found) {
+        if (GetUnique())
+            error = ERROR_CONFLICT;
+        else
+            error = AppendValue(b, node, i, value);
+        if (!error)
+            error = LogOperation(BTREE_OP_INSERT, key, value, 0);
+    } else if (!error) {
+        error = AddKeyValuePair(node, key, value, 0);
+        if (!error) {
+            counted = false;
+            error = LogOperation(BTREE_OP_INSERT, key, value, 1);
+        }
+    }
+    if (error) {
+        buffercache->UnlatchFrameExclusive(node);
+        if (counted)
+            AddToCounts(key, -1);
+        return error;
+    }
+
+    if ((error = SplitFullNodes(node, path)))
+        return error;
+    return CommitOperation();
+}
+
+/// Splits node for as long as it is full, posting each separator to
+/// the level above.  The caller has node latched exclusively, and
+/// path holds the interior nodes its descent passed through; with an
+/// empty path the levels above are found from the root.  No latch is
+/// held on return.
+ERROR_T BTreeIndex::SplitFullNodes(SIZE_T node, vector<SIZE_T> &path)
+{
+    ERROR_T error = ERROR_NOERROR;
+    BTreeNode b;
+    SIZE_T newNode, newCount, level;
+    KEY_T splitKey;
+
+    level = 0;
+    while (!error && IsNodeFull(node)) {
+        if (node == superblock.info.rootnode) {
+            error = SplitRoot(node);
+            break;
+        }
+        if ((error = SplitNode(node, newNode, splitKey, newCount)))
+            break;
+        buffercache->UnlatchFrameExclusive(node);
+        level++;
+        if (path.empty()) {
+            node = superblock.info.rootnode;
+        } else {
+            node = path.back();
+            path.pop_back();
+        }
+        if ((error = LatchNodeAtLevel(splitKey, level, node, b)))
+            return error;
+        error = AddKeyValuePair(node, splitKey, VALUE_T(), newNode, newCount);
+    }
+
+    buffercache->UnlatchFrameExclusive(node);
+    return error;
+}
+  
+ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
+{
+    ERROR_T error;
+    VALUE_T val = value;
+    // a compressed leaf can split, which moves counts around
+    bool serialize = superblock.info.counted && !copyonwrite &&
+        superblock.info.format == BTREE_COMPRESSED_FORMAT;
+
+    if (serialize)
+        pthread_mutex_lock(&writelock);
+    if (resultcache)
+        resultcache->BeginChange(key);
+    error = LookupOrUpdateInternal(BTREE_OP_UPDATE, key, val);
+    if (resultcache)
+        resultcache->EndChange(key);
+    if (serialize)
+        pthread_mutex_unlock(&writelock);
+    return error;
 }
 
-/// Recursively adds the moved nodes to a new block
-ERROR_T BTreeIndex::RecursivePlacement(SIZE_T node, SIZE_T parent, const KEY_T &key, const VALUE_T &value)
+  
+ERROR_T BTreeIndex::ShadowNode(const SIZE_T node,
+				const SIZE_T offset,
+				const SIZE_T newchild,
+				SIZE_T &shadow,
+				const int delta)
 {
     BTreeNode b;
+    SIZE_T count;
     ERROR_T rc;
-    SIZE_T i;
-    KEY_T testkey;
-    SIZE_T ptr;
-    
-    SIZE_T newNode;
+
+    if ((rc = b.Unserialize(buffercache, node)))
+        return rc;
+    if ((rc = AllocateNode(shadow, node)))
+        return rc;
+    if (newchild && (rc = b.SetPtr(offset, newchild)))
+        return rc;
+    if (delta && b.info.counted &&
+        ((rc = b.GetCount(offset, count)) || (rc = b.SetCount(offset, count + delta))))
+        return rc;
+    b.info.rightlink = 0;
+    return b.Serialize(buffercache, shadow);
+}
+
+/// Copy-on-write insert or update
+///
+/// The current version is searched first, so a conflicting insert or
+/// an update of a missing key changes nothing.  Then the leaf and
+/// every node above it are copied, each copy pointing at the copy
+/// below it, and the insert and any splits happen on those private
+/// copies.  Publishing is a single superblock write with the new root.
+/// The superblock goes out before the replaced blocks are freed in
+/// the bitmap, so a crash can leak them but never reuse a live one.
+ERROR_T BTreeIndex::CopyOnWriteInternal(const BTreeOp op,
+					const KEY_T &key,
+					const VALUE_T &value)
+{
+    ERROR_T error;
+    vector<SIZE_T> path, offsets, old;
+    BTreeNode b;
+    SIZE_T node, newRoot, newNode, newCount, child, offset, i;
     KEY_T splitKey;
+    bool found = false;
+    int delta = op == BTREE_OP_INSERT ? 1 : 0;
 
-    b.Unserialize(buffercache, node); 
-    // Store block data
-    switch (b.info.nodetype) {
-        case BTREE_ROOT_NODE:
-        case BTREE_LEAF_NODE:
-            return AddKeyValuePair(node, key, value, 0);
+    // overflow chains would have to be versioned too
+    if (superblock.info.format != BTREE_FIXED_FORMAT)
+        return ERROR_UNIMPL;
+
+    pthread_mutex_lock(&writelock);
+
+    node = superblock.info.rootnode;
+    while (1) {
+        if ((error = b.Unserialize(buffercache, node)))
+            goto done;
+        if (b.info.nodetype == BTREE_LEAF_NODE || b.info.numkeys == 0)
             break;
-        case BTREE_INTERIOR_NODE:
-            for (i=0;i<b.info.numkeys;i++)
-            {
-                rc=b.GetKey(i,testkey);
-                if (rc) {  return rc; }
-                if (key<testkey) {
-                    rc=b.GetPtr(i,ptr);
-                    if (rc) { return rc; }
-                    rc=RecursivePlacement(ptr, node, key, value);
-                    if (rc) { return rc; }
-                    if (IsNodeFull(ptr)) {
-                        rc = SplitNode(ptr, newNode, splitKey);
-                        if (rc) { return rc; }
-                        return AddKeyValuePair(node, splitKey, VALUE_T(), newNode);
-                    } else {
-                        return rc;
-                    }
-                }
+        if ((error = ChooseChildOffset(b, key, offset)) ||
+            (error = b.GetPtr(offset, child)))
+            goto done;
+        path.push_back(node);
+        offsets.push_back(offset);
+        node = child;
+    }
+
+    if (b.info.nodetype == BTREE_LEAF_NODE &&
+        (error = SearchNode(b, key, i, found)))
+        goto done;
+    if (op == BTREE_OP_INSERT && found) {
+        error = ERROR_CONFLICT;
+        goto done;
+    }
+    if (op == BTREE_OP_UPDATE && !found) {
+        error = ERROR_NONEXISTENT;
+        goto done;
+    }
+
+    if (b.info.nodetype != BTREE_LEAF_NODE) {
+        // empty tree
+        if ((error = ShadowNode(node, 0, 0, newRoot)))
+            goto done;
+        old.push_back(node);
+        if ((error = GrowFirstLeaves(newRoot, key)) ||
+            (error = b.Unserialize(buffercache, newRoot)) ||
+            (error = ChooseChildOffset(b, key, offset)) ||
+            (error = b.GetPtr(offset, node)))
+            goto done;
+        if (b.info.counted &&
+            ((error = b.SetCount(offset, 1)) ||
+             (error = b.Serialize(buffercache, newRoot))))
+            goto done;
+        path.push_back(newRoot);
+        error = AddKeyValuePair(node, key, value, 0);
+    } else {
+        if ((error = ShadowNode(node, 0, 0, child)))
+            goto done;
+        old.push_back(node);
+        node = child;
+        if (op == BTREE_OP_UPDATE) {
+            if ((error = b.SetVal(i, value)) ||
+                (error = b.Serialize(buffercache, node)))
+                goto done;
+        } else if ((error = AddKeyValuePair(node, key, value, 0))) {
+            goto done;
+        }
+        for (i = path.size(); i > 0; i--) {
+            if ((error = ShadowNode(path[i-1], offsets[i-1], child, child, delta)))
+                goto done;
+            old.push_back(path[i-1]);
+            path[i-1] = child;
+        }
+        newRoot = child;
+    }
+    if (error)
+        goto done;
+
+    // splits stay within the new version, so nothing needs latching
+    while (IsNodeFull(node)) {
+        if (node == newRoot) {
+            error = SplitRoot(node);
+            break;
+        }
+        if ((error = SplitNode(node, newNode, splitKey, newCount)))
+            break;
+        node = path.back();
+        path.pop_back();
+        if ((error = AddKeyValuePair(node, splitKey, VALUE_T(), newNode, newCount)))
+            break;
+    }
+    if (error)
+        goto done;
+
+    pthread_mutex_lock(&epochlock);
+    superblock.info.rootnode = newRoot;
+    error = superblock.Serialize(buffercache, superblock_index);
+    for (i = 0; !error && i < old.size(); i++) {
+        error = freespace->Retire(old[i]);
+        retired.push_back(make_pair(old[i], epoch));
+    }
+    epoch++;
+    ReclaimRetired();
+    pthread_mutex_unlock(&epochlock);
+
+    if (!error)
+        error = LogOperation(op, key, value, delta);
+
+ done:
+    pthread_mutex_unlock(&writelock);
+    if (!error)
+        error = CommitOperation();
+    return error;
+}
+
+ERROR_T BTreeIndex::OpenSnapshot(BTreeSnapshot &snap) const
+{
+    pthread_mutex_lock(&epochlock);
+    snap.epoch = epoch;
+    readers[epoch]++;
+    snap.rootnode = superblock.info.rootnode;
+    pthread_mutex_unlock(&epochlock);
+    return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::CloseSnapshot(const BTreeSnapshot &snap) const
+{
+    pthread_mutex_lock(&epochlock);
+    map<SIZE_T, SIZE_T>::iterator r = readers.find(snap.epoch);
+    if (r == readers.end()) {
+        pthread_mutex_unlock(&epochlock);
+        return ERROR_INSANE;
+    }
+    if (--(*r).second == 0)
+        readers.erase(r);
+    ReclaimRetired();
+    pthread_mutex_unlock(&epochlock);
+    return ERROR_NOERROR;
+}
+
+/// A block replaced in epoch e is still reachable from snapshots
+/// opened at e or earlier
+void BTreeIndex::ReclaimRetired() const
+{
+    SIZE_T oldest = readers.empty() ? epoch : (*readers.begin()).first;
+    SIZE_T i, j;
+
+    for (i = 0, j = 0; i < retired.size(); i++) {
+        if (retired[i].second < oldest) {
+            freespace->Release(retired[i].first);
+            buffercache->NotifyDeallocateBlock(retired[i].first);
+        } else {
+            retired[j++] = retired[i];
+        }
+    }
+    retired.resize(j);
+}
+
+ERROR_T BTreeIndex::SetCopyOnWrite(const bool cow)
+{
+    ERROR_T error = ERROR_NOERROR;
+
+    if (!freespace) {
+        // not attached yet
+        copyonwrite = cow;
+        return ERROR_NOERROR;
+    }
+    if (cow == copyonwrite)
+        return ERROR_NOERROR;
+
+    pthread_mutex_lock(&writelock);
+    if (!cow)
+        error = Relink();
+    if (!error) {
+        superblock.info.copyonwrite = cow;
+        error = superblock.Serialize(buffercache, superblock_index);
+    }
+    if (!error)
+        copyonwrite = cow;
+    pthread_mutex_unlock(&writelock);
+    if (!error)
+        error = CommitOperation();
+    return error;
+}
+
+ERROR_T BTreeIndex::Relink()
+{
+    vector<SIZE_T> level(1, superblock.info.rootnode), below;
+    BTreeNode b;
+    SIZE_T i, offset, ptr, next;
+    ERROR_T rc;
+
+    while (!level.empty()) {
+        below.clear();
+        for (i = 0; i < level.size(); i++) {
+            if ((rc = b.Unserialize(buffercache, level[i])))
+                return rc;
+            next = i + 1 < level.size() ? level[i + 1] : 0;
+            if (b.info.rightlink != next) {
+                b.info.rightlink = next;
+                if ((rc = b.Serialize(buffercache, level[i])))
+                    return rc;
             }
-            if (b.info.numkeys>0) {
-                rc=b.GetPtr(b.info.numkeys,ptr);
-                if (rc) { return rc; }
-                rc=RecursivePlacement(ptr, node, key, value);
-                if (rc) { return rc; }
-                if (IsNodeFull(ptr)) {
-                    rc = SplitNode(ptr, newNode, splitKey);
-                    if (rc) { return rc; }
-                    return AddKeyValuePair(node, splitKey, VALUE_T(), newNode);
-                } else {
+            // an empty root is an empty tree
+            for (offset = 0; b.info.nodetype != BTREE_LEAF_NODE && b.info.numkeys > 0 &&
+                     offset <= b.info.numkeys; offset++) {
+                if ((rc = b.GetPtr(offset, ptr)))
                     return rc;
-                }
-            } else {
-                return ERROR_NONEXISTENT;
+                below.push_back(ptr);
             }
+        }
+        level.swap(below);
+    }
+    return ERROR_NOERROR;
+}
+
+SIZE_T BTreeIndex::GetNumFreeBlocks() const
+{
+    return freespace ? freespace->GetNumFree() : 0;
+}
+
+/// Called with writelock held, so no split is under way and no node
+/// above the leaves changes underneath.  Each node is latched only
+/// while its count is rewritten.
+ERROR_T BTreeIndex::AddToCounts(const KEY_T &key, const int delta)
+{
+    BTreeNode b;
+    SIZE_T node = superblock.info.rootnode, offset, count;
+    ERROR_T rc;
+
+    while (1) {
+        buffercache->LatchFrameExclusive(node);
+        if ((rc = b.Unserialize(buffercache, node)) ||
+            b.info.nodetype == BTREE_LEAF_NODE || b.info.numkeys == 0) {
+            buffercache->UnlatchFrameExclusive(node);
+            return rc;
+        }
+        if ((rc = ChooseChildOffset(b, key, offset)) ||
+            (rc = b.GetCount(offset, count)) ||
+            (rc = b.SetCount(offset, count + delta)) ||
+            (rc = b.Serialize(buffercache, node))) {
+            buffercache->UnlatchFrameExclusive(node);
+            return rc;
+        }
+        buffercache->UnlatchFrameExclusive(node);
+        if ((rc = b.GetPtr(offset, node)))
+            return rc;
+    }
+}
+
+ERROR_T BTreeIndex::RebuildCounts(const SIZE_T node, SIZE_T &count)
+{
+    BTreeNode b;
+    SIZE_T i, ptr, below;
+    ERROR_T rc;
+
+    if ((rc = b.Unserialize(buffercache, node)))
+        return rc;
+    if (b.info.nodetype == BTREE_LEAF_NODE) {
+        count = b.info.numkeys;
+        return ERROR_NOERROR;
+    }
+    count = 0;
+    if (b.info.numkeys == 0)
+        return ERROR_NOERROR;
+    for (i = 0; i <= b.info.numkeys; i++) {
+        if ((rc = b.GetPtr(i, ptr)) ||
+            (rc = RebuildCounts(ptr, below)) ||
+            (rc = b.SetCount(i, below)))
+            return rc;
+        count += below;
+    }
+    return b.Serialize(buffercache, node);
+}
+
+/// The keys counted under the pointers before the one the descent
+/// takes, plus those before key in its leaf
+ERROR_T BTreeIndex::Rank(const KEY_T &key, SIZE_T &rank) const
+{
+    BTreeNode b;
+    SIZE_T node = superblock.info.rootnode, offset, count, i;
+    bool found;
+    ERROR_T rc;
+
+    rank = 0;
+    while (1) {
+        // updates can still be rewriting leaves
+        buffercache->LatchFrameShared(node);
+        rc = b.Unserialize(buffercache, node);
+        buffercache->UnlatchFrameShared(node);
+        if (rc)
+            return rc;
+        if (b.info.nodetype == BTREE_LEAF_NODE) {
+            if ((rc = SearchNode(b, key, offset, found)))
+                return rc;
+            rank += offset;
+            return ERROR_NOERROR;
+        }
+        if (b.info.numkeys == 0)
+            return ERROR_NOERROR;
+        if ((rc = ChooseChildOffset(b, key, offset)))
+            return rc;
+        for (i = 0; i < offset; i++) {
+            if ((rc = b.GetCount(i, count)))
+                return rc;
+            rank += count;
+        }
+        if ((rc = b.GetPtr(offset, node)))
+            return rc;
+    }
+}
+
+ERROR_T BTreeIndex::Count(const KEY_T &lo, const KEY_T &hi, SIZE_T &count) const
+{
+    SIZE_T first, last;
+    ERROR_T rc;
+
+    if (!superblock.info.counted)
+        return ERROR_UNIMPL;
+    if (!IsValidKey(lo) || !IsValidKey(hi))
+        return ERROR_SIZE;
+
+    pthread_mutex_lock(&writelock);
+    if (!(rc = Rank(lo, first)) && !(rc = Rank(hi, last)))
+        count = last > first ? last - first : 0;
+    pthread_mutex_unlock(&writelock);
+    return rc;
+}
+
+ERROR_T BTreeIndex::Select(const SIZE_T k, KEY_T &key, VALUE_T &value) const
+{
+    ERROR_T rc;
+
+    if (!superblock.info.counted)
+        return ERROR_UNIMPL;
+
+    pthread_mutex_lock(&writelock);
+    rc = SelectInternal(k, key, value);
+    pthread_mutex_unlock(&writelock);
+    return rc;
+}
+
+/// Skips whole subtrees by their counts on the way down
+ERROR_T BTreeIndex::SelectInternal(const SIZE_T k, KEY_T &key, VALUE_T &value) const
+{
+    BTreeNode b;
+    SIZE_T node = superblock.info.rootnode, rest = k, count, i;
+    ERROR_T rc;
+
+    while (1) {
+        buffercache->LatchFrameShared(node);
+        if ((rc = b.Unserialize(buffercache, node))) {
+            buffercache->UnlatchFrameShared(node);
             break;
-        default:
-            return ERROR_INSANE;
+        }
+        if (b.info.nodetype == BTREE_LEAF_NODE) {
+            // latched, so that no update can free an overflow chain
+            // while it is being read
+            if (rest >= b.info.numkeys)
+                rc = ERROR_INSANE;
+            else if (!(rc = b.GetKey(rest, key)))
+                rc = GetLeafValue(buffercache, b, rest, value,
+                                  GetUnique() ? (SIZE_T)-1 : superblock.info.valuesize);
+            buffercache->UnlatchFrameShared(node);
             break;
-    }  
-    return ERROR_INSANE;
+        }
+        buffercache->UnlatchFrameShared(node);
+        for (i = 0; b.info.numkeys > 0 && i <= b.info.numkeys; i++) {
+            if ((rc = b.GetCount(i, count)) || rest < count)
+                break;
+            rest -= count;
+        }
+        if (rc)
+            break;
+        if (b.info.numkeys == 0 || i > b.info.numkeys) {
+            rc = ERROR_NONEXISTENT;
+            break;
+        }
+        if ((rc = b.GetPtr(i, node)))
+            break;
+    }
+    return rc;
+}
+
+/// Positions drawn uniformly from the root's total, each then selected
+ERROR_T BTreeIndex::Sample(const SIZE_T n, unsigned &seed, vector<KeyValuePair> &sample) const
+{
+    BTreeNode root;
+    KeyValuePair p;
+    SIZE_T total, k, i;
+    ERROR_T rc;
+
+    if (!superblock.info.counted)
+        return ERROR_UNIMPL;
+
+    sample.clear();
+    pthread_mutex_lock(&writelock);
+    buffercache->LatchFrameShared(superblock.info.rootnode);
+    rc = root.Unserialize(buffercache, superblock.info.rootnode);
+    buffercache->UnlatchFrameShared(superblock.info.rootnode);
+    total = root.GetNumKeysBelow();
+    if (!rc && n > 0 && total == 0)
+        rc = ERROR_NONEXISTENT;
+    for (i = 0; !rc && i < n; i++) {
+        // rand_r() gives only 31 bits at a time
+        k = (((SIZE_T)rand_r(&seed) << 31) | rand_r(&seed)) % total;
+        if (!(rc = SelectInternal(k, p.key, p.value)))
+            sample.push_back(p);
+    }
+    pthread_mutex_unlock(&writelock);
+    return rc;
+}
+
+ERROR_T BTreeIndex::DefragWalk(const SIZE_T node,
+				map<SIZE_T, BTreeDefragRef> &refs,
+				vector<SIZE_T> &order,
+				map<SIZE_T, SIZE_T> &lastatlevel)
+{
+    BTreeNode b;
+    BTreeDefragRef r;
+    SIZE_T offset, child;
+    ERROR_T rc;
+
+    if ((rc = b.Unserialize(buffercache, node)))
+        return rc;
+    if (b.info.nodetype == BTREE_LEAF_NODE || b.info.numkeys == 0)
+        return ERROR_NOERROR;
+
+    for (offset = 0; offset <= b.info.numkeys; offset++) {
+        if ((rc = b.GetPtr(offset, child)))
+            return rc;
+        r.parent = node;
+        r.offset = offset;
+        r.left = lastatlevel[b.info.level - 1];
+        r.right = 0;
+        r.position = order.size();
+        if (r.left)
+            refs[r.left].right = child;
+        lastatlevel[b.info.level - 1] = child;
+        refs[child] = r;
+        order.push_back(child);
+        // no need to read the leaves themselves
+        if (b.info.level > 1 &&
+            (rc = DefragWalk(child, refs, order, lastatlevel)))
+            return rc;
+    }
+    return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::DefragMove(const SIZE_T from,
+				const SIZE_T to,
+				map<SIZE_T, BTreeDefragRef> &refs,
+				vector<SIZE_T> &order)
+{
+    BTreeDefragRef r = refs[from];
+    BTreeNode b, n;
+    SIZE_T offset, child;
+    ERROR_T rc;
+
+    // the copy goes out first, then the links to it, so a log cut
+    // anywhere in between leaves a tree that still reads correctly
+    if ((rc = b.Unserialize(buffercache, from)) ||
+        (rc = b.Serialize(buffercache, to)))
+        return rc;
+    if (r.left) {
+        if ((rc = n.Unserialize(buffercache, r.left)))
+            return rc;
+        if (n.info.rightlink == from) {
+            n.info.rightlink = to;
+            if ((rc = n.Serialize(buffercache, r.left)))
+                return rc;
+        }
+        refs[r.left].right = to;
+    }
+    if (r.right)
+        refs[r.right].left = to;
+    if ((rc = n.Unserialize(buffercache, r.parent)) ||
+        (rc = n.SetPtr(r.offset, to)) ||
+        (rc = n.Serialize(buffercache, r.parent)) ||
+        (rc = DeallocateNode(from)))
+        return rc;
+
+    order[r.position] = to;
+    if (b.info.nodetype != BTREE_LEAF_NODE) {
+        for (offset = 0; offset <= b.info.numkeys; offset++) {
+            if ((rc = b.GetPtr(offset, child)))
+                return rc;
+            refs[child].parent = to;
+        }
+    }
+    refs.erase(from);
+    refs[to] = r;
+    return ERROR_NOERROR;
 }
 
-/// Inserting a key value pair in the btree
-ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
+ERROR_T BTreeIndex::Defragment(const SIZE_T maxmoves, SIZE_T &nummoves, bool &done)
 {
-    ERROR_T error;
-    BTreeNode root;
-    root.Unserialize(buffercache,superblock.info.rootnode);
-
-    if (root.info.numkeys == 0) { 
-        BTreeNode leaf(BTREE_LEAF_NODE, 
-            superblock.info.keysize,
-            superblock.info.valuesize,
-            buffercache->GetBlockSize());
-        
-        SIZE_T leftNode;
-        SIZE_T rightNode;
-        if ((error = AllocateNode(leftNode)) != ERROR_NOERROR) return error;
-        if ((error = AllocateNode(rightNode)) != ERROR_NOERROR) return error;
-        leaf.Serialize(buffercache, leftNode); 
-        leaf.Serialize(buffercache, rightNode);
-        root.info.numkeys += 1;
-        root.SetKey(0, key);
-        root.SetPtr(0, leftNode);
-        root.SetPtr(1, rightNode);
-        root.Serialize(buffercache, superblock.info.rootnode);
-    } 
-    VALUE_T temp;
-    SIZE_T oldRoot=superblock.info.rootnode, newNode;
-    KEY_T splitKey;
+    map<SIZE_T, BTreeDefragRef> refs;
+    map<SIZE_T, SIZE_T> lastatlevel;
+    vector<SIZE_T> order;
+    SIZE_T numblocks = buffercache->GetNumBlocks();
+    SIZE_T i, target, away;
+    ERROR_T rc;
 
-    BTreeNode interior(BTREE_INTERIOR_NODE,superblock.info.keysize,  superblock.info.valuesize,
-        buffercache->GetBlockSize());
+    nummoves = 0;
+    done = false;
 
-    if (ERROR_NONEXISTENT == Lookup(key, temp)) {
-        error = RecursivePlacement(superblock.info.rootnode, superblock.info.rootnode, key, value);
-        if (IsNodeFull(superblock.info.rootnode)) {
-            SplitNode(oldRoot, newNode, splitKey);
-            interior.Unserialize(buffercache, oldRoot);
-            interior.Serialize(buffercache, oldRoot);
-            interior.Unserialize(buffercache, newNode);
-            interior.Serialize(buffercache, newNode);
+    if (copyonwrite)
+        return ERROR_UNIMPL;
 
-            if ((error = AllocateNode(superblock.info.rootnode)) != ERROR_NOERROR)
-                return error;
-            root.info.numkeys = 1;
-            root.SetKey(0, splitKey);
-            root.SetPtr(0, oldRoot);
-            root.SetPtr(1, newNode);
-            root.Serialize(buffercache, superblock.info.rootnode);
+    // The tree may have changed since the last call, so look again.
+    // This only reads the interior nodes.
+    if ((rc = DefragWalk(superblock.info.rootnode, refs, order, lastatlevel)))
+        return rc;
+
+    target = 0;
+    for (i = 0; i < order.size() && i < defragnext; i++)
+        target = order[i] + 1;
+
+    for (; i < order.size() && nummoves < maxmoves; i++, target++) {
+        // skip the blocks that are not ours to move
+        while (target < numblocks && freespace->IsAllocated(target) &&
+               refs.find(target) == refs.end())
+            target++;
+        if (target >= numblocks)
+            break;
+        if (order[i] == target)
+            continue;
+        if (freespace->IsAllocated(target)) {
+            if ((rc = AllocateNode(away, numblocks - 1)) ||
+                (rc = DefragMove(target, away, refs, order)))
+                return rc;
+            nummoves++;
         }
-        return error;
+        if ((rc = freespace->MarkAllocated(target)) ||
+            (rc = buffercache->NotifyAllocateBlock(target)) ||
+            (rc = DefragMove(order[i], target, refs, order)))
+            return rc;
+        nummoves++;
     }
-    else
-        return ERROR_CONFLICT;
 
-  return ERROR_UNIMPL;
-}
-  
-ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
-{
-    VALUE_T val = value;
-    return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_UPDATE, key, val);
+    defragnext = i;
+    if (i >= order.size() || target >= numblocks) {
+        done = true;
+        defragnext = 0;
+    }
     return ERROR_NOERROR;
 }
 
-  
 ERROR_T BTreeIndex::Delete(const KEY_T &key)
 {
   // Optional - Extra Credit
@@ -632,7 +2354,7 @@ ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
     return rc;
   }
 
-  rc = PrintNode(o,node,b,display_type);
+  rc = PrintNode(o,buffercache,node,b,display_type);
   
   if (rc) { return rc; }
 
@@ -678,95 +2400,664 @@ ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
 ERROR_T BTreeIndex::Display(ostream &o, BTreeDisplayType display_type) const
 {
   ERROR_T rc;
+  BTreeSnapshot snap;
   if (display_type==BTREE_DEPTH_DOT) { 
     o << "digraph tree { \n";
   }
-  rc=DisplayInternal(superblock.info.rootnode,o,display_type);
+  if (copyonwrite) { 
+    // a long traversal sees one version from start to finish
+    OpenSnapshot(snap);
+    rc=DisplayInternal(snap.rootnode,o,display_type);
+    CloseSnapshot(snap);
+  } else {
+    rc=DisplayInternal(superblock.info.rootnode,o,display_type);
+  }
   if (display_type==BTREE_DEPTH_DOT) { 
     o << "}\n";
   }
-  return ERROR_NOERROR;
+  return rc;
 }
 
 
-ERROR_T BTreeIndex::SanityCheck() const
+// Bytes Export() collects before each write to its stream
+static const SIZE_T EXPORT_CHUNK = 256*1024;
+
+// Export() output, and the scratch space it reuses for every leaf
+struct ExportBuffer {
+  ostream &os;
+  BTreeExportFormat format;
+  vector<char> buf;
+  SIZE_T used;
+  BTreeNode leaf;
+  KEY_T key;
+  VALUE_T value;
+
+  ExportBuffer(ostream &o, const BTreeExportFormat f) : os(o), format(f), buf(EXPORT_CHUNK), used(0) {}
+
+  void Flush() { 
+    if (used>0) { 
+      os.write(&buf[0],used);
+      used=0;
+    }
+  }
+
+  void Put(const void *p, const SIZE_T n) { 
+    if (used+n>buf.size()) { 
+      Flush();
+      if (n>buf.size()) { 
+	os.write((const char*)p,n);
+	return;
+      }
+    }
+    memcpy(&buf[used],p,n);
+    used+=n;
+  }
+
+  void PutPair(const BYTE_T *v, const SIZE_T vlen) { 
+    if (format==BTREE_EXPORT_BINARY) { 
+      SIZE_T lengths[2];
+      lengths[0]=key.length;
+      lengths[1]=vlen;
+      Put(lengths,sizeof(lengths));
+      Put(key.data,key.length);
+      Put(v,vlen);
+    } else {
+      Put("(",1);
+      Put(key.data,key.length);
+      Put(",",1);
+      Put(v,vlen);
+      Put(")\n",2);
+    }
+  }
+};
+
+
+static ERROR_T ExportNode(BufferCache *cache, const SIZE_T node, ExportBuffer &out)
 {
-      ERROR_T rc;
-    SIZE_T totalKeys;
-    // Check if keys in order within node
-    // Also, count up keys in leaf nodes
-    rc=NodeCheck(superblock.info.rootnode, totalKeys);
-    if(rc){
-        return rc;
+  BTreeNode b;
+  SIZE_T offset, ptr, next, n, fetched, pos;
+  ERROR_T rc;
+
+  if ((rc=out.leaf.Unserialize(cache,node))) { 
+    return rc;
+  }
+
+  switch (out.leaf.info.nodetype) { 
+  case BTREE_LEAF_NODE: { 
+    BTreeNode &l=out.leaf;
+    for (offset=0;offset<l.info.numkeys;offset++) { 
+      if ((rc=l.GetKey(offset,out.key)) ||
+	  (rc=GetLeafValue(cache,l,offset,out.value))) { 
+	return rc;
+      }
+      // a posting list is a pair per value
+      n=(l.info.format==BTREE_POSTING_FORMAT) ? l.info.valuesize : out.value.length;
+      pos=0;
+      do { 
+	out.PutPair(out.value.data+pos,n);
+	pos+=n;
+      } while (pos<out.value.length);
     }
-    // return insane tree when totalkeys in leaf nodes isn't the same as the numkeys of superblock
-    if (totalKeys != superblock.info.numkeys) {
-        return ERROR_INSANE;
+    return ERROR_NOERROR;
+  }
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    // the leaf scratch node is about to be reused below
+    b=out.leaf;
+    fetched=0;
+    for (offset=0;b.info.numkeys>0 && offset<=b.info.numkeys;offset++) { 
+      if ((rc=b.GetPtr(offset,ptr))) { 
+	return rc;
+      }
+      if (b.info.level==1 && offset>=fetched) { 
+	// read ahead the run of consecutive leaves starting here
+	for (n=1;
+	     offset+n<=b.info.numkeys && n<cache->GetCacheSize()/2 &&
+	       b.GetPtr(offset+n,next)==ERROR_NOERROR && next==ptr+n;
+	     n++) { 
+	}
+	if (n>1) { 
+	  cache->PrefetchBlocks(ptr,n);
+	}
+	fetched=offset+n;
+      }
+      if ((rc=ExportNode(cache,ptr,out))) { 
+	return rc;
+      }
     }
     return ERROR_NOERROR;
+  default:
+    return ERROR_INSANE;
+  }
 }
 
-ERROR_T BTreeIndex::NodeCheck(const SIZE_T &node, SIZE_T &totalKeys) const
+
+ERROR_T BTreeIndex::Export(ostream &o, const BTreeExportFormat format) const
 {
+  ExportBuffer out(o,format);
+  BTreeSnapshot snap;
+  ERROR_T rc;
+
+  if (copyonwrite) { 
+    OpenSnapshot(snap);
+    rc=ExportNode(buffercache,snap.rootnode,out);
+    CloseSnapshot(snap);
+  } else {
+    rc=ExportNode(buffercache,superblock.info.rootnode,out);
+  }
+  out.Flush();
+  return rc;
+}
+
+
+// Sanity checking
+//
+// The tree is checked a range at a time: a node, the keys its parent
+// says it may hold, and any siblings that a split has put to its
+// right without its parent knowing yet, which share out the range
+// between them.  Each level's nodes come up from left to right, so
+// following the rightlinks only takes remembering, for each level,
+// the first node seen and where the last one seen links to.  A
+// copy-on-write index keeps no links, so there every node is where
+// its parent says and its rightlink is ignored.
+
+// Subtrees handed out per checking thread, so that one with a big
+// subtree doesn't hold up the rest
+static const SIZE_T CHECK_TASKS_PER_THREAD = 8;
+
+struct CheckRange {
+  SIZE_T node;
+  SIZE_T level;
+  KEY_T  low, high;
+  bool   haslow, hashigh;
+  bool   hascount;
+  SIZE_T count;      // keys the parent's count says are below
+};
+
+struct CheckLinks {
+  vector<SIZE_T> first, next;   // by level, 0 until a node is seen
+
+  CheckLinks(const SIZE_T levels=0) : first(levels,0), next(levels,0) {}
+};
+
+// A subtree for one of the checking threads
+struct CheckTask {
+  CheckRange range;
+  CheckLinks links;
+  SIZE_T     numkeys;
+};
+
+struct SanityChecker {
+  BufferCache        *cache;
+  const NodeMetadata &super;
+  SIZE_T              root;
+  bool                linked;   // false if rightlinks are not kept (copy-on-write)
+  BTreeCheckReport   &report;
+  BTreeCheckCallback  callback;
+  void               *arg;
+  pthread_mutex_t     lock;     // one callback at a time
+  vector<BYTE_T>      seen;     // a bit for each block the index uses
+  volatile ERROR_T    rc;       // the first problem found
+  vector<CheckTask>   tasks;
+  volatile SIZE_T     nexttask;
+
+  SanityChecker(BufferCache *c, const NodeMetadata &s, const SIZE_T r, const bool l,
+		BTreeCheckReport &rep, BTreeCheckCallback cb, void *a) :
+    cache(c), super(s), root(r), linked(l), report(rep), callback(cb), arg(a),
+    seen(c->GetNumBlocks()/8+1,0), rc(ERROR_NOERROR), nexttask(0) { 
+    pthread_mutex_init(&lock,0);
+    memset(&report,0,sizeof(report));
+  }
+  ~SanityChecker() { pthread_mutex_destroy(&lock); }
+
+  ERROR_T Fail(const SIZE_T block, const ERROR_T error=ERROR_INSANE) { 
+    if (__sync_bool_compare_and_swap(&rc,ERROR_NOERROR,error)) { 
+      report.badblock=block;
+    }
+    return error;
+  }
+
+  // false if the block is off the disk or has been seen already, in
+  // which case the index is not a tree
+  bool See(const SIZE_T block) { 
+    BYTE_T bit=1<<(block%8);
+    return block<cache->GetNumBlocks() && !(__sync_fetch_and_or(&seen[block/8],bit) & bit);
+  }
+  bool WasSeen(const SIZE_T block) const { return (seen[block/8]>>(block%8)) & 0x1; }
+
+  // true if a node that links to next is followed by node
+  bool Follows(const SIZE_T next, const SIZE_T node) const { 
+    return next==node || (!linked && next==0);
+  }
+
+  ERROR_T Link(CheckLinks &links, const SIZE_T level, const SIZE_T node, const SIZE_T rightlink) { 
+    if (links.first[level]==0) { 
+      links.first[level]=node;
+    } else if (!Follows(links.next[level],node)) { 
+      return Fail(node);
+    }
+    links.next[level]=rightlink;
     return ERROR_NOERROR;
-    KEY_T key;
-    SIZE_T ptr;
-    KEY_T prev;
-    SIZE_T offset;
-    int first=1;
-    ERROR_T rc;
-    BTreeNode b;
-    totalKeys = 0;
+  }
 
-    rc= b.Unserialize(buffercache,node);
-    if(rc) {
-        return rc;
+  void NodeDone() { 
+    SIZE_T n=__sync_add_and_fetch(&report.numnodes,1);
+    if (callback && n%BTREE_CHECK_PROGRESS==0) { 
+      pthread_mutex_lock(&lock);
+      callback(report,arg);
+      pthread_mutex_unlock(&lock);
     }
-    switch(b.info.nodetype){
-        case BTREE_ROOT_NODE:
-        case BTREE_INTERIOR_NODE:
-            if ((int)(b.info.GetNumSlotsAsInterior()*(2./3.)) <= b.info.numkeys) { 
-                return ERROR_INSANE;
-            }
-            if (b.info.numkeys>0) {
-                for (offset=0;offset<=b.info.numkeys;offset++) {
-                    // Recurse down
-                    rc=b.GetPtr(offset,ptr);
-                    if (rc) { return rc; }
-                    rc=NodeCheck(ptr,totalKeys);
-                    if (rc) { return rc; }
-                  }
-            }
-            return ERROR_NOERROR;
-            break;
-        case BTREE_LEAF_NODE:
-            if ((int)(b.info.GetNumSlotsAsLeaf()*(2./3.)) <= b.info.numkeys){
-                return ERROR_INSANE;
-            }
-            if (b.info.numkeys>0) {
-                // keep track of number of keys
-                totalKeys += b.info.numkeys;
-                for (offset=0;offset<=b.info.numkeys;offset++) {
-                    rc=b.GetKey(offset,key);
-                    if ( rc ) { return rc; }
-                    if(first==1)
-                    {
-                        prev = key; first = 0;
-                    } 
-                    else 
-                    {if( prev==key|| prev<key){
-                            prev=key;
-                        }
-                        else
-                        {return ERROR_INSANE;}
-                    }
-                }
-            }
-            return ERROR_NOERROR;
-            break;
-        default:
+  }
+
+  ERROR_T CheckOverflow(const SIZE_T leaf, SIZE_T block, const SIZE_T last, const SIZE_T length);
+  ERROR_T CheckLeaf(const SIZE_T node, const BTreeNode &b, const KEY_T &low, const bool haslow,
+		    const KEY_T &high, const bool hashigh);
+  // Checks the range and, with expand, only its own nodes, adding the
+  // ranges of their children to expand rather than checking them too
+  ERROR_T Check(const CheckRange &r, CheckLinks &links, SIZE_T &numkeys,
+		vector<CheckRange> *expand);
+  ERROR_T Run(const SIZE_T numthreads);
+};
+
+
+// Every block but the last is full, and the chain has at least the
+// length the leaf gives it; an interrupted append may have left more
+ERROR_T SanityChecker::CheckOverflow(const SIZE_T leaf, SIZE_T block, const SIZE_T last, const SIZE_T length)
+{
+  BTreeNode o;
+  SIZE_T bytes=0;
+  ERROR_T error;
+
+  while (1) { 
+    if (!See(block)) { 
+      return Fail(block);
+    }
+    if ((error=o.Unserialize(cache,block))) { 
+      return Fail(block,error);
+    }
+    if (o.info.nodetype!=BTREE_OVERFLOW_BLOCK || o.info.numkeys>o.info.GetNumDataBytes() ||
+	(block!=last && o.info.numkeys!=o.info.GetNumDataBytes())) { 
+      return Fail(block);
+    }
+    __sync_fetch_and_add(&report.numoverflow,1);
+    bytes+=o.info.numkeys;
+    if (block==last) { 
+      break;
+    }
+    block=o.info.rightlink;
+  }
+  return bytes<length ? Fail(leaf) : ERROR_NOERROR;
+}
+
+
+ERROR_T SanityChecker::CheckLeaf(const SIZE_T node, const BTreeNode &b, const KEY_T &low, const bool haslow,
+				 const KEY_T &high, const bool hashigh)
+{
+  KEY_T lowkey, highkey;
+  SIZE_T i, first, last, length;
+  ERROR_T error;
+
+  if (b.info.IsSlotted()) { 
+    for (i=0;i<b.info.numkeys;i++) { 
+      if (b.GetOverflow(i,first,last,length) && (error=CheckOverflow(node,first,last,length))) { 
+	return error;
+      }
+    }
+    return ERROR_NOERROR;
+  }
+
+  // The fences are the range the parent gives the leaf, and the
+  // prefix its keys share has to be shared by both
+  if ((b.info.fences & BTREE_LOW_FENCE) && 
+      (!haslow || b.GetLowKey(lowkey) || !(lowkey==low))) { 
+    return Fail(node);
+  }
+  if ((b.info.fences & BTREE_HIGH_FENCE) && 
+      (!hashigh || b.GetHighKey(highkey) || !(highkey==high))) { 
+    return Fail(node);
+  }
+  if (b.info.prefixlen>0 && 
+      (b.info.fences!=(BTREE_LOW_FENCE|BTREE_HIGH_FENCE) || 
+       memcmp(lowkey.data,highkey.data,b.info.prefixlen))) { 
+    return Fail(node);
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T SanityChecker::Check(const CheckRange &r, CheckLinks &links, SIZE_T &numkeys,
+			     vector<CheckRange> *expand)
+{
+  BTreeNode b;
+  KEY_T low=r.low, highkey, key, prev;
+  bool haslow=r.haslow, more;
+  SIZE_T node=r.node, promised=0, below, used, room, i;
+  ERROR_T error;
+
+  numkeys=0;
+  while (1) { 
+    if (rc) { 
+      return rc;
+    }
+    if (!See(node)) { 
+      return Fail(node);
+    }
+    if ((error=b.Unserialize(cache,node))) { 
+      return Fail(node,error);
+    }
+    SIZE_T rightlink=linked ? b.info.rightlink : 0;
+    // a node of this index, where its parent expects it
+    int type=(node==root) ? BTREE_ROOT_NODE : r.level==0 ? BTREE_LEAF_NODE : BTREE_INTERIOR_NODE;
+    if (b.info.nodetype!=type || b.info.level!=r.level || 
+	b.info.keysize!=super.keysize || b.info.valuesize!=super.valuesize ||
+	b.info.format!=super.format || 
+	(type!=BTREE_LEAF_NODE && (b.info.counted!=super.counted || (r.level==0 && b.info.numkeys>0))) ||
+	(node==root && rightlink) ||
+	!b.IsWellFormed()) { 
+      return Fail(node);
+    }
+
+    // The node's part of the range ends at its high key if a sibling
+    // its parent doesn't know of takes over from there
+    more=false;
+    if (rightlink) { 
+      if ((error=b.GetHighKey(highkey))) { 
+	return Fail(node,error);
+      }
+      more=!r.hashigh || !(highkey==r.high);
+      if (more && ((r.hashigh && !(highkey<r.high)) || (haslow && !(low<highkey)))) { 
+	return Fail(node);
+      }
+    }
+    const KEY_T &high=more ? highkey : r.high;
+    bool hashigh=more || r.hashigh;
+
+    if ((error=Link(links,r.level,node,rightlink))) { 
+      return error;
+    }
+    for (i=0;i<b.info.numkeys;i++) { 
+      if ((error=b.GetKey(i,key))) { 
+	return Fail(node,error);
+      }
+      if ((i>0 ? !(prev<key) : (haslow && key<low)) || (hashigh && !(key<high))) { 
+	return Fail(node);
+      }
+      prev=key;
+    }
+
+    b.GetFill(used,room);
+    if (node!=root && 2*used<room) { 
+      __sync_fetch_and_add(&report.numunderfull,1);
+    }
+    if (node!=r.node) { 
+      __sync_fetch_and_add(&report.numunposted,1);
+    }
+
+    if (type==BTREE_LEAF_NODE) { 
+      if ((error=CheckLeaf(node,b,low,haslow,high,hashigh))) { 
+	return error;
+      }
+      numkeys+=b.info.numkeys;
+      __sync_fetch_and_add(&report.numleaves,1);
+      __sync_fetch_and_add(&report.numkeys,b.info.numkeys);
+      __sync_fetch_and_add(&report.leafused,(unsigned long long)used);
+      __sync_fetch_and_add(&report.leafroom,(unsigned long long)room);
+    } else if (b.info.numkeys>0 || node!=root) { 
+      // an empty root is an empty tree
+      CheckRange c;
+      c.level=r.level-1;
+      c.hascount=(b.info.counted!=0);
+      c.count=0;
+      for (i=0;i<=b.info.numkeys;i++) { 
+	if (i==0) { 
+	  c.low=low;
+	  c.haslow=haslow;
+	} else { 
+	  c.low=c.high;
+	  c.haslow=true;
+	}
+	if (i<b.info.numkeys) { 
+	  b.GetKey(i,c.high);
+	  c.hashigh=true;
+	} else {
+	  c.high=high;
+	  c.hashigh=hashigh;
+	}
+	if ((error=b.GetPtr(i,c.node)) ||
+	    (c.hascount && (error=b.GetCount(i,c.count)))) { 
+	  return Fail(node,error);
+	}
+	if (expand) { 
+	  expand->push_back(c);
+	  promised+=c.count;
+	  continue;
+	}
+	if ((error=Check(c,links,below,0))) { 
+	  return error;
+	}
+	if (c.hascount && below!=c.count) { 
+	  return Fail(node);
+	}
+	numkeys+=below;
+      }
+    }
+    NodeDone();
+
+    if (!more) { 
+      break;
+    }
+    low=highkey;
+    haslow=true;
+    node=rightlink;
+  }
+
+  if (expand && r.hascount && promised!=r.count) { 
+    return Fail(r.node);
+  }
+  return ERROR_NOERROR;
+}
+
+
+static void *CheckThread(void *arg)
+{
+  SanityChecker *c=(SanityChecker *)arg;
+  SIZE_T i;
+
+  while (!c->rc && (i=__sync_fetch_and_add(&c->nexttask,1))<c->tasks.size()) { 
+    CheckTask &t=c->tasks[i];
+    c->Check(t.range,t.links,t.numkeys,0);
+  }
+  return 0;
+}
+
+
+// Checks the levels near the root itself until there are enough
+// subtrees below them to keep the threads busy, and then has the
+// threads check those
+ERROR_T SanityChecker::Run(const SIZE_T numthreads)
+{
+  BTreeNode b;
+  CheckRange r;
+  SIZE_T i, level, numkeys;
+  ERROR_T error;
+
+  if ((error=b.Unserialize(cache,root))) { 
+    return Fail(root,error);
+  }
+  r.node=root;
+  r.level=b.info.level;
+  r.haslow=r.hashigh=r.hascount=false;
+  r.count=0;
+  report.height=r.level+1;
+
+  CheckLinks top(r.level+1);
+  vector<CheckRange> frontier(1,r), next;
+  while (frontier[0].level>0 && frontier.size()<CHECK_TASKS_PER_THREAD*numthreads) { 
+    next.clear();
+    for (i=0;i<frontier.size();i++) { 
+      if ((error=Check(frontier[i],top,numkeys,&next))) { 
+	return error;
+      }
+    }
+    if (next.empty()) { 
+      break;
+    }
+    frontier.swap(next);
+  }
+
+  tasks.resize(frontier.size());
+  for (i=0;i<tasks.size();i++) { 
+    tasks[i].range=frontier[i];
+    tasks[i].links=CheckLinks(frontier[i].level+1);
+    tasks[i].numkeys=0;
+  }
+  if (numthreads<=1 || tasks.size()==1) { 
+    CheckThread(this);
+  } else {
+    vector<pthread_t> threads(numthreads<tasks.size() ? numthreads : tasks.size());
+    for (i=0;i<threads.size();i++) { 
+      pthread_create(&threads[i],0,CheckThread,this);
+    }
+    for (i=0;i<threads.size();i++) { 
+      pthread_join(threads[i],0);
+    }
+  }
+  if (rc) { 
+    return rc;
+  }
+
+  // The subtrees have to hold what the counts above them say, and
+  // each level has to link up from one subtree to the next, and end
+  numkeys=0;
+  for (i=0;i<tasks.size();i++) { 
+    CheckTask &t=tasks[i];
+    if (t.range.hascount && t.numkeys!=t.range.count) { 
+      return Fail(t.range.node);
+    }
+    numkeys+=t.numkeys;
+    for (level=0;level<t.links.next.size();level++) { 
+      if (i+1<tasks.size() ? !Follows(t.links.next[level],tasks[i+1].links.first[level]) : 
+	  t.links.next[level]!=0) { 
+	return Fail(i+1<tasks.size() ? tasks[i+1].links.first[level] : t.links.next[level]);
+      }
+    }
+  }
+  for (level=0;level<top.next.size();level++) { 
+    if (top.next[level]!=0) { 
+      return Fail(top.next[level]);
+    }
+  }
+  if (numkeys!=super.numkeys) { 
+    return Fail(root);
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::SanityCheck(BTreeCheckReport &report, const SIZE_T numthreads,
+				BTreeCheckCallback callback, void *arg) const
+{
+  BTreeSnapshot snap;
+  SIZE_T root=superblock.info.rootnode, i;
+  ERROR_T rc;
+
+  if (copyonwrite) { 
+    OpenSnapshot(snap);
+    root=snap.rootnode;
+  }
+  SanityChecker c(buffercache,superblock.info,root,!superblock.info.copyonwrite,report,callback,arg);
+
+  report.numallocated=buffercache->GetNumBlocks()-freespace->GetNumFree();
+
+  // the superblock, the free space bitmap and the Bloom filter
+  c.See(superblock_index);
+  for (i=0;i<freespace->GetNumBitmapBlocks();i++) { 
+    if (!c.See(freespace->GetFirstBlock()+i)) { 
+      c.Fail(freespace->GetFirstBlock()+i);
+    }
+  }
+  for (i=0;bloom && i<bloom->GetNumBlocks();i++) { 
+    if (!c.See(bloom->GetFirstBlock()+i)) { 
+      c.Fail(bloom->GetFirstBlock()+i);
+    }
+  }
+
+  rc=c.rc ? c.rc : c.Run(numthreads);
+
+  if (copyonwrite) { 
+    CloseSnapshot(snap);
+  }
+  if (rc) { 
+    return rc;
+  }
+
+  // Only blocks the index uses may be allocated, on the disk as well
+  // as in the bitmap, but a crash can leave some allocated unused
+  for (i=0;i<buffercache->GetNumBlocks();i++) { 
+    bool allocated=freespace->IsAllocated(i), ondisk=buffercache->IsBlockAllocated(i);
+    if (c.WasSeen(i)) { 
+      report.numused++;
+      if (!allocated || !ondisk) { 
+	return c.Fail(i);
+      }
+    } else if (allocated || ondisk) { 
+      report.numleaked++;
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::SanityCheck() const
+{
+  BTreeCheckReport report;
+  return SanityCheck(report);
+}
+
+
+ERROR_T BTreeIndex::GetShape(BTreeShape &shape) const
+{
+  memset(&shape,0,sizeof(shape));
+  shape.fullfanout=superblock.info.GetNumSlotsAsInterior()+1;
+  return ShapeInternal(superblock.info.rootnode,1,shape);
+}
+
+ERROR_T BTreeIndex::ShapeInternal(const SIZE_T node, const SIZE_T depth, BTreeShape &shape) const
+{
+  BTreeNode b;
+  SIZE_T offset, ptr;
+  ERROR_T rc;
+
+  if ((rc=b.Unserialize(buffercache,node))) { 
+    return rc;
+  }
+  if (depth>shape.height) { 
+    shape.height=depth;
+  }
+  switch (b.info.nodetype) { 
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    shape.numinterior++;
+    if (b.info.numkeys==0) { 
+      // empty tree
       return ERROR_NOERROR;
     }
+    shape.numpointers+=b.info.numkeys+1;
+    for (offset=0;offset<=b.info.numkeys;offset++) { 
+      if ((rc=b.GetPtr(offset,ptr)) ||
+	  (rc=ShapeInternal(ptr,depth+1,shape))) { 
+	return rc;
+      }
+    }
+    return ERROR_NOERROR;
+  case BTREE_LEAF_NODE:
+    shape.numleaves++;
+    shape.numkeys+=b.info.numkeys;
+    shape.prefixbytes+=b.info.numkeys*b.info.prefixlen;
+    return ERROR_NOERROR;
+  default:
+    return ERROR_INSANE;
+  }
 }
 
 
@@ -3,11 +3,17 @@
 
 #include <iostream>
 #include <string>
+#include <vector>
+#include <map>
+#include <pthread.h>
 
 #include "global.h"
 #include "block.h"
 #include "disksystem.h"
 #include "buffercache.h"
+#include "freespace.h"
+#include "bloom.h"
+#include "resultcache.h"
 
 #include "btree_ds.h"
 
@@ -41,24 +47,245 @@ enum BTreeOp {BTREE_OP_INSERT, BTREE_OP_DELETE, BTREE_OP_UPDATE,BTREE_OP_LOOKUP}
 
 enum BTreeDisplayType {BTREE_DEPTH, BTREE_DEPTH_DOT, BTREE_SORTED_KEYVAL};
 
+// What Export() writes for each pair
+// BTREE_EXPORT_TEXT is a "(key,value)" line, as in BTREE_SORTED_KEYVAL
+// BTREE_EXPORT_BINARY is the key length and the value length, each a
+// SIZE_T in host byte order, followed by the key and value bytes
+enum BTreeExportFormat {BTREE_EXPORT_TEXT, BTREE_EXPORT_BINARY};
+
+// How readers coordinate with concurrent writers
+// BTREE_LATCH_PESSIMISTIC means readers take shared latches on each
+// node frame, coupling from parent to child
+// BTREE_LATCH_OPTIMISTIC means readers take no latches at all, but
+// record each frame's version, read it, and validate the version
+// afterwards, restarting from the root if a writer got in the way
+enum BTreeLatchMode {BTREE_LATCH_PESSIMISTIC, BTREE_LATCH_OPTIMISTIC};
+
+// A pinned, immutable version of a copy-on-write index
+struct BTreeSnapshot {
+  SIZE_T rootnode;
+  SIZE_T epoch;
+};
+
+// Called by LookupAll() with each value of a key, in order.  Anything
+// but ERROR_NOERROR stops the lookup and is what it returns.  The leaf
+// stays latched during the calls, so they must not use the index.
+typedef ERROR_T (*BTreeValueCallback)(const VALUE_T &value, void *arg);
+
+// What the tree looks like, from GetShape()
+struct BTreeShape {
+  SIZE_T height;       // levels, from the root down to the leaves
+  SIZE_T numinterior;  // interior nodes, including the root
+  SIZE_T numleaves;
+  SIZE_T numpointers;  // child pointers in interior nodes
+  SIZE_T numkeys;      // keys in leaves
+  SIZE_T prefixbytes;  // key bytes the leaves don't store thanks to prefixes
+  SIZE_T fullfanout;   // pointers per interior node with full-size separators
+};
+
+// SanityCheck() reports its progress every this many nodes
+#define BTREE_CHECK_PROGRESS 65536
+
+// What SanityCheck() found, and how far it has got
+struct BTreeCheckReport {
+  SIZE_T numnodes;      // interior nodes and leaves checked
+  SIZE_T numleaves;
+  SIZE_T numoverflow;   // overflow blocks
+  SIZE_T numkeys;       // keys in the leaves
+  SIZE_T height;        // levels, from the root down to the leaves
+  SIZE_T numunposted;   // nodes whose parent a split did not get to
+  SIZE_T numunderfull;  // nodes below the root less than half full
+  unsigned long long leafused, leafroom; // bytes, for the leaves' fill
+  SIZE_T numallocated;  // blocks the free space bitmap has allocated
+  SIZE_T numused;       // blocks the index was found to use
+  SIZE_T numleaked;     // blocks allocated that nothing uses
+  SIZE_T badblock;      // where the first problem was found, 0 if none
+};
+
+// Called by SanityCheck() as it goes, from whichever of its threads
+// is running.  Calls are never concurrent.
+typedef void (*BTreeCheckCallback)(const BTreeCheckReport &report, void *arg);
+
+// How well the Bloom filter is doing, from GetBloomFilterStats()
+struct BTreeBloomStats {
+  SIZE_T numbits;
+  SIZE_T numbitsset;
+  SIZE_T numprobes;         // lookups and updates that asked the filter
+  SIZE_T numnegatives;      // certain misses, each a descent avoided
+  SIZE_T numfalsepositives; // keys it let through that were not there
+};
+
+// Where Defragment() found a node: its parent and neighbours
+struct BTreeDefragRef {
+  SIZE_T parent;
+  SIZE_T offset;    // of the pointer to the node in its parent
+  SIZE_T left;      // previous node on the same level, 0 if none
+  SIZE_T right;     // next node on the same level, 0 if none
+  SIZE_T position;  // in the order Defragment() lays nodes out in
+};
+
 class BTreeIndex {
  private:
   BufferCache *buffercache;
   SIZE_T       superblock_index;
   BTreeNode    superblock;
+  BTreeLatchMode latchmode;
+  FreeSpaceMap *freespace;
+  BloomFilter  *bloom;           // 0 if the index has no filter
+  ResultCache  *resultcache;     // 0 if lookups go straight to the tree
+  SIZE_T       bloomkeys;        // keys to size a new index's filter for
+  pthread_mutex_t oplock;        // orders numkeys changes with their log records
+  pthread_mutex_t checkpointlock;
+  volatile SIZE_T restarts;
+  volatile SIZE_T splits;
+  mutable volatile SIZE_T searchprobes; // keys looked at by node searches
+  bool         synccommit;
+  SIZE_T       checkpointinterval;
+
+  // Copy-on-write state
+  bool         copyonwrite;
+  mutable pthread_mutex_t writelock; // one copy-on-write writer at a time,
+                                     // or structure change while counts are kept
+  mutable pthread_mutex_t epochlock; // guards the root swap and what follows
+  mutable SIZE_T epoch;              // advances with every new version
+  mutable map<SIZE_T, SIZE_T> readers; // epoch -> number of pinned snapshots
+  mutable vector<pair<SIZE_T, SIZE_T> > retired; // (block, epoch it was replaced in)
+
+  SIZE_T       defragnext;   // nodes the current Defragment() pass has placed
 
  protected:
 
-  ERROR_T      AllocateNode(SIZE_T &node);
+  // Allocates a block, near hint if possible
+  ERROR_T      AllocateNode(SIZE_T &node, const SIZE_T hint=0);
 
   ERROR_T      DeallocateNode(const SIZE_T &node);
 
-  ERROR_T      LookupOrUpdateInternal(const SIZE_T &Node,
-				      const BTreeOp op, 
+  // Descend to the leaf that would contain key
+  // Optimistic: nothing is latched on return, and b is a validated
+  //             copy of the leaf.  ERROR_RESTART means try again.
+  // Pessimistic: the leaf is returned latched, exclusively if
+  //             forwrite, shared otherwise.
+  ERROR_T      FindLeaf(const KEY_T &key,
+			const bool forwrite,
+			SIZE_T &leaf,
+			BTreeNode &b);
+
+  ERROR_T      LookupOrUpdateInternal(const BTreeOp op, 
 				      const KEY_T &key,
 				      VALUE_T &val);
+
+  // Insert without copy-on-write.  The caller holds writelock if the
+  // index keeps subtree counts.
+  ERROR_T      InsertInternal(const KEY_T &key, const VALUE_T &value);
+
+  // Appends the logical record that ends an insert, update or delete
+  // to the cache's write-ahead log, if there is one.  delta is the
+  // change in the number of keys.  Call with the leaf still latched
+  // so the record follows the leaf's page image in the log.
+  ERROR_T      LogOperation(const BTreeOp op,
+			    const KEY_T &key,
+			    const VALUE_T &val,
+			    const int delta);
+
+  // Makes the operation durable before it returns, if so configured,
+  // and takes a checkpoint when enough log has built up
+  ERROR_T      CommitOperation();
+
+  // Writes a checkpoint record from a dirty page table snapshot
+  ERROR_T      WriteCheckpoint(const SIZE_T numkeys,
+			       const LSN_T snapshot,
+			       const map<SIZE_T, LSN_T, cache_compare_lessthan> &dpt);
+
+  // Brings the disk up to date from the log after a crash
+  ERROR_T      Recover();
+
+  // Adds the keys in the leaves under node to the Bloom filter.  It
+  // goes down from node rather than along the leaves, since a
+  // copy-on-write index doesn't keep the rightlinks.
+  ERROR_T      RebuildBloomFilter(const SIZE_T node);
+
+  // Searches node b in the index's search mode, counting the probes
+  ERROR_T      SearchNode(const BTreeNode &b, const KEY_T &key, SIZE_T &offset, bool &found) const;
+  // Interior nodes: the offset of (or the pointer to) the child whose
+  // range covers key
+  ERROR_T      ChooseChildOffset(const BTreeNode &b, const KEY_T &key, SIZE_T &offset) const;
+  ERROR_T      ChooseChild(const BTreeNode &b, const KEY_T &key, SIZE_T &ptr) const;
+
+  // Keys and values the index can take (ERROR_SIZE otherwise)
+  bool         IsValidKey(const KEY_T &key) const;
+  bool         IsValidValue(const VALUE_T &value) const;
+
+  // Variable and posting format overflow chains
+  //
+  // Writes value to a new chain of blocks allocated near hint
+  ERROR_T      WriteOverflow(const VALUE_T &value, const SIZE_T hint, SIZE_T &first, SIZE_T &last);
+  // Frees the chain starting at first
+  ERROR_T      FreeOverflow(const SIZE_T first);
+  // Latches node shared and follows rightlinks until it covers key,
+  // coupling the latches.  b is the latched node.
+  ERROR_T      LatchSharedAndMoveRight(const KEY_T &key, SIZE_T &node, BTreeNode &b);
+  // Reads the value of the leaf entry for key, at most maxlength bytes
+  // of it, latching the leaf so that no update can free the chain
+  // while it is being read
+  ERROR_T      ReadOverflowLatched(const KEY_T &key, SIZE_T node, VALUE_T &value,
+				   const SIZE_T maxlength);
+  // Replaces the value at offset of leaf b, which is latched
+  // exclusively and written back to node.  The value goes to an
+  // overflow chain if it is too long, or if keeping it in the leaf
+  // would leave the leaf full.
+  ERROR_T      SetValue(BTreeNode &b, const SIZE_T node, const SIZE_T offset, const VALUE_T &value);
+  // Posting format: adds value to the end of the list at offset of
+  // leaf b, which is latched exclusively and written back to node
+  ERROR_T      AppendValue(BTreeNode &b, const SIZE_T node, const SIZE_T offset, const VALUE_T &value);
+
+  // Subtree counts
+  //
+  // Adds delta to the count of each pointer on the way down to key.
+  // Called with writelock held and no latches.
+  ERROR_T      AddToCounts(const KEY_T &key, const int delta);
+  // Recomputes the counts under node from its leaves, returning the
+  // number of keys below it
+  ERROR_T      RebuildCounts(const SIZE_T node, SIZE_T &count);
+  // Number of keys less than key.  Called with writelock held.
+  ERROR_T      Rank(const KEY_T &key, SIZE_T &rank) const;
+  // Select() with writelock already held
+  ERROR_T      SelectInternal(const SIZE_T k, KEY_T &key, VALUE_T &value) const;
+
+  // Copy-on-write versions of Insert and Update
+  ERROR_T      CopyOnWriteInternal(const BTreeOp op,
+				   const KEY_T &key,
+				   const VALUE_T &value);
+  // Copies a node to a fresh block near it, pointing its child at
+  // offset to newchild unless newchild is 0, and adding delta to that
+  // child's count if the index keeps them
+  ERROR_T      ShadowNode(const SIZE_T node,
+			  const SIZE_T offset,
+			  const SIZE_T newchild,
+			  SIZE_T &shadow,
+			  const int delta=0);
+  // Frees the blocks of old versions that no snapshot can reach
+  // Called with epochlock held
+  void         ReclaimRetired() const;
+  // Links every node to the next on its level again, level by level
+  // from the root, for leaving copy-on-write.  Called with writelock
+  // held.
+  ERROR_T      Relink();
   
 
+  // Defragmentation support
+  //
+  // Finds every node below the root and lists them in preorder
+  ERROR_T      DefragWalk(const SIZE_T node,
+			  map<SIZE_T, BTreeDefragRef> &refs,
+			  vector<SIZE_T> &order,
+			  map<SIZE_T, SIZE_T> &lastatlevel);
+  // Moves a node found by DefragWalk to block to, which the caller
+  // has already allocated, fixing its parent, left neighbour and refs
+  ERROR_T      DefragMove(const SIZE_T from,
+			  const SIZE_T to,
+			  map<SIZE_T, BTreeDefragRef> &refs,
+			  vector<SIZE_T> &order);
+
   ERROR_T      DisplayInternal(const SIZE_T &node,
 			       ostream &o, 
 			       const BTreeDisplayType display_type=BTREE_DEPTH) const;
@@ -77,6 +304,7 @@ public:
 	     SIZE_T valuesize,
 	     BufferCache *cache,
 	     bool unique=true);   // true if a  key maps to a single value
+                                  // false for a posting format index
 
 
   BTreeIndex();
@@ -91,6 +319,8 @@ public:
   // the block that the last detach returned
   // This should be your superblock, which contains the information 
   // you need to find the elements of the tree.
+  // If the cache has a write-ahead log, attaching to an existing index
+  // first replays whatever the log holds after its last checkpoint.
   // return zero on success or ERROR_NOTANINDEX if we are
   // giving you an incorrect block to start with
   ERROR_T Attach(const SIZE_T initblock, const bool create=false );
@@ -104,18 +334,25 @@ public:
   // return ERROR_NOSPACE if you run out of disk space
   // return ERROR_SIZE if the key or value are the wrong size for this index
   // return ERROR_CONFLICT if the key already exists and it's a unique index
+  // If it is not unique, value goes at the end of the key's list
   ERROR_T Insert(const KEY_T &key, const VALUE_T &value);
 
   // Insert Helper functions
-  ERROR_T AddKeyValuePair(const SIZE_T node, const KEY_T &key, const VALUE_T &value, SIZE_T newNode);
-  ERROR_T SplitNode(const SIZE_T node, SIZE_T &newNode, KEY_T &splitKey);
-  ERROR_T RecursivePlacement(SIZE_T node, SIZE_T parent, const KEY_T &key, const VALUE_T &value);
+  ERROR_T AddKeyValuePair(const SIZE_T node, const KEY_T &key, const VALUE_T &value, SIZE_T newNode,
+			  const SIZE_T newCount=0);
+  ERROR_T SplitNode(const SIZE_T node, SIZE_T &newNode, KEY_T &splitKey, SIZE_T &newCount);
+  ERROR_T SplitRoot(const SIZE_T root);
+  ERROR_T GrowFirstLeaves(const SIZE_T root, const KEY_T &key);
+  ERROR_T LatchAndMoveRight(const KEY_T &key, SIZE_T &node, BTreeNode &b);
+  ERROR_T LatchNodeAtLevel(const KEY_T &key, const SIZE_T level, SIZE_T &node, BTreeNode &b);
+  ERROR_T SplitFullNodes(SIZE_T node, vector<SIZE_T> &path);
   bool IsNodeFull(const SIZE_T node);
   
   
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
   // return ERROR_SIZE if the key or value are the wrong size for this index
+  // return ERROR_UNIMPL if the index is not unique
   ERROR_T Update(const KEY_T &key, const VALUE_T &value);
   
   // return zero on success
@@ -125,16 +362,47 @@ public:
   
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
+  // If the index is not unique, value is the first of the key's values
   ERROR_T Lookup(const KEY_T &key, VALUE_T &value);
 
+  // Calls callback with every value of key, in the order they were
+  // inserted, with one descent of the tree.  Long lists are read from
+  // their overflow chains a block at a time, never as a whole.
+  // return zero on success
+  // return ERROR_NONEXISTENT  if the key doesn't exist
+  ERROR_T LookupAll(const KEY_T &key, BTreeValueCallback callback, void *arg);
+
   // Here you should figure out if your index makes sense
   // Is it a tree?  Is it in order?  Is it balanced?  Does each node have
   // a valid use ratio?
+  //
+  // Every node is checked to be of the index, at the level its parent
+  // expects, no fuller than it can be, and with its keys in order and
+  // within the range its parent gives it.  A node that a split has
+  // added to the right of one of these, and that its parent does not
+  // point to yet, is checked as part of the same range.  Rightlinks
+  // must chain each level together from left to right, the subtree
+  // counts and the number of keys in the superblock must agree with
+  // the leaves, and overflow chains must hold their values.  Every
+  // block the index uses must be allocated both in its free space
+  // bitmap and in the disk's.  Blocks that are allocated but that
+  // nothing uses are only counted, since a crash can leak them.
+  //
+  // The top of the tree is checked first, and then its subtrees are
+  // shared out among numthreads threads.  callback, if there is one,
+  // is given the report every BTREE_CHECK_PROGRESS nodes.  Nothing may
+  // change the index while the check runs; making the cache read-only
+  // makes sure of that.  ERROR_INSANE, with badblock set, if the index
+  // doesn't make sense.
+  ERROR_T SanityCheck(BTreeCheckReport &report,
+		      const SIZE_T numthreads=1,
+		      BTreeCheckCallback callback=0,
+		      void *arg=0) const;
   ERROR_T SanityCheck() const;
 
-  // looks for nodes in order
-  // also keeps track of keys in leaves
-  ERROR_T NodeCheck(const SIZE_T&, SIZE_T&) const;
+  // Walks the whole tree to measure its height and fanout
+  ERROR_T GetShape(BTreeShape &shape) const;
+  ERROR_T ShapeInternal(const SIZE_T node, const SIZE_T depth, BTreeShape &shape) const;
 
   // Display tree
   // BTREE_DEPTH means to do a depth first traversal of 
@@ -147,6 +415,179 @@ public:
   // per line.  This will be the keys and values in the tree
   // sorted in order of keys.
   ERROR_T Display(ostream &o, BTreeDisplayType display_type=BTREE_DEPTH) const;
+
+  // Streams every pair to o in key order, for dumping a whole index.
+  // Unlike Display, it only reads the interior nodes to find the
+  // leaves, reads ahead each run of leaves that sit in consecutive
+  // blocks with one disk request, and hands o large chunks rather
+  // than a byte at a time.  Posting lists give a pair per value.  As
+  // with Display, the output is only a consistent version of a
+  // copy-on-write index or of one with no writers running.
+  ERROR_T Export(ostream &o, const BTreeExportFormat format=BTREE_EXPORT_TEXT) const;
+
+  // Select how lookups synchronize with writers (default optimistic)
+  void SetLatchMode(const BTreeLatchMode mode) { latchmode=mode; }
+  BTreeLatchMode GetLatchMode() const { return latchmode; }
+  // Number of times an optimistic operation had to restart
+  SIZE_T GetNumRestarts() const { return restarts; }
+  // Number of nodes split, root splits included
+  SIZE_T GetNumSplits() const { return splits; }
+
+  // Select how nodes are searched for a key, one of BTREE_SEARCH_*
+  // (default binary).  The mode is kept in the superblock, so it
+  // persists once the index is detached; set it before
+  // Attach(initblock,true) to create an index with it.  It can be
+  // changed at any time, even with operations running.
+  void SetSearchMode(const SIZE_T mode) { superblock.info.search=mode; }
+  SIZE_T GetSearchMode() const { return superblock.info.search; }
+  // Number of keys node searches have looked at
+  SIZE_T GetNumSearchProbes() const { return searchprobes; }
+
+  // With a write-ahead log attached to the cache, Insert, Update and
+  // Delete normally return only once their log records are durable.
+  // Turning this off lets the caller batch commits itself by calling
+  // Flush on the log before acknowledging a group of operations.
+  void SetSynchronousCommit(const bool sync) { synccommit=sync; }
+
+  // Fuzzy checkpoint: records the dirty page table and the key count
+  // in the log without stopping writers.  Blocks that have been dirty
+  // since before the previous checkpoint are written back first, so
+  // recovery never has to go back further than that checkpoint.
+  // Operations take one by themselves every interval bytes of log.
+  ERROR_T Checkpoint();
+  void SetCheckpointInterval(const SIZE_T interval) { checkpointinterval=interval; }
+
+  // Shadow paging
+  //
+  // With copy-on-write on, Insert and Update never modify a node in
+  // place.  The path from the leaf to the root is copied to freshly
+  // allocated blocks and the new root is swapped into the superblock,
+  // so every root ever published heads an immutable tree.  Writers
+  // are serialized; lookups and Display pin a snapshot and read it
+  // without any latches.  Replaced blocks are retired and only reused
+  // once every snapshot that could reach them has been closed.
+  // Only switch modes while no operations are running.
+  // Copy-on-write indexes must use the fixed format.
+  //
+  // Copies are never linked to their siblings, so the superblock
+  // records that the index is written copy-on-write, and attaching
+  // turns the mode back on.  Turning it off links up every level
+  // again first.  Before Attach(initblock,true) this only sets the
+  // mode a new index starts in.
+  ERROR_T SetCopyOnWrite(const bool cow);
+  bool GetCopyOnWrite() const { return copyonwrite; }
+  ERROR_T OpenSnapshot(BTreeSnapshot &snap) const;
+  ERROR_T CloseSnapshot(const BTreeSnapshot &snap) const;
+  // Free blocks according to the free space bitmap
+  SIZE_T GetNumFreeBlocks() const;
+
+  // Variable-length keys and values
+  //
+  // By default every key is keysize bytes and every value valuesize
+  // bytes, and leaves are plain arrays of them.  An index created with
+  // variable length on takes keys of 1 to keysize bytes and values of
+  // 0 to valuesize bytes instead, and its leaves are slotted pages.
+  // Values too long to share a leaf with three others are kept in
+  // chains of overflow blocks.  Call before Attach(initblock,true); an
+  // existing index reads the setting from its superblock.
+  // A non-unique index always has variable-length keys and ignores it.
+  void SetVariableLength(const bool v) { if (GetUnique()) superblock.info.format=v ? BTREE_VARIABLE_FORMAT : BTREE_FIXED_FORMAT; }
+  bool GetVariableLength() const { return superblock.info.format==BTREE_VARIABLE_FORMAT; }
+
+  // Compressed leaves
+  //
+  // Keys and values as in the fixed format, but each leaf is
+  // compressed on its way to disk and expanded again when it is read,
+  // so that a block can hold up to BTREE_COMPRESSION_RATIO blocks of
+  // entries.  Prefixes shared with the previous entry and trailing
+  // zero bytes are not stored.  This saves disk space and I/O at the
+  // cost of coding a leaf every time it is read or written.  Call
+  // before Attach(initblock,true); copy-on-write is not supported.
+  void SetCompressed(const bool c) { if (!GetVariableLength() && GetUnique()) superblock.info.format=c ? BTREE_COMPRESSED_FORMAT : BTREE_FIXED_FORMAT; }
+  bool GetCompressed() const { return superblock.info.format==BTREE_COMPRESSED_FORMAT; }
+
+  // Non-unique indexes
+  //
+  // An index constructed with unique=false uses the posting format: a
+  // key can be inserted any number of times, and its values are kept
+  // together, in one slotted leaf entry or in an overflow chain, rather
+  // than as a pair each.  Keys are 1 to keysize bytes and every value
+  // is exactly valuesize bytes.  Inserting a key that is already there
+  // appends to its list without looking at the rest of it, so the same
+  // value can be in the list twice.
+  bool GetUnique() const { return superblock.info.format!=BTREE_POSTING_FORMAT; }
+
+  // Bloom filter
+  //
+  // An index created after SetBloomFilter(numkeys) keeps a Bloom
+  // filter sized for numkeys keys in blocks after the free space
+  // bitmap.  Lookups and updates of a key the filter has never seen
+  // fail with ERROR_NONEXISTENT without descending the tree.  Insert
+  // still has to descend, since the key goes into a leaf either way.
+  // The filter is written back by Detach(); one that was not, because
+  // the index crashed, is rebuilt from the leaves by the next Attach().
+  // Call before Attach(initblock,true); 0, the default, means none.
+  void SetBloomFilter(const SIZE_T numkeys) { bloomkeys=numkeys; }
+  bool HasBloomFilter() const { return bloom!=0; }
+  ERROR_T GetBloomFilterStats(BTreeBloomStats &stats) const;
+
+  // Result cache
+  //
+  // With a result cache of bytes > 0, Lookup() first looks for the key
+  // among the results of recent lookups, and remembers what it finds
+  // in the tree, least recently used results making room for new
+  // ones.  Update() invalidates the key's result.  Insert() never has
+  // to, since only lookups that succeed are cached and a key's first
+  // value never changes once it is in the tree; Delete() will have to,
+  // like Update().  LookupAll() is not cached.  Only change the size
+  // while no operations are running; 0 turns the cache off.
+  void SetResultCacheSize(const SIZE_T bytes);
+  const ResultCache *GetResultCache() const { return resultcache; }
+
+  // Order statistics
+  //
+  // An index created after SetSubtreeCounts(true) keeps, next to each
+  // pointer in its interior nodes, the number of keys in the leaves
+  // under it.  Count() then finds how many keys lie in a range,
+  // Select() the key at a given position, and Sample() random keys,
+  // with one descent each instead of a scan.  The counts cost a word per pointer, and since
+  // every level of the path changes with each new key, inserts (and
+  // updates of compressed leaves, which can split) are serialized
+  // while they are kept.  After a crash, Attach() recomputes them from
+  // the leaves.  Call before
+  // Attach(initblock,true); an existing index reads the setting from
+  // its superblock.
+  void SetSubtreeCounts(const bool c) { superblock.info.counted=c; }
+  bool HasSubtreeCounts() const { return superblock.info.counted!=0; }
+  // Number of keys k with lo <= k < hi
+  // return ERROR_UNIMPL if the index does not keep counts
+  ERROR_T Count(const KEY_T &lo, const KEY_T &hi, SIZE_T &count) const;
+  // The key at position k, 0 being the smallest, and its (first) value
+  // return ERROR_NONEXISTENT if there are not more than k keys
+  // return ERROR_UNIMPL if the index does not keep counts
+  ERROR_T Select(const SIZE_T k, KEY_T &key, VALUE_T &value) const;
+  // n pairs drawn uniformly at random, with replacement, from the
+  // keys in the index, using rand_r(&seed).  Each takes one descent,
+  // and no insert can get in between them.  In a non-unique index,
+  // each key comes with its first value.
+  // return ERROR_NONEXISTENT if n>0 and the index is empty
+  // return ERROR_UNIMPL if the index does not keep counts
+  ERROR_T Sample(const SIZE_T n, unsigned &seed, vector<KeyValuePair> &sample) const;
+
+  // Online defragmentation
+  //
+  // Moves nodes so that their block order is the order a scan reads
+  // them in: each interior node followed by its subtree, so the leaves
+  // end up in key order.  They are packed right after the superblock,
+  // root and free space bitmap, and whatever occupies a node's target
+  // block is first moved out of the way to the end of the disk.
+  // Each call makes at most maxmoves moves (plus one to clear the way
+  // for the last) and then returns, so a pass can be spread out
+  // between foreground operations; done says the pass has placed the
+  // last node, and the next call starts a new one.  A call must not
+  // run concurrently with other operations on the index, and
+  // copy-on-write indexes are not supported (ERROR_UNIMPL).
+  ERROR_T Defragment(const SIZE_T maxmoves, SIZE_T &nummoves, bool &done);
   
   ostream & Print(ostream &os) const;
   
@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include "btree.h"
+
+void usage()
+{
+  cerr << "usage: btree_bench filestem cachesize keysize valuesize numkeys numthreads numops readpercent [linear|binary|interpolation]\n";
+}
+
+//
+// Multithreaded read-mostly benchmark
+//
+// Builds a fresh index with numkeys random numeric keys, as gensim.pl
+// would generate them, and then runs the same mix of lookups, updates
+// and inserts against it three times: with pessimistic (shared latch)
+// readers, with optimistic (version validated) readers, and with
+// copy-on-write, where writers are serialized and readers look at a
+// snapshot without latching anything.  Nodes are searched in the
+// given mode, binary by default.  The index is sanity checked after
+// the copy-on-write phase, again once it has been detached and
+// attached, and again after it leaves copy-on-write.
+//
+
+struct BenchArgs {
+  BTreeIndex *btree;
+  SIZE_T keysize, valuesize, maxkey, numops, readpercent;
+  unsigned seed;
+  SIZE_T numlookups, numfound, numwrites;
+};
+
+static void MakeNumber(char *buf, const SIZE_T width, const SIZE_T n)
+{
+  snprintf(buf,width+1,"%0*u",(int)width,n);
+}
+
+static void *BenchThread(void *arg)
+{
+  BenchArgs *a = (BenchArgs *) arg;
+  char key[a->keysize+1], val[a->valuesize+1];
+  VALUE_T found;
+
+  for (SIZE_T i=0;i<a->numops;i++) {
+    MakeNumber(key,a->keysize,rand_r(&a->seed)%a->maxkey);
+    if ((SIZE_T)(rand_r(&a->seed)%100) < a->readpercent) {
+      a->numlookups++;
+      if (a->btree->Lookup(KEY_T(key),found)==ERROR_NOERROR) {
+	a->numfound++;
+      }
+    } else {
+      MakeNumber(val,a->valuesize,rand_r(&a->seed)%a->maxkey);
+      a->numwrites++;
+      if (rand_r(&a->seed)%2) {
+	a->btree->Update(KEY_T(key),VALUE_T(val));
+      } else {
+	a->btree->Insert(KEY_T(key),VALUE_T(val));
+      }
+    }
+  }
+  return 0;
+}
+
+static double Now()
+{
+  struct timeval tv;
+  gettimeofday(&tv,0);
+  return tv.tv_sec + tv.tv_usec/1e6;
+}
+
+
+static void RunPhase(const char *name, BTreeIndex &btree, BufferCache &cache,
+		     SIZE_T keysize, SIZE_T valuesize, SIZE_T maxkey,
+		     SIZE_T numthreads, SIZE_T numops, SIZE_T readpercent)
+{
+  pthread_t tids[numthreads];
+  BenchArgs args[numthreads];
+  SIZE_T lookups=0, found=0, writes=0;
+  SIZE_T restarts=btree.GetNumRestarts();
+  SIZE_T reads=cache.GetNumReads();
+  SIZE_T probes=btree.GetNumSearchProbes();
+
+  double start=Now();
+  for (SIZE_T i=0;i<numthreads;i++) {
+    args[i].btree=&btree;
+    args[i].keysize=keysize;
+    args[i].valuesize=valuesize;
+    args[i].maxkey=maxkey;
+    args[i].numops=numops/numthreads;
+    args[i].readpercent=readpercent;
+    args[i].seed=i+1;
+    args[i].numlookups=args[i].numfound=args[i].numwrites=0;
+    pthread_create(&tids[i],0,BenchThread,&args[i]);
+  }
+  for (SIZE_T i=0;i<numthreads;i++) {
+    pthread_join(tids[i],0);
+    lookups+=args[i].numlookups;
+    found+=args[i].numfound;
+    writes+=args[i].numwrites;
+  }
+  double elapsed=Now()-start;
+
+  cerr << name << ":\n";
+  cerr << "  lookups         = "<<lookups<<" ("<<found<<" found)"<<endl;
+  cerr << "  writes          = "<<writes<<endl;
+  cerr << "  restarts        = "<<(btree.GetNumRestarts()-restarts)<<endl;
+  cerr << "  numreads        = "<<(cache.GetNumReads()-reads)<<endl;
+  cerr << "  probes/op       = "<<(double)(btree.GetNumSearchProbes()-probes)/(lookups+writes)<<endl;
+  cerr << "  wall time (s)   = "<<elapsed<<endl;
+  cerr << "  ops/s           = "<<(lookups+writes)/elapsed<<endl;
+}
+
+
+static bool Check(const char *when, BTreeIndex &btree, const SIZE_T numthreads)
+{
+  BTreeCheckReport report;
+  ERROR_T rc=btree.SanityCheck(report,numthreads);
+
+  if (rc!=ERROR_NOERROR) {
+    cerr << "Sanity failed "<<when<<": error "<<rc<<" at block "<<report.badblock<<endl;
+    return false;
+  }
+  cerr << "Sanity check "<<when<<" succeded ("<<report.numkeys<<" keys)"<<endl;
+  return true;
+}
+
+
+int main(int argc, char **argv)
+{
+  char *filestem;
+  SIZE_T cachesize, keysize, valuesize, numkeys, numthreads, numops, readpercent;
+  SIZE_T superblocknum;
+
+  if (argc!=9 && argc!=10) {
+    usage();
+    return -1;
+  }
+
+  filestem=argv[1];
+  cachesize=atoi(argv[2]);
+  keysize=atoi(argv[3]);
+  valuesize=atoi(argv[4]);
+  numkeys=atoi(argv[5]);
+  numthreads=atoi(argv[6]);
+  numops=atoi(argv[7]);
+  readpercent=atoi(argv[8]);
+  string mode=(argc==10) ? argv[9] : "binary";
+
+  if (numthreads<1 || readpercent>100 ||
+      (mode!="linear" && mode!="binary" && mode!="interpolation")) {
+    usage();
+    return -1;
+  }
+
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,cachesize);
+  BTreeIndex btree(keysize,valuesize,&cache);
+
+  btree.SetSearchMode(mode=="linear" ? BTREE_SEARCH_LINEAR :
+		      mode=="interpolation" ? BTREE_SEARCH_INTERPOLATION : BTREE_SEARCH_BINARY);
+
+  ERROR_T rc;
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) {
+    cerr << "Can't attach buffer cache due to error"<<rc<<endl;
+    return -1;
+  }
+
+  if ((rc=btree.Attach(0,true))!=ERROR_NOERROR) {
+    cerr << "Can't attach to index with creation due to error "<<rc<<endl;
+    return -1;
+  }
+
+  // keys are drawn from twice the loaded range so about half of
+  // the lookups miss, like gensim.pl
+  SIZE_T maxkey=numkeys*2;
+  unsigned seed=0;
+  char key[keysize+1], val[valuesize+1];
+  for (SIZE_T i=0;i<numkeys;i++) {
+    MakeNumber(key,keysize,rand_r(&seed)%maxkey);
+    MakeNumber(val,valuesize,rand_r(&seed)%maxkey);
+    rc=btree.Insert(KEY_T(key),VALUE_T(val));
+    if (rc!=ERROR_NOERROR && rc!=ERROR_CONFLICT) {
+      cerr << "Can't load index due to error "<<rc<<endl;
+      return -1;
+    }
+  }
+  cerr << "Index loaded!"<<endl;
+
+  btree.SetLatchMode(BTREE_LATCH_PESSIMISTIC);
+  RunPhase("pessimistic",btree,cache,keysize,valuesize,maxkey,numthreads,numops,readpercent);
+  btree.SetLatchMode(BTREE_LATCH_OPTIMISTIC);
+  RunPhase("optimistic",btree,cache,keysize,valuesize,maxkey,numthreads,numops,readpercent);
+  if ((rc=btree.SetCopyOnWrite(true))!=ERROR_NOERROR) {
+    cerr << "Can't turn on copy-on-write due to error "<<rc<<endl;
+    return -1;
+  }
+  RunPhase("copy-on-write",btree,cache,keysize,valuesize,maxkey,numthreads,numops,readpercent);
+  cerr << "numfreeblocks   = "<<btree.GetNumFreeBlocks()<<endl;
+  if (!Check("after copy-on-write",btree,numthreads)) {
+    return -1;
+  }
+
+  // the index has to come back copy-on-write
+  if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR ||
+      (rc=btree.Attach(0,false))!=ERROR_NOERROR) {
+    cerr << "Can't reattach index due to error "<<rc<<endl;
+    return -1;
+  }
+  if (!btree.GetCopyOnWrite()) {
+    cerr << "Index reattached without copy-on-write"<<endl;
+    return -1;
+  }
+  if (!Check("after reattach",btree,numthreads)) {
+    return -1;
+  }
+
+  if ((rc=btree.SetCopyOnWrite(false))!=ERROR_NOERROR) {
+    cerr << "Can't turn off copy-on-write due to error "<<rc<<endl;
+    return -1;
+  }
+  if (!Check("after relinking",btree,numthreads)) {
+    return -1;
+  }
+
+  if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+    cerr <<"Can't detach from index due to error "<<rc<<endl;
+    return -1;
+  }
+  if ((rc=cache.Detach())!=ERROR_NOERROR) {
+    cerr <<"Can't detach from cache due to error "<<rc<<endl;
+    return -1;
+  }
+
+  cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+
+  return 0;
+}
@@ -0,0 +1,121 @@
+#include <stdlib.h>
+#include <fstream>
+#include "btree.h"
+
+void usage() 
+{
+  cerr << "usage: btree_defrag filestem cachesize [movesperstep]\n";
+}
+
+//
+// Defragments the index in steps of at most movesperstep node moves,
+// and reports the simulated time of a full scan from a cold cache
+// before and after.
+//
+
+static ERROR_T ScanTime(BTreeIndex &btree, BufferCache &cache, double &t)
+{
+  ofstream null("/dev/null");
+  ERROR_T rc;
+
+  // write everything back first so the scan starts cold
+  if ((rc=cache.Detach()) || (rc=cache.Attach())) { 
+    return rc;
+  }
+  double start=cache.GetCurrentTime();
+  if ((rc=btree.Display(null,BTREE_SORTED_KEYVAL))) { 
+    return rc;
+  }
+  t=cache.GetCurrentTime()-start;
+  return ERROR_NOERROR;
+}
+
+
+int main(int argc, char **argv)
+{
+  char *filestem;
+  SIZE_T cachesize;
+  SIZE_T movesperstep;
+  SIZE_T superblocknum;
+  SIZE_T moves, nummoves=0, numsteps=0;
+  bool done=false;
+  double before, after;
+
+  if (argc!=3 && argc!=4) { 
+    usage();
+    return -1;
+  }
+
+  filestem=argv[1];
+  cachesize=atoi(argv[2]);
+  movesperstep=(argc==4) ? atoi(argv[3]) : 16;
+
+  DiskSystem disk(filestem);
+  WriteAheadLog log(filestem);
+  BufferCache cache(&disk,cachesize);
+  BTreeIndex btree(0,0,&cache);
+  
+  ERROR_T rc;
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) { 
+    cerr << "Can't attach buffer cache due to error"<<rc<<endl;
+    return -1;
+  }
+
+  if ((rc=log.Open())!=ERROR_NOERROR) { 
+    cerr << "Can't open log due to error "<<rc<<endl;
+    return -1;
+  }
+  cache.SetLog(&log);
+
+  if ((rc=btree.Attach(0))!=ERROR_NOERROR) { 
+    cerr << "Can't attach to index  due to error "<<rc<<endl;
+    return -1;
+  }
+  cerr << "Index attached!"<<endl;
+
+  if ((rc=ScanTime(btree,cache,before))!=ERROR_NOERROR) { 
+    cerr << "Can't scan index due to error "<<rc<<endl;
+    return -1;
+  }
+
+  double start=cache.GetCurrentTime();
+  while (!done) { 
+    if ((rc=btree.Defragment(movesperstep,moves,done))!=ERROR_NOERROR) { 
+      cerr << "Can't defragment index due to error "<<rc<<endl;
+      return -1;
+    }
+    nummoves+=moves;
+    numsteps++;
+  }
+  double defragtime=cache.GetCurrentTime()-start;
+
+  if ((rc=ScanTime(btree,cache,after))!=ERROR_NOERROR) { 
+    cerr << "Can't scan index due to error "<<rc<<endl;
+    return -1;
+  }
+
+  if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) { 
+    cerr <<"Can't detach from index due to error "<<rc<<endl;
+    return -1;
+  }
+  if ((rc=cache.Detach())!=ERROR_NOERROR) { 
+    cerr <<"Can't detach from cache due to error "<<rc<<endl;
+    return -1;
+  }
+
+  cerr << "Performance statistics:\n";
+  cerr << "numsteps        = "<<numsteps<<endl;
+  cerr << "nummoves        = "<<nummoves<<endl;
+  cerr << "defrag time     = "<<defragtime<<endl;
+  cerr << "scan time before= "<<before<<endl;
+  cerr << "scan time after = "<<after<<endl;
+  cerr << endl;
+  cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
+  cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
+  cerr << endl;
+    
+  cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+
+  return 0;
+}
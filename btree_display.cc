@@ -24,6 +24,7 @@ int main(int argc, char **argv)
   dot=argv[3][0]=='d' || argv[3][0]=='D';
 
   DiskSystem disk(filestem);
+  WriteAheadLog log(filestem);
   BufferCache cache(&disk,cachesize);
   BTreeIndex btree(0,0,&cache);
   
@@ -35,6 +36,12 @@ int main(int argc, char **argv)
     return -1;
   }
 
+  if ((rc=log.Open())!=ERROR_NOERROR) { 
+    cerr << "Can't open log due to error "<<rc<<endl;
+    return -1;
+  }
+  cache.SetLog(&log);
+
   if ((rc=btree.Attach(0))!=ERROR_NOERROR) { 
     cerr << "Can't attach to index  due to error "<<rc<<endl;
     return -1;
@@ -1,7 +1,9 @@
 #include <new>
 #include <iostream>
+#include <vector>
 #include <assert.h>
 #include <string.h>
+#include <math.h>
 
 #include "btree_ds.h"
 #include "buffercache.h"
@@ -12,19 +14,269 @@ using namespace std;
 
 SIZE_T NodeMetadata::GetNumDataBytes() const
 {
+  if (format==BTREE_COMPRESSED_FORMAT && nodetype==BTREE_LEAF_NODE) { 
+    return BTREE_COMPRESSION_RATIO*blocksize-sizeof(*this);
+  }
   SIZE_T n=blocksize-sizeof(*this);
   return n;
 }
 
 
+// Both node layouts reserve the last keysize bytes for the high key,
+// and leaves the keysize bytes before that for the low key
+
 SIZE_T NodeMetadata::GetNumSlotsAsInterior() const
 {
-  return (GetNumDataBytes()-sizeof(SIZE_T))/(keysize+sizeof(SIZE_T));  // floor intended
+  return (GetNumDataBytes()-GetFirstPtrBytes()-keysize)/(keysize+GetInteriorSlotBytes());  // floor intended
+}
+
+SIZE_T NodeMetadata::GetInteriorSlotBytes() const
+{
+  return sizeof(InteriorSlot)+(counted ? sizeof(SIZE_T) : 0);
 }
 
 SIZE_T NodeMetadata::GetNumSlotsAsLeaf() const
 {
-  return (GetNumDataBytes()-sizeof(SIZE_T))/(keysize+valuesize);  // floor intended
+  if (IsSlotted()) { 
+    // at least this many, and as many as the largest entries allow
+    return (GetNumDataBytes()-sizeof(SIZE_T)-keysize)/(sizeof(LeafSlot)+keysize+GetMaxInlineValue());
+  }
+  return (GetNumDataBytes()-sizeof(SIZE_T)-2*keysize)/(GetNumSuffixBytes()+valuesize);  // floor intended
+}
+
+
+// A slotted leaf takes four of its largest entries before it splits,
+// so each entry gets a quarter of the room after the high key.  An
+// entry always has room for an overflow chain's two block numbers.
+SIZE_T NodeMetadata::GetMaxInlineValue() const
+{
+  int quarter=((int)GetNumDataBytes()-(int)sizeof(SIZE_T)-(int)keysize)/4
+    -(int)sizeof(LeafSlot)-(int)keysize;
+
+  if (quarter<(int)(2*sizeof(SIZE_T))) { 
+    return 0;
+  }
+  if (format==BTREE_POSTING_FORMAT) { 
+    // a list must have room for at least one value
+    return valuesize<=(SIZE_T)quarter ? quarter : 0;
+  }
+  return valuesize<(SIZE_T)quarter ? (valuesize>2*sizeof(SIZE_T) ? valuesize : 2*sizeof(SIZE_T)) : quarter;
+}
+
+
+#define MIN(x,y) ((x)<(y) ? (x) : (y))
+
+static SIZE_T CommonPrefix(const BYTE_T *a, const BYTE_T *b, const SIZE_T n)
+{
+  SIZE_T i;
+  for (i=0;i<n && a[i]==b[i];i++) {
+  }
+  return i;
+}
+
+
+// Fixed format separators are stored without their trailing zero
+// bytes, variable format ones as they are
+static SIZE_T StoredLength(const KEY_T &k, const NodeMetadata &info)
+{
+  if (info.IsSlotted()) { 
+    return k.length;
+  }
+  SIZE_T n=info.keysize;
+  while (n>0 && k.data[n-1]==0) {
+    n--;
+  }
+  return n;
+}
+
+
+// Set in LeafSlot::valuelength when the value is in overflow blocks
+#define OVERFLOW_VALUE 0x80000000u
+
+// Bytes a slotted leaf keeps for a value, given its slot's
+// valuelength: the value itself, or the first and last blocks of its
+// overflow chain.  Never less than two block numbers, so any value can
+// be moved out to an overflow chain in place.
+static SIZE_T StoredValueLength(const SIZE_T valuelength)
+{
+  if ((valuelength & OVERFLOW_VALUE) || valuelength<2*sizeof(SIZE_T)) { 
+    return 2*sizeof(SIZE_T);
+  }
+  return valuelength;
+}
+
+
+// Compressed format leaves
+
+static SIZE_T VarintLength(SIZE_T n)
+{
+  SIZE_T len=1;
+  for (;n>=0x80;n>>=7) { 
+    len++;
+  }
+  return len;
+}
+
+// Appends n to out, if there is room below end, and moves pos past it
+static void PutVarint(SIZE_T n, char *out, const SIZE_T end, SIZE_T &pos)
+{
+  for (;;) { 
+    BYTE_T c=n & 0x7f;
+    n>>=7;
+    if (n) { 
+      c|=0x80;
+    }
+    if (out && pos<end) { 
+      out[pos]=c;
+    }
+    pos++;
+    if (!n) { 
+      return;
+    }
+  }
+}
+
+static bool GetVarint(const char *in, const SIZE_T end, SIZE_T &pos, SIZE_T &n)
+{
+  SIZE_T shift;
+  n=0;
+  for (shift=0;pos<end && shift<32;shift+=7) { 
+    BYTE_T c=in[pos++];
+    n|=(SIZE_T)(c & 0x7f)<<shift;
+    if (!(c & 0x80)) { 
+      return true;
+    }
+  }
+  return false;
+}
+
+// Codes the len bytes at x against the len bytes at prev
+static void PutField(const char *x, const char *prev, const SIZE_T len,
+		     char *out, const SIZE_T end, SIZE_T &pos)
+{
+  SIZE_T shared=CommonPrefix((const BYTE_T*)x,(const BYTE_T*)prev,len);
+  SIZE_T last=len;
+  while (last>shared && x[last-1]==0) {
+    last--;
+  }
+  PutVarint(shared,out,end,pos);
+  PutVarint(last-shared,out,end,pos);
+  if (out && pos+last-shared<=end) { 
+    memcpy(out+pos,x+shared,last-shared);
+  }
+  pos+=last-shared;
+}
+
+static bool GetField(char *x, const char *prev, const SIZE_T len,
+		     const char *in, const SIZE_T end, SIZE_T &pos)
+{
+  SIZE_T shared, n;
+  if (!GetVarint(in,end,pos,shared) || shared>len ||
+      !GetVarint(in,end,pos,n) || n>len-shared || n>end-pos) { 
+    return false;
+  }
+  memmove(x,prev,shared);
+  memcpy(x+shared,in+pos,n);
+  memset(x+shared+n,0,len-shared-n);
+  pos+=n;
+  return true;
+}
+
+// The entry itself and what the next one loses of its coding
+SIZE_T NodeMetadata::GetMaxCompressedGrowth() const
+{
+  SIZE_T entry=2*VarintLength(keysize)+keysize+2*VarintLength(valuesize)+valuesize;
+  return 2*entry;
+}
+
+// Writes the on-disk form of leaf b to out, as much of it as fits in
+// end bytes, and returns how many bytes all of it takes.  With out 0
+// it just works out the size.
+static SIZE_T CompressLeaf(const BTreeNode &b, char *out, const SIZE_T end)
+{
+  SIZE_T suffix=b.info.GetNumSuffixBytes();
+  SIZE_T entry=suffix+b.info.valuesize;
+  SIZE_T keys=b.info.GetNumDataBytes()-2*b.info.keysize;
+  SIZE_T head=sizeof(SIZE_T)+2*b.info.keysize;
+  vector<char> zeros(entry,0);
+  const char *prev=&zeros[0];
+  SIZE_T pos=head;
+
+  if (out && head<=end) { 
+    memcpy(out,b.data,sizeof(SIZE_T));
+    memcpy(out+sizeof(SIZE_T),b.data+keys,2*b.info.keysize);
+  }
+  for (SIZE_T i=0;i<b.info.numkeys;i++) { 
+    const char *e=b.data+sizeof(SIZE_T)+i*entry;
+    PutField(e,prev,suffix,out,end,pos);
+    PutField(e+suffix,prev+suffix,b.info.valuesize,out,end,pos);
+    prev=e;
+  }
+  return pos;
+}
+
+// Where to split compressed leaf b so that each side gets about half
+// of its compressed bytes, and at least one entry
+static SIZE_T CompressedSplitPoint(const BTreeNode &b)
+{
+  SIZE_T suffix=b.info.GetNumSuffixBytes();
+  SIZE_T entry=suffix+b.info.valuesize;
+  vector<SIZE_T> bytes(b.info.numkeys);
+  vector<char> zeros(entry,0);
+  const char *prev=&zeros[0];
+  SIZE_T total=0, left=0, n;
+
+  for (SIZE_T i=0;i<b.info.numkeys;i++) { 
+    const char *e=b.data+sizeof(SIZE_T)+i*entry;
+    SIZE_T pos=0;
+    PutField(e,prev,suffix,0,0,pos);
+    PutField(e+suffix,prev+suffix,b.info.valuesize,0,0,pos);
+    bytes[i]=pos;
+    total+=pos;
+    prev=e;
+  }
+  for (n=0;n+1<b.info.numkeys;n++) { 
+    if (n>0 && 2*left>=total) { 
+      break;
+    }
+    left+=bytes[n];
+  }
+  return n;
+}
+
+// Fills in the data of leaf b, whose metadata has been read, from the
+// len bytes of its on-disk form at in
+static ERROR_T DecompressLeaf(BTreeNode &b, const char *in, const SIZE_T len)
+{
+  SIZE_T suffix, entry, keys, head, pos;
+
+  if (b.info.prefixlen>b.info.keysize ||
+      b.info.numkeys>b.info.GetNumSlotsAsLeaf()) { 
+    return ERROR_INSANE;
+  }
+  suffix=b.info.GetNumSuffixBytes();
+  entry=suffix+b.info.valuesize;
+  keys=b.info.GetNumDataBytes()-2*b.info.keysize;
+  head=sizeof(SIZE_T)+2*b.info.keysize;
+  if (head>len) { 
+    return ERROR_INSANE;
+  }
+  vector<char> zeros(entry,0);
+  const char *prev=&zeros[0];
+
+  memset(b.data,0,b.info.GetNumDataBytes());
+  memcpy(b.data,in,sizeof(SIZE_T));
+  memcpy(b.data+keys,in+sizeof(SIZE_T),2*b.info.keysize);
+  pos=head;
+  for (SIZE_T i=0;i<b.info.numkeys;i++) { 
+    char *e=b.data+sizeof(SIZE_T)+i*entry;
+    if (!GetField(e,prev,suffix,in,len,pos) ||
+	!GetField(e+suffix,prev+suffix,b.info.valuesize,in,len,pos)) { 
+      return ERROR_INSANE;
+    }
+    prev=e;
+  }
+  return ERROR_NOERROR;
 }
 
 
@@ -34,9 +286,18 @@ ostream & NodeMetadata::Print(ostream &os) const
 				   nodetype==BTREE_SUPERBLOCK ? "SUPERBLOCK" :
 				   nodetype==BTREE_ROOT_NODE ? "ROOT_NODE" :
 				   nodetype==BTREE_INTERIOR_NODE ? "INTERIOR_NODE" :
-				   nodetype==BTREE_LEAF_NODE ? "LEAF_NODE" : "UNKNOWN_TYPE")
+				   nodetype==BTREE_LEAF_NODE ? "LEAF_NODE" :
+				   nodetype==BTREE_FREESPACE_BLOCK ? "FREESPACE_BLOCK" :
+				   nodetype==BTREE_OVERFLOW_BLOCK ? "OVERFLOW_BLOCK" :
+				   nodetype==BTREE_BLOOM_BLOCK ? "BLOOM_BLOCK" : "UNKNOWN_TYPE")
      << ", keysize="<<keysize<<", valuesize="<<valuesize<<", blocksize="<<blocksize
-     << ", rootnode="<<rootnode<<", freelist="<<freelist<<", numkeys="<<numkeys<<")";
+     << ", rootnode="<<rootnode<<", freespace="<<freespace<<", bloom="<<bloom<<", search="<<search<<", numkeys="<<numkeys
+     << ", rightlink="<<rightlink<<", level="<<level
+     << ", prefixlen="<<prefixlen<<", fences="<<fences<<", heap="<<heap<<", counted="<<counted<<", copyonwrite="<<copyonwrite
+     << ", format="<<(format==BTREE_VARIABLE_FORMAT ? "VARIABLE" :
+		      format==BTREE_POSTING_FORMAT ? "POSTING" :
+		      format==BTREE_COMPRESSED_FORMAT ? "COMPRESSED" : "FIXED")
+     << ", highkeylen="<<highkeylen<<")";
   return os;
 }
 
@@ -56,15 +317,27 @@ BTreeNode::~BTreeNode()
 }
 
 
-BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size)
+BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size,
+		     SIZE_T format)
 {
   info.nodetype=node_type;
   info.keysize=key_size;
   info.valuesize=value_size;
   info.blocksize=block_size;
   info.rootnode=0;
-  info.freelist=0;
+  info.freespace=0;
+  info.bloom=0;
+  info.search=BTREE_SEARCH_LINEAR;
   info.numkeys=0;				       
+  info.rightlink=0;
+  info.level=0;
+  info.prefixlen=0;
+  info.fences=0;
+  info.heap=info.GetNumDataBytes()-info.keysize;
+  info.format=format;
+  info.highkeylen=info.keysize;
+  info.counted=0;
+  info.copyonwrite=0;
   data=0;
   if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
     data = new char [info.GetNumDataBytes()];
@@ -79,8 +352,19 @@ BTreeNode::BTreeNode(const BTreeNode &rhs)
   info.valuesize=rhs.info.valuesize;
   info.blocksize=rhs.info.blocksize;
   info.rootnode=rhs.info.rootnode;
-  info.freelist=rhs.info.freelist;
+  info.freespace=rhs.info.freespace;
+  info.bloom=rhs.info.bloom;
+  info.search=rhs.info.search;
   info.numkeys=rhs.info.numkeys;				       
+  info.rightlink=rhs.info.rightlink;
+  info.level=rhs.info.level;
+  info.prefixlen=rhs.info.prefixlen;
+  info.fences=rhs.info.fences;
+  info.heap=rhs.info.heap;
+  info.format=rhs.info.format;
+  info.highkeylen=rhs.info.highkeylen;
+  info.counted=rhs.info.counted;
+  info.copyonwrite=rhs.info.copyonwrite;
   data=0;
   if (rhs.data) { 
    data=new char [info.GetNumDataBytes()];
@@ -99,6 +383,18 @@ ERROR_T BTreeNode::Serialize(BufferCache *b, const SIZE_T blocknum) const
 {
   assert((unsigned)info.blocksize==b->GetBlockSize());
 
+  if (info.format==BTREE_COMPRESSED_FORMAT && info.nodetype==BTREE_LEAF_NODE) { 
+    Block block(info.blocksize);
+    memset(block.data,0,info.blocksize);
+    memcpy(block.data,&info,sizeof(info));
+    if (CompressLeaf(*this,(char*)block.data+sizeof(info),info.GetNumDiskDataBytes())
+	>info.GetNumDiskDataBytes()) { 
+      // IsFull() should have split it before it got here
+      return ERROR_INSANE;
+    }
+    return b->WriteBlock(blocknum,block);
+  }
+
   Block block(sizeof(info)+info.GetNumDataBytes());
 
   memcpy(block.data,&info,sizeof(info));
@@ -110,6 +406,18 @@ ERROR_T BTreeNode::Serialize(BufferCache *b, const SIZE_T blocknum) const
 }
 
 
+BYTE_T BTreeNode::GetBlockType(const Block &block)
+{
+  int type;
+
+  if (block.length<sizeof(NodeMetadata)) { 
+    return BTREE_UNALLOCATED_BLOCK;
+  }
+  memcpy(&type,block.data,sizeof(type));
+  return (type>=BTREE_UNALLOCATED_BLOCK && type<=BTREE_BLOOM_BLOCK) ? type : BTREE_UNALLOCATED_BLOCK;
+}
+
+
 ERROR_T  BTreeNode::Unserialize(BufferCache *b, const SIZE_T blocknum)
 {
   Block block;
@@ -122,17 +430,35 @@ ERROR_T  BTreeNode::Unserialize(BufferCache *b, const SIZE_T blocknum)
     return rc;
   }
 
+  // a node read over and over, as in a scan, keeps its buffer
+  SIZE_T had=data ? info.GetNumDataBytes() : 0;
+
   memcpy(&info,block.data,sizeof(info));
-  
-  if (data) { 
+
+  if (b->GetBlockSize()!=(unsigned)info.blocksize) { 
+    // not a node of this index at all
     delete [] data;
     data=0;
+    info.nodetype=BTREE_UNALLOCATED_BLOCK;
+    return ERROR_INSANE;
   }
+  
+  bool hasdata=(info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK);
 
-  assert(b->GetBlockSize()==(unsigned)info.blocksize);
+  if (data && (!hasdata || had!=info.GetNumDataBytes())) { 
+    delete [] data;
+    data=0;
+  }
 
-  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
+  if (hasdata && !data) { 
     data = new char [info.GetNumDataBytes()];
+  }
+
+  if (info.format==BTREE_COMPRESSED_FORMAT && info.nodetype==BTREE_LEAF_NODE) { 
+    return DecompressLeaf(*this,(const char*)block.data+sizeof(info),info.GetNumDiskDataBytes());
+  }
+
+  if (hasdata) {
     memcpy(data,block.data+sizeof(info),info.GetNumDataBytes());
   }
   
@@ -140,17 +466,200 @@ ERROR_T  BTreeNode::Unserialize(BufferCache *b, const SIZE_T blocknum)
 }
 
 
+// Interior slots come right after the first pointer
+static char *ResolveSlot(const BTreeNode &b, const SIZE_T offset)
+{
+  return b.data+b.info.GetFirstPtrBytes()+offset*b.info.GetInteriorSlotBytes();
+}
+
+static InteriorSlot GetSlot(const BTreeNode &b, const SIZE_T offset)
+{
+  InteriorSlot slot;
+  memcpy(&slot,ResolveSlot(b,offset),sizeof(slot));
+  return slot;
+}
+
+static void SetSlot(BTreeNode &b, const SIZE_T offset, const InteriorSlot &slot)
+{
+  memcpy(ResolveSlot(b,offset),&slot,sizeof(slot));
+}
+
+// true if the slot describes bytes in the separator area
+static bool IsSlotValid(const BTreeNode &b, const InteriorSlot &slot)
+{
+  return slot.keyoffset>=b.info.heap && 
+    slot.keyoffset+slot.keylength<=b.info.GetNumDataBytes()-b.info.keysize;
+}
+
+// Packs the separators of the first numkeys slots against the high
+// key, dropping the space of any that were replaced
+static void CompactSeparators(BTreeNode &b)
+{
+  SIZE_T end=b.info.GetNumDataBytes()-b.info.keysize;
+  SIZE_T top=end;
+  vector<char> tmp(end);
+
+  for (SIZE_T i=0;i<b.info.numkeys;i++) { 
+    InteriorSlot slot=GetSlot(b,i);
+    if (!IsSlotValid(b,slot)) { 
+      slot.keylength=0;
+    }
+    top-=slot.keylength;
+    memcpy(&tmp[top],b.data+slot.keyoffset,slot.keylength);
+    slot.keyoffset=top;
+    SetSlot(b,i,slot);
+  }
+  memcpy(b.data+top,&tmp[top],end-top);
+  b.info.heap=top;
+}
+
+// Contiguous free bytes between the slots and the separators
+static SIZE_T GetFreeSeparatorBytes(const BTreeNode &b, const SIZE_T numslots)
+{
+  SIZE_T used=b.info.GetFirstPtrBytes()+numslots*b.info.GetInteriorSlotBytes();
+  return b.info.heap>used ? b.info.heap-used : 0;
+}
+
+
+// Variable format leaf slots come right after the unused pointer
+static char *ResolveLeafSlot(const BTreeNode &b, const SIZE_T offset)
+{
+  return b.data+sizeof(SIZE_T)+offset*sizeof(LeafSlot);
+}
+
+static LeafSlot GetLeafSlot(const BTreeNode &b, const SIZE_T offset)
+{
+  LeafSlot slot;
+  memcpy(&slot,ResolveLeafSlot(b,offset),sizeof(slot));
+  return slot;
+}
+
+static void SetLeafSlot(BTreeNode &b, const SIZE_T offset, const LeafSlot &slot)
+{
+  memcpy(ResolveLeafSlot(b,offset),&slot,sizeof(slot));
+}
+
+static SIZE_T GetLeafEntryBytes(const BTreeNode &b, const LeafSlot &slot)
+{
+  return slot.keylength+StoredValueLength(slot.valuelength);
+}
+
+// Bytes the slots and entries of a variable format leaf take up
+static SIZE_T GetUsedLeafBytes(const BTreeNode &b)
+{
+  SIZE_T used=sizeof(SIZE_T)+b.info.numkeys*sizeof(LeafSlot);
+  for (SIZE_T i=0;i<b.info.numkeys;i++) { 
+    used+=GetLeafEntryBytes(b,GetLeafSlot(b,i));
+  }
+  return used;
+}
+
+// Packs the entries of a variable format leaf against the high key
+static void CompactLeaf(BTreeNode &b)
+{
+  SIZE_T end=b.info.GetNumDataBytes()-b.info.keysize;
+  SIZE_T top=end;
+  vector<char> tmp(end);
+
+  for (SIZE_T i=0;i<b.info.numkeys;i++) { 
+    LeafSlot slot=GetLeafSlot(b,i);
+    SIZE_T n=GetLeafEntryBytes(b,slot);
+    top-=n;
+    memcpy(&tmp[top],b.data+slot.offset,n);
+    slot.offset=top;
+    SetLeafSlot(b,i,slot);
+  }
+  memcpy(b.data+top,&tmp[top],end-top);
+  b.info.heap=top;
+}
+
+// Adds an entry to a variable format leaf.  stored is what goes after
+// the key, StoredValueLength(valuelength) bytes of it, and valuelength
+// is what goes in the slot.
+static ERROR_T InsertLeafEntry(BTreeNode &b, const SIZE_T offset, const KEY_T &k,
+			       const char *stored, const SIZE_T valuelength)
+{
+  SIZE_T n=k.length+StoredValueLength(valuelength);
+  SIZE_T used=sizeof(SIZE_T)+(b.info.numkeys+1)*sizeof(LeafSlot);
+
+  if (offset>b.info.numkeys) { 
+    return ERROR_INSANE;
+  }
+  if (b.info.heap<used+n) { 
+    CompactLeaf(b);
+    if (b.info.heap<used+n) { 
+      return ERROR_NOSPACE;
+    }
+  }
+  char *p=ResolveLeafSlot(b,offset);
+  memmove(p+sizeof(LeafSlot),p,(b.info.numkeys-offset)*sizeof(LeafSlot));
+  b.info.numkeys++;
+
+  LeafSlot slot;
+  b.info.heap-=n;
+  slot.offset=b.info.heap;
+  slot.keylength=k.length;
+  slot.valuelength=valuelength;
+  memcpy(b.data+slot.offset,k.data,k.length);
+  memcpy(b.data+slot.offset+k.length,stored,n-k.length);
+  SetLeafSlot(b,offset,slot);
+  return ERROR_NOERROR;
+}
+
+// Replaces the value of an entry of a variable format leaf
+static ERROR_T ReplaceLeafValue(BTreeNode &b, const SIZE_T offset,
+				const char *stored, const SIZE_T valuelength)
+{
+  LeafSlot slot=GetLeafSlot(b,offset);
+  SIZE_T oldlen=StoredValueLength(slot.valuelength);
+  SIZE_T newlen=StoredValueLength(valuelength);
+
+  if (newlen<=oldlen) { 
+    // fits where the old one was
+    memcpy(b.data+slot.offset+slot.keylength,stored,newlen);
+    slot.valuelength=valuelength;
+    SetLeafSlot(b,offset,slot);
+    return ERROR_NOERROR;
+  }
+  if (GetUsedLeafBytes(b)+newlen-oldlen>b.info.GetNumDataBytes()-b.info.keysize) { 
+    return ERROR_NOSPACE;
+  }
+  // take the entry out and put it back in with the new value
+  KEY_T k;
+  k.Resize(slot.keylength,false);
+  memcpy(k.data,b.data+slot.offset,slot.keylength);
+  char *p=ResolveLeafSlot(b,offset);
+  memmove(p,p+sizeof(LeafSlot),(b.info.numkeys-offset-1)*sizeof(LeafSlot));
+  b.info.numkeys--;
+  return InsertLeafEntry(b,offset,k,stored,valuelength);
+}
+
+// A value padded out to the bytes a leaf keeps for it
+static void MakeStoredValue(const VALUE_T &v, vector<char> &stored)
+{
+  stored.assign(StoredValueLength(v.length),0);
+  if (v.length>0) { 
+    memcpy(&stored[0],v.data,v.length);
+  }
+}
+
+
 char * BTreeNode::ResolveKey(const SIZE_T offset) const
 {
   switch (info.nodetype) { 
   case BTREE_INTERIOR_NODE:
   case BTREE_ROOT_NODE:
+    // just the stored part of the separator
     assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(sizeof(SIZE_T)+info.keysize);
+    return data+GetSlot(*this,offset).keyoffset;
     break;
   case BTREE_LEAF_NODE:
     assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(info.keysize+info.valuesize);
+    if (info.IsSlotted()) { 
+      return data+GetLeafSlot(*this,offset).offset;
+    }
+    // just the suffix
+    return data+sizeof(SIZE_T)+offset*(info.GetNumSuffixBytes()+info.valuesize);
     break;
   default:
     return 0;
@@ -164,7 +673,8 @@ char * BTreeNode::ResolvePtr(const SIZE_T offset) const
   case BTREE_INTERIOR_NODE:
   case BTREE_ROOT_NODE:
     assert(offset<=info.numkeys);
-    return data+offset*(sizeof(SIZE_T)+info.keysize);
+    // the pointer is the first thing in a slot
+    return offset==0 ? data : ResolveSlot(*this,offset-1);
     break;
   case BTREE_LEAF_NODE:
     assert(offset==0);
@@ -182,7 +692,12 @@ char * BTreeNode::ResolveVal(const SIZE_T offset) const
   switch (info.nodetype) { 
   case BTREE_LEAF_NODE:
     assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(info.keysize+info.valuesize)+info.keysize;
+    if (info.IsSlotted()) { 
+      // what is stored, the value or its overflow block
+      LeafSlot slot=GetLeafSlot(*this,offset);
+      return data+slot.offset+slot.keylength;
+    }
+    return data+sizeof(SIZE_T)+offset*(info.GetNumSuffixBytes()+info.valuesize)+info.GetNumSuffixBytes();
     break;
   default:
     return 0;
@@ -196,6 +711,35 @@ char * BTreeNode::ResolveKeyVal(const SIZE_T offset) const
   return ResolveKey(offset);
 }
 
+
+char * BTreeNode::ResolveHighKey() const
+{
+  switch (info.nodetype) { 
+  case BTREE_INTERIOR_NODE:
+  case BTREE_ROOT_NODE:
+  case BTREE_LEAF_NODE:
+    return data+info.GetNumDataBytes()-info.keysize;
+    break;
+  default:
+    return 0;
+  }
+}
+
+
+char * BTreeNode::ResolveLowKey() const
+{
+  switch (info.nodetype) { 
+  case BTREE_LEAF_NODE:
+    if (info.IsSlotted()) { 
+      return 0;
+    }
+    return data+info.GetNumDataBytes()-2*info.keysize;
+    break;
+  default:
+    return 0;
+  }
+}
+
 ERROR_T BTreeNode::GetKey(const SIZE_T offset, KEY_T &k) const
 {
   char *p=ResolveKey(offset);
@@ -204,8 +748,26 @@ ERROR_T BTreeNode::GetKey(const SIZE_T offset, KEY_T &k) const
     return ERROR_NOMEM;
   }
   
+  if (info.nodetype==BTREE_LEAF_NODE && info.IsSlotted()) { 
+    k.Resize(GetLeafSlot(*this,offset).keylength,false);
+    memcpy(k.data,p,k.length);
+    return ERROR_NOERROR;
+  }
+  if (info.IsSlotted()) { 
+    k.Resize(GetSlot(*this,offset).keylength,false);
+    memcpy(k.data,p,k.length);
+    return ERROR_NOERROR;
+  }
+
   k.Resize(info.keysize,false);
-  memcpy(k.data,p,info.keysize);
+  if (info.nodetype==BTREE_LEAF_NODE) { 
+    memcpy(k.data,ResolveLowKey(),info.prefixlen);
+    memcpy(k.data+info.prefixlen,p,info.GetNumSuffixBytes());
+  } else {
+    SIZE_T n=GetSlot(*this,offset).keylength;
+    memcpy(k.data,p,n);
+    memset(k.data+n,0,info.keysize-n);
+  }
   return ERROR_NOERROR;
 }
 
@@ -221,6 +783,19 @@ ERROR_T BTreeNode::GetPtr(const SIZE_T offset, SIZE_T &ptr) const
   return ERROR_NOERROR;
 }
 
+// A counted interior node's count follows the pointer it goes with
+ERROR_T BTreeNode::GetCount(const SIZE_T offset, SIZE_T &count) const
+{
+  char *p=ResolvePtr(offset);
+
+  if (p==0 || !info.counted || info.nodetype==BTREE_LEAF_NODE) { 
+    return ERROR_NOMEM;
+  }
+  
+  memcpy(&count,offset==0 ? p+sizeof(SIZE_T) : p+sizeof(InteriorSlot),sizeof(SIZE_T));
+  return ERROR_NOERROR;
+}
+
 ERROR_T BTreeNode::GetVal(const SIZE_T offset, VALUE_T &v) const
 {
   char *p=ResolveVal(offset);
@@ -229,6 +804,16 @@ ERROR_T BTreeNode::GetVal(const SIZE_T offset, VALUE_T &v) const
     return ERROR_NOMEM;
   }
   
+  if (info.IsSlotted()) { 
+    LeafSlot slot=GetLeafSlot(*this,offset);
+    if (slot.valuelength & OVERFLOW_VALUE) { 
+      // only GetOverflow() can say where it is
+      return ERROR_NOFETCH;
+    }
+    v.Resize(slot.valuelength,false);
+    memcpy(v.data,p,slot.valuelength);
+    return ERROR_NOERROR;
+  }
   v.Resize(info.valuesize,false);
   memcpy(v.data,p,info.valuesize);
   return ERROR_NOERROR;
@@ -247,17 +832,67 @@ ERROR_T BTreeNode::GetKeyVal(const SIZE_T offset, KeyValuePair &p) const
 }
 
 
-ERROR_T BTreeNode::SetKey(const SIZE_T offset, const KEY_T &k)
+ERROR_T BTreeNode::GetHighKey(KEY_T &k) const
 {
-  char *p=ResolveKey(offset);
+  char *p=ResolveHighKey();
 
   if (p==0) { 
     return ERROR_NOMEM;
   }
+  
+  k.Resize(info.IsSlotted() ? info.highkeylen : info.keysize,false);
+  memcpy(k.data,p,k.length);
+  return ERROR_NOERROR;
+}
 
-  memcpy(p,k.data,info.keysize);
 
-  return ERROR_NOERROR;
+ERROR_T BTreeNode::SetKey(const SIZE_T offset, const KEY_T &k)
+{
+  switch (info.nodetype) { 
+  case BTREE_LEAF_NODE: {
+    char *p=ResolveKey(offset);
+    if (info.IsSlotted()) { 
+      // entries don't move, so the key can't change length
+      if (k.length!=GetLeafSlot(*this,offset).keylength) { 
+	return ERROR_SIZE;
+      }
+      memcpy(p,k.data,k.length);
+      return ERROR_NOERROR;
+    }
+    if (memcmp(k.data,ResolveLowKey(),info.prefixlen)) { 
+      // out of the leaf's range
+      return ERROR_INSANE;
+    }
+    memcpy(p,k.data+info.prefixlen,info.GetNumSuffixBytes());
+    return ERROR_NOERROR;
+  }
+  case BTREE_INTERIOR_NODE:
+  case BTREE_ROOT_NODE: {
+    assert(offset<info.numkeys);
+    InteriorSlot slot=GetSlot(*this,offset);
+    SIZE_T n=StoredLength(k,info);
+    if (!IsSlotValid(*this,slot) || n>slot.keylength) { 
+      // needs new space
+      slot.keylength=0;
+      SetSlot(*this,offset,slot);
+      if (GetFreeSeparatorBytes(*this,info.numkeys)<n) { 
+	CompactSeparators(*this);
+	slot=GetSlot(*this,offset);
+	if (GetFreeSeparatorBytes(*this,info.numkeys)<n) { 
+	  return ERROR_NOSPACE;
+	}
+      }
+      info.heap-=n;
+      slot.keyoffset=info.heap;
+    }
+    slot.keylength=n;
+    memcpy(data+slot.keyoffset,k.data,n);
+    SetSlot(*this,offset,slot);
+    return ERROR_NOERROR;
+  }
+  default:
+    return ERROR_NOMEM;
+  }
 }
 
 
@@ -276,6 +911,21 @@ ERROR_T BTreeNode::SetPtr(const SIZE_T offset, const SIZE_T &ptr)
 
 
 
+ERROR_T BTreeNode::SetCount(const SIZE_T offset, const SIZE_T &count)
+{
+  char *p=ResolvePtr(offset);
+
+  if (p==0 || !info.counted || info.nodetype==BTREE_LEAF_NODE) { 
+    return ERROR_NOMEM;
+  }
+
+  memcpy(offset==0 ? p+sizeof(SIZE_T) : p+sizeof(InteriorSlot),&count,sizeof(SIZE_T));
+
+  return ERROR_NOERROR;
+}
+
+
+
 ERROR_T BTreeNode::SetVal(const SIZE_T offset, const VALUE_T &v)
 {
   char *p=ResolveVal(offset);
@@ -284,6 +934,15 @@ ERROR_T BTreeNode::SetVal(const SIZE_T offset, const VALUE_T &v)
     return ERROR_NOMEM;
   }
   
+  if (info.IsSlotted()) { 
+    vector<char> stored;
+    if (IsOverflowValue(v)) { 
+      return ERROR_SIZE;
+    }
+    MakeStoredValue(v,stored);
+    return ReplaceLeafValue(*this,offset,&stored[0],v.length);
+  }
+
   memcpy(p,v.data,info.valuesize);
   
   return ERROR_NOERROR;
@@ -304,6 +963,584 @@ ERROR_T BTreeNode::SetKeyVal(const SIZE_T offset, const KeyValuePair &p)
 
 
 
+ERROR_T BTreeNode::SetHighKey(const KEY_T &k)
+{
+  char *p=ResolveHighKey();
+
+  if (p==0) { 
+    return ERROR_NOMEM;
+  }
+
+  if (info.IsSlotted()) { 
+    if (k.length>info.keysize) { 
+      return ERROR_SIZE;
+    }
+    info.highkeylen=k.length;
+  }
+  memcpy(p,k.data,info.IsSlotted() ? k.length : info.keysize);
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::GetLowKey(KEY_T &k) const
+{
+  char *p=ResolveLowKey();
+
+  if (p==0) { 
+    return ERROR_NOMEM;
+  }
+  
+  k.Resize(info.keysize,false);
+  memcpy(k.data,p,info.keysize);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::SetLowKey(const KEY_T &k)
+{
+  if (info.IsSlotted()) { 
+    // no prefix compression, so nothing needs it
+    return ERROR_NOERROR;
+  }
+
+  char *p=ResolveLowKey();
+
+  if (p==0) { 
+    return ERROR_NOMEM;
+  }
+
+  // the stored prefix of every entry would change
+  assert(info.numkeys==0);
+  memcpy(p,k.data,info.keysize);
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::InsertKeyVal(const SIZE_T offset, const KEY_T &k, const VALUE_T &v)
+{
+  ERROR_T rc;
+
+  if (info.nodetype!=BTREE_LEAF_NODE || offset>info.numkeys) { 
+    return ERROR_INSANE;
+  }
+  if (info.IsSlotted()) { 
+    vector<char> stored;
+    if (IsOverflowValue(v)) { 
+      return ERROR_SIZE;
+    }
+    MakeStoredValue(v,stored);
+    return InsertLeafEntry(*this,offset,k,&stored[0],v.length);
+  }
+  if (info.numkeys>=info.GetNumSlotsAsLeaf()) { 
+    return ERROR_NOSPACE;
+  }
+  SIZE_T entrysize=info.GetNumSuffixBytes()+info.valuesize;
+  char *p=data+sizeof(SIZE_T)+offset*entrysize;
+  memmove(p+entrysize,p,(info.numkeys-offset)*entrysize);
+  info.numkeys++;
+  if ((rc=SetKey(offset,k)) || (rc=SetVal(offset,v))) { 
+    return rc;
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::InsertKeyPtr(const SIZE_T offset, const KEY_T &k, const SIZE_T &ptr)
+{
+  if ((info.nodetype!=BTREE_INTERIOR_NODE && info.nodetype!=BTREE_ROOT_NODE) ||
+      offset>info.numkeys) { 
+    return ERROR_INSANE;
+  }
+  SIZE_T n=StoredLength(k,info);
+  if (GetFreeSeparatorBytes(*this,info.numkeys+1)<n) { 
+    CompactSeparators(*this);
+    if (GetFreeSeparatorBytes(*this,info.numkeys+1)<n) { 
+      return ERROR_NOSPACE;
+    }
+  }
+  char *p=ResolveSlot(*this,offset);
+  memmove(p+info.GetInteriorSlotBytes(),p,(info.numkeys-offset)*info.GetInteriorSlotBytes());
+  info.numkeys++;
+
+  InteriorSlot slot;
+  info.heap-=n;
+  slot.ptr=ptr;
+  slot.keyoffset=info.heap;
+  slot.keylength=n;
+  memcpy(data+slot.keyoffset,k.data,n);
+  SetSlot(*this,offset,slot);
+  if (info.counted) { 
+    SetCount(offset+1,0);
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::InsertKeyOverflow(const SIZE_T offset, const KEY_T &k, const SIZE_T first, const SIZE_T last,
+				     const SIZE_T length)
+{
+  SIZE_T ends[2]={first, last};
+
+  if (info.nodetype!=BTREE_LEAF_NODE || !info.IsSlotted() || 
+      (length & OVERFLOW_VALUE)) { 
+    return ERROR_INSANE;
+  }
+  return InsertLeafEntry(*this,offset,k,(const char*)ends,length | OVERFLOW_VALUE);
+}
+
+
+bool BTreeNode::GetOverflow(const SIZE_T offset, SIZE_T &first, SIZE_T &last, SIZE_T &length) const
+{
+  if (info.nodetype!=BTREE_LEAF_NODE || !info.IsSlotted()) { 
+    return false;
+  }
+  LeafSlot slot=GetLeafSlot(*this,offset);
+  if (!(slot.valuelength & OVERFLOW_VALUE)) { 
+    return false;
+  }
+  memcpy(&first,data+slot.offset+slot.keylength,sizeof(SIZE_T));
+  memcpy(&last,data+slot.offset+slot.keylength+sizeof(SIZE_T),sizeof(SIZE_T));
+  length=slot.valuelength & ~OVERFLOW_VALUE;
+  return true;
+}
+
+
+ERROR_T BTreeNode::SetOverflow(const SIZE_T offset, const SIZE_T first, const SIZE_T last, const SIZE_T length)
+{
+  SIZE_T ends[2]={first, last};
+
+  if (info.nodetype!=BTREE_LEAF_NODE || !info.IsSlotted() || 
+      (length & OVERFLOW_VALUE)) { 
+    return ERROR_INSANE;
+  }
+  return ReplaceLeafValue(*this,offset,(const char*)ends,length | OVERFLOW_VALUE);
+}
+
+
+bool BTreeNode::IsOverflowValue(const VALUE_T &v) const
+{
+  return info.IsSlotted() && v.length>info.GetMaxInlineValue();
+}
+
+
+bool BTreeNode::IsFull() const
+{
+  switch (info.nodetype) { 
+  case BTREE_LEAF_NODE:
+    if (info.IsSlotted()) { 
+      // room for one more slot and the largest entry
+      return GetUsedLeafBytes(*this)+sizeof(LeafSlot)+info.keysize+info.GetMaxInlineValue()
+	>info.GetNumDataBytes()-info.keysize;
+    }
+    if (info.format==BTREE_COMPRESSED_FORMAT && info.numkeys<info.GetNumSlotsAsLeaf()) { 
+      // whatever the next insert or update does, it must still fit
+      return CompressLeaf(*this,0,0)+info.GetMaxCompressedGrowth()>info.GetNumDiskDataBytes();
+    }
+    return info.numkeys>=info.GetNumSlotsAsLeaf();
+  case BTREE_INTERIOR_NODE:
+  case BTREE_ROOT_NODE: {
+    // room for one more slot and a separator that can't be truncated
+    SIZE_T used=info.GetFirstPtrBytes()+info.keysize+info.numkeys*info.GetInteriorSlotBytes();
+    for (SIZE_T i=0;i<info.numkeys;i++) { 
+      used+=GetSlot(*this,i).keylength;
+    }
+    return used+info.GetInteriorSlotBytes()+info.keysize>info.GetNumDataBytes();
+  }
+  default:
+    return false;
+  }
+}
+
+
+void BTreeNode::GetFill(SIZE_T &used, SIZE_T &room) const
+{
+  switch (info.nodetype) { 
+  case BTREE_LEAF_NODE:
+    if (info.IsSlotted()) { 
+      used=GetUsedLeafBytes(*this);
+      room=info.GetNumDataBytes()-info.keysize;
+    } else if (info.format==BTREE_COMPRESSED_FORMAT) { 
+      used=CompressLeaf(*this,0,0);
+      room=info.GetNumDiskDataBytes();
+    } else {
+      used=info.numkeys*(info.GetNumSuffixBytes()+info.valuesize);
+      room=info.GetNumSlotsAsLeaf()*(info.GetNumSuffixBytes()+info.valuesize);
+    }
+    break;
+  case BTREE_INTERIOR_NODE:
+  case BTREE_ROOT_NODE:
+    used=info.GetFirstPtrBytes()+info.numkeys*info.GetInteriorSlotBytes();
+    for (SIZE_T i=0;i<info.numkeys;i++) { 
+      used+=GetSlot(*this,i).keylength;
+    }
+    room=info.GetNumDataBytes()-info.keysize;
+    break;
+  default:
+    used=room=0;
+  }
+}
+
+
+bool BTreeNode::IsWellFormed() const
+{
+  SIZE_T top=info.GetNumDataBytes()-info.keysize;
+  SIZE_T i;
+
+  if (!data || info.keysize==0 || info.keysize>=info.GetNumDataBytes() ||
+      (info.IsSlotted() && (info.highkeylen==0 || info.highkeylen>info.keysize))) { 
+    return false;
+  }
+  switch (info.nodetype) { 
+  case BTREE_LEAF_NODE:
+    if (!info.IsSlotted()) { 
+      // a prefix as long as the key would leave nothing to store
+      return info.prefixlen<info.keysize && info.numkeys<=info.GetNumSlotsAsLeaf();
+    }
+    if (info.prefixlen!=0 || info.heap>top || 
+	sizeof(SIZE_T)+info.numkeys*sizeof(LeafSlot)>info.heap) { 
+      return false;
+    }
+    for (i=0;i<info.numkeys;i++) { 
+      LeafSlot slot=GetLeafSlot(*this,i);
+      if (slot.keylength==0 || slot.keylength>info.keysize ||
+	  slot.offset<info.heap || slot.offset+GetLeafEntryBytes(*this,slot)>top ||
+	  (!(slot.valuelength & OVERFLOW_VALUE) && slot.valuelength>info.GetMaxInlineValue())) { 
+	return false;
+      }
+    }
+    return true;
+  case BTREE_INTERIOR_NODE:
+  case BTREE_ROOT_NODE:
+    if (info.heap>top || info.GetFirstPtrBytes()+info.numkeys*info.GetInteriorSlotBytes()>info.heap) { 
+      return false;
+    }
+    for (i=0;i<info.numkeys;i++) { 
+      InteriorSlot slot=GetSlot(*this,i);
+      if (!IsSlotValid(*this,slot) || slot.keylength>info.keysize) { 
+	return false;
+      }
+    }
+    return true;
+  default:
+    return false;
+  }
+}
+
+
+ERROR_T BTreeNode::Split(BTreeNode &right, KEY_T &splitKey)
+{
+  SIZE_T numkeys=info.numkeys;
+  SIZE_T numLeftKeys, i;
+  ERROR_T rc;
+
+  if (info.nodetype==BTREE_LEAF_NODE && info.IsSlotted()) { 
+    vector<KEY_T> keys(numkeys);
+    vector<LeafSlot> slots(numkeys);
+    vector<char> heap(info.GetNumDataBytes());
+    SIZE_T total=0, leftbytes=0;
+
+    if (numkeys<2) { 
+      return ERROR_INSANE;
+    }
+    // the entries are copied as they are stored, so values that
+    // overflowed keep their chains
+    for (i=0;i<numkeys;i++) { 
+      if ((rc=GetKey(i,keys[i]))) { 
+	return rc;
+      }
+      slots[i]=GetLeafSlot(*this,i);
+      total+=sizeof(LeafSlot)+GetLeafEntryBytes(*this,slots[i]);
+    }
+    memcpy(&heap[0],data,info.GetNumDataBytes());
+
+    // half the bytes to each side, and at least one entry
+    for (numLeftKeys=0;numLeftKeys<numkeys-1;numLeftKeys++) { 
+      if (numLeftKeys>0 && 2*leftbytes>=total) { 
+	break;
+      }
+      leftbytes+=sizeof(LeafSlot)+GetLeafEntryBytes(*this,slots[numLeftKeys]);
+    }
+
+    // shortest key above the left node's last one
+    splitKey=keys[numLeftKeys];
+    splitKey.Resize(CommonPrefix(keys[numLeftKeys-1].data,splitKey.data,
+				 MIN(keys[numLeftKeys-1].length,splitKey.length))+1);
+
+    right.info.numkeys=0;
+    right.info.heap=info.GetNumDataBytes()-info.keysize;
+    for (i=numLeftKeys;i<numkeys;i++) { 
+      if ((rc=InsertLeafEntry(right,i-numLeftKeys,keys[i],&heap[slots[i].offset+slots[i].keylength],
+			      slots[i].valuelength))) { 
+	return rc;
+      }
+    }
+
+    info.numkeys=numLeftKeys;
+    CompactLeaf(*this);
+    SetHighKey(splitKey);
+  } else if (info.nodetype==BTREE_LEAF_NODE) { 
+    vector<KeyValuePair> entries(numkeys);
+    KEY_T low, high;
+
+    for (i=0;i<numkeys;i++) { 
+      if ((rc=GetKeyVal(i,entries[i]))) { 
+	return rc;
+      }
+    }
+    GetLowKey(low);
+    GetHighKey(high);
+    if (info.format==BTREE_COMPRESSED_FORMAT) { 
+      if (numkeys<2) { 
+	return ERROR_INSANE;
+      }
+      // by compressed bytes, so that both sides are sure to have room
+      numLeftKeys=CompressedSplitPoint(*this);
+    } else {
+      numLeftKeys=(numkeys+2)/2;
+    }
+
+    // keys >= splitKey live to the right, and the shortest such key
+    // is the right node's first key cut just past where it differs
+    // from the left node's last one
+    splitKey=entries[numLeftKeys].key;
+    i=CommonPrefix(entries[numLeftKeys-1].key.data,splitKey.data,info.keysize)+1;
+    memset(splitKey.data+i,0,info.keysize-i);
+
+    right.info.fences=BTREE_LOW_FENCE | (info.fences & BTREE_HIGH_FENCE);
+    right.info.prefixlen=(info.fences & BTREE_HIGH_FENCE) ? 
+      CommonPrefix(splitKey.data,high.data,info.keysize) : 0;
+    right.info.numkeys=0;
+    right.SetLowKey(splitKey);
+    for (i=numLeftKeys;i<numkeys;i++) { 
+      if ((rc=right.InsertKeyVal(i-numLeftKeys,entries[i].key,entries[i].value))) { 
+	return rc;
+      }
+    }
+
+    info.fences=(info.fences & BTREE_LOW_FENCE) | BTREE_HIGH_FENCE;
+    info.prefixlen=(info.fences & BTREE_LOW_FENCE) ? 
+      CommonPrefix(low.data,splitKey.data,info.keysize) : 0;
+    info.numkeys=0;
+    SetHighKey(splitKey);
+    for (i=0;i<numLeftKeys;i++) { 
+      if ((rc=InsertKeyVal(i,entries[i].key,entries[i].value))) { 
+	return rc;
+      }
+    }
+  } else if (info.nodetype==BTREE_INTERIOR_NODE || info.nodetype==BTREE_ROOT_NODE) { 
+    KEY_T key;
+    SIZE_T ptr, count=0;
+
+    // the middle separator moves up
+    numLeftKeys=numkeys/2;
+    if ((rc=GetKey(numLeftKeys,splitKey)) ||
+	(rc=GetPtr(numLeftKeys+1,ptr)) ||
+	(info.counted && (rc=GetCount(numLeftKeys+1,count)))) { 
+      return rc;
+    }
+    right.info.numkeys=0;
+    right.info.heap=info.GetNumDataBytes()-info.keysize;
+    right.SetPtr(0,ptr);
+    if (info.counted) { 
+      right.SetCount(0,count);
+    }
+    for (i=numLeftKeys+1;i<numkeys;i++) { 
+      if ((rc=GetKey(i,key)) || 
+	  (rc=GetPtr(i+1,ptr)) ||
+	  (rc=right.InsertKeyPtr(i-numLeftKeys-1,key,ptr)) ||
+	  (info.counted && ((rc=GetCount(i+1,count)) || (rc=right.SetCount(i-numLeftKeys,count))))) { 
+	return rc;
+      }
+    }
+
+    info.numkeys=numLeftKeys;
+    CompactSeparators(*this);
+    SetHighKey(splitKey);
+  } else {
+    return ERROR_INSANE;
+  }
+  return ERROR_NOERROR;
+}
+
+
+SIZE_T BTreeNode::GetNumKeysBelow() const
+{
+  SIZE_T n=0, count;
+
+  if (info.nodetype==BTREE_LEAF_NODE) { 
+    return info.numkeys;
+  }
+  for (SIZE_T i=0;info.counted && info.numkeys>0 && i<=info.numkeys;i++) { 
+    if (GetCount(i,count)==ERROR_NOERROR) { 
+      n+=count;
+    }
+  }
+  return n;
+}
+
+
+bool BTreeNode::MustMoveRight(const KEY_T &key) const
+{
+  KEY_T highkey;
+
+  if (info.rightlink==0 || GetHighKey(highkey)!=ERROR_NOERROR) { 
+    return false;
+  }
+  return !(key<highkey);
+}
+
+
+// Number of bytes, after those all the keys of a node share, that
+// interpolation reads a key as a number from
+#define INTERPOLATION_DIGITS 8
+
+// Key k read as a number from byte start on: decimal digits if
+// decimal, as in zero-padded numeric keys, bytes otherwise.  Past the
+// end, and in the zero padding of a truncated separator, digits are 0.
+// Only the place of the next probe depends on this, so any key gives
+// a usable answer.
+static unsigned long long KeyNumber(const KEY_T &k, const SIZE_T start, const bool decimal)
+{
+  unsigned long long x=0;
+
+  for (SIZE_T i=start;i<start+INTERPOLATION_DIGITS;i++) { 
+    BYTE_T c=(i<k.length) ? k.data[i] : 0;
+    if (decimal) { 
+      x=x*10+(c ? c-'0' : 0);
+    } else { 
+      x=(x<<8)|c;
+    }
+  }
+  return x;
+}
+
+
+ERROR_T BTreeNode::Search(const KEY_T &key, const SIZE_T mode, SIZE_T &offset, bool &found,
+			  SIZE_T &probes) const
+{
+  // Keys are read into these three in turn, and handed on by
+  // swapping the pointers rather than copying them
+  KEY_T keys[3];
+  KEY_T *testkey=&keys[0], *lokey=&keys[1], *hikey=&keys[2], *t;
+  SIZE_T lo, hi, mid, budget;
+  bool hiknown=false;
+  ERROR_T rc;
+
+  found=false;
+
+  if (mode==BTREE_SEARCH_LINEAR) { 
+    for (offset=0;offset<info.numkeys;offset++) { 
+      probes++;
+      if ((rc=GetKey(offset,*testkey))) { 
+	return rc;
+      }
+      if (!(*testkey<key)) { 
+	found=(*testkey==key);
+	break;
+      }
+    }
+    return ERROR_NOERROR;
+  }
+
+  // The keys before lo are less than key, and those from hi on are
+  // not.  If hiknown, hikey is the key at hi.
+  lo=0;
+  hi=info.numkeys;
+
+  if (mode==BTREE_SEARCH_INTERPOLATION && hi>2) { 
+    // the keys at both ends bound the first guess
+    probes+=2;
+    if ((rc=GetKey(0,*lokey)) || (rc=GetKey(hi-1,*hikey))) { 
+      return rc;
+    }
+    if (!(*lokey<key)) { 
+      offset=0;
+      found=(*lokey==key);
+      return ERROR_NOERROR;
+    }
+    if (*hikey<key) { 
+      offset=hi;
+      return ERROR_NOERROR;
+    }
+    lo=1;
+    hi--;
+    hiknown=true;
+    // The keys in between share the prefix the ends have in common,
+    // so they are told apart by what follows it
+    SIZE_T start=0, k;
+    bool decimal=true;
+    while (start<lokey->length && start<hikey->length && lokey->data[start]==hikey->data[start]) { 
+      start++;
+    }
+    for (k=start;k<start+INTERPOLATION_DIGITS;k++) { 
+      BYTE_T a=(k<lokey->length) ? lokey->data[k] : 0;
+      BYTE_T b=(k<hikey->length) ? hikey->data[k] : 0;
+      if ((a && (a<'0' || a>'9')) || (b && (b<'0' || b>'9'))) { 
+	decimal=false;
+      }
+    }
+    unsigned long long x=KeyNumber(key,start,decimal);
+    unsigned long long xlo=KeyNumber(*lokey,start,decimal);
+    unsigned long long xhi=KeyNumber(*hikey,start,decimal);
+    // On uniform keys a handful of guesses, about log log numkeys,
+    // is all it takes.  On skewed keys a guess soon does no better
+    // than halving the range, and binary search takes over.
+    budget=2+(hi>4)+(hi>16)+(hi>256)+(hi>65536);
+    SIZE_T range=(SIZE_T)-1;
+    while (lo<hi && budget-->0 && 2*(hi-lo)<range) { 
+      range=hi-lo;
+      // xlo is the number of the key at lo-1, xhi that of the key at
+      // hi.  A guess is rarely exact, so the key a short step past it
+      // is looked at too, in the direction the key lies, to close in
+      // on it from both sides.
+      SIZE_T step=(SIZE_T)sqrt((double)(hi-lo))/2+1;
+      double f=(xhi>xlo && x>xlo) ? (x<xhi ? (double)(x-xlo)/(xhi-xlo) : 1) : 0;
+      mid=lo-1+(SIZE_T)(f*(hi-lo+1)+0.5);
+      mid=mid<lo ? lo : mid>=hi ? hi-1 : mid;
+      for (int guard=0; guard<2 && lo<hi; guard++) { 
+	probes++;
+	if ((rc=GetKey(mid,*testkey))) { 
+	  return rc;
+	}
+	if (*testkey<key) { 
+	  lo=mid+1;
+	  xlo=KeyNumber(*testkey,start,decimal);
+	  mid=(mid+step<hi) ? mid+step : hi-1;
+	} else { 
+	  hi=mid;
+	  xhi=KeyNumber(*testkey,start,decimal);
+	  t=hikey; hikey=testkey; testkey=t;
+	  mid=(mid>=lo+step) ? mid-step : lo;
+	}
+      }
+    }
+  }
+
+  while (lo<hi) { 
+    mid=lo+(hi-lo)/2;
+    probes++;
+    if ((rc=GetKey(mid,*testkey))) { 
+      return rc;
+    }
+    if (*testkey<key) { 
+      lo=mid+1;
+    } else { 
+      hi=mid;
+      t=hikey; hikey=testkey; testkey=t;
+      hiknown=true;
+    }
+  }
+
+  offset=lo;
+  found=(hiknown && lo<info.numkeys && *hikey==key);
+  return ERROR_NOERROR;
+}
+
+
+
+
 ostream & BTreeNode::Print(ostream &os) const 
 {
   os << "BTreeNode(info="<<info;
@@ -13,6 +13,38 @@ using namespace std;
 #define BTREE_ROOT_NODE 2
 #define BTREE_INTERIOR_NODE 3
 #define BTREE_LEAF_NODE 4
+#define BTREE_FREESPACE_BLOCK 5
+#define BTREE_OVERFLOW_BLOCK 6
+#define BTREE_BLOOM_BLOCK 7
+
+// How an index lays out its keys and values (NodeMetadata::format)
+// Fixed: every key is keysize bytes and every value valuesize bytes
+// Variable: keys of 1 to keysize bytes, values of 0 to valuesize bytes
+// Posting: keys as in the variable format, each with a list of
+//          valuesize byte values (a non-unique index)
+// Compressed: as fixed, but leaves are compressed on disk
+#define BTREE_FIXED_FORMAT      0
+#define BTREE_VARIABLE_FORMAT   1
+#define BTREE_POSTING_FORMAT    2
+#define BTREE_COMPRESSED_FORMAT 3
+
+// A compressed leaf holds up to this many blocks' worth of entries
+#define BTREE_COMPRESSION_RATIO 4
+
+// How a node is searched for a key (NodeMetadata::search, superblock)
+// Linear: every key in order until one is not less
+// Binary: halving the range each time
+// Interpolation: guessing the place of the key from its value and
+//          those of the keys at the ends of the range, for fixed-width
+//          numeric keys, with binary search to finish the job if the
+//          guesses are not narrowing things down quickly enough
+#define BTREE_SEARCH_LINEAR        0
+#define BTREE_SEARCH_BINARY        1
+#define BTREE_SEARCH_INTERPOLATION 2
+
+// Which bounds of a leaf's key range are known (NodeMetadata::fences)
+#define BTREE_LOW_FENCE  1
+#define BTREE_HIGH_FENCE 2
 
 
 typedef Block Buffer;
@@ -30,12 +62,44 @@ struct NodeMetadata {
   SIZE_T valuesize;
   SIZE_T blocksize;
   SIZE_T rootnode; //meaningful only for superblock
-  SIZE_T freelist; //meaningful only for superblock or a free block
+  SIZE_T freespace; //meaningful only for superblock: first block of the free space bitmap
+  SIZE_T bloom;     //meaningful only for superblock: first block of the Bloom filter, 0 if none
+  SIZE_T search;    //meaningful only for superblock: BTREE_SEARCH_*
   SIZE_T numkeys;
-
+  SIZE_T rightlink; //next node at the same level, 0 if rightmost
+  SIZE_T level;     //height above the leaves (leaf=0)
+  SIZE_T prefixlen; //leaf: bytes shared by every key the node can hold
+  SIZE_T fences;    //leaf: BTREE_LOW_FENCE|BTREE_HIGH_FENCE
+  SIZE_T heap;      //interior, variable leaf: where the heap area starts in data
+  SIZE_T format;    //BTREE_*_FORMAT, same in every node
+  SIZE_T highkeylen; //variable and posting formats: bytes in the high key
+  SIZE_T counted;   //interior: pointers carry subtree key counts (superblock: the index keeps them)
+  SIZE_T copyonwrite; //meaningful only for superblock: written copy-on-write, so rightlinks are not kept
+
+  // Bytes after the metadata in memory, which for a compressed leaf
+  // is more than it has on disk
   SIZE_T GetNumDataBytes() const;
+  SIZE_T GetNumDiskDataBytes() const { return blocksize-sizeof(*this); }
+  // Interior nodes hold at least this many separators, more when
+  // they are shorter than keysize
   SIZE_T GetNumSlotsAsInterior() const;
+  // Bytes of an interior node's first pointer and of each slot, with
+  // their counts if it has them
+  SIZE_T GetFirstPtrBytes() const { return sizeof(SIZE_T)+(counted ? sizeof(SIZE_T) : 0); }
+  SIZE_T GetInteriorSlotBytes() const;
   SIZE_T GetNumSlotsAsLeaf() const;
+  // Bytes of each key a leaf stores itself
+  SIZE_T GetNumSuffixBytes() const { return keysize-prefixlen; }
+  // Variable format: longest value a leaf stores itself, longer ones
+  // go to a chain of overflow blocks.  Zero if the block size can't
+  // hold four of the largest entries a leaf may have to take.
+  // The posting format keeps lists of up to a quarter of a leaf in it.
+  SIZE_T GetMaxInlineValue() const;
+  // Compressed format: most bytes one insert or update can add to the
+  // on-disk size of a leaf
+  SIZE_T GetMaxCompressedGrowth() const;
+  // Variable and posting format leaves are slotted pages
+  bool IsSlotted() const { return format==BTREE_VARIABLE_FORMAT || format==BTREE_POSTING_FORMAT; }
 
   ostream &Print(ostream &rhs) const;
 			  
@@ -49,13 +113,111 @@ inline ostream & operator<< (ostream &os, const NodeMetadata &node) { return nod
 //
 // Interior node:
 //
-// PTR KEY PTR KEY PTR KEY PTR
+// PTR SLOT SLOT SLOT ... free ... SEPARATORS HIGHKEY
+//
+// Each slot holds a separator's place in the SEPARATORS area and the
+// pointer that follows it.  In an index that keeps subtree counts,
+// every pointer, the first one and those in the slots, is followed by
+// the number of keys in the leaves under it:
+//
+// PTR COUNT SLOT COUNT SLOT COUNT ... free ... SEPARATORS HIGHKEY
+//
+// Separators are suffix truncated: a leaf
+// split posts the shortest prefix of the right node's first key that
+// is still greater than the left node's last key, and trailing zero
+// bytes are never stored.  GetKey() pads them back out to keysize
+// with zeros, which compares the same way against any full key.
 //
 // Leaf:
 //
-// PTR* KEY VALUE KEY VALUE KEY VALUE
+// PTR* SUFFIX VALUE SUFFIX VALUE SUFFIX VALUE ... LOWKEY HIGHKEY
 //
 // *Here this pointer is not used
+//
+// Every key in a leaf lies between LOWKEY and HIGHKEY, so when both
+// are known the keys all start with their common prefix.  That prefix
+// is kept once, as the start of LOWKEY, and each entry stores only
+// the rest of its key.  The prefix is fixed when the leaf is created
+// by a split, so inserts never have to re-layout a leaf.
+//
+// Every node on a level is linked to its right sibling (B-link tree).
+// HIGHKEY is an upper bound on the keys reachable through the node,
+// and is only meaningful when rightlink is nonzero; a search for a
+// key >= HIGHKEY has landed on a node that split and must move right.
+// An index written copy-on-write doesn't keep the links (the
+// superblock says so), and its searches only ever go down.
+//
+// Variable format
+//
+// Interior nodes are laid out the same way, but separators are kept
+// at their own length instead of being padded to keysize.  Leaves
+// become slotted pages:
+//
+// PTR* SLOT SLOT SLOT ... free ... ENTRIES HIGHKEY
+//
+// Each slot gives the place of its entry in the heap of ENTRIES, the
+// length of its key and the length of its value.  An entry is the key
+// followed by the value, or, if the value is longer than
+// GetMaxInlineValue(), by the numbers of the first and the last block
+// of the chain of overflow blocks that holds it.  A value that fits can also be
+// moved out to overflow blocks when it grows and the leaf can't take
+// it without becoming full.  Entries are packed against HIGHKEY, and
+// space left behind by updates is only reclaimed when the heap runs
+// into the slots.  There is no prefix compression, so there is no
+// LOWKEY either.  Keysize and valuesize are maximums, and HIGHKEY has
+// room for the longest key.
+//
+// Posting format
+//
+// Leaves are slotted pages as in the variable format, and the value of
+// each entry is the list of values that go with its key, one after
+// the other.  A list that outgrows the leaf moves to an overflow chain,
+// and from then on new values are appended to the chain's last block.
+//
+// Compressed format
+//
+// Interior nodes are as in the fixed format, and so are leaves once
+// they are read, except that they are BTREE_COMPRESSION_RATIO blocks
+// long.  On disk, a leaf is
+//
+// PTR LOWKEY HIGHKEY ENTRY ENTRY ENTRY ...
+//
+// where each ENTRY is a key suffix and a value, both coded against the
+// suffix and value of the entry before it (zeros for the first): the
+// number of leading bytes they share, the number of bytes after those
+// up to the last nonzero one, and those bytes.  The counts are
+// varints.  A leaf is full once it could not be sure of still fitting
+// in a block after the next change, so it splits before that happens.
+//
+// Overflow block:
+//
+// BYTES
+//
+// numkeys says how many bytes of the value the block holds, and
+// rightlink is the next block of the chain, 0 for the last.  Every
+// block but the last is full.
+
+
+// Slots keep offsets and lengths within a node's data in 16 bits, so
+// an index can only be made on blocks whose data fits in this many
+// bytes, 64 KiB less the node metadata
+#define BTREE_MAX_SLOTTED_BYTES 65535
+
+// A separator's place in an interior node
+struct InteriorSlot {
+  SIZE_T         ptr;        // the pointer that follows the separator
+  unsigned short keyoffset;  // within data
+  unsigned short keylength;
+};
+
+
+// An entry's place in a variable format leaf, so the same
+// BTREE_MAX_SLOTTED_BYTES limit holds for leaves
+struct LeafSlot {
+  unsigned short offset;      // of the key within data
+  unsigned short keylength;
+  SIZE_T         valuelength; // of the value itself, top bit set if it overflowed
+};
 
 
 struct BTreeNode {
@@ -74,28 +236,82 @@ struct BTreeNode {
   //         because we will serialize it directly to disk
   //
   ~BTreeNode();
-  BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size);
+  BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size,
+	    SIZE_T format=BTREE_FIXED_FORMAT);
   BTreeNode(const BTreeNode &rhs);
   BTreeNode & operator=(const BTreeNode &rhs);
   
   ERROR_T Serialize(BufferCache *b, const SIZE_T block) const;
   ERROR_T Unserialize(BufferCache *b, const SIZE_T block);
+  // The type of node a block holds, from its header alone, or
+  // BTREE_UNALLOCATED_BLOCK if it can't be one (see BlockTyper)
+  static BYTE_T GetBlockType(const Block &block);
 
   char *ResolveKey(const SIZE_T offset) const; // Gives a pointer to the ith key  (interior or leaf)
   char *ResolvePtr(const SIZE_T offset) const; // Gives a pointer to the ith pointer (interior)
   char *ResolveVal(const SIZE_T offset) const; // Gives a pointer to the ith value (leaf)
   char *ResolveKeyVal(const SIZE_T offset) const ; // Gives a pointer to the ith keyvalue pair (leaf)
+  char *ResolveHighKey() const; // Gives a pointer to the high key (interior or leaf)
+  char *ResolveLowKey() const; // Gives a pointer to the low key (leaf)
 
   ERROR_T GetKey(const SIZE_T offset, KEY_T &k) const ; // Gives the ith key  (interior or leaf)
   ERROR_T GetPtr(const SIZE_T offset, SIZE_T &p) const ;   // Gives the ith pointer (interior)
-  ERROR_T GetVal(const SIZE_T offset, VALUE_T &v) const ; // Gives  the ith value (leaf)
+  ERROR_T GetCount(const SIZE_T offset, SIZE_T &c) const ; // Gives the keys under the ith pointer (counted interior)
+  ERROR_T GetVal(const SIZE_T offset, VALUE_T &v) const ; // Gives  the ith value (leaf, not if it overflowed)
   ERROR_T GetKeyVal(const SIZE_T offset, KeyValuePair &p) const; // Gives  the ith key value pair (leaf)
+  ERROR_T GetHighKey(KEY_T &k) const; // Gives the high key (interior or leaf)
+  ERROR_T GetLowKey(KEY_T &k) const; // Gives the low key (leaf)
 
 
   ERROR_T SetKey(const SIZE_T offset, const KEY_T &k); // Writesthe ith key  (interior or leaf)
   ERROR_T SetPtr(const SIZE_T offset, const SIZE_T &p);   // Writes the ith pointer (interior)
+  ERROR_T SetCount(const SIZE_T offset, const SIZE_T &c); // Writes the keys under the ith pointer (counted interior)
   ERROR_T SetVal(const SIZE_T offset, const VALUE_T &v); // Writes the ith value (leaf)
   ERROR_T SetKeyVal(const SIZE_T offset, const KeyValuePair &p); // Writes the ith key value pair (leaf)
+  ERROR_T SetHighKey(const KEY_T &k); // Writes the high key (interior or leaf)
+  ERROR_T SetLowKey(const KEY_T &k); // Writes the low key (leaf, only while empty)
+
+  // Variable and posting formats: values that live in overflow blocks.
+  // The node only has the ends of the chain and the value's length.
+  bool    GetOverflow(const SIZE_T offset, SIZE_T &first, SIZE_T &last, SIZE_T &length) const; // true if the ith value overflowed
+  ERROR_T SetOverflow(const SIZE_T offset, const SIZE_T first, const SIZE_T last, const SIZE_T length);
+  bool    IsOverflowValue(const VALUE_T &v) const; // true if v is too long to store in a leaf
+
+  // Inserts key k at offset, shifting the later ones up
+  ERROR_T InsertKeyVal(const SIZE_T offset, const KEY_T &k, const VALUE_T &v); // leaf
+  ERROR_T InsertKeyPtr(const SIZE_T offset, const KEY_T &k, const SIZE_T &p); // interior, p follows k, count 0
+  ERROR_T InsertKeyOverflow(const SIZE_T offset, const KEY_T &k, const SIZE_T first, const SIZE_T last,
+			    const SIZE_T length); // variable or posting leaf
+
+  // true if the node can't be sure of taking one more key
+  bool    IsFull() const;
+  // Bytes the node's keys take up, and the bytes it has for them, by
+  // the measure IsFull() uses (on disk for a compressed leaf)
+  void    GetFill(SIZE_T &used, SIZE_T &room) const;
+  // true if what the node holds fits in it and every slot points
+  // inside it, so that its keys can be looked at without going astray
+  bool    IsWellFormed() const;
+
+  // Keys in the leaves under the node: its own for a leaf, the sum of
+  // the counts of a counted interior node
+  SIZE_T  GetNumKeysBelow() const;
+
+  // Moves the upper half of the node into right, which starts out as
+  // a copy of it, and returns the key that separates them.  Leaf
+  // splits pick the shortest separator and work out the prefixes of
+  // both halves; variable and compressed format leaves split by
+  // bytes rather than by keys.  Links are left to the caller.
+  ERROR_T Split(BTreeNode &right, KEY_T &splitKey);
+
+  // true if a search for key must follow the rightlink
+  bool    MustMoveRight(const KEY_T &key) const;
+
+  // Finds the first offset whose key is not less than key (numkeys if
+  // there is none) in the given BTREE_SEARCH_* mode.  found says if
+  // that key is key itself.  probes is increased by the number of keys
+  // looked at.
+  ERROR_T Search(const KEY_T &key, const SIZE_T mode, SIZE_T &offset, bool &found,
+		 SIZE_T &probes) const;
 
   ostream &Print(ostream &rhs) const;
 };
@@ -25,6 +25,7 @@ int main(int argc, char **argv)
   valuesize=atoi(argv[4]);
 
   DiskSystem disk(filestem);
+  WriteAheadLog log(filestem);
   BufferCache cache(&disk,cachesize);
   BTreeIndex btree(keysize,valuesize,&cache);
   
@@ -35,11 +36,18 @@ int main(int argc, char **argv)
     return -1;
   }
 
+  if ((rc=log.Open())!=ERROR_NOERROR) { 
+    cerr << "Can't open log due to error "<<rc<<endl;
+    return -1;
+  }
+
   if ((rc=btree.Attach(0,true))!=ERROR_NOERROR) { 
     cerr << "Can't attach to index with creation due to error "<<rc<<endl;
     return -1;
   } else {
     cerr << "Index created!"<<endl;
+    // whatever an earlier index left in the log no longer applies
+    cache.SetLog(&log);
     if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) { 
       cerr <<"Can't detach from index due to error "<<rc<<endl;
       return -1;
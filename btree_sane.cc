@@ -1,9 +1,33 @@
 #include <stdlib.h>
+#include <sys/time.h>
 #include "btree.h"
 
 void usage() 
 {
-  cerr << "usage: btree_sane filestem cachesize\n";
+  cerr << "usage: btree_sane filestem cachesize [numthreads]\n";
+}
+
+#define SANE_DEFAULT_THREADS 4
+
+static double Now()
+{
+  struct timeval tv;
+  gettimeofday(&tv,0);
+  return tv.tv_sec + tv.tv_usec/1e6;
+}
+
+static double start;
+
+static void Progress(const BTreeCheckReport &report, void *arg)
+{
+  double elapsed=Now()-start;
+  SIZE_T done=report.numnodes+report.numoverflow;
+
+  cerr << "checked "<<report.numnodes<<" nodes and "<<report.numoverflow<<" overflow blocks";
+  if (report.numallocated) { 
+    cerr << " ("<<(int)(100.0*done/report.numallocated)<<"%)";
+  }
+  cerr << ", "<<(SIZE_T)(elapsed>0 ? done/elapsed : 0)<<" blocks/s"<<endl;
 }
 
 
@@ -12,16 +36,24 @@ int main(int argc, char **argv)
   char *filestem;
   SIZE_T cachesize;
   SIZE_T superblocknum;
+  SIZE_T numthreads;
 
-  if (argc!=3) { 
+  if (argc<3 || argc>4) { 
     usage();
     return -1;
   }
 
   filestem=argv[1];
   cachesize=atoi(argv[2]);
+  numthreads=(argc==4) ? atoi(argv[3]) : SANE_DEFAULT_THREADS;
+
+  if (numthreads<1) { 
+    usage();
+    return -1;
+  }
 
   DiskSystem disk(filestem);
+  WriteAheadLog log(filestem);
   BufferCache cache(&disk,cachesize);
   BTreeIndex btree(0,0,&cache);
   
@@ -33,17 +65,58 @@ int main(int argc, char **argv)
     return -1;
   }
 
+  if ((rc=log.Open())!=ERROR_NOERROR) { 
+    cerr << "Can't open log due to error "<<rc<<endl;
+    return -1;
+  }
+  cache.SetLog(&log);
+
   if ((rc=btree.Attach(0))!=ERROR_NOERROR) { 
     cerr << "Can't attach to index  due to error "<<rc<<endl;
     return -1;
   } else {
     cerr << "Index attached!"<<endl;
     // Your Implementation should do the right thing here
-    if ((rc=btree.SanityCheck())!=ERROR_NOERROR) { 
-      cerr <<"Sanity failed: error "<<rc<<endl;
+    BTreeCheckReport report;
+    double checktime=cache.GetCurrentTime();
+    start=Now();
+    // nothing should change while it's being checked
+    cache.SetReadOnly(true);
+    rc=btree.SanityCheck(report,numthreads,Progress,0);
+    cache.SetReadOnly(false);
+    double elapsed=Now()-start;
+    checktime=cache.GetCurrentTime()-checktime;
+    if (rc!=ERROR_NOERROR) { 
+      cerr <<"Sanity failed: error "<<rc<<" at block "<<report.badblock<<endl;
     } else {
       cerr <<"Sanity check succeded\n";
     }
+    cerr << "Check statistics:\n";
+    cerr << "numthreads      = "<<numthreads<<endl;
+    cerr << "numnodes        = "<<report.numnodes<<endl;
+    cerr << "numoverflow     = "<<report.numoverflow<<endl;
+    cerr << "numkeys         = "<<report.numkeys<<endl;
+    cerr << "numunposted     = "<<report.numunposted<<endl;
+    cerr << "numunderfull    = "<<report.numunderfull<<endl;
+    cerr << "avg leaf fill   = "<<(report.leafroom ? (double)report.leafused/report.leafroom : 0)<<endl;
+    cerr << "numused         = "<<report.numused<<endl;
+    cerr << "numleaked       = "<<report.numleaked<<endl;
+    cerr << "check time      = "<<checktime<<endl;
+    cerr << "wall seconds    = "<<elapsed<<endl;
+    cerr << "blocks/second   = "<<(elapsed>0 ? (report.numnodes+report.numoverflow)/elapsed : 0)<<endl;
+    BTreeShape shape;
+    if ((rc=btree.GetShape(shape))!=ERROR_NOERROR) { 
+      cerr <<"Can't measure the tree due to error "<<rc<<endl;
+    } else {
+      cerr << "height          = "<<shape.height<<endl;
+      cerr << "numinterior     = "<<shape.numinterior<<endl;
+      cerr << "numleaves       = "<<shape.numleaves<<endl;
+      cerr << "avg fanout      = "<<(shape.numinterior ? (double)shape.numpointers/shape.numinterior : 0)<<endl;
+      // what the same nodes would hold with full-size separators
+      cerr << "full-key fanout = "<<shape.fullfanout<<endl;
+      cerr << "avg leaf keys   = "<<(shape.numleaves ? (double)shape.numkeys/shape.numleaves : 0)<<endl;
+      cerr << "prefix bytes    = "<<shape.prefixbytes<<endl;
+    }
     if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) { 
       cerr <<"Can't detach from index due to error "<<rc<<endl;
       return -1;
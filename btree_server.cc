@@ -0,0 +1,374 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <deque>
+#include <vector>
+#include <sstream>
+#include "btree.h"
+#include "request.h"
+
+void usage()
+{
+  cerr << "usage: btree_server filestem cachesize [numworkers [socketpath]]\n";
+}
+
+//
+// Long-running server for an index made with btree_init
+//
+// Attaches to the index once, recovering it from its log if need be,
+// and then takes sim's requests, INSERT through DISPLAY, over a Unix
+// domain socket (filestem.sock unless another path is given), so that
+// the buffer cache stays warm from one request to the next.  Each
+// connection speaks text or binary as sim does and gets sim's replies.
+// INIT fails, ATTACH just replies OK, and DEINIT closes the
+// connection.  Updates are durable before they are acknowledged, and
+// those of concurrent clients share log flushes.
+//
+// Clients may pipeline as many requests as they like.  The main thread
+// polls the idle connections and hands one with input to a worker,
+// which runs the requests that have arrived on it, in order, sends
+// all of their replies in one go and hands the connection back.  So a
+// connection is served by at most one worker at a time, but a few
+// workers can serve any number of clients.  A worker stops after
+// SERVER_MAX_BATCH requests or SERVER_MAX_REPLY bytes of replies, and
+// a connection with more to do then goes to the back of the line, so
+// a client that keeps sending can't keep a worker to itself.
+//
+// SIGINT or SIGTERM stops the server, which lets the workers finish
+// what they have and detaches the index cleanly.  The blocks that were
+// cached are saved in filestem.warm and loaded in the background when
+// the server starts again.
+//
+
+#define SERVER_DEFAULT_WORKERS 4
+#define SERVER_BACKLOG 64
+#define SERVER_MAX_BATCH 256
+#define SERVER_MAX_REPLY (64*1024)
+
+struct Connection {
+  int            fd;
+  RequestReader  reader;
+  RequestHandler handler;
+  ostringstream  out;
+  bool           open;
+  bool           more;      // stopped with requests possibly left to run
+
+  Connection(const int f, BTreeIndex *btree) : fd(f), reader(f), handler(btree), open(true), more(false) {}
+  ~Connection() { close(fd); }
+};
+
+static pthread_mutex_t lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  ready=PTHREAD_COND_INITIALIZER;
+static deque<Connection *> work;       // connections with input, for the workers
+static deque<Connection *> returned;   // served, for the main thread to poll again
+static bool   stopping=false;
+static int    wakeup[2];               // to get the main thread out of poll()
+static volatile sig_atomic_t stopsignal=0;
+static SIZE_T numrequests=0, numfailed=0, numbatches=0, numconnections=0;
+
+static void Stop(int sig)
+{
+  stopsignal=1;
+  if (write(wakeup[1],"",1)) {}
+}
+
+static void Wakeup()
+{
+  if (write(wakeup[1],"",1)) {}
+}
+
+static ERROR_T SetNonBlocking(const int fd)
+{
+  int flags=fcntl(fd,F_GETFL,0);
+  return (flags<0 || fcntl(fd,F_SETFL,flags|O_NONBLOCK)<0) ? ERROR_GENERAL : ERROR_NOERROR;
+}
+
+// Sends everything, waiting for a slow client to take it
+static ERROR_T SendAll(const int fd, const string &s)
+{
+  SIZE_T sent=0;
+
+  while (sent<s.size()) {
+    ssize_t n=send(fd,s.data()+sent,s.size()-sent,MSG_NOSIGNAL);
+    if (n>0) {
+      sent+=n;
+    } else if (n<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) {
+      struct pollfd p;
+      p.fd=fd;
+      p.events=POLLOUT;
+      poll(&p,1,-1);
+    } else if (n<0 && errno==EINTR) {
+      continue;
+    } else {
+      return ERROR_GENERAL;
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+// Runs a batch of what has arrived on a connection and sends the replies
+static void Serve(Connection *c)
+{
+  Request r;
+  ERROR_T rc=ERROR_NOERROR;
+  SIZE_T n=0, failed=0;
+
+  c->more=false;
+  while (true) {
+    if (n>=SERVER_MAX_BATCH || (SIZE_T)c->out.tellp()>=SERVER_MAX_REPLY) {
+      // the reader may already hold the rest, so poll() can't be
+      // trusted to say so
+      c->more=true;
+      break;
+    }
+    if ((rc=c->reader.Next(r))!=ERROR_NOERROR) {
+      break;
+    }
+    n++;
+    if (r.op==REQUEST_INIT) {
+      // the server owns the index
+      c->out << "FAIL\n";
+      failed++;
+    } else if (r.op==REQUEST_ATTACH) {
+      c->out << "OK\n";
+    } else if (r.op==REQUEST_DEINIT) {
+      c->out << "OK\n";
+      c->open=false;
+      break;
+    } else if (c->handler.Run(r,c->out)!=ERROR_NOERROR) {
+      failed++;
+    }
+  }
+  if (rc!=ERROR_NOERROR && rc!=ERROR_NOFETCH) {
+    // the client went away, or sent something we can't read
+    c->open=false;
+  }
+  if (SendAll(c->fd,c->out.str())!=ERROR_NOERROR) {
+    c->open=false;
+  }
+  c->out.str("");
+
+  __sync_fetch_and_add(&numrequests,n);
+  __sync_fetch_and_add(&numfailed,failed);
+  __sync_fetch_and_add(&numbatches,1);
+}
+
+static void *Worker(void *arg)
+{
+  while (true) {
+    pthread_mutex_lock(&lock);
+    while (work.empty() && !stopping) {
+      pthread_cond_wait(&ready,&lock);
+    }
+    if (work.empty()) {
+      pthread_mutex_unlock(&lock);
+      return 0;
+    }
+    Connection *c=work.front();
+    work.pop_front();
+    pthread_mutex_unlock(&lock);
+
+    Serve(c);
+
+    pthread_mutex_lock(&lock);
+    if (c->open && !stopping && c->more) {
+      // behind whatever else is waiting
+      work.push_back(c);
+      pthread_cond_signal(&ready);
+      pthread_mutex_unlock(&lock);
+    } else if (c->open && !stopping) {
+      returned.push_back(c);
+      pthread_mutex_unlock(&lock);
+      Wakeup();
+    } else {
+      pthread_mutex_unlock(&lock);
+      delete c;
+    }
+  }
+}
+
+
+int main(int argc, char **argv)
+{
+  char *filestem;
+  SIZE_T cachesize;
+  SIZE_T numworkers;
+  SIZE_T superblocknum;
+  string socketpath;
+  ERROR_T rc;
+
+  if (argc<3 || argc>5) {
+    usage();
+    return -1;
+  }
+
+  filestem=argv[1];
+  cachesize=atoi(argv[2]);
+  numworkers=(argc>=4) ? atoi(argv[3]) : SERVER_DEFAULT_WORKERS;
+  socketpath=(argc==5) ? string(argv[4]) : string(filestem)+".sock";
+
+  if (numworkers<1) {
+    usage();
+    return -1;
+  }
+
+  DiskSystem disk(filestem);
+  WriteAheadLog log(filestem);
+  BufferCache cache(&disk,cachesize);
+  BTreeIndex btree(0,0,&cache);
+
+  // come back up with what was cached when we last stopped
+  cache.SetWarmFile(string(filestem)+".warm",true);
+  if ((rc=cache.Attach())!=ERROR_NOERROR) {
+    cerr << "Can't attach buffer cache due to error "<<rc<<endl;
+    return -1;
+  }
+
+  if ((rc=log.Open())!=ERROR_NOERROR) {
+    cerr << "Can't open log due to error "<<rc<<endl;
+    return -1;
+  }
+  cache.SetLog(&log);
+
+  if ((rc=btree.Attach(0))!=ERROR_NOERROR) {
+    cerr << "Can't attach to index due to error "<<rc<<endl;
+    return -1;
+  }
+
+  struct sockaddr_un addr;
+  int listener;
+
+  if (socketpath.size()>=sizeof(addr.sun_path)) {
+    cerr << "Socket path "<<socketpath<<" is too long\n";
+    return -1;
+  }
+  memset(&addr,0,sizeof(addr));
+  addr.sun_family=AF_UNIX;
+  strcpy(addr.sun_path,socketpath.c_str());
+  unlink(socketpath.c_str());
+
+  if ((listener=socket(AF_UNIX,SOCK_STREAM,0))<0 ||
+      bind(listener,(struct sockaddr *)&addr,sizeof(addr))<0 ||
+      listen(listener,SERVER_BACKLOG)<0 ||
+      SetNonBlocking(listener)!=ERROR_NOERROR ||
+      pipe(wakeup)<0) {
+    cerr << "Can't listen on "<<socketpath<<": "<<strerror(errno)<<endl;
+    return -1;
+  }
+
+  signal(SIGPIPE,SIG_IGN);
+  signal(SIGINT,Stop);
+  signal(SIGTERM,Stop);
+
+  vector<pthread_t> workers(numworkers);
+  for (SIZE_T i=0;i<numworkers;i++) {
+    pthread_create(&workers[i],0,Worker,0);
+  }
+
+  cerr << "Serving "<<filestem<<" on "<<socketpath<<" with "<<numworkers<<" workers\n";
+
+  vector<Connection *> idle;
+  vector<struct pollfd> fds;
+
+  while (!stopsignal) {
+    pthread_mutex_lock(&lock);
+    idle.insert(idle.end(),returned.begin(),returned.end());
+    returned.clear();
+    pthread_mutex_unlock(&lock);
+
+    fds.resize(2+idle.size());
+    fds[0].fd=listener;
+    fds[0].events=POLLIN;
+    fds[1].fd=wakeup[0];
+    fds[1].events=POLLIN;
+    for (SIZE_T i=0;i<idle.size();i++) {
+      fds[2+i].fd=idle[i]->fd;
+      fds[2+i].events=POLLIN;
+    }
+    if (poll(&fds[0],fds.size(),-1)<0) {
+      continue;
+    }
+
+    if (fds[1].revents) {
+      char buf[64];
+      if (read(wakeup[0],buf,sizeof(buf))) {}
+    }
+
+    // anything readable, or closed, goes to the workers
+    vector<Connection *> still;
+    pthread_mutex_lock(&lock);
+    for (SIZE_T i=0;i<idle.size();i++) {
+      if (fds[2+i].revents) {
+	work.push_back(idle[i]);
+	pthread_cond_signal(&ready);
+      } else {
+	still.push_back(idle[i]);
+      }
+    }
+    pthread_mutex_unlock(&lock);
+    idle.swap(still);
+
+    if (fds[0].revents) {
+      int fd;
+      while ((fd=accept(listener,0,0))>=0) {
+	if (SetNonBlocking(fd)!=ERROR_NOERROR) {
+	  close(fd);
+	  continue;
+	}
+	idle.push_back(new Connection(fd,&btree));
+	numconnections++;
+      }
+    }
+  }
+
+  cerr << "Stopping\n";
+
+  close(listener);
+  unlink(socketpath.c_str());
+
+  pthread_mutex_lock(&lock);
+  stopping=true;
+  pthread_cond_broadcast(&ready);
+  pthread_mutex_unlock(&lock);
+  for (SIZE_T i=0;i<numworkers;i++) {
+    pthread_join(workers[i],0);
+  }
+  for (SIZE_T i=0;i<idle.size();i++) {
+    delete idle[i];
+  }
+  for (SIZE_T i=0;i<returned.size();i++) {
+    delete returned[i];
+  }
+
+  if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+    cerr <<"Can't detach from index due to error "<<rc<<endl;
+    return -1;
+  }
+  if ((rc=cache.Detach())!=ERROR_NOERROR) {
+    cerr <<"Can't detach from cache due to error "<<rc<<endl;
+    return -1;
+  }
+
+  cerr << "Server statistics:\n";
+  cerr << "numconnections  = "<<numconnections<<endl;
+  cerr << "numrequests     = "<<numrequests<<endl;
+  cerr << "numfailed       = "<<numfailed<<endl;
+  cerr << "requests/batch  = "<<(numbatches ? (double)numrequests/numbatches : 0)<<endl;
+  cerr << "numlogsyncs     = "<<log.GetNumSyncs()<<endl;
+  cerr << "Performance statistics:\n";
+  cerr << "numwarmblocks   = "<<cache.GetNumWarmBlocks()<<endl;
+  cerr << "numreads        = "<<cache.GetNumReads()<<endl;
+  cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
+  cerr << "numwrites       = "<<cache.GetNumWrites()<<endl;
+  cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
+  cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+
+  return 0;
+}
@@ -3,9 +3,12 @@
 
 void usage() 
 {
-  cerr << "usage: btree_show filestem cachesize\n";
+  cerr << "usage: btree_show filestem cachesize [text|binary|display]\n";
 }
 
+// text and binary stream the pairs with Export(), display prints
+// them through Display(BTREE_SORTED_KEYVAL) as before
+
 
 int main(int argc, char **argv)
 {
@@ -13,15 +16,22 @@ int main(int argc, char **argv)
   SIZE_T cachesize;
   SIZE_T superblocknum;
 
-  if (argc!=3) { 
+  if (argc!=3 && argc!=4) { 
     usage();
     return -1;
   }
 
   filestem=argv[1];
   cachesize=atoi(argv[2]);
+  string format=(argc==4) ? argv[3] : "text";
+
+  if (format!="text" && format!="binary" && format!="display") { 
+    usage();
+    return -1;
+  }
 
   DiskSystem disk(filestem);
+  WriteAheadLog log(filestem);
   BufferCache cache(&disk,cachesize);
   BTreeIndex btree(0,0,&cache);
   
@@ -33,13 +43,23 @@ int main(int argc, char **argv)
     return -1;
   }
 
+  if ((rc=log.Open())!=ERROR_NOERROR) { 
+    cerr << "Can't open log due to error "<<rc<<endl;
+    return -1;
+  }
+  cache.SetLog(&log);
+
   if ((rc=btree.Attach(0))!=ERROR_NOERROR) { 
     cerr << "Can't attach to index  due to error "<<rc<<endl;
     return -1;
   } else {
     cerr << "Index attached!"<<endl;
-    // Your Implementation should do the right thing here
-    cout << btree;
+    if (format=="display") { 
+      cout << btree;
+    } else if ((rc=btree.Export(cout,format=="binary" ? BTREE_EXPORT_BINARY : BTREE_EXPORT_TEXT))!=ERROR_NOERROR) { 
+      cerr <<"Can't export index due to error "<<rc<<endl;
+      return -1;
+    }
     if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) { 
       cerr <<"Can't detach from index due to error "<<rc<<endl;
       return -1;
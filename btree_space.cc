@@ -0,0 +1,190 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fstream>
+#include <vector>
+#include "btree.h"
+
+void usage()
+{
+  cerr << "usage: btree_space filestem cachesize keysize valuesize numkeys [seed]\n";
+}
+
+//
+// Space amplification of the fixed, compressed and variable formats
+//
+// Generates numkeys pairs whose key and value lengths are skewed
+// towards the short end, up to keysize and valuesize, and loads them
+// into a fresh index three times: in the fixed format, where every key
+// and value is padded out to the maximum, in the compressed format,
+// which gets the same padded pairs, and in the variable format.  For
+// each it reports the blocks the index takes up against the bytes of
+// the keys and values themselves, the simulated time of a full scan
+// from a cold cache, and the CPU time spent on the load and the scan,
+// which is where compression pays for its smaller footprint.
+//
+
+static const char *chars="abcdefghijklmnopqrstuvwxyz0123456789";
+
+// 1 to max, mostly short: a cube of a uniform number
+static SIZE_T SkewedLength(const SIZE_T max, unsigned &seed)
+{
+  double u=rand_r(&seed)/(RAND_MAX+1.0);
+  return 1+(SIZE_T)((max-1)*u*u*u);
+}
+
+static void MakeString(Block &b, const SIZE_T length, unsigned &seed)
+{
+  b.Resize(length,false);
+  for (SIZE_T i=0;i<length;i++) {
+    b.data[i]=chars[rand_r(&seed)%36];
+  }
+}
+
+// The same bytes, padded with zeros to length
+static Block Pad(const Block &b, const SIZE_T length)
+{
+  Block p(length);
+  memset(p.data,0,length);
+  memcpy(p.data,b.data,b.length);
+  return p;
+}
+
+
+static ERROR_T RunFormat(const char *name, const bool variable, const bool compressed,
+			 BufferCache &cache,
+			 const SIZE_T keysize, const SIZE_T valuesize,
+			 const vector<KeyValuePair> &pairs)
+{
+  BTreeIndex btree(keysize,valuesize,&cache);
+  BTreeShape shape;
+  ofstream null("/dev/null");
+  SIZE_T numloaded=0, numfound=0, userbytes=0, superblocknum;
+  VALUE_T found;
+  ERROR_T rc;
+
+  btree.SetVariableLength(variable);
+  btree.SetCompressed(compressed);
+  if ((rc=btree.Attach(0,true))) {
+    cerr << "Can't create "<<name<<" index due to error "<<rc<<endl;
+    return rc;
+  }
+
+  double start=cache.GetCurrentTime();
+  clock_t cpustart=clock();
+  for (SIZE_T i=0;i<pairs.size();i++) {
+    KEY_T key=variable ? pairs[i].key : Pad(pairs[i].key,keysize);
+    VALUE_T value=variable ? pairs[i].value : Pad(pairs[i].value,valuesize);
+    rc=btree.Insert(key,value);
+    if (rc==ERROR_CONFLICT) {
+      continue;
+    }
+    if (rc) {
+      cerr << "Can't load "<<name<<" index due to error "<<rc<<endl;
+      return rc;
+    }
+    numloaded++;
+    userbytes+=pairs[i].key.length+pairs[i].value.length;
+  }
+  double loadtime=cache.GetCurrentTime()-start;
+  double loadcpu=(double)(clock()-cpustart)/CLOCKS_PER_SEC;
+
+  for (SIZE_T i=0;i<pairs.size();i++) {
+    KEY_T key=variable ? pairs[i].key : Pad(pairs[i].key,keysize);
+    if (btree.Lookup(key,found)==ERROR_NOERROR) {
+      numfound++;
+    }
+  }
+
+  // write everything back so the scan starts cold
+  if ((rc=btree.Detach(superblocknum)) || (rc=cache.Detach()) || (rc=cache.Attach())) {
+    return rc;
+  }
+  start=cache.GetCurrentTime();
+  cpustart=clock();
+  if ((rc=btree.Display(null,BTREE_SORTED_KEYVAL))) {
+    return rc;
+  }
+  double scantime=cache.GetCurrentTime()-start;
+  double scancpu=(double)(clock()-cpustart)/CLOCKS_PER_SEC;
+
+  if ((rc=btree.GetShape(shape))) {
+    return rc;
+  }
+  SIZE_T numused=cache.GetNumBlocks()-btree.GetNumFreeBlocks();
+  SIZE_T numfixed=1+FreeSpaceMap::GetNumBitmapBlocks(cache.GetBlockSize(),cache.GetNumBlocks());
+  double allocated=(double)numused*cache.GetBlockSize();
+
+  cerr << name << ":\n";
+  cerr << "  numloaded       = "<<numloaded<<" ("<<numfound<<" found again)"<<endl;
+  cerr << "  userbytes       = "<<userbytes<<endl;
+  cerr << "  numblocks       = "<<numused<<endl;
+  cerr << "  numleaves       = "<<shape.numleaves<<endl;
+  cerr << "  numinterior     = "<<shape.numinterior<<endl;
+  cerr << "  numoverflow     = "<<numused-numfixed-shape.numleaves-shape.numinterior<<endl;
+  cerr << "  height          = "<<shape.height<<endl;
+  cerr << "  amplification   = "<<(userbytes ? allocated/userbytes : 0)<<endl;
+  cerr << "  load time       = "<<loadtime<<endl;
+  cerr << "  scan time       = "<<scantime<<endl;
+  cerr << "  load cpu        = "<<loadcpu<<" s"<<endl;
+  cerr << "  scan cpu        = "<<scancpu<<" s"<<endl;
+
+  return btree.Detach(superblocknum);
+}
+
+
+int main(int argc, char **argv)
+{
+  char *filestem;
+  SIZE_T cachesize, keysize, valuesize, numkeys;
+  unsigned seed;
+
+  if (argc!=6 && argc!=7) {
+    usage();
+    return -1;
+  }
+
+  filestem=argv[1];
+  cachesize=atoi(argv[2]);
+  keysize=atoi(argv[3]);
+  valuesize=atoi(argv[4]);
+  numkeys=atoi(argv[5]);
+  seed=(argc==7) ? atoi(argv[6]) : 1;
+
+  if (keysize<1 || valuesize<1) {
+    usage();
+    return -1;
+  }
+
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,cachesize);
+
+  ERROR_T rc;
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) {
+    cerr << "Can't attach buffer cache due to error"<<rc<<endl;
+    return -1;
+  }
+
+  vector<KeyValuePair> pairs(numkeys);
+  for (SIZE_T i=0;i<numkeys;i++) {
+    MakeString(pairs[i].key,SkewedLength(keysize,seed),seed);
+    MakeString(pairs[i].value,SkewedLength(valuesize,seed),seed);
+  }
+
+  // all use the same disk, one after the other
+  if (RunFormat("fixed",false,false,cache,keysize,valuesize,pairs) ||
+      RunFormat("compressed",false,true,cache,keysize,valuesize,pairs) ||
+      RunFormat("variable",true,false,cache,keysize,valuesize,pairs)) {
+    return -1;
+  }
+
+  if ((rc=cache.Detach())!=ERROR_NOERROR) {
+    cerr <<"Can't detach from cache due to error "<<rc<<endl;
+    return -1;
+  }
+
+  cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+
+  return 0;
+}
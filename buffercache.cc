@@ -1,5 +1,31 @@
+#include <sched.h>
+#include <stdio.h>
+#include <vector>
+#include <algorithm>
+
 #include "buffercache.h"
 
+// Holds the cache mutex for the lifetime of the object
+class CacheLock {
+  pthread_mutex_t *m;
+ public:
+  CacheLock(pthread_mutex_t *mutex) : m(mutex) { pthread_mutex_lock(m); }
+  ~CacheLock() { pthread_mutex_unlock(m); }
+};
+
+// The warm file is this header and then count block numbers, least
+// recently used first
+#define WARM_MAGIC 0x5741524d  // "WARM"
+// Longest run of blocks loaded with one disk request
+#define WARM_MAX_RUN 64
+
+struct WarmFileHeader {
+  SIZE_T magic;
+  SIZE_T numblocks;   // of the disk, which the file is only good for
+  SIZE_T count;
+};
+
+// Called with the cache mutex held
 ERROR_T BufferCache::CheckDeleteOldest()
 {
   // In a real buffer cache, we would use a priority queue to make this O(1)
@@ -27,12 +53,7 @@ ERROR_T BufferCache::CheckDeleteOldest()
  
   if (oldestptr!=blockmap.end()) { 
     if ((*oldestptr).second.dirty) {
-      double reqtime;
-      int rc=disk->Write((*oldestptr).first,
-			 (*oldestptr).second,
-			 reqtime);
-      curtime+=reqtime;
-      diskwrites++;
+      int rc=WriteBack((*oldestptr).first,(*oldestptr).second);
       if (rc!=ERROR_NOERROR) { 
 	return rc;
       }
@@ -42,12 +63,37 @@ ERROR_T BufferCache::CheckDeleteOldest()
   return ERROR_NOERROR;
 }
 
+// Called with the cache mutex held
+// Log before data: the block's last log record must be durable first
+ERROR_T BufferCache::WriteBack(const SIZE_T blocknum, const Block &block)
+{
+  double reqtime;
+  ERROR_T rc;
+
+  if (log && block.lsn>log->GetDurableLSN()) { 
+    if ((rc=log->Flush(block.lsn))!=ERROR_NOERROR) { 
+      return rc;
+    }
+  }
+  rc=disk->Write(blocknum,block,reqtime);
+  curtime+=reqtime;
+  diskwrites++;
+  dirtypages.erase(blocknum);
+  return rc;
+}
+
 BufferCache::BufferCache(DiskSystem *d,
 			 SIZE_T cs) : 
    disk(d), cachesize(cs), curtime(0),
-   allocs(0), deallocs(0), reads(0), writes(0),
-   diskreads(0), diskwrites(0)
-{}
+   allocs(0), deallocs(0), reads(0), hits(0), writes(0),
+   diskreads(0), diskwrites(0), log(0), readonly(false),
+   warmbackground(false), warmloading(false), warmstop(false),
+   warmtime(0), warmblocks(0), warmrequests(0), trace(0), typer(0), mrc(0)
+{
+  pthread_mutex_init(&lock,0);
+  versions = new SIZE_T [disk->GetNumBlocks()]();
+  sharers = new SIZE_T [disk->GetNumBlocks()]();
+}
 
 
 BufferCache::~BufferCache()
@@ -55,35 +101,219 @@ BufferCache::~BufferCache()
   if (disk) { 
     Detach();
   }
+  StopTrace();
+  delete trace;
+  delete mrc;
   disk=0; cachesize=0; curtime=0;
+  delete [] versions;
+  delete [] sharers;
+  pthread_mutex_destroy(&lock);
 }
 
 ERROR_T BufferCache::Attach()
 {
-  blockmap.clear();
+  StopWarmLoad();
+  {
+    CacheLock l(&lock);
+    blockmap.clear();
+  }
+  if (warmfile!="") { 
+    // only a hint, so a bad or missing file just means a cold start
+    LoadWarmFile();
+  }
   return ERROR_NOERROR;
 }
 
 ERROR_T BufferCache::Detach()
 {
+  StopWarmLoad();
+
   // write out all of our data and then throw it away
+  ERROR_T rc=Flush();
+
+  CacheLock l(&lock);
+  if (warmfile!="" && blockmap.size()>0) { 
+    // failing to save it is not an error either
+    SaveWarmFile();
+  }
+  blockmap.clear();
+  return rc;
+}
+
+void BufferCache::SetWarmFile(const string &filename, const bool background)
+{
+  warmfile=filename;
+  warmbackground=background;
+}
+
+// Called with the cache mutex held
+ERROR_T BufferCache::SaveWarmFile()
+{
+  vector<pair<double, SIZE_T> > byage;
+  WarmFileHeader h;
+  string tmp=warmfile+".tmp";
+  FILE *f;
+  bool ok;
+
+  for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=blockmap.begin();
+       i!=blockmap.end();
+       ++i) {
+    byage.push_back(make_pair((*i).second.lastaccessed,(*i).first));
+  }
+  sort(byage.begin(),byage.end());
+
+  h.magic=WARM_MAGIC;
+  h.numblocks=disk->GetNumBlocks();
+  h.count=byage.size();
+  if (!(f=fopen(tmp.c_str(),"w"))) { 
+    return ERROR_NOFILE;
+  }
+  ok=(fwrite(&h,sizeof(h),1,f)==1);
+  for (SIZE_T i=0; ok && i<byage.size(); i++) { 
+    ok=(fwrite(&byage[i].second,sizeof(SIZE_T),1,f)==1);
+  }
+  ok=(fclose(f)==0) && ok;
+  // a restart sees either the old file or the whole new one
+  if (!ok || rename(tmp.c_str(),warmfile.c_str())!=0) { 
+    remove(tmp.c_str());
+    return ERROR_GENERAL;
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BufferCache::LoadWarmFile()
+{
+  WarmFileHeader h;
+  FILE *f;
+
+  StopWarmLoad();
+  if (!(f=fopen(warmfile.c_str(),"r"))) { 
+    // nothing saved yet
+    return ERROR_NOERROR;
+  }
+  if (fread(&h,sizeof(h),1,f)!=1 || h.magic!=WARM_MAGIC || 
+      h.numblocks!=disk->GetNumBlocks()) { 
+    fclose(f);
+    return ERROR_INSANE;
+  }
+  warmlist.resize(h.count);
+  if (h.count>0 && fread(&warmlist[0],sizeof(SIZE_T),h.count,f)!=h.count) { 
+    fclose(f);
+    warmlist.clear();
+    return ERROR_INSANE;
+  }
+  fclose(f);
+  // the most recently used are the ones worth having
+  if (warmlist.size()>cachesize) { 
+    warmlist.erase(warmlist.begin(),warmlist.end()-cachesize);
+  }
+
+  warmtime=curtime;
+  warmstop=false;
+  if (warmbackground && 
+      pthread_create(&warmthread,0,WarmLoadThread,this)==0) { 
+    warmloading=true;
+    return ERROR_NOERROR;
+  }
+  return LoadWarmBlocks();
+}
+
+void *BufferCache::WarmLoadThread(void *arg)
+{
+  ((BufferCache *)arg)->LoadWarmBlocks();
+  return 0;
+}
+
+void BufferCache::StopWarmLoad()
+{
+  if (warmloading) { 
+    warmstop=true;
+    pthread_join(warmthread,0);
+    warmloading=false;
+  }
+}
+
+// Reads the warm list in runs of consecutive blocks, a run per disk
+// request and under the cache mutex, so that others get in between.
+// The blocks keep their order of use, but behind anything used since
+// the load started.
+ERROR_T BufferCache::LoadWarmBlocks()
+{
+  vector<pair<SIZE_T, SIZE_T> > byblock;  // block number, rank by age
+  SIZE_T n=warmlist.size();
+  ERROR_T rc=ERROR_NOERROR;
+
+  for (SIZE_T i=0;i<n;i++) { 
+    if (warmlist[i]<disk->GetNumBlocks()) { 
+      byblock.push_back(make_pair(warmlist[i],i));
+    }
+  }
+  sort(byblock.begin(),byblock.end());
+
+  for (SIZE_T i=0; i<byblock.size() && !warmstop; ) { 
+    SIZE_T j=i+1;
+    while (j<byblock.size() && j-i<WARM_MAX_RUN && 
+	   byblock[j].first==byblock[j-1].first+1) { 
+      j++;
+    }
+
+    CacheLock l(&lock);
+    vector<Block> blocks;
+    double reqtime;
+
+    if (blockmap.size()>=cachesize) { 
+      break;
+    }
+    if ((rc=disk->Read(byblock[i].first,j-i,blocks,reqtime))!=ERROR_NOERROR) { 
+      break;
+    }
+    curtime+=reqtime;
+    diskreads+=j-i;
+    warmrequests++;
+    for (SIZE_T k=i; k<j && blockmap.size()<cachesize; k++) { 
+      if (blockmap.find(byblock[k].first)==blockmap.end()) { 
+	Block &b=blocks[k-i];
+	b.lastaccessed=warmtime-(n-byblock[k].second);
+	b.dirty=false;
+	b.lsn=0;
+	blockmap[byblock[k].first]=b;
+	warmblocks++;
+      }
+    }
+    i=j;
+  }
+  return rc;
+}
+
+ERROR_T BufferCache::Flush()
+{
+  CacheLock l(&lock);
+  int rc;
+
+  // one log flush covers every block
+  if (log && (rc=log->Flush(log->GetAppendedLSN()))!=ERROR_NOERROR) { 
+    return rc;
+  }
 
   for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=blockmap.begin();
 	 i!=blockmap.end();
 	 ++i) {
     if ((*i).second.dirty) { 
-      double reqtime;
-      int rc=disk->Write((*i).first,
-			 (*i).second,
-			 reqtime);
-      curtime+=reqtime;
-      diskwrites++;
+      rc=WriteBack((*i).first,(*i).second);
       if (rc!=ERROR_NOERROR) { 
 	return rc;
       }
+      (*i).second.dirty=false;
     }
   }
-  blockmap.clear();
+
+  if (log) { 
+    // the data file now holds everything the log describes
+    if ((rc=disk->Sync())!=ERROR_NOERROR || (rc=log->Reset())!=ERROR_NOERROR) { 
+      return rc;
+    }
+  }
+  dirtypages.clear();
   return ERROR_NOERROR;
 }
 
@@ -111,12 +341,20 @@ double BufferCache::GetCurrentTime() const
 
 ERROR_T BufferCache::NotifyAllocateBlock(const SIZE_T outblocknum)
 {
+  CacheLock l(&lock);
+  if (readonly) { 
+    return ERROR_GENERAL;
+  }
   allocs++;
   return disk->NotifyAllocateBlocks(outblocknum,1);
 }
 
 ERROR_T BufferCache::NotifyDeallocateBlock(const SIZE_T inblocknum)
 {
+  CacheLock l(&lock);
+  if (readonly) { 
+    return ERROR_GENERAL;
+  }
   deallocs++;
   return disk->NotifyDeallocateBlocks(inblocknum,1);
 }
@@ -124,12 +362,14 @@ ERROR_T BufferCache::NotifyDeallocateBlock(const SIZE_T inblocknum)
 
 bool  BufferCache::IsBlockAllocated(const SIZE_T inblocknum)
 {
+  CacheLock l(&lock);
   return disk->IsBlockAllocated(inblocknum);
 }
 
 
 ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock) 
 {
+  CacheLock l(&lock);
   map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
 
   b = blockmap.find(inblocknum);
@@ -139,6 +379,8 @@ ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock)
     outblock=(*b).second;
     (*b).second.lastaccessed=curtime;
     reads++;
+    hits++;
+    Observe(inblocknum,outblock,0);
     return ERROR_NOERROR;
   } else {
     // It's not in cache, so time to allocate it
@@ -162,6 +404,7 @@ ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock)
       outblock.dirty=false;
       blockmap[inblocknum]=outblock;
       reads++;
+      Observe(inblocknum,outblock,CACHETRACE_MISS);
       return ERROR_NOERROR;
     }
   }
@@ -169,7 +412,23 @@ ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock)
  
 ERROR_T BufferCache::WriteBlock(const SIZE_T inblocknum, const Block &inblock)
 {
+  CacheLock l(&lock);
   map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
+  LSN_T lsn=0;
+
+  if (readonly) { 
+    return ERROR_GENERAL;
+  }
+
+  if (log) { 
+    ERROR_T rc=log->AppendPage(inblocknum,inblock,lsn);
+    if (rc!=ERROR_NOERROR) { 
+      return rc;
+    }
+    if (dirtypages.find(inblocknum)==dirtypages.end()) { 
+      dirtypages[inblocknum]=lsn-sizeof(WALRecordHeader)-inblock.length;
+    }
+  }
   
   b = blockmap.find(inblocknum);
 
@@ -178,7 +437,9 @@ ERROR_T BufferCache::WriteBlock(const SIZE_T inblocknum, const Block &inblock)
     (*b).second=inblock;
     (*b).second.lastaccessed=curtime;
     (*b).second.dirty=true;
+    (*b).second.lsn=lsn;
     writes++;
+    Observe(inblocknum,inblock,CACHETRACE_WRITE);
     return ERROR_NOERROR;
   } else {
     // It's not in cache, so time to allocate it
@@ -191,20 +452,68 @@ ERROR_T BufferCache::WriteBlock(const SIZE_T inblocknum, const Block &inblock)
     Block myblock=inblock;
     myblock.lastaccessed=curtime;
     myblock.dirty=true;
+    myblock.lsn=lsn;
     blockmap[inblocknum]=myblock;
     writes++;
+    Observe(inblocknum,inblock,CACHETRACE_WRITE|CACHETRACE_MISS);
     return ERROR_NOERROR;
   }
 }
   
 ERROR_T BufferCache::PrefetchBlock (const SIZE_T blocknum)
 {
-  // Not implemented yet
-  return ERROR_IMPLBUG;
+  return PrefetchBlocks(blocknum,1);
+}
+
+ERROR_T BufferCache::PrefetchBlocks(const SIZE_T first, const SIZE_T num)
+{
+  CacheLock l(&lock);
+  vector<Block> blocks;
+  SIZE_T i, missing;
+  double reqtime;
+  ERROR_T rc;
+
+  if (first+num>disk->GetNumBlocks()) { 
+    return ERROR_NOSUCHBLOCK;
+  }
+  if (num>1 && num>cachesize/2) { 
+    // they would push each other out before being used
+    return ERROR_NOFETCH;
+  }
+  for (i=0, missing=0; i<num; i++) { 
+    if (blockmap.find(first+i)==blockmap.end()) { 
+      missing++;
+    }
+  }
+  if (missing==0) { 
+    return ERROR_NOERROR;
+  }
+
+  if ((rc=disk->Read(first,num,blocks,reqtime))!=ERROR_NOERROR) { 
+    return rc;
+  }
+  curtime+=reqtime;
+  diskreads+=num;
+
+  // a cached copy may be dirty, and is never older than the disk
+  for (i=0; i<num; i++) { 
+    if (blockmap.find(first+i)==blockmap.end()) { 
+      if ((rc=CheckDeleteOldest())!=ERROR_NOERROR) { 
+	return rc;
+      }
+      blocks[i].lastaccessed=curtime;
+      blocks[i].dirty=false;
+      blocks[i].lsn=0;
+      blockmap[first+i]=blocks[i];
+      Observe(first+i,blocks[i],CACHETRACE_PREFETCH|CACHETRACE_MISS);
+    }
+  }
+  return ERROR_NOERROR;
 }
   
 ERROR_T BufferCache::FlushBlock(const SIZE_T blocknum)
 {
+  CacheLock l(&lock);
   map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
   
   b = blockmap.find(blocknum);
@@ -213,13 +522,7 @@ ERROR_T BufferCache::FlushBlock(const SIZE_T blocknum)
     return ERROR_NOERROR;
   } else {
     if ((*b).second.dirty) { 
-      double reqtime;
-      int rc;
-      rc=disk->Write((*b).first,
-		     (*b).second,
-		     reqtime);
-      diskwrites++;
-      curtime+=reqtime;
+      int rc=WriteBack((*b).first,(*b).second);
       if (rc!=ERROR_NOERROR) { 
 	return rc;
       }
@@ -229,14 +532,210 @@ ERROR_T BufferCache::FlushBlock(const SIZE_T blocknum)
   }
 }
   
+
+
+ERROR_T BufferCache::GetDirtyPageTable(map<SIZE_T, LSN_T, cache_compare_lessthan> &dpt,
+				       LSN_T &snapshot) const
+{
+  CacheLock l(&lock);
+  dpt=dirtypages;
+  // any block dirtied after this point gets a later log position
+  snapshot=log ? log->GetAppendedLSN() : 0;
+  return ERROR_NOERROR;
+}
+
+ERROR_T BufferCache::WriteBackDirtyBlocks(const LSN_T lsn)
+{
+  vector<SIZE_T> old;
+
+  {
+    CacheLock l(&lock);
+    for (map<SIZE_T, LSN_T, cache_compare_lessthan>::const_iterator i=dirtypages.begin();
+	 i!=dirtypages.end();
+	 ++i) {
+      if ((*i).second<lsn) { 
+	old.push_back((*i).first);
+      }
+    }
+  }
+
+  // one block at a time, so writers are never held up for long
+  for (SIZE_T j=0;j<old.size();j++) { 
+    CacheLock l(&lock);
+    map<SIZE_T, LSN_T, cache_compare_lessthan>::iterator d=dirtypages.find(old[j]);
+    map<SIZE_T, Block, cache_compare_lessthan>::iterator b=blockmap.find(old[j]);
+    if (d==dirtypages.end() || (*d).second>=lsn || b==blockmap.end()) { 
+      continue;
+    }
+    ERROR_T rc=WriteBack((*b).first,(*b).second);
+    if (rc!=ERROR_NOERROR) { 
+      return rc;
+    }
+    (*b).second.dirty=false;
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BufferCache::Sync()
+{
+  CacheLock l(&lock);
+  return disk->Sync();
+}
+
+ERROR_T BufferCache::RedoBlock(const SIZE_T blocknum, const Block &block)
+{
+  CacheLock l(&lock);
+  map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
+
+  if (readonly) { 
+    return ERROR_GENERAL;
+  }
+
+  b = blockmap.find(blocknum);
+
+  if (b==blockmap.end()) { 
+    CheckDeleteOldest();
+    b = blockmap.insert(make_pair(blocknum,block)).first;
+  } else {
+    (*b).second=block;
+  }
+  (*b).second.lastaccessed=curtime;
+  (*b).second.dirty=true;
+  (*b).second.lsn=0;
+  writes++;
+  return ERROR_NOERROR;
+}
+
+
+SIZE_T BufferCache::GetFrameVersion(const SIZE_T blocknum) const
+{
+  SIZE_T v;
+  while ((v=versions[blocknum]) & 0x1) { 
+    sched_yield();
+  }
+  __sync_synchronize();
+  return v;
+}
+
+bool BufferCache::ValidateFrameVersion(const SIZE_T blocknum, const SIZE_T version) const
+{
+  __sync_synchronize();
+  return versions[blocknum]==version;
+}
+
+bool BufferCache::UpgradeFrameLatch(const SIZE_T blocknum, const SIZE_T version)
+{
+  if (version & 0x1) { 
+    return false;
+  }
+  if (!__sync_bool_compare_and_swap(&versions[blocknum],version,version+1)) { 
+    return false;
+  }
+  // drain any pessimistic readers that got in before us
+  while (sharers[blocknum]>0) { 
+    sched_yield();
+  }
+  return true;
+}
+
+ERROR_T BufferCache::LatchFrameShared(const SIZE_T blocknum)
+{
+  if (blocknum>=GetNumBlocks()) { 
+    return ERROR_NOSUCHBLOCK;
+  }
+  while (1) { 
+    SIZE_T v=GetFrameVersion(blocknum);
+    __sync_fetch_and_add(&sharers[blocknum],1);
+    if (versions[blocknum]==v) { 
+      // no writer slipped in before our increment became visible
+      return ERROR_NOERROR;
+    }
+    __sync_fetch_and_sub(&sharers[blocknum],1);
+  }
+}
+
+ERROR_T BufferCache::UnlatchFrameShared(const SIZE_T blocknum)
+{
+  __sync_fetch_and_sub(&sharers[blocknum],1);
+  return ERROR_NOERROR;
+}
+
+ERROR_T BufferCache::LatchFrameExclusive(const SIZE_T blocknum)
+{
+  if (blocknum>=GetNumBlocks()) { 
+    return ERROR_NOSUCHBLOCK;
+  }
+  while (!UpgradeFrameLatch(blocknum,GetFrameVersion(blocknum))) { 
+    sched_yield();
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BufferCache::UnlatchFrameExclusive(const SIZE_T blocknum)
+{
+  if (!(versions[blocknum] & 0x1)) { 
+    return ERROR_IMPLBUG;
+  }
+  __sync_fetch_and_add(&versions[blocknum],1);
+  return ERROR_NOERROR;
+}
+
+  
+ERROR_T BufferCache::StartTrace(const string &filestem, const double samplerate)
+{
+  CacheLock l(&lock);
+  ERROR_T rc;
+
+  if (trace && trace->IsRunning()) { 
+    return ERROR_CONFLICT;
+  }
+  delete trace;
+  trace = new CacheTrace(filestem,disk->GetNumBlocks(),disk->GetBlockSize(),cachesize,samplerate);
+  if ((rc=trace->Start())!=ERROR_NOERROR) { 
+    delete trace;
+    trace=0;
+  }
+  return rc;
+}
+
+ERROR_T BufferCache::StopTrace()
+{
+  CacheLock l(&lock);
+
+  if (!trace) { 
+    return ERROR_NOERROR;
+  }
+  // kept for its counts until the next StartTrace()
+  return trace->Stop();
+}
+
+
+void BufferCache::SetMissRatioCurve(const double samplerate)
+{
+  CacheLock l(&lock);
+
+  delete mrc;
+  mrc = samplerate>0 ? new MissRatioCurve(disk->GetNumBlocks(),samplerate) : 0;
+}
+
+
+DiskAccessStats BufferCache::GetDiskAccessStats() const
+{
+  CacheLock l(&lock);
+  return disk->GetAccessStats();
+}
+
+
 ostream & BufferCache::Print(ostream &os) const
 {
+  CacheLock l(&lock);
   os << "BufferCache(cachesize="<<cachesize
      << ", blocksize="<<GetBlockSize()
      << ", curtime="<<curtime
      << ", allocs="<<allocs
      << ", deallocs="<<deallocs
      << ", reads="<<reads
+     << ", hits="<<hits
      << ", writes="<<writes
      << ", diskreads="<<diskreads
      << ", diskwrites="<<diskwrites
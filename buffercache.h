@@ -2,11 +2,17 @@
 #define _buffercache
 
 #include <iostream>
+#include <string>
+#include <vector>
 #include <map>
+#include <pthread.h>
 
 #include "global.h"
 #include "block.h"
 #include "disksystem.h"
+#include "wal.h"
+#include "cachetrace.h"
+#include "missratio.h"
 
 using namespace std;
 
@@ -22,15 +28,68 @@ struct cache_compare_lessthan {
 //
 // Write Back
 // Write Allocate
+//
+// The cache is safe to use from multiple threads.  Each block number
+// also has a latch word that callers use to coordinate access to the
+// index node stored in it.  The latch word is a version counter which
+// is even when the frame is unlatched and odd while a writer holds it
+// exclusively, plus a count of pessimistic shared holders.  Optimistic
+// readers never write the latch word: they record the version, read
+// the block, and then validate that the version has not moved.
+//
+// If a write-ahead log is attached, every block write appends the
+// block's after-image to the log, and a dirty block is never written
+// back to disk before the log is durable up to its last record.  The
+// cache also keeps a dirty page table that maps each dirty block to
+// the log position of the first record that dirtied it, which is
+// what a checkpoint needs to know where redo has to start.
+//
+// With a warm file, Detach records which blocks were cached, least
+// recently used first, and Attach reads them back in with as few disk
+// requests as it can, so that a restarted program does not start
+// cold.  The file only names blocks, whose contents always come from
+// the disk, so an out of date file costs reads but is never wrong.
 class BufferCache {
  private:
   DiskSystem *disk;
   SIZE_T cachesize;
   map<SIZE_T, Block, cache_compare_lessthan> blockmap;
   double curtime;
-  SIZE_T allocs, deallocs, reads, writes, diskreads, diskwrites;
+  SIZE_T allocs, deallocs, reads, hits, writes, diskreads, diskwrites;
+  mutable pthread_mutex_t lock;
+  volatile SIZE_T *versions;  // one per block, odd => exclusively latched
+  volatile SIZE_T *sharers;   // one per block, pessimistic shared holders
+  WriteAheadLog *log;
+  bool readonly;
+  map<SIZE_T, LSN_T, cache_compare_lessthan> dirtypages;
+  string warmfile;
+  bool warmbackground;
+  bool warmloading;            // a background load thread is running
+  volatile bool warmstop;
+  pthread_t warmthread;
+  vector<SIZE_T> warmlist;     // blocks to load, least recently used first
+  double warmtime;             // curtime when the load started
+  SIZE_T warmblocks, warmrequests;
+  CacheTrace *trace;           // 0 unless tracing
+  BlockTyper typer;
+  MissRatioCurve *mrc;         // 0 unless estimating one
  protected:
   ERROR_T CheckDeleteOldest();
+  ERROR_T WriteBack(const SIZE_T blocknum, const Block &block);
+  // Called with the cache mutex held
+  ERROR_T SaveWarmFile();
+  void    StopWarmLoad();
+  ERROR_T LoadWarmBlocks();
+  static void *WarmLoadThread(void *cache);
+  // Feeds an access to the trace and the miss ratio curve
+  void    Observe(const SIZE_T blocknum, const Block &block, const BYTE_T flags) { 
+    if (trace && trace->IsRunning()) { 
+      trace->Record(curtime,blocknum,flags,typer ? typer(block) : 0);
+    }
+    if (mrc && !(flags&CACHETRACE_PREFETCH)) { 
+      mrc->Access(blocknum,!(flags&CACHETRACE_WRITE));
+    }
+  }
  public:
   // Cache size is in number of blocks
   BufferCache(DiskSystem *disk,
@@ -42,9 +101,58 @@ class BufferCache {
 
   // Call Attach before your first read or write
   // Call Detach after your last read or write
+  // Detach leaves everything durable on disk and empties the log
   ERROR_T Attach();
   ERROR_T Detach();
 
+  // Writes back every dirty block and, with a log, syncs the disk and
+  // empties the log.  The cache stays attached.
+  ERROR_T Flush();
+
+  // Warm restart: Detach saves the cached block numbers in filename
+  // and Attach loads them back.  In the background, Attach returns at
+  // once and a thread loads the blocks while the cache is in use; it
+  // only fills frames that are still free and never replaces a block
+  // that has been read or written in the meantime.  An empty name
+  // turns this off.
+  void    SetWarmFile(const string &filename, const bool background=false);
+  // What Attach does with the warm file.  It can also be called on a
+  // cache that is attached but still empty.
+  ERROR_T LoadWarmFile();
+  // Blocks loaded from the warm file so far, and the disk requests
+  // that took
+  SIZE_T  GetNumWarmBlocks() const { return warmblocks; }
+  SIZE_T  GetNumWarmRequests() const { return warmrequests; }
+
+  // While the cache is read-only, writes, allocations and redo fail
+  // with ERROR_GENERAL, so something that should only be reading
+  // can't change the disk.  Blocks that were already dirty are still
+  // written back.
+  void    SetReadOnly(const bool ro) { readonly=ro; }
+  bool    IsReadOnly() const { return readonly; }
+
+  // Tracing: every read, write and prefetch is counted in a heat map
+  // of the blocks, and those of a sample of samplerate of the blocks
+  // are recorded in filestem.trace, until StopTrace() also saves the
+  // heat map in filestem.heat (see CacheTrace, and cachetrace for
+  // reading them).  The typer, if any, tells what each traced block
+  // holds.
+  ERROR_T StartTrace(const string &filestem, const double samplerate=1);
+  ERROR_T StopTrace();
+  // The current or last trace, 0 if there has been none
+  const CacheTrace *GetTrace() const { return trace; }
+  void    SetBlockTyper(BlockTyper t) { typer=t; }
+
+  // Estimates the hit ratio every cache size would have had, from the
+  // reads and writes of a samplerate fraction of the blocks (see
+  // MissRatioCurve), starting afresh.  0 turns it off.
+  void    SetMissRatioCurve(const double samplerate);
+  const MissRatioCurve *GetMissRatioCurve() const { return mrc; }
+
+  // Attach a write-ahead log (0 to run without one)
+  void    SetLog(WriteAheadLog *wal) { log=wal; }
+  WriteAheadLog *GetLog() const { return log; }
+
   // Number of blocks in the cache
   SIZE_T GetCacheSize() const;
   // Number of bytes per block
@@ -76,18 +184,60 @@ class BufferCache {
   // ERROR_NOFETCH means that there is no room currently
   // to prefetch the block and it was not prefetched.
   ERROR_T PrefetchBlock (const SIZE_T blocknum);
+  // Read-ahead: brings num consecutive blocks into the cache with a
+  // single disk request, keeping the cached copies of any that are
+  // already there.  ERROR_NOFETCH if they would take up more than
+  // half the cache.
+  ERROR_T PrefetchBlocks(const SIZE_T first, const SIZE_T num);
   
   // Request that a block be flushed to disk
   // Note that this blocks until the block is finished.
   ERROR_T FlushBlock(const SIZE_T blocknum);
-  
+
+  // Checkpoint and recovery support
+  //
+  // Copies the dirty page table, along with the end of the log at the
+  // moment it was taken
+  ERROR_T GetDirtyPageTable(map<SIZE_T, LSN_T, cache_compare_lessthan> &dpt,
+			    LSN_T &snapshot) const;
+  // Writes back (but keeps) the blocks that have been dirty since
+  // before log position lsn
+  ERROR_T WriteBackDirtyBlocks(const LSN_T lsn);
+  // Makes everything written back so far durable
+  ERROR_T Sync();
+  // Installs a block image from the log without logging it again
+  ERROR_T RedoBlock(const SIZE_T blocknum, const Block &block);
+
+
+  // Frame latches
+  //
+  // Returns the current version of the frame, waiting while a writer
+  // holds it.  This never modifies the latch word.
+  SIZE_T  GetFrameVersion(const SIZE_T blocknum) const;
+  // true if the frame is still at the version returned earlier
+  bool    ValidateFrameVersion(const SIZE_T blocknum, const SIZE_T version) const;
+  // Atomically turn an optimistic read at version into an exclusive
+  // latch.  Returns false if the frame has changed in the meantime.
+  bool    UpgradeFrameLatch(const SIZE_T blocknum, const SIZE_T version);
+  // Pessimistic shared latch (readers block writers, not each other)
+  ERROR_T LatchFrameShared(const SIZE_T blocknum);
+  ERROR_T UnlatchFrameShared(const SIZE_T blocknum);
+  // Exclusive latch.  Releasing it advances the version so that any
+  // optimistic reader that overlapped the writer will fail validation.
+  ERROR_T LatchFrameExclusive(const SIZE_T blocknum);
+  ERROR_T UnlatchFrameExclusive(const SIZE_T blocknum);
  
   SIZE_T GetNumAllocs() const { return allocs; }
   SIZE_T GetNumDeallocs() const { return deallocs; }
   SIZE_T GetNumReads() const { return reads;}
+  // Reads that found the block in the cache
+  SIZE_T GetNumHits() const { return hits;}
   SIZE_T GetNumWrites() const { return writes;}
   SIZE_T GetNumDiskReads() const { return diskreads;}
   SIZE_T GetNumDiskWrites() const { return diskwrites;}
+  // What the disk's requests have cost since it was opened, split
+  // into seeking, rotation and transfer (see DiskAccessStats)
+  DiskAccessStats GetDiskAccessStats() const;
 
   ostream & Print(ostream &os) const;
   
@@ -0,0 +1,246 @@
+#include <unistd.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+#include "cachetrace.h"
+
+
+CacheTrace::CacheTrace(const string &fs,
+		       const SIZE_T nb,
+		       const SIZE_T blocksize,
+		       const SIZE_T cachesize,
+		       const double samplerate,
+		       const SIZE_T rs) :
+  filestem(fs),
+  file(0),
+  numblocks(nb),
+  threshold(GetThreshold(samplerate)),
+  ringsize(1),
+  head(0),
+  tail(0),
+  running(false),
+  stop(false)
+{
+  // the slot of a ticket is its low bits
+  while (ringsize<rs) {
+    ringsize*=2;
+  }
+  ring = new CacheTraceRecord [ringsize];
+  seqs = new unsigned long long [ringsize]();
+  reads = new SIZE_T [numblocks]();
+  writes = new SIZE_T [numblocks]();
+  misses = new SIZE_T [numblocks]();
+
+  memset(&header,0,sizeof(header));
+  header.magic=CACHETRACE_MAGIC;
+  header.numblocks=numblocks;
+  header.blocksize=blocksize;
+  header.cachesize=cachesize;
+  header.samplerate=samplerate;
+}
+
+
+CacheTrace::~CacheTrace()
+{
+  Stop();
+  delete [] ring;
+  delete [] seqs;
+  delete [] reads;
+  delete [] writes;
+  delete [] misses;
+}
+
+
+// The finalizer of MurmurHash3, which takes consecutive block numbers
+// far apart
+SIZE_T CacheTrace::Hash(const SIZE_T block)
+{
+  SIZE_T h=block;
+  h^=h>>16;
+  h*=0x85ebca6b;
+  h^=h>>13;
+  h*=0xc2b2ae35;
+  h^=h>>16;
+  return h;
+}
+
+
+unsigned long long CacheTrace::GetThreshold(const double samplerate)
+{
+  if (samplerate>=1) {
+    return 1ULL<<32;
+  }
+  if (samplerate<=0) {
+    return 0;
+  }
+  return (unsigned long long)(samplerate*(1ULL<<32));
+}
+
+
+ERROR_T CacheTrace::Start()
+{
+  if (running) {
+    return ERROR_NOERROR;
+  }
+  if (!(file=fopen((filestem+".trace").c_str(),"w"))) {
+    return ERROR_NOFILE;
+  }
+  // rewritten with the counts at the end
+  if (fwrite(&header,sizeof(header),1,file)!=1) {
+    fclose(file);
+    file=0;
+    return ERROR_GENERAL;
+  }
+  stop=false;
+  if (pthread_create(&thread,0,DrainThread,this)!=0) {
+    fclose(file);
+    file=0;
+    return ERROR_GENERAL;
+  }
+  running=true;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T CacheTrace::Stop()
+{
+  ERROR_T rc=ERROR_NOERROR;
+
+  if (!running) {
+    return ERROR_NOERROR;
+  }
+  stop=true;
+  pthread_join(thread,0);
+  running=false;
+
+  Drain();
+  rewind(file);
+  if (fwrite(&header,sizeof(header),1,file)!=1) {
+    rc=ERROR_GENERAL;
+  }
+  if (fclose(file)) {
+    rc=ERROR_GENERAL;
+  }
+  file=0;
+  if (rc==ERROR_NOERROR) {
+    rc=SaveHeatMap();
+  }
+  return rc;
+}
+
+
+void CacheTrace::Record(const double time, const SIZE_T block,
+			const BYTE_T flags, const BYTE_T nodetype)
+{
+  if (block>=numblocks) {
+    return;
+  }
+  __sync_fetch_and_add(flags&CACHETRACE_WRITE ? &writes[block] : &reads[block],1);
+  if (flags&CACHETRACE_MISS) {
+    __sync_fetch_and_add(&misses[block],1);
+  }
+  if (!IsSampled(block)) {
+    return;
+  }
+
+  unsigned long long ticket=__sync_fetch_and_add(&head,1);
+  SIZE_T slot=ticket&(ringsize-1);
+
+  // a slot being written is marked so that the drain can't take half
+  // of an old record and half of the new one
+  seqs[slot]=0;
+  __sync_synchronize();
+  ring[slot].time=time;
+  ring[slot].block=block;
+  ring[slot].flags=flags;
+  ring[slot].nodetype=nodetype;
+  ring[slot].pad[0]=ring[slot].pad[1]=0;
+  __sync_synchronize();
+  seqs[slot]=ticket+1;
+}
+
+
+void *CacheTrace::DrainThread(void *arg)
+{
+  CacheTrace *t=(CacheTrace *)arg;
+
+  while (!t->stop) {
+    if (t->Drain()==0) {
+      usleep(CACHETRACE_DRAIN_INTERVAL);
+    }
+  }
+  return 0;
+}
+
+
+SIZE_T CacheTrace::Drain()
+{
+  vector<CacheTraceRecord> out;
+  unsigned long long h=head;
+
+  if (h-tail>ringsize) {
+    // lapped: whatever was in between is gone
+    header.numdropped+=h-tail-ringsize;
+    tail=h-ringsize;
+  }
+  while (tail<h) {
+    SIZE_T slot=tail&(ringsize-1);
+    unsigned long long before=seqs[slot];
+    if (before==0 || before<tail+1) {
+      // claimed but not yet written; the rest waits for the next drain
+      break;
+    }
+    __sync_synchronize();
+    CacheTraceRecord r=ring[slot];
+    __sync_synchronize();
+    if (before!=tail+1 || seqs[slot]!=before) {
+      // overwritten by a later ticket
+      header.numdropped++;
+    } else {
+      out.push_back(r);
+    }
+    tail++;
+  }
+
+  if (!out.empty()) {
+    if (fwrite(&out[0],sizeof(CacheTraceRecord),out.size(),file)!=out.size()) {
+      header.numdropped+=out.size();
+    } else {
+      header.numrecords+=out.size();
+    }
+  }
+  return out.size();
+}
+
+
+ERROR_T CacheTrace::SaveHeatMap() const
+{
+  vector<CacheHeatEntry> entries;
+  CacheHeatHeader h;
+  FILE *f;
+
+  for (SIZE_T i=0;i<numblocks;i++) {
+    if (reads[i] || writes[i]) {
+      CacheHeatEntry e;
+      e.block=i;
+      e.reads=reads[i];
+      e.writes=writes[i];
+      e.misses=misses[i];
+      entries.push_back(e);
+    }
+  }
+  h.magic=CACHEHEAT_MAGIC;
+  h.numblocks=numblocks;
+  h.count=entries.size();
+
+  if (!(f=fopen((filestem+".heat").c_str(),"w"))) {
+    return ERROR_NOFILE;
+  }
+  if (fwrite(&h,sizeof(h),1,f)!=1 ||
+      (h.count>0 && fwrite(&entries[0],sizeof(CacheHeatEntry),h.count,f)!=h.count)) {
+    fclose(f);
+    return ERROR_GENERAL;
+  }
+  return fclose(f) ? ERROR_GENERAL : ERROR_NOERROR;
+}
@@ -0,0 +1,137 @@
+#ifndef _cachetrace
+#define _cachetrace
+
+#include <string>
+#include <pthread.h>
+#include <stdio.h>
+
+#include "global.h"
+#include "block.h"
+
+using namespace std;
+
+// What a trace record's flags say about the access
+#define CACHETRACE_WRITE    0x1   // a write, otherwise a read
+#define CACHETRACE_MISS     0x2   // the block was not in the cache
+#define CACHETRACE_PREFETCH 0x4   // read ahead of its use
+
+// Records the ring holds before the oldest is overwritten (a power
+// of two), and how often the drain thread writes them out
+#define CACHETRACE_RING_SIZE      (64*1024)
+#define CACHETRACE_DRAIN_INTERVAL 10000   // us
+
+#define CACHETRACE_MAGIC 0x43545243  // "CTRC"
+#define CACHEHEAT_MAGIC  0x48454154  // "HEAT"
+
+// One access, 16 bytes in the trace file
+struct CacheTraceRecord {
+  double time;       // simulated ms
+  SIZE_T block;
+  BYTE_T flags;
+  BYTE_T nodetype;   // from the cache's block typer, 0 without one
+  BYTE_T pad[2];
+};
+
+// filestem.trace is this header followed by the records, in the order
+// they were taken.  The counts are filled in when the trace stops.
+struct CacheTraceHeader {
+  SIZE_T magic;
+  SIZE_T numblocks;
+  SIZE_T blocksize;
+  SIZE_T cachesize;
+  double samplerate;
+  unsigned long long numrecords;
+  unsigned long long numdropped;  // overwritten before they were written out
+};
+
+// filestem.heat is a header with the number of entries and then an
+// entry for each block that was accessed, by block number
+struct CacheHeatHeader {
+  SIZE_T magic;
+  SIZE_T numblocks;
+  SIZE_T count;
+};
+
+struct CacheHeatEntry {
+  SIZE_T block;
+  SIZE_T reads;
+  SIZE_T writes;
+  SIZE_T misses;
+};
+
+// What a block holds, for the trace, as a small number
+typedef BYTE_T (*BlockTyper)(const Block &block);
+
+//
+// Trace of a buffer cache's accesses, and a heat map of its blocks
+//
+// Record() is called for every read and write.  The heat map counts
+// them all, per block.  A trace record is only taken for the blocks in
+// the sample: a block is in it if a hash of its number falls below
+// samplerate, so a sampled block has all of its accesses traced, and
+// reuse distances and miss ratio curves can be worked out from the
+// sample and scaled up.
+//
+// Records go into a ring that any number of threads fill without
+// locking: each claims a slot by advancing the head, writes it and
+// then publishes it with the slot's sequence number.  A thread drains
+// the ring into filestem.trace in the background.  If it falls more
+// than the ring behind, the oldest records are overwritten and
+// counted as dropped rather than the cache ever waiting for the file.
+//
+class CacheTrace {
+ private:
+  string   filestem;
+  FILE    *file;
+  SIZE_T   numblocks;
+  CacheTraceHeader header;
+  unsigned long long threshold;  // sampled if the block's hash is below
+  CacheTraceRecord *ring;
+  volatile unsigned long long *seqs;   // ticket+1 once a slot is written
+  SIZE_T   ringsize;
+  volatile unsigned long long head;    // next ticket to hand out
+  unsigned long long tail;             // next ticket to write out
+  volatile SIZE_T *reads, *writes, *misses;  // the heat map
+  pthread_t thread;
+  bool     running;
+  volatile bool stop;
+
+  static void *DrainThread(void *trace);
+  // Writes out what has been published, and returns how many
+  SIZE_T   Drain();
+  ERROR_T  SaveHeatMap() const;
+
+ public:
+  CacheTrace(const string &filestem,
+	     const SIZE_T numblocks,
+	     const SIZE_T blocksize,
+	     const SIZE_T cachesize,
+	     const double samplerate=1,
+	     const SIZE_T ringsize=CACHETRACE_RING_SIZE);
+  CacheTrace() { throw GenericException(); }
+  CacheTrace(const CacheTrace &rhs) { throw GenericException(); }
+  CacheTrace & operator=(const CacheTrace &rhs) { throw GenericException(); return *this; }
+  virtual ~CacheTrace();
+
+  // Start() opens filestem.trace and starts the drain thread.  Stop()
+  // writes out the rest, fills in the header and saves the heat map
+  // in filestem.heat.
+  ERROR_T Start();
+  ERROR_T Stop();
+  bool    IsRunning() const { return running; }
+
+  void    Record(const double time, const SIZE_T block,
+		 const BYTE_T flags, const BYTE_T nodetype);
+
+  bool    IsSampled(const SIZE_T block) const { return Hash(block)<threshold; }
+  double  GetSampleRate() const { return header.samplerate; }
+  unsigned long long GetNumRecords() const { return header.numrecords; }
+  unsigned long long GetNumDropped() const { return header.numdropped; }
+
+  // Spreads block numbers evenly over 32 bits
+  static SIZE_T Hash(const SIZE_T block);
+  // The threshold Hash() has to fall below for a sample rate
+  static unsigned long long GetThreshold(const double samplerate);
+};
+
+#endif
@@ -0,0 +1,142 @@
+#!/usr/bin/perl -w
+
+use Time::HiRes qw(usleep);
+
+# Crash injection test for the write-ahead log.
+#
+# Each trial feeds a random prefix of a test sequence to sim, kills
+# it with SIGKILL at a random moment, and then has a new sim ATTACH
+# to what was left on disk.  Every update that sim acknowledged
+# before it died must survive, and the recovered contents must be
+# exactly what ref_impl.pl holds after some number of operations
+# between the acknowledged ones and the ones that were sent.
+
+$diskstem="__crash";
+$numblocks=1024;
+$blocksize=1024;
+$heads=1;
+$blockspertrack=1024;
+$tracks=1;
+$avgseek=10;
+$trackseek=1;
+$rotlat=10;
+# small, so that blocks get evicted and written back before commit
+$cachesize=16;
+
+$#ARGV==5 or die "usage: crash_test.pl keysize valuesize seed numops commitbatch numcrashes\n";
+
+($keysize,$valuesize,$seed,$numops,$commitbatch,$numcrashes)=@ARGV;
+
+$commitbatch>0 or die "commitbatch must be at least 1\n";
+
+$ENV{PATH}.=":.";
+
+$numfailed=0;
+$numskipped=0;
+
+for ($trial=1;$trial<=$numcrashes;$trial++) {
+  srand($seed+$trial);
+
+  system "deletedisk $diskstem >/dev/null 2>&1";
+  unlink "$diskstem.wal";
+  system "makedisk $diskstem $numblocks $blocksize $heads $blockspertrack $tracks $avgseek $trackseek $rotlat >/dev/null 2>&1";
+
+  # one reply per operation, so no DISPLAY and no DEINIT
+  $trialseed=$seed+$trial;
+  @ops=grep { !/^(INIT|DISPLAY|DEINIT)/ } `gen_test_sequence_nocomments.pl $keysize $valuesize $trialseed $numops`;
+  $numsent=1+int(rand($#ops+1));
+
+  $pid=open(SIM, "| exec sim $diskstem $cachesize $commitbatch > $diskstem.out 2>/dev/null") or die "can't run sim\n";
+  select((select(SIM), $|=1)[0]);
+  print SIM "INIT $keysize $valuesize\n";
+  print SIM @ops[0..$numsent-1];
+  usleep(int(rand(50000)));
+  kill 9, $pid;
+  close(SIM);
+
+  @acks=ReadLines("$diskstem.out");
+  if ($#acks<0) {
+    print "crash $trial: killed before INIT completed\n";
+    $numskipped++;
+    next;
+  }
+  $numacked=$#acks;
+
+  # recover
+  open(SIM, "| sim $diskstem $cachesize $commitbatch > $diskstem.out 2>/dev/null") or die "can't run sim\n";
+  print SIM "ATTACH\nDISPLAY\nDEINIT\n";
+  close(SIM);
+  @recovered=ReadLines("$diskstem.out");
+  $recovered=Contents(@recovered);
+
+  # what the reference says the acknowledged replies and the possible
+  # contents are
+  open(SEQ, ">$diskstem.seq") or die "can't write $diskstem.seq\n";
+  print SEQ "INIT $keysize $valuesize\n";
+  print SEQ @ops[0..$numacked-1];
+  for ($i=$numacked;$i<$numsent;$i++) {
+    print SEQ "DISPLAY\n", $ops[$i];
+  }
+  print SEQ "DISPLAY\nDEINIT\n";
+  close(SEQ);
+  @ref=`ref_impl.pl nodebug 0 < $diskstem.seq`;
+
+  $status="";
+  for ($i=0;$i<=$numacked;$i++) {
+    if ($acks[$i] ne $ref[$i]) {
+      $status="FAILED: reply ".$i." was ".$acks[$i]." but should be ".$ref[$i];
+      last;
+    }
+  }
+
+  if ($status eq "" && $#recovered>=0 && $recovered[0] eq "OK\n") {
+    $status="FAILED: recovered contents match no reference state";
+    @rest=@ref[$numacked+1..$#ref];
+    for ($i=$numacked;$i<=$numsent;$i++) {
+      # each block is one DISPLAY, followed by the reply to one operation
+      @block=();
+      while ($#rest>=0) {
+	$line=shift @rest;
+	push @block, $line;
+	last if $line eq "OK END DISPLAY\n";
+      }
+      shift @rest;
+      if (Contents(@block) eq $recovered) {
+	$status="recovered state after ".$i." operations";
+	last;
+      }
+    }
+  } elsif ($status eq "") {
+    $status="FAILED: could not reattach";
+  }
+
+  print "crash $trial: sent $numsent, acknowledged $numacked, $status\n";
+  $numfailed++ if $status =~ /^FAILED/;
+}
+
+unlink "$diskstem.out", "$diskstem.seq";
+
+print "$numcrashes crashes, $numfailed failed, $numskipped before INIT\n";
+
+exit($numfailed>0);
+
+
+sub ReadLines {
+  my ($file)=@_;
+  my @lines;
+  open(F, $file) or return ();
+  @lines=<F>;
+  close(F);
+  return @lines;
+}
+
+# the pairs of one DISPLAY, normalized
+sub Contents {
+  my $c="";
+  foreach my $line (@_) {
+    if ($line =~ /^\((\S+?),\s*(\S+)\)/) {
+      $c.="$1 $2\n";
+    }
+  }
+  return $c;
+}
@@ -6,9 +6,12 @@
 #include <stdio.h>
 
 #include <math.h>
+#include <fstream>
 
 #include "disksystem.h"
 
+#define DISKSYSTEM_STATS_HEADER "# disksystem access statistics version 1"
+
 
 static SIZE_T mywrite(FILE *f, const SIZE_T off, const BYTE_T *buf, const int len)
 {
@@ -97,11 +100,14 @@ DiskSystem::DiskSystem(const string &filestem,
   last_sector(0),
   averageseeklatency(avgseek),
   trackseeklatency(trackseek),
-  rotationallatency(rotlat)
+  rotationallatency(rotlat),
+  resetstats(false)
 {
   if (create) { 
     // Only in this case are the parameters used:
     InitFromInMemoryConfig();
+    // a new disk starts counting from nothing
+    resetstats=true;
   } else {
     InitFromConfigFile();
   }
@@ -111,6 +117,9 @@ DiskSystem::~DiskSystem()
 {
   WriteConfig();
   WriteBitMap();
+  if (datafilefd && (resetstats || stats.numreads+stats.numwrites>0)) { 
+    WriteStats();
+  }
   fclose(configfilefd);
   fclose(bitmapfilefd);
   fclose(datafilefd);
@@ -276,6 +285,8 @@ ERROR_T DiskSystem::InitFromConfigFile()
     return rc;
   }
 
+  ReadStats();
+
   return ERROR_NOERROR;
 }
 
@@ -409,6 +420,13 @@ double DiskSystem::ModelAccess(const SIZE_T offblock, const SIZE_T numblock)
   last_track=req_trackend;
   last_sector=req_sectorend;
 
+  stats.timeinseek+=timeinseek;
+  stats.timeinrotation+=timeinrotation;
+  stats.timeintrackhops+=timeintrackbytrackhops;
+  stats.timeintransfer+=timeinreadsectors;
+  stats.requestsize.Record(numblock);
+  stats.seekdistance.Record(trackhop);
+
   return timeinseek+timeinrotation+timeintrackbytrackhops+timeinreadsectors;
 }
 
@@ -426,6 +444,8 @@ ERROR_T DiskSystem::Read(const SIZE_T   inoffblock,
   }
 
   reqtime=ModelAccess(inoffblock,numblock);
+  stats.numreads++;
+  stats.numblocksread+=numblock;
 
   for (SIZE_T i=0;i<numblock;i++) { 
     Block b(blocksize);
@@ -457,6 +477,8 @@ ERROR_T DiskSystem::Write(const SIZE_T   inoffblock,
   }
 
   reqtime=ModelAccess(inoffblock,numblock);
+  stats.numwrites++;
+  stats.numblockswritten+=numblock;
 
   for (SIZE_T i=0;i<numblock;i++) { 
     if (!IsBlockAllocated(inoffblock+i)) { 
@@ -505,6 +527,16 @@ ERROR_T DiskSystem::Write(const SIZE_T inoffblock, const Block &blocks, double &
 }
 
 
+ERROR_T DiskSystem::Sync()
+{
+  if (fflush(datafilefd) || fsync(fileno(datafilefd))) { 
+    cerr << "DiskSystem::Sync: can't sync data file"<<endl;
+    return ERROR_IMPLBUG;
+  }
+  return ERROR_NOERROR;
+}
+
+
 SIZE_T DiskSystem::GetBlockSize() const
 {
   return blocksize;
@@ -569,6 +601,146 @@ ERROR_T DiskSystem::NotifyDeallocateBlocks(const SIZE_T offset,const SIZE_T innu
 }
 
 
+// A missing or unreadable file just means nothing has been counted
+ERROR_T DiskSystem::ReadStats()
+{
+  ifstream in((diskfilestem+".stats").c_str());
+  string header;
+
+  laststats.Reset();
+  if (!in) { 
+    return ERROR_NOFILE;
+  }
+  if (!getline(in,header) || header!=DISKSYSTEM_STATS_HEADER || laststats.Load(in)!=ERROR_NOERROR) { 
+    cerr << "DiskSystem: ignoring unreadable "<<diskfilestem<<".stats"<<endl;
+    laststats.Reset();
+    return ERROR_INSANE;
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T DiskSystem::WriteStats()
+{
+  ofstream out((diskfilestem+".stats").c_str());
+  DiskAccessStats total=GetTotalAccessStats();
+
+  out << DISKSYSTEM_STATS_HEADER << "\n";
+  total.Save(out);
+  if (!out) { 
+    cerr << "Can't write stats file\n";
+    return ERROR_IMPLBUG;
+  }
+  return ERROR_NOERROR;
+}
+
+
+DiskAccessStats DiskSystem::GetTotalAccessStats() const
+{
+  DiskAccessStats total=laststats;
+  total.Add(stats);
+  return total;
+}
+
+
+void DiskSystem::ResetAccessStats()
+{
+  stats.Reset();
+  laststats.Reset();
+  resetstats=true;
+}
+
+
+DiskAccessStats::DiskAccessStats()
+{
+  Reset();
+}
+
+
+void DiskAccessStats::Add(const DiskAccessStats &rhs)
+{
+  numreads+=rhs.numreads;
+  numwrites+=rhs.numwrites;
+  numblocksread+=rhs.numblocksread;
+  numblockswritten+=rhs.numblockswritten;
+  timeinseek+=rhs.timeinseek;
+  timeinrotation+=rhs.timeinrotation;
+  timeintrackhops+=rhs.timeintrackhops;
+  timeintransfer+=rhs.timeintransfer;
+  requestsize.Add(rhs.requestsize);
+  seekdistance.Add(rhs.seekdistance);
+}
+
+
+void DiskAccessStats::Reset()
+{
+  numreads=numwrites=0;
+  numblocksread=numblockswritten=0;
+  timeinseek=timeinrotation=timeintrackhops=timeintransfer=0;
+  requestsize.Reset();
+  seekdistance.Reset();
+}
+
+
+double DiskAccessStats::GetTotalTime() const
+{
+  return timeinseek+timeinrotation+timeintrackhops+timeintransfer;
+}
+
+
+ostream & DiskAccessStats::Save(ostream &os) const
+{
+  os.precision(17);
+  os << numreads<<" "<<numwrites<<" "<<numblocksread<<" "<<numblockswritten<<"\n";
+  os << timeinseek<<" "<<timeinrotation<<" "<<timeintrackhops<<" "<<timeintransfer<<"\n";
+  requestsize.Save(os);
+  seekdistance.Save(os);
+  return os;
+}
+
+
+ERROR_T DiskAccessStats::Load(istream &is)
+{
+  Reset();
+  if (!(is >> numreads >> numwrites >> numblocksread >> numblockswritten
+	>> timeinseek >> timeinrotation >> timeintrackhops >> timeintransfer) ||
+      requestsize.Load(is)!=ERROR_NOERROR ||
+      seekdistance.Load(is)!=ERROR_NOERROR) { 
+    Reset();
+    return ERROR_INSANE;
+  }
+  return ERROR_NOERROR;
+}
+
+
+ostream & DiskAccessStats::Print(ostream &os) const
+{
+  double total=GetTotalTime();
+  HISTOGRAM_T requests=requestsize.GetCount();
+#define SHARE(t) (total>0 ? 100*(t)/total : 0)<<"%)"
+
+  os << "numreads        = "<<numreads<<endl;
+  os << "numwrites       = "<<numwrites<<endl;
+  os << "blocksread      = "<<numblocksread<<endl;
+  os << "blockswritten   = "<<numblockswritten<<endl;
+  os << "timeinseek      = "<<timeinseek<<" ("<<SHARE(timeinseek)<<endl;
+  os << "timeinrotation  = "<<timeinrotation<<" ("<<SHARE(timeinrotation)<<endl;
+  os << "timeintrackhops = "<<timeintrackhops<<" ("<<SHARE(timeintrackhops)<<endl;
+  os << "timeintransfer  = "<<timeintransfer<<" ("<<SHARE(timeintransfer)<<endl;
+  os << "reqblocks mean  = "<<requestsize.GetMean()<<endl;
+  os << "reqblocks p50   = "<<requestsize.GetPercentile(50)<<endl;
+  os << "reqblocks p99   = "<<requestsize.GetPercentile(99)<<endl;
+  os << "reqblocks max   = "<<requestsize.GetMax()<<endl;
+  os << "seektracks mean = "<<seekdistance.GetMean()<<endl;
+  os << "seektracks p50  = "<<seekdistance.GetPercentile(50)<<endl;
+  os << "seektracks p99  = "<<seekdistance.GetPercentile(99)<<endl;
+  os << "seektracks max  = "<<seekdistance.GetMax()<<endl;
+  os << "noseek          = "<<(requests ? 100.0*seekdistance.GetCountAtOrBelow(0)/requests : 0)<<"%"<<endl;
+#undef SHARE
+  return os;
+}
+
+
 ostream & DiskSystem::Print(ostream &os) const
 {
   os << "DiskSystem(diskfilestem="<<diskfilestem
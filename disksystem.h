@@ -7,9 +7,38 @@
 
 #include "global.h"
 #include "block.h"
+#include "histogram.h"
 
 using namespace std;
 
+//
+// What a disk's requests have cost, split up the way ModelAccess()
+// models them, with times in ms.  Seeking and waiting for the first
+// block to come around are the price of where a request is; the track
+// to track hops and the transfer are the price of how much it moves.
+//
+struct DiskAccessStats {
+  SIZE_T      numreads, numwrites;            // requests
+  HISTOGRAM_T numblocksread, numblockswritten;
+  double      timeinseek;
+  double      timeinrotation;
+  double      timeintrackhops;
+  double      timeintransfer;
+  Histogram   requestsize;                    // blocks per request
+  Histogram   seekdistance;                   // tracks moved to start one
+
+  DiskAccessStats();
+
+  void    Add(const DiskAccessStats &rhs);
+  void    Reset();
+  double  GetTotalTime() const;
+
+  ostream & Save(ostream &os) const;
+  ERROR_T   Load(istream &is);
+  // One "name = value" line each
+  ostream & Print(ostream &os) const;
+};
+
 // Models a single disk with a single outstanding request
 //
 // Includes storage allocator and free space bitmap to 
@@ -41,6 +70,10 @@ class DiskSystem {
   double trackseeklatency;
   double rotationallatency;
 
+  DiskAccessStats stats;       // since the disk was opened
+  DiskAccessStats laststats;   // in filestem.stats when it was opened
+  bool            resetstats;
+
  protected:
   virtual double ModelAccess(const SIZE_T off, const SIZE_T num);
 
@@ -51,6 +84,8 @@ class DiskSystem {
   ERROR_T WriteConfig();
   ERROR_T ReadBitMap();
   ERROR_T WriteBitMap();
+  ERROR_T ReadStats();
+  ERROR_T WriteStats();
   
    
  public:
@@ -94,6 +129,9 @@ class DiskSystem {
 		const Block &blocks,
 		double &reqtime);
 
+  // Forces all written blocks to stable storage
+  ERROR_T Sync();
+
   SIZE_T GetBlockSize() const;
   SIZE_T GetNumBlocks() const;
 
@@ -109,6 +147,17 @@ class DiskSystem {
 
   bool    IsBlockAllocated(const SIZE_T offset);
 
+  //
+  // Access statistics.  Those of every run that shuts the disk down
+  // cleanly are added up in filestem.stats, as the bitmap is saved.
+  //
+  // Since the disk was opened
+  const DiskAccessStats & GetAccessStats() const { return stats; }
+  // Of all runs so far, this one included
+  DiskAccessStats GetTotalAccessStats() const;
+  // Forget all of them, in filestem.stats too once the disk is closed
+  void    ResetAccessStats();
+
 
   ostream & Print(ostream &os) const;
 };
@@ -0,0 +1,320 @@
+#include <string.h>
+
+#include "freespace.h"
+#include "btree_ds.h"
+
+
+FreeSpaceMap::FreeSpaceMap(BufferCache *c) :
+  cache(c),
+  firstblock(0),
+  numblocks(c->GetNumBlocks()),
+  bitsperblock(0),
+  numformatted(0),
+  numfree(0),
+  cursor(0)
+{
+  NodeMetadata m;
+  m.nodetype=BTREE_FREESPACE_BLOCK;
+  m.blocksize=c->GetBlockSize();
+  bitsperblock=m.GetNumDataBytes()*8;
+  pthread_mutex_init(&lock,0);
+}
+
+
+FreeSpaceMap::~FreeSpaceMap()
+{
+  pthread_mutex_destroy(&lock);
+}
+
+
+SIZE_T FreeSpaceMap::GetNumBitmapBlocks(const SIZE_T blocksize, const SIZE_T numblocks)
+{
+  NodeMetadata m;
+  m.nodetype=BTREE_FREESPACE_BLOCK;
+  m.blocksize=blocksize;
+  SIZE_T bits=m.GetNumDataBytes()*8;
+  return numblocks/bits + (numblocks%bits != 0);
+}
+
+
+SIZE_T FreeSpaceMap::GetNumBitmapBlocks() const
+{
+  return numblocks/bitsperblock + (numblocks%bitsperblock != 0);
+}
+
+
+bool FreeSpaceMap::IsInUse(const SIZE_T block) const
+{
+  return (inuse[block/8] >> (block%8)) & 0x1;
+}
+
+
+void FreeSpaceMap::SetBit(vector<BYTE_T> &bits, const SIZE_T block, const bool val)
+{
+  if (val) {
+    bits[block/8] |= 0x1 << (block%8);
+  } else {
+    bits[block/8] &= ~(0x1 << (block%8));
+  }
+}
+
+
+// Starts ondisk as a bitmap with nothing allocated but the blocks
+// that can never be: the bitmap's own and those past the end of the
+// device
+void FreeSpaceMap::SetFixedBits(const SIZE_T first)
+{
+  SIZE_T n=GetNumBitmapBlocks();
+
+  firstblock=first;
+  ondisk.assign(n*bitsperblock/8,0);
+  for (SIZE_T i=numblocks;i<n*bitsperblock;i++) {
+    SetBit(ondisk,i,true);
+  }
+  for (SIZE_T i=first;i<first+n;i++) {
+    SetBit(ondisk,i,true);
+  }
+}
+
+
+// Called with the lock held
+ERROR_T FreeSpaceMap::WriteBitmapBlock(const SIZE_T i)
+{
+  BTreeNode b(BTREE_FREESPACE_BLOCK,0,0,cache->GetBlockSize());
+  SIZE_T bytes=bitsperblock/8;
+  ERROR_T rc;
+
+  if (i>=numformatted) {
+    // moving the high-water mark: the blocks in between get written
+    // too, and the first block records the new count
+    SIZE_T old=numformatted;
+    numformatted=i+1;
+    for (SIZE_T j=old;j<i;j++) {
+      if ((rc=WriteBitmapBlock(j))) {
+	return rc;
+      }
+    }
+    if (old>0 && (rc=WriteBitmapBlock(0))) {
+      return rc;
+    }
+  }
+
+  if (i==0) {
+    b.info.numkeys=numformatted;
+  }
+  memcpy(b.data,&ondisk[i*bytes],bytes);
+  return b.Serialize(cache,firstblock+i);
+}
+
+
+// Called with the lock held
+ERROR_T FreeSpaceMap::Mark(const SIZE_T block, const bool disk, const bool mem)
+{
+  bool wasdisk=(ondisk[block/8] >> (block%8)) & 0x1;
+
+  if (IsInUse(block) && !mem) {
+    numfree++;
+  } else if (!IsInUse(block) && mem) {
+    numfree--;
+  }
+  SetBit(inuse,block,mem);
+  SetBit(ondisk,block,disk);
+  if (wasdisk!=disk) {
+    return WriteBitmapBlock(block/bitsperblock);
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T FreeSpaceMap::Format(const SIZE_T first)
+{
+  ERROR_T rc;
+  SIZE_T n=GetNumBitmapBlocks();
+
+  pthread_mutex_lock(&lock);
+
+  SetFixedBits(first);
+  inuse=ondisk;
+  numfree=numblocks-n;
+  cursor=first+n;
+  numformatted=0;
+
+  rc=WriteBitmapBlock(0);
+
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+
+ERROR_T FreeSpaceMap::Load(const SIZE_T first)
+{
+  ERROR_T rc;
+  SIZE_T n=GetNumBitmapBlocks();
+  SIZE_T bytes=bitsperblock/8;
+
+  pthread_mutex_lock(&lock);
+
+  SetFixedBits(first);
+  numformatted=1;
+  for (SIZE_T i=0;i<numformatted;i++) {
+    BTreeNode b;
+    if ((rc=b.Unserialize(cache,first+i))) {
+      pthread_mutex_unlock(&lock);
+      return rc;
+    }
+    if (b.info.nodetype!=BTREE_FREESPACE_BLOCK ||
+	(i==0 && (b.info.numkeys<1 || b.info.numkeys>n))) {
+      pthread_mutex_unlock(&lock);
+      return ERROR_INSANE;
+    }
+    if (i==0) {
+      numformatted=b.info.numkeys;
+    }
+    memcpy(&ondisk[i*bytes],b.data,bytes);
+  }
+  inuse=ondisk;
+  numfree=0;
+  for (SIZE_T i=0;i<numblocks;i++) {
+    if (!IsInUse(i)) {
+      numfree++;
+    }
+  }
+  cursor=first+n;
+
+  pthread_mutex_unlock(&lock);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T FreeSpaceMap::Allocate(const SIZE_T hint, SIZE_T &block)
+{
+  ERROR_T rc;
+  SIZE_T run, d;
+
+  pthread_mutex_lock(&lock);
+
+  if (numfree==0) {
+    pthread_mutex_unlock(&lock);
+    return ERROR_NOSPACE;
+  }
+
+  block=numblocks;
+
+  if (hint>0 && hint<numblocks) {
+    // spread over the free extent that follows the hint
+    for (run=0; run<FREESPACE_EXTENT && hint+1+run<numblocks && !IsInUse(hint+1+run); run++) {
+    }
+    if (run>0) {
+      block=hint+1+run/2;
+    } else {
+      // nearest free block, looking forward first
+      for (d=1; block==numblocks && (hint+d<numblocks || d<=hint); d++) {
+	if (hint+d<numblocks && !IsInUse(hint+d)) {
+	  block=hint+d;
+	} else if (d<=hint && !IsInUse(hint-d)) {
+	  block=hint-d;
+	}
+      }
+    }
+  } else {
+    for (d=0; d<numblocks; d++) {
+      SIZE_T i=(cursor+d)%numblocks;
+      if (!IsInUse(i)) {
+	block=i;
+	break;
+      }
+    }
+    cursor=block+1;
+  }
+
+  if (block==numblocks) {
+    pthread_mutex_unlock(&lock);
+    return ERROR_NOSPACE;
+  }
+
+  rc=Mark(block,true,true);
+
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+
+ERROR_T FreeSpaceMap::MarkAllocated(const SIZE_T block)
+{
+  if (block>=numblocks) {
+    return ERROR_NOSUCHBLOCK;
+  }
+  pthread_mutex_lock(&lock);
+  ERROR_T rc=Mark(block,true,true);
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+
+ERROR_T FreeSpaceMap::Free(const SIZE_T block)
+{
+  if (block>=numblocks) {
+    return ERROR_NOSUCHBLOCK;
+  }
+  pthread_mutex_lock(&lock);
+  ERROR_T rc=Mark(block,false,false);
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+
+ERROR_T FreeSpaceMap::Retire(const SIZE_T block)
+{
+  if (block>=numblocks) {
+    return ERROR_NOSUCHBLOCK;
+  }
+  pthread_mutex_lock(&lock);
+  ERROR_T rc=Mark(block,false,true);
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+
+ERROR_T FreeSpaceMap::Release(const SIZE_T block)
+{
+  if (block>=numblocks) {
+    return ERROR_NOSUCHBLOCK;
+  }
+  pthread_mutex_lock(&lock);
+  bool disk=(ondisk[block/8] >> (block%8)) & 0x1;
+  ERROR_T rc=Mark(block,disk,disk);
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+
+bool FreeSpaceMap::IsAllocated(const SIZE_T block) const
+{
+  pthread_mutex_lock(&lock);
+  bool a=block<numblocks && IsInUse(block);
+  pthread_mutex_unlock(&lock);
+  return a;
+}
+
+
+SIZE_T FreeSpaceMap::GetNumFree() const
+{
+  pthread_mutex_lock(&lock);
+  SIZE_T n=numfree;
+  pthread_mutex_unlock(&lock);
+  return n;
+}
+
+
+ostream & FreeSpaceMap::Print(ostream &os) const
+{
+  pthread_mutex_lock(&lock);
+  os << "FreeSpaceMap(firstblock="<<firstblock
+     << ", numbitmapblocks="<<GetNumBitmapBlocks()
+     << ", numformattedblocks="<<numformatted
+     << ", numblocks="<<numblocks
+     << ", numfree="<<numfree
+     << ")";
+  pthread_mutex_unlock(&lock);
+  return os;
+}
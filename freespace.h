@@ -0,0 +1,94 @@
+#ifndef _freespace
+#define _freespace
+
+#include <iostream>
+#include <vector>
+#include <pthread.h>
+
+#include "global.h"
+#include "buffercache.h"
+
+using namespace std;
+
+// Number of free blocks after the hint that an allocation will spread
+// new nodes over, see Allocate()
+#define FREESPACE_EXTENT 256
+
+//
+// Free space bitmap for the index
+//
+// One bit per block, kept in memory and persisted in a run of
+// BTREE_FREESPACE_BLOCK blocks that are written through the buffer
+// cache (and so through the write-ahead log, if there is one).
+//
+// Allocation takes a hint, normally the node the new one will sit
+// next to in key order.  If there are free blocks right after the
+// hint, the new block goes in the middle of them, so that later
+// neighbours still find room between the two and leaves stay
+// roughly in key order on disk.  Otherwise the free block nearest
+// the hint is used.
+//
+// Only the bitmap blocks that cover something ever allocated are
+// written.  The first bitmap block records how many that is; the rest
+// describe blocks past this high-water mark, which are all free, so
+// creating an index costs the same on any size of disk.
+//
+// A block can also be retired: it is free as far as the bitmap on
+// disk is concerned, but is not handed out again until Release().
+// Copy-on-write uses this to keep old versions intact while readers
+// may still be looking at them, without leaking them across a crash.
+//
+class FreeSpaceMap {
+ private:
+  BufferCache *cache;
+  SIZE_T firstblock;
+  SIZE_T numblocks;
+  SIZE_T bitsperblock;
+  SIZE_T numformatted;    // bitmap blocks written so far
+  vector<BYTE_T> ondisk;  // contents of the bitmap blocks
+  vector<BYTE_T> inuse;   // ondisk plus retired blocks
+  SIZE_T numfree;
+  SIZE_T cursor;          // where unhinted allocations start looking
+  mutable pthread_mutex_t lock;
+
+  void    SetFixedBits(const SIZE_T first);
+  ERROR_T WriteBitmapBlock(const SIZE_T block);
+  bool    IsInUse(const SIZE_T block) const;
+  void    SetBit(vector<BYTE_T> &bits, const SIZE_T block, const bool val);
+  ERROR_T Mark(const SIZE_T block, const bool disk, const bool mem);
+
+ public:
+  FreeSpaceMap(BufferCache *cache);
+  FreeSpaceMap() { throw GenericException(); }
+  FreeSpaceMap(const FreeSpaceMap &rhs) { throw GenericException(); }
+  FreeSpaceMap & operator=(const FreeSpaceMap &rhs) { throw GenericException(); return *this; }
+  virtual ~FreeSpaceMap();
+
+  // Number of bitmap blocks needed for the cache's device
+  static SIZE_T GetNumBitmapBlocks(const SIZE_T blocksize, const SIZE_T numblocks);
+
+  // Starts an empty bitmap at firstblock.  The bitmap's own blocks are
+  // marked allocated, and only the first of them is written.
+  ERROR_T Format(const SIZE_T firstblock);
+  // Reads the bitmap starting at firstblock
+  ERROR_T Load(const SIZE_T firstblock);
+
+  // Allocates a block near hint (0 for no preference)
+  ERROR_T Allocate(const SIZE_T hint, SIZE_T &block);
+  // Marks a specific block allocated, for fixed structures
+  ERROR_T MarkAllocated(const SIZE_T block);
+  ERROR_T Free(const SIZE_T block);
+  ERROR_T Retire(const SIZE_T block);
+  ERROR_T Release(const SIZE_T block);
+
+  bool    IsAllocated(const SIZE_T block) const;
+  SIZE_T  GetFirstBlock() const { return firstblock; }
+  SIZE_T  GetNumBitmapBlocks() const;
+  SIZE_T  GetNumFree() const;
+
+  ostream & Print(ostream &os) const;
+};
+
+inline ostream & operator<< (ostream &os, const FreeSpaceMap &rhs) { return rhs.Print(os);}
+
+#endif
@@ -1,8 +1,23 @@
 #!/usr/bin/perl -w
 
-$#ARGV==3 or die "usage: gen_test_sequence.pl keysize valsize seed num\n";
-
-($keysize,$valuesize,$seed,$num)=@ARGV;
+$#ARGV>=3 && $#ARGV<=5 or die "usage: gen_test_sequence.pl keysize valsize seed num [zipf] [COUNTED|NONUNIQUE]\n";
+
+# With zipf, existing keys are picked with Zipfian skew of that
+# exponent (1 is typical), the earliest inserted being the hottest.
+# Otherwise they are picked uniformly.  COUNTED makes a COUNTED index
+# and mixes in COUNT and SELECT.  NONUNIQUE makes a non-unique index,
+# to which inserting an existing key adds a value, and mixes in
+# LOOKUPALL.
+($keysize,$valuesize,$seed,$num,@rest)=@ARGV;
+foreach (@rest) { 
+  if ($_ eq "COUNTED") { 
+    $counted=1;
+  } elsif ($_ eq "NONUNIQUE") { 
+    $nonunique=1;
+  } else {
+    $zipf=$_;
+  }
+}
 
 srand $seed;
 
@@ -23,12 +38,23 @@ $valuebytes="abcdefghijklmnopqrstuvwxyz0123456789";
 	 DISPLAY => \&gen_display
        );
 
+if ($counted) { 
+  $ops{COUNT}=\&gen_count;
+  $ops{SELECT_NEW}=\&gen_select_new;
+  $ops{SELECT_EXISTS}=\&gen_select_exists;
+}
+if ($nonunique) { 
+  $ops{LOOKUPALL_NEW}=\&gen_lookupall_new;
+  $ops{LOOKUPALL_EXISTS}=\&gen_lookupall_exists;
+}
+
 @opnames=keys %ops;
 
 
 %content= ();
+@inserted= ();
 
-print "INIT $keysize $valuesize\n";
+print "INIT $keysize $valuesize".($counted ? " COUNTED" : "").($nonunique ? " NONUNIQUE" : "")."\n";
 
 for ($i=1;$i<$num;$i++) { 
   # never try to do an existing key if no keys currently exist
@@ -55,10 +81,27 @@ sub MakeNonExistentKey {
 }
 
 sub MakeExistentKey {
+  if (defined $zipf) {
+    my $key;
+    do {
+      $key=$inserted[ZipfRank($#inserted+1,$zipf)];
+    } while (!defined $content{$key});
+    return $key;
+  }
   my @keys=keys %content;
   return $keys[int(rand($#keys+1))];
 }
 
+# 0 to n-1, k with probability roughly proportional to 1/(k+1)^s:
+# inverts the continuous power law on [1,n+1)
+sub ZipfRank {
+  my ($n,$s)=@_;
+  my $u=rand();
+  my $x= $s==1 ? exp($u*log($n+1)) : ((($n+1)**(1-$s)-1)*$u+1)**(1/(1-$s));
+  my $k=int($x)-1;
+  return $k<$n ? $k : $n-1;
+}
+
 sub MakeValue {
   return join("", map { substr($valuebytes,int(rand(length($valuebytes))),1) } (1..$valuesize));
 }
@@ -67,10 +110,15 @@ sub MakeValue {
 sub gen_insert_new {
   my ($key, $value) = (MakeNonExistentKey(), MakeValue());
   $content{$key}=$value;
+  push @inserted, $key;
   return "INSERT $key $value  # should succeed";
 }
 
 sub gen_insert_exists {
+  if ($nonunique) { 
+    my ($key, $value) = (MakeExistentKey(), MakeValue());
+    return "INSERT $key $value  # should succeed, adding to the values of $key";
+  }
   return "INSERT ".MakeExistentKey()." ".MakeValue()."  # should fail";
 }
 
@@ -80,6 +128,9 @@ sub gen_update_new {
 
 sub gen_update_exists {
   my ($key, $value) = (MakeExistentKey(), MakeValue());
+  if ($nonunique) { 
+    return "UPDATE $key $value  # should fail";
+  }
   $content{$key}=$value;
   return "UPDATE $key $value  # should succeed";
 }
@@ -103,6 +154,29 @@ sub gen_lookup_exists {
   return "LOOKUP $key  # should succeed and return $content{$key}";
 }
 
+sub gen_count {
+  my ($lo, $hi) = sort (MakeKey(), MakeKey());
+  return "COUNT $lo $hi  # should succeed";
+}
+
+sub gen_select_new {
+  my $numkeys=keys %content;
+  return "SELECT ".($numkeys+int(rand(3)))."  # should fail";
+}
+
+sub gen_select_exists {
+  my $numkeys=keys %content;
+  return "SELECT ".int(rand($numkeys))."  # should succeed";
+}
+
+sub gen_lookupall_new {
+  return "LOOKUPALL ".MakeNonExistentKey()."  # should fail";
+}
+
+sub gen_lookupall_exists {
+  return "LOOKUPALL ".MakeExistentKey()."  # should succeed";
+}
+
 sub gen_display {
   return "DISPLAY  # should always succeed";
 }
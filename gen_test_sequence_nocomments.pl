@@ -1,8 +1,11 @@
 #!/usr/bin/perl -w
 
-$#ARGV==3 or die "usage: gen_test_sequence.pl keysize valsize seed num\n";
+$#ARGV==3 or $#ARGV==4 or die "usage: gen_test_sequence.pl keysize valsize seed num [zipf]\n";
 
-($keysize,$valuesize,$seed,$num)=@ARGV;
+# With zipf, existing keys are picked with Zipfian skew of that
+# exponent (1 is typical), the earliest inserted being the hottest.
+# Otherwise they are picked uniformly.
+($keysize,$valuesize,$seed,$num,$zipf)=@ARGV;
 
 srand $seed;
 
@@ -26,6 +29,7 @@ $valuebytes="abcdefghijklmnopqrstuvwxyz0123456789";
 
 
 %content= ();
+@inserted= ();
 
 print "INIT $keysize $valuesize\n";
 
@@ -54,10 +58,27 @@ sub MakeNonExistentKey {
 }
 
 sub MakeExistentKey {
+  if (defined $zipf) {
+    my $key;
+    do {
+      $key=$inserted[ZipfRank($#inserted+1,$zipf)];
+    } while (!defined $content{$key});
+    return $key;
+  }
   my @keys=keys %content;
   return $keys[int(rand($#keys+1))];
 }
 
+# 0 to n-1, k with probability roughly proportional to 1/(k+1)^s:
+# inverts the continuous power law on [1,n+1)
+sub ZipfRank {
+  my ($n,$s)=@_;
+  my $u=rand();
+  my $x= $s==1 ? exp($u*log($n+1)) : ((($n+1)**(1-$s)-1)*$u+1)**(1/(1-$s));
+  my $k=int($x)-1;
+  return $k<$n ? $k : $n-1;
+}
+
 sub MakeValue {
   return join("", map { substr($valuebytes,int(rand(length($valuebytes))),1) } (1..$valuesize));
 }
@@ -66,6 +87,7 @@ sub MakeValue {
 sub gen_insert_new {
   my ($key, $value) = (MakeNonExistentKey(), MakeValue());
   $content{$key}=$value;
+  push @inserted, $key;
   return "INSERT $key $value";
 }
 
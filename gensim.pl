@@ -1,13 +1,25 @@
 #!/usr/bin/perl -w
 
-$#ARGV==2 or die "usage: gensim.pl seed maxkey numrecords > simrequests\n";
+$#ARGV==2 or $#ARGV==3 or die "usage: gensim.pl seed maxkey numrecords [zipf] > simrequests\n";
 
 $seed=shift;
 $maxkey=shift;
 $num=shift;
+# With zipf, keys are drawn with Zipfian skew of that exponent (1 is
+# typical) instead of uniformly.  The hot keys are spread over the key
+# space rather than all being small numbers.
+$zipf=shift;
 
 srand($seed);
 
+if (defined $zipf) {
+  @bykeyrank=(0..$maxkey-1);
+  for ($i=$maxkey-1;$i>0;$i--) {
+    $j=int(rand($i+1));
+    @bykeyrank[$i,$j]=@bykeyrank[$j,$i];
+  }
+}
+
 for ($i=0;$i<$num;$i++) {
   print join(" ",GenRandomRequest($maxkey)), "\n";
 }
@@ -19,28 +31,28 @@ sub GenRandomRequest() {
 
   if ($r==0) {
     $type="INSERT";
-    $key=int(rand($maxkey));
+    $key=RandomKey($maxkey);
     $value=int(rand($maxkey));
     return ($type, $key,$value);
   }
 
   if ($r==1) {
     $type="DELETE";
-    $key=int(rand($maxkey));
+    $key=RandomKey($maxkey);
     $value=0;
     return ($type,$key);
   }
 
   if ($r==2) {
     $type="UPDATE";
-    $key=int(rand($maxkey));
+    $key=RandomKey($maxkey);
     $value=int(rand($maxkey));
     return ($type,$key,$value);
   }
 
   if ($r==3) { 
     $type="LOOKUP";
-    $key=int(rand($maxkey));
+    $key=RandomKey($maxkey);
     return ($type, $key);
   }
 }
@@ -48,3 +60,13 @@ sub GenRandomRequest() {
 
 	  
     
+
+sub RandomKey {
+  my $maxkey=shift;
+  return int(rand($maxkey)) if !defined $zipf;
+  # inverts the continuous power law on [1,maxkey+1)
+  my $u=rand();
+  my $x= $zipf==1 ? exp($u*log($maxkey+1)) : ((($maxkey+1)**(1-$zipf)-1)*$u+1)**(1/(1-$zipf));
+  my $k=int($x)-1;
+  return $bykeyrank[$k<$maxkey ? $k : $maxkey-1];
+}
@@ -5,6 +5,7 @@
 typedef unsigned char BYTE_T;
 typedef unsigned int SIZE_T;
 typedef int ERROR_T;
+typedef unsigned long long LSN_T;  // byte position in the write-ahead log
 
 
 // Shared by all
@@ -24,6 +25,7 @@ const ERROR_T ERROR_BADCONFIG=-12;
 const ERROR_T ERROR_NOFILE=-13;
 const ERROR_T ERROR_UNIMPL=-14;
 const ERROR_T ERROR_INSANE=-15;
+const ERROR_T ERROR_RESTART=-16;
 
 struct GenericException {};
 
@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+
+#include "histogram.h"
+
+
+Histogram::Histogram() : counts(HISTOGRAM_NUM_BUCKETS,0)
+{
+  Reset();
+}
+
+
+Histogram::~Histogram()
+{
+}
+
+
+SIZE_T Histogram::GetBucket(const HISTOGRAM_T value)
+{
+  if (value<HISTOGRAM_SUB_BUCKETS) {
+    return value;
+  }
+  // value>>shift lands in the upper half of the sub-buckets
+  SIZE_T shift=63-__builtin_clzll(value)-(HISTOGRAM_SUB_BUCKET_BITS-1);
+  return shift*HISTOGRAM_HALF_BUCKETS+(value>>shift);
+}
+
+
+HISTOGRAM_T Histogram::GetLowest(const SIZE_T bucket)
+{
+  if (bucket<HISTOGRAM_SUB_BUCKETS) {
+    return bucket;
+  }
+  SIZE_T shift=bucket/HISTOGRAM_HALF_BUCKETS-1;
+  return (HISTOGRAM_T)(bucket-shift*HISTOGRAM_HALF_BUCKETS)<<shift;
+}
+
+
+HISTOGRAM_T Histogram::GetHighest(const SIZE_T bucket)
+{
+  if (bucket<HISTOGRAM_SUB_BUCKETS) {
+    return bucket;
+  }
+  SIZE_T shift=bucket/HISTOGRAM_HALF_BUCKETS-1;
+  return GetLowest(bucket)+(((HISTOGRAM_T)1<<shift)-1);
+}
+
+
+void Histogram::Record(const HISTOGRAM_T value)
+{
+  counts[GetBucket(value)]++;
+  if (total==0 || value<min) {
+    min=value;
+  }
+  if (value>max) {
+    max=value;
+  }
+  total++;
+  sum+=value;
+  sumsquares+=(double)value*value;
+}
+
+
+void Histogram::Add(const Histogram &rhs)
+{
+  if (rhs.total==0) {
+    return;
+  }
+  for (SIZE_T i=0;i<HISTOGRAM_NUM_BUCKETS;i++) {
+    counts[i]+=rhs.counts[i];
+  }
+  if (total==0 || rhs.min<min) {
+    min=rhs.min;
+  }
+  if (rhs.max>max) {
+    max=rhs.max;
+  }
+  total+=rhs.total;
+  sum+=rhs.sum;
+  sumsquares+=rhs.sumsquares;
+}
+
+
+void Histogram::Reset()
+{
+  fill(counts.begin(),counts.end(),0);
+  total=min=max=0;
+  sum=sumsquares=0;
+}
+
+
+double Histogram::GetMean() const
+{
+  return total ? sum/total : 0;
+}
+
+
+double Histogram::GetStdDeviation() const
+{
+  if (total==0) {
+    return 0;
+  }
+  double mean=sum/total;
+  double var=sumsquares/total-mean*mean;
+  return var>0 ? sqrt(var) : 0;
+}
+
+
+HISTOGRAM_T Histogram::GetPercentile(const double percent) const
+{
+  HISTOGRAM_T target, seen=0;
+
+  if (total==0) {
+    return 0;
+  }
+  target=(HISTOGRAM_T)ceil(percent/100*total);
+  if (target<1) {
+    target=1;
+  }
+  if (target>total) {
+    target=total;
+  }
+  for (SIZE_T i=0;i<HISTOGRAM_NUM_BUCKETS;i++) {
+    seen+=counts[i];
+    if (seen>=target) {
+      HISTOGRAM_T v=GetHighest(i);
+      return v<max ? v : max;
+    }
+  }
+  return max;
+}
+
+
+ostream & Histogram::PrintPercentiles(ostream &o, const double scale, const SIZE_T ticks) const
+{
+  char line[128];
+  double percent=0;
+  HISTOGRAM_T seen=0;
+  SIZE_T bucket=0;
+
+  o << "       Value     Percentile TotalCount 1/(1-Percentile)\n\n";
+
+  while (total>0) {
+    HISTOGRAM_T target=(HISTOGRAM_T)ceil(percent/100*total);
+    if (target<1) {
+      target=1;
+    }
+    while (seen<target) {
+      seen+=counts[bucket++];
+    }
+    HISTOGRAM_T v=GetHighest(bucket-1);
+    if (seen==total) {
+      break;
+    }
+    snprintf(line,sizeof(line),"%12.3f %14.12f %10llu %14.2f\n",
+	     (v<max ? v : max)/scale,percent/100,seen,1/(1-percent/100));
+    o << line;
+    // the steps shrink by half each time the distance to 100% does
+    double halvings=floor(log2(100/(100-percent)))+1;
+    percent+=100/(ticks*pow(2,halvings));
+  }
+
+  snprintf(line,sizeof(line),"%12.3f %14.12f %10llu\n",max/scale,1.0,total);
+  o << line;
+  snprintf(line,sizeof(line),"#[Mean    = %12.3f, StdDeviation   = %12.3f]\n",
+	   GetMean()/scale,GetStdDeviation()/scale);
+  o << line;
+  snprintf(line,sizeof(line),"#[Max     = %12.3f, Total count    = %12llu]\n",max/scale,total);
+  o << line;
+  snprintf(line,sizeof(line),"#[Buckets = %12d, SubBuckets     = %12d]\n",
+	   HISTOGRAM_NUM_BUCKETS/HISTOGRAM_HALF_BUCKETS-1,HISTOGRAM_SUB_BUCKETS);
+  o << line;
+  return o;
+}
+
+
+HISTOGRAM_T Histogram::GetCountAtOrBelow(const HISTOGRAM_T value) const
+{
+  HISTOGRAM_T seen=0;
+  SIZE_T last=GetBucket(value);
+
+  for (SIZE_T i=0;i<=last;i++) {
+    seen+=counts[i];
+  }
+  return seen;
+}
+
+
+ostream & Histogram::Save(ostream &o) const
+{
+  SIZE_T used=0;
+
+  for (SIZE_T i=0;i<HISTOGRAM_NUM_BUCKETS;i++) {
+    used+=(counts[i]>0);
+  }
+  o.precision(17);
+  o << total<<" "<<min<<" "<<max<<" "<<sum<<" "<<sumsquares<<" "<<used<<"\n";
+  for (SIZE_T i=0;i<HISTOGRAM_NUM_BUCKETS;i++) {
+    if (counts[i]) {
+      o << i<<" "<<counts[i]<<"\n";
+    }
+  }
+  return o;
+}
+
+
+ERROR_T Histogram::Load(istream &in)
+{
+  SIZE_T used, bucket;
+  HISTOGRAM_T count;
+
+  Reset();
+  if (!(in >> total >> min >> max >> sum >> sumsquares >> used)) {
+    Reset();
+    return ERROR_INSANE;
+  }
+  for (SIZE_T i=0;i<used;i++) {
+    if (!(in >> bucket >> count) || bucket>=HISTOGRAM_NUM_BUCKETS) {
+      Reset();
+      return ERROR_INSANE;
+    }
+    counts[bucket]=count;
+  }
+  return ERROR_NOERROR;
+}
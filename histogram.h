@@ -0,0 +1,79 @@
+#ifndef _histogram
+#define _histogram
+
+#include <iostream>
+#include <vector>
+
+#include "global.h"
+
+using namespace std;
+
+// Each power of two is split into this many buckets, half of them
+// new, so values are kept to within 1/64, better than two
+// significant digits
+#define HISTOGRAM_SUB_BUCKET_BITS 7
+#define HISTOGRAM_SUB_BUCKETS     (1<<HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_HALF_BUCKETS    (HISTOGRAM_SUB_BUCKETS/2)
+#define HISTOGRAM_NUM_BUCKETS     ((64-HISTOGRAM_SUB_BUCKET_BITS+2)*HISTOGRAM_HALF_BUCKETS)
+
+// Lines per halving of the distance to 100% in PrintPercentiles()
+#define HISTOGRAM_TICKS_PER_HALF  5
+
+typedef unsigned long long HISTOGRAM_T;
+
+//
+// Histogram of non-negative integers, kept as HdrHistogram keeps them
+//
+// Values below HISTOGRAM_SUB_BUCKETS get a bucket each.  Above that,
+// each power of two gets HISTOGRAM_HALF_BUCKETS buckets of equal
+// width, so the whole range of 64 bit values fits in a few thousand
+// counters and recording a value is a shift and an add.  Percentiles
+// are reported as the highest value of their bucket, never more than
+// the largest value recorded.
+//
+// Record time in the smallest unit wanted (ns, us) and scale when
+// printing.  Not thread safe.
+//
+class Histogram {
+ private:
+  vector<HISTOGRAM_T> counts;
+  HISTOGRAM_T total;
+  HISTOGRAM_T min, max;
+  double      sum, sumsquares;
+
+  static SIZE_T      GetBucket(const HISTOGRAM_T value);
+  static HISTOGRAM_T GetLowest(const SIZE_T bucket);
+  static HISTOGRAM_T GetHighest(const SIZE_T bucket);
+
+ public:
+  Histogram();
+  virtual ~Histogram();
+
+  void        Record(const HISTOGRAM_T value);
+  // Adds another histogram's values to this one's
+  void        Add(const Histogram &rhs);
+  void        Reset();
+
+  HISTOGRAM_T GetCount() const { return total; }
+  HISTOGRAM_T GetMin() const { return total ? min : 0; }
+  HISTOGRAM_T GetMax() const { return max; }
+  double      GetMean() const;
+  double      GetStdDeviation() const;
+  // The value that percentile percent (0 to 100) of those recorded
+  // are at or below
+  HISTOGRAM_T GetPercentile(const double percent) const;
+  // How many of the values recorded are at or below value, to within
+  // the width of its bucket
+  HISTOGRAM_T GetCountAtOrBelow(const HISTOGRAM_T value) const;
+
+  // The percentile distribution in HdrHistogram's text format (.hgrm),
+  // with the values divided by scale
+  ostream &   PrintPercentiles(ostream &o, const double scale=1,
+			       const SIZE_T ticks=HISTOGRAM_TICKS_PER_HALF) const;
+
+  // Text form that Load() reads back, the non-empty buckets only
+  ostream &   Save(ostream &o) const;
+  ERROR_T     Load(istream &i);
+};
+
+#endif
@@ -6,22 +6,29 @@
 
 void usage() 
 {
-  cerr << "usage: readdisk filestem\n";
+  cerr << "usage: infodisk filestem [reset]\n";
 }
 
 int main(int argc, char *argv[])
 {
-#if 0
-  if (argc<2) { 
+  if (argc<2 || argc>3 || (argc==3 && string(argv[2])!="reset")) { 
     usage();
     exit(-1);
   }
-#endif
 
   DiskSystem disk(argv[1]);
   
   cerr << "Disk is as follows.\n" << disk << "\n";
 
+  // what every run that closed the disk cleanly has done with it
+  cerr << "Access statistics:\n";
+  disk.GetTotalAccessStats().Print(cerr);
+
+  if (argc==3) { 
+    disk.ResetAccessStats();
+    cerr << "Access statistics reset.\n";
+  }
+
   cerr << "Done.\n";
 
   return 0;
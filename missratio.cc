@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <fstream>
+#include <algorithm>
+
+#include "missratio.h"
+#include "cachetrace.h"
+
+
+MissRatioCurve::MissRatioCurve(const SIZE_T nb, const double rate) :
+  numblocks(nb),
+  samplerate(rate>1 ? 1 : rate),
+  threshold(CacheTrace::GetThreshold(rate)),
+  last(nb,0),
+  tree(MISSRATIO_MIN_TIMES+1,0),
+  now(0),
+  live(0),
+  distances(nb+1,0),
+  numreads(0),
+  numsampled(0),
+  numcold(0)
+{
+}
+
+
+MissRatioCurve::~MissRatioCurve()
+{
+}
+
+
+void MissRatioCurve::Mark(const unsigned long long time, const int delta)
+{
+  for (unsigned long long i=time; i<tree.size(); i+=i&(~i+1)) {
+    tree[i]+=delta;
+  }
+}
+
+
+SIZE_T MissRatioCurve::CountUpTo(const unsigned long long time) const
+{
+  SIZE_T n=0;
+  for (unsigned long long i=time; i>0; i-=i&(~i+1)) {
+    n+=tree[i];
+  }
+  return n;
+}
+
+
+void MissRatioCurve::Compact()
+{
+  vector<pair<unsigned long long, SIZE_T> > bytime;
+
+  for (SIZE_T b=0;b<numblocks;b++) {
+    if (last[b]) {
+      bytime.push_back(make_pair(last[b],b));
+    }
+  }
+  sort(bytime.begin(),bytime.end());
+
+  SIZE_T size=2*bytime.size();
+  if (size<MISSRATIO_MIN_TIMES) {
+    size=MISSRATIO_MIN_TIMES;
+  }
+  tree.assign(size+1,0);
+  for (SIZE_T i=0;i<bytime.size();i++) {
+    last[bytime[i].second]=i+1;
+    Mark(i+1,1);
+  }
+  now=bytime.size();
+}
+
+
+void MissRatioCurve::Access(const SIZE_T block, const bool read)
+{
+  if (block>=numblocks) {
+    return;
+  }
+  numreads+=read;
+  if (CacheTrace::Hash(block)>=threshold) {
+    return;
+  }
+  numsampled+=read;
+
+  if (now+1>=tree.size()) {
+    Compact();
+  }
+
+  unsigned long long previous=last[block];
+  if (previous==0) {
+    numcold+=read;
+    live++;
+  } else {
+    if (read) {
+      // the sampled blocks used since, scaled up to all blocks
+      SIZE_T since=live-CountUpTo(previous);
+      double distance=since/samplerate;
+      distances[distance<numblocks ? (SIZE_T)distance : numblocks]+=1;
+    }
+    Mark(previous,-1);
+  }
+  now++;
+  Mark(now,1);
+  last[block]=now;
+}
+
+
+void MissRatioCurve::GetCurve(vector<double> &hitratios) const
+{
+  double expected=numreads*samplerate;
+  double hits;
+
+  hitratios.assign(numblocks+1,0);
+  if (numsampled==0 || expected<=0) {
+    return;
+  }
+  // SHARDS_adj: the sample's shortfall or excess counts at distance 0
+  hits=expected-numsampled;
+  for (SIZE_T c=1;c<=numblocks;c++) {
+    hits+=distances[c-1];
+    double ratio=hits/expected;
+    hitratios[c]=ratio<0 ? 0 : ratio>1 ? 1 : ratio;
+  }
+}
+
+
+double MissRatioCurve::GetHitRatio(const SIZE_T cachesize) const
+{
+  vector<double> curve;
+
+  GetCurve(curve);
+  return curve[cachesize<numblocks ? cachesize : numblocks];
+}
+
+
+ERROR_T MissRatioCurve::Save(const string &filename) const
+{
+  vector<double> curve;
+  ofstream out(filename.c_str());
+
+  GetCurve(curve);
+  out << "# cachesize hitratio\n";
+  for (SIZE_T c=1;c<=numblocks;c++) {
+    out << c<<" "<<curve[c]<<"\n";
+  }
+  return out ? ERROR_NOERROR : ERROR_GENERAL;
+}
+
+
+ostream & MissRatioCurve::Print(ostream &os, const SIZE_T cachesize) const
+{
+  vector<double> curve;
+  char line[64];
+
+  GetCurve(curve);
+  os << "samplerate      = "<<samplerate<<endl;
+  os << "numreads        = "<<numreads<<endl;
+  os << "sampledreads    = "<<numsampled<<endl;
+  os << "coldreads       = "<<(samplerate>0 ? numcold/samplerate : 0)<<endl;
+  for (SIZE_T c=1; c<=numblocks; c*=2) {
+    if (cachesize>c/2 && cachesize<c) {
+      snprintf(line,sizeof(line),"hitratio %-7u= ",cachesize);
+      os << line<<curve[cachesize]<<" (this cache)"<<endl;
+    }
+    snprintf(line,sizeof(line),"hitratio %-7u= ",c);
+    os << line<<curve[c]<<(c==cachesize ? " (this cache)" : "")<<endl;
+    if (c>numblocks/2 && c<numblocks) {
+      // the whole disk, if it isn't a power of two
+      snprintf(line,sizeof(line),"hitratio %-7u= ",numblocks);
+      os << line<<curve[numblocks]<<endl;
+    }
+  }
+  return os;
+}
@@ -0,0 +1,90 @@
+#ifndef _missratio
+#define _missratio
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "global.h"
+
+using namespace std;
+
+// Timestamps the reuse distance tree starts with room for, and grows
+// to when it is compacted
+#define MISSRATIO_MIN_TIMES (64*1024)
+
+//
+// Miss ratio curve of an LRU cache, estimated online with SHARDS
+// (Waldspurger et al., FAST '15)
+//
+// Only the blocks whose hash falls below samplerate are followed, the
+// same blocks a CacheTrace at that rate samples.  For each access to
+// one of them, the number of other sampled blocks used since its last
+// access is counted in a Fenwick tree over access times, and divided
+// by samplerate it estimates the reuse distance: the smallest LRU
+// cache that would have held on to the block.  Reads after the first
+// add their distance to a histogram, so one pass gives the hit ratio
+// of every cache size at once.  Writes move a block to the front of
+// the LRU order as reads do, but only reads are counted, as the
+// cache's own hit ratio counts them.
+//
+// The sample holds about samplerate of all reads, but not exactly.
+// As in SHARDS_adj, the difference is added to the smallest distance
+// so that the curve is scaled by the expected sample size.
+//
+// Sampling blurs the curve at cache sizes of up to a few times
+// 1/samplerate blocks, where a handful of very hot blocks, like the
+// root, being in the sample or not makes all the difference.
+//
+// Memory is a timestamp per block of the disk and a tree about twice
+// the number of sampled blocks in use.  An access outside the sample
+// costs a hash, and one inside it two walks of the tree.  Not thread
+// safe; BufferCache calls it with its mutex held.
+//
+class MissRatioCurve {
+ private:
+  SIZE_T numblocks;
+  double samplerate;
+  unsigned long long threshold;
+  vector<unsigned long long> last;   // per block, time of its last access, 0 if none
+  vector<SIZE_T> tree;               // Fenwick tree, 1 at each block's last access
+  unsigned long long now;            // time of the last sampled access
+  SIZE_T live;                       // sampled blocks accessed so far
+  vector<double> distances;          // reads by estimated reuse distance, in
+                                     // blocks, the last for numblocks and up
+  unsigned long long numreads;       // all of them
+  unsigned long long numsampled;     // those in the sample
+  unsigned long long numcold;        // sampled first reads
+
+  void   Mark(const unsigned long long time, const int delta);
+  SIZE_T CountUpTo(const unsigned long long time) const;
+  // Renumbers the live timestamps from 1, into a tree with room for
+  // at least as many again
+  void   Compact();
+
+ public:
+  MissRatioCurve(const SIZE_T numblocks, const double samplerate);
+  MissRatioCurve() { throw GenericException(); }
+  MissRatioCurve(const MissRatioCurve &rhs) { throw GenericException(); }
+  MissRatioCurve & operator=(const MissRatioCurve &rhs) { throw GenericException(); return *this; }
+  virtual ~MissRatioCurve();
+
+  void   Access(const SIZE_T block, const bool read);
+
+  double GetSampleRate() const { return samplerate; }
+  unsigned long long GetNumReads() const { return numreads; }
+  unsigned long long GetNumSampled() const { return numsampled; }
+
+  // The predicted read hit ratio of an LRU cache of every size from 0
+  // to numblocks blocks
+  void   GetCurve(vector<double> &hitratios) const;
+  double GetHitRatio(const SIZE_T cachesize) const;
+
+  // "cachesize hitratio" for every size from 1 to numblocks
+  ERROR_T Save(const string &filename) const;
+  // The sizes that are powers of two, and cachesize, one "name = value"
+  // line each
+  ostream & Print(ostream &os, const SIZE_T cachesize=0) const;
+};
+
+#endif
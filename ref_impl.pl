@@ -9,21 +9,36 @@ $debug=substr($ARGV[0],0,1) eq 'd';
 $bugprob=$ARGV[1];
 
 $line=<STDIN>;
-($op, $keysize, $valuesize) = split(/\s+/, $line);
+($op, $keysize, $valuesize, @options) = split(/\s+/, $line);
 
 if (!($op eq "INIT")) { 
   die "First operation is not an init!";
 } else {
-  print STDERR "Initialized with keysize=$keysize and valuesize=$valuesize\n" if $debug;
+  # NONUNIQUE keeps a list of values for each key, in the order they
+  # were inserted
+  $nonunique=grep { $_ eq "NONUNIQUE" } @options;
+  print STDERR "Initialized with keysize=$keysize and valuesize=$valuesize".($nonunique ? " NONUNIQUE" : "")."\n" if $debug;
   print "OK\n";
 }
 
 %content=();
+%lists=();
 
 while ($line=<STDIN>) { 
   $line=~/^(\S+)\s+(.*)$/;
   $op=$1; $rest=$2; 
-  if ($op eq "INSERT") {
+  if ($op eq "INSERT" && $nonunique) {
+    ($key, $value) = split(/\s+/,$rest);
+    if (length($key)<1 || length($key)>$keysize || length($value)!=$valuesize || Bug()) { 
+      print STDERR "Inserting ($key, $value) failed because of its size\n" if $debug;
+      print "FAIL\n";
+    } else {
+      $content{$key}=$value if !defined $content{$key};
+      push @{$lists{$key}}, $value;
+      print STDERR "Inserted ($key, $value)\n" if $debug;
+      print "OK\n";
+    }
+  } elsif ($op eq "INSERT") {
     ($key, $value) = split(/\s+/,$rest);
     if (defined $content{$key} || Bug()) { 
       print STDERR "Inserting ($key, $value) failed because $key already exists\n" if $debug;
@@ -35,7 +50,10 @@ while ($line=<STDIN>) {
     }
   } elsif ($op eq "UPDATE") { 
     ($key, $value) = split(/\s+/,$rest);
-    if (!(defined $content{$key}) || Bug()) { 
+    if ($nonunique) { 
+      print STDERR "Updating ($key, $value) failed because keys have lists of values\n" if $debug;
+      print "FAIL\n";
+    } elsif (!(defined $content{$key}) || Bug()) { 
       print STDERR "Updating ($key, $value) failed because $key does not exist\n" if $debug;
       print "FAIL\n";
     } else {
@@ -50,6 +68,7 @@ while ($line=<STDIN>) {
       print "FAIL\n";
     } else {
       delete $content{$key};
+      delete $lists{$key};
       print STDERR "Deleted ($key)\n" if $debug;
       print "OK\n";
     }
@@ -63,11 +82,44 @@ while ($line=<STDIN>) {
       print STDERR "Lookup ($key) found $value\n" if $debug;
       print "OK $value\n";
     }
+  } elsif ($op eq "LOOKUPALL") { 
+    ($key)=split(/\s+/,$rest);
+    if (!(defined $content{$key}) || Bug() ) { 
+      print STDERR "Looking up all of ($key) failed because $key does not exist\n" if $debug;
+      print "FAIL\n";
+    } else {
+      @values=$nonunique ? @{$lists{$key}} : ($content{$key});
+      print STDERR "Lookup all ($key) found @values\n" if $debug;
+      print join(" ", "OK", @values), "\n";
+    }
+  } elsif ($op eq "COUNT") { 
+    ($lo, $hi)=split(/\s+/,$rest);
+    if (Bug()) { 
+      print STDERR "Counting [$lo, $hi) failed\n" if $debug;
+      print "FAIL\n";
+    } else {
+      $n=grep { $_ ge $lo && $_ lt $hi } keys %content;
+      print STDERR "Count [$lo, $hi) found $n\n" if $debug;
+      print "OK $n\n";
+    }
+  } elsif ($op eq "SELECT") { 
+    ($k)=split(/\s+/,$rest);
+    @sorted=sort keys %content;
+    if ($k>$#sorted || Bug()) { 
+      print STDERR "Selecting ($k) failed because there are only ".($#sorted+1)." keys\n" if $debug;
+      print "FAIL\n";
+    } else {
+      $key=$sorted[$k];
+      print STDERR "Select ($k) found ($key, $content{$key})\n" if $debug;
+      print "OK $key $content{$key}\n";
+    }
   } elsif ($op eq "DISPLAY") { 
     print STDERR "Displaying content in sorted order\n" if $debug;
     print "OK BEGIN DISPLAY\n";
     foreach $key (sort keys %content) {
-      print "($key, $content{$key})\n";
+      foreach $value ($nonunique ? @{$lists{$key}} : ($content{$key})) { 
+	print "($key, $value)\n";
+      }
     }
     print "OK END DISPLAY\n";
   } elsif ($op eq "DEINIT") {
@@ -0,0 +1,348 @@
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "request.h"
+
+
+static const char *verbs[REQUEST_NUM_OPS] = {
+  "",
+  "INIT",
+  "ATTACH",
+  "INSERT",
+  "UPDATE",
+  "DELETE",
+  "LOOKUP",
+  "LOOKUPALL",
+  "COUNT",
+  "SELECT",
+  "SAMPLE",
+  "DISPLAY",
+  "DEINIT"
+};
+
+
+void Request::GetKey(KEY_T &k) const
+{
+  if (k.Resize(keylength,false)!=ERROR_NOERROR) {
+    throw GenericException();
+  }
+  memcpy(k.data,key,keylength);
+}
+
+
+void Request::GetValue(VALUE_T &v) const
+{
+  if (v.Resize(valuelength,false)!=ERROR_NOERROR) {
+    throw GenericException();
+  }
+  memcpy(v.data,value,valuelength);
+}
+
+
+RequestReader::RequestReader(const int f, const SIZE_T buffersize) :
+  fd(f),
+  buf(0),
+  size(buffersize),
+  start(0),
+  end(0),
+  binary(-1),
+  eof(false)
+{
+  buf = new char [size];
+}
+
+
+RequestReader::~RequestReader()
+{
+  delete [] buf;
+}
+
+
+const char *RequestReader::GetVerb(const RequestOp op)
+{
+  return (op>=0 && op<REQUEST_NUM_OPS) ? verbs[op] : "";
+}
+
+
+// Moves what is left to the front, growing the buffer only if that is
+// all of it, and reads as much as fits, or fails with ERROR_NOFETCH if
+// nothing has arrived on a non-blocking descriptor
+ERROR_T RequestReader::Fill()
+{
+  if (start>0) {
+    memmove(buf,buf+start,end-start);
+    end-=start;
+    start=0;
+  }
+  if (end==size) {
+    char *b;
+    try {
+      b = new char [size*2];
+    }
+    catch (...) {
+      return ERROR_NOMEM;
+    }
+    memcpy(b,buf,end);
+    delete [] buf;
+    buf=b;
+    size*=2;
+  }
+
+  ssize_t n;
+  do {
+    n=read(fd,buf+end,size-end);
+  } while (n<0 && errno==EINTR);
+  if (n<0) {
+    return (errno==EAGAIN || errno==EWOULDBLOCK) ? ERROR_NOFETCH : ERROR_GENERAL;
+  }
+  if (n==0) {
+    eof=true;
+  }
+  end+=n;
+  return ERROR_NOERROR;
+}
+
+
+static bool IsSpace(const char c)
+{
+  return c==' ' || c=='\t' || c=='\r' || c=='\n' || c=='\v' || c=='\f';
+}
+
+
+ERROR_T RequestReader::ParseLine(const char *line, const SIZE_T length, Request &r) const
+{
+  const char *p=line, *e=line+length;
+  const char *verb;
+  SIZE_T verblength;
+
+  r.op=REQUEST_NONE;
+  r.key=r.value=e;
+  r.keylength=r.valuelength=0;
+
+  while (p<e && IsSpace(*p)) { p++; }
+  for (verb=p; p<e && !IsSpace(*p); p++) {}
+  verblength=p-verb;
+  for (int i=1;i<REQUEST_NUM_OPS;i++) {
+    if (strlen(verbs[i])==verblength && !memcmp(verbs[i],verb,verblength)) {
+      r.op=(RequestOp)i;
+      break;
+    }
+  }
+
+  while (p<e && IsSpace(*p)) { p++; }
+  if (r.op==REQUEST_INIT) {
+    // the rest of the line holds the sizes and the options
+    while (e>p && IsSpace(e[-1])) { e--; }
+    r.key=p;
+    r.keylength=e-p;
+    return ERROR_NOERROR;
+  }
+  for (r.key=p; p<e && !IsSpace(*p); p++) {}
+  r.keylength=p-r.key;
+  while (p<e && IsSpace(*p)) { p++; }
+  for (r.value=p; p<e && !IsSpace(*p); p++) {}
+  r.valuelength=p-r.value;
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T RequestReader::Take(Request &r)
+{
+  SIZE_T avail=end-start;
+
+  if (binary<0) {
+    if (avail<REQUEST_BINARY_MAGIC_SIZE && !(eof && avail>0)) {
+      return ERROR_NOFETCH;
+    }
+    binary=(avail>=REQUEST_BINARY_MAGIC_SIZE &&
+	    !memcmp(buf+start,REQUEST_BINARY_MAGIC,REQUEST_BINARY_MAGIC_SIZE));
+    if (binary) {
+      start+=REQUEST_BINARY_MAGIC_SIZE;
+      avail-=REQUEST_BINARY_MAGIC_SIZE;
+    }
+  }
+
+  if (binary) {
+    if (avail<REQUEST_HEADER_SIZE) {
+      return ERROR_NOFETCH;
+    }
+    const char *h=buf+start;
+    BYTE_T op=(BYTE_T)h[0];
+    SIZE_T keylength, valuelength;
+    memcpy(&keylength,h+1,sizeof(SIZE_T));
+    memcpy(&valuelength,h+1+sizeof(SIZE_T),sizeof(SIZE_T));
+    if (op==REQUEST_NONE || op>=REQUEST_NUM_OPS ||
+	keylength>REQUEST_MAX_LENGTH || valuelength>REQUEST_MAX_LENGTH) {
+      return ERROR_INSANE;
+    }
+    if (avail<REQUEST_HEADER_SIZE+keylength+valuelength) {
+      return ERROR_NOFETCH;
+    }
+    r.op=(RequestOp)op;
+    r.key=h+REQUEST_HEADER_SIZE;
+    r.keylength=keylength;
+    r.value=r.key+keylength;
+    r.valuelength=valuelength;
+    start+=REQUEST_HEADER_SIZE+keylength+valuelength;
+    return ERROR_NOERROR;
+  }
+
+  while (avail>0) {
+    const char *line=buf+start;
+    const char *nl=(const char *)memchr(line,'\n',avail);
+    if (!nl && !eof) {
+      return ERROR_NOFETCH;
+    }
+    SIZE_T length=nl ? nl-line : avail;
+    start+=nl ? length+1 : length;
+    avail=end-start;
+    ParseLine(line,length,r);
+    if (r.op!=REQUEST_NONE) {
+      return ERROR_NOERROR;
+    }
+  }
+  return ERROR_NOFETCH;
+}
+
+
+ERROR_T RequestReader::Next(Request &r)
+{
+  ERROR_T rc;
+
+  while ((rc=Take(r))==ERROR_NOFETCH) {
+    if (eof) {
+      // a binary request cut short is an error, nothing left is not
+      return end>start ? ERROR_INSANE : ERROR_NONEXISTENT;
+    }
+    if ((rc=Fill())) {
+      return rc;
+    }
+  }
+  return rc;
+}
+
+
+RequestHandler::RequestHandler(BTreeIndex *b, const unsigned s) :
+  btree(b),
+  seed(s)
+{
+}
+
+
+RequestHandler::~RequestHandler()
+{
+}
+
+
+static void PrintBlock(ostream &out, const Block &b)
+{
+  out.write((const char *)b.data,b.length);
+}
+
+// LOOKUPALL prints the values on the reply line as they come
+static ERROR_T PrintValue(const VALUE_T &value, void *arg)
+{
+  ostream &out=*(ostream *)arg;
+  out << " ";
+  PrintBlock(out,value);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T RequestHandler::Run(const Request &r, ostream &out)
+{
+  ERROR_T rc=ERROR_UNIMPL;
+
+  if (!btree) {
+    out << "FAIL\n";
+    return ERROR_NONEXISTENT;
+  }
+  r.GetKey(key);
+  r.GetValue(value);
+
+  switch (r.op) {
+  case REQUEST_INSERT:
+    if ((rc=btree->Insert(key,value))==ERROR_NOERROR) {
+      out << "OK\n";
+    }
+    break;
+  case REQUEST_UPDATE:
+    if ((rc=btree->Update(key,value))==ERROR_NOERROR) {
+      out << "OK\n";
+    }
+    break;
+  case REQUEST_DELETE:
+    if ((rc=btree->Delete(key))==ERROR_NOERROR) {
+      out << "OK\n";
+    }
+    break;
+  case REQUEST_LOOKUP:
+    if ((rc=btree->Lookup(key,found))==ERROR_NOERROR) {
+      out << "OK ";
+      PrintBlock(out,found);
+      out << "\n";
+    }
+    break;
+  case REQUEST_LOOKUPALL:
+    values.str("");
+    if ((rc=btree->LookupAll(key,PrintValue,&values))==ERROR_NOERROR) {
+      out << "OK" << values.str() << "\n";
+    }
+    break;
+  case REQUEST_COUNT: {
+    // COUNT lo hi: keys k with lo <= k < hi
+    SIZE_T count;
+    if ((rc=btree->Count(key,value,count))==ERROR_NOERROR) {
+      out << "OK " << count << "\n";
+    }
+    break;
+  }
+  case REQUEST_SELECT: {
+    // SELECT k: the key at position k, from 0, and its value
+    KEY_T selectkey;
+    if ((rc=btree->Select(atol(r.GetKeyString().c_str()),selectkey,found))==ERROR_NOERROR) {
+      out << "OK ";
+      PrintBlock(out,selectkey);
+      out << " ";
+      PrintBlock(out,found);
+      out << "\n";
+    }
+    break;
+  }
+  case REQUEST_SAMPLE: {
+    // SAMPLE n [seed]: n random pairs, with replacement, on one line
+    vector<KeyValuePair> sample;
+    if (r.valuelength>0) {
+      seed=atoi(r.GetValueString().c_str());
+    }
+    if ((rc=btree->Sample(atol(r.GetKeyString().c_str()),seed,sample))==ERROR_NOERROR) {
+      out << "OK";
+      for (SIZE_T i=0;i<sample.size();i++) {
+	out << " ";
+	PrintBlock(out,sample[i].key);
+	out << " ";
+	PrintBlock(out,sample[i].value);
+      }
+      out << "\n";
+    }
+    break;
+  }
+  case REQUEST_DISPLAY:
+    // This should always be OK
+    out << "OK BEGIN DISPLAY\n";
+    btree->Display(out,BTREE_SORTED_KEYVAL);
+    out << "OK END DISPLAY\n";
+    rc=ERROR_NOERROR;
+    break;
+  default:
+    break;
+  }
+
+  if (rc!=ERROR_NOERROR) {
+    out << "FAIL\n";
+  }
+  return rc;
+}
@@ -0,0 +1,138 @@
+#ifndef _request
+#define _request
+
+#include <string>
+#include <sstream>
+
+#include "global.h"
+#include "btree.h"
+
+using namespace std;
+
+// Operations sim accepts, as the op byte of a binary request
+enum RequestOp {
+  REQUEST_NONE=0,
+  REQUEST_INIT=1,
+  REQUEST_ATTACH=2,
+  REQUEST_INSERT=3,
+  REQUEST_UPDATE=4,
+  REQUEST_DELETE=5,
+  REQUEST_LOOKUP=6,
+  REQUEST_LOOKUPALL=7,
+  REQUEST_COUNT=8,
+  REQUEST_SELECT=9,
+  REQUEST_SAMPLE=10,
+  REQUEST_DISPLAY=11,
+  REQUEST_DEINIT=12
+};
+
+#define REQUEST_NUM_OPS 13
+
+// A binary request stream starts with these bytes, which no text
+// request can
+#define REQUEST_BINARY_MAGIC "\0BRQ"
+#define REQUEST_BINARY_MAGIC_SIZE 4
+
+// Each binary request is the op byte, the key length and the value
+// length as SIZE_Ts in the machine's byte order, and then the key and
+// value bytes, with nothing in between
+#define REQUEST_HEADER_SIZE (1+2*sizeof(SIZE_T))
+
+#define REQUEST_BUFFER_SIZE (1024*1024)
+// Longest key or value a request may carry
+#define REQUEST_MAX_LENGTH  (16*1024*1024)
+
+//
+// One request.  key and value point into the reader's buffer, are not
+// NUL terminated, and stay valid until the reader's next Next().
+//
+// The key and value are the first and second word after the verb of a
+// text request, so COUNT has lo and hi in them, and SELECT and SAMPLE
+// their numbers and the seed in decimal.  INIT is the exception: its
+// key is everything after the verb, "keysize valuesize [options]".
+//
+struct Request {
+  RequestOp   op;
+  const char *key;
+  SIZE_T      keylength;
+  const char *value;
+  SIZE_T      valuelength;
+
+  // Copy the key or value into a block, reusing its buffer
+  void   GetKey(KEY_T &k) const;
+  void   GetValue(VALUE_T &v) const;
+  string GetKeyString() const { return string(key,keylength); }
+  string GetValueString() const { return string(value,valuelength); }
+};
+
+//
+// Reads requests from a file descriptor, in text as ref_impl.pl takes
+// them, a line each, or in binary if the input starts with
+// REQUEST_BINARY_MAGIC.
+//
+// Input is read into one large buffer and requests are handed out in
+// place, so nothing is copied or allocated per request.  Text lines
+// that are blank or start with an unknown verb are skipped.
+//
+class RequestReader {
+ private:
+  int    fd;
+  char  *buf;
+  SIZE_T size;
+  SIZE_T start;     // first byte not yet handed out
+  SIZE_T end;       // end of the bytes read so far
+  int    binary;    // -1 until the first bytes have been seen
+  bool   eof;
+
+  ERROR_T Fill();
+  ERROR_T ParseLine(const char *line, const SIZE_T length, Request &r) const;
+  // ERROR_NOFETCH if there is no whole request in the buffer
+  ERROR_T Take(Request &r);
+
+ public:
+  RequestReader(const int fd, const SIZE_T buffersize=REQUEST_BUFFER_SIZE);
+  RequestReader() { throw GenericException(); }
+  RequestReader(const RequestReader &rhs) { throw GenericException(); }
+  RequestReader & operator=(const RequestReader &rhs) { throw GenericException(); return *this; }
+  virtual ~RequestReader();
+
+  // ERROR_NOERROR and the next request, ERROR_NONEXISTENT at the end
+  // of the input, or ERROR_INSANE for a malformed binary request.  On
+  // a non-blocking descriptor, ERROR_NOFETCH once everything that has
+  // arrived so far has been handed out.
+  ERROR_T Next(Request &r);
+
+  // Whether requests are binary, once Next() has returned one
+  bool    IsBinary() const { return binary==1; }
+
+  static const char *GetVerb(const RequestOp op);
+};
+
+
+//
+// Runs the requests that work on an attached index, INSERT through
+// DISPLAY, and writes their replies as sim prints them.  A failed
+// request replies "FAIL" and returns its error.  The scratch keys and
+// values, and the random numbers for SAMPLE, carry over from one
+// request to the next, so there should be one handler per stream of
+// requests.
+//
+class RequestHandler {
+ private:
+  BTreeIndex  *btree;
+  KEY_T        key;
+  VALUE_T      value, found;
+  unsigned     seed;
+  ostringstream values;
+
+ public:
+  RequestHandler(BTreeIndex *btree=0, const unsigned seed=1);
+  RequestHandler(const RequestHandler &rhs) { throw GenericException(); }
+  RequestHandler & operator=(const RequestHandler &rhs) { throw GenericException(); return *this; }
+  virtual ~RequestHandler();
+
+  void    SetIndex(BTreeIndex *b) { btree=b; }
+  ERROR_T Run(const Request &r, ostream &out);
+};
+
+#endif
@@ -0,0 +1,156 @@
+#include "resultcache.h"
+
+
+ResultCache::ResultCache(const SIZE_T max) :
+  maxbytes(max),
+  numbytes(0),
+  ticket(0),
+  numhits(0),
+  nummisses(0),
+  numputs(0),
+  numevictions(0),
+  numinvalidations(0)
+{
+  pthread_mutex_init(&lock,0);
+}
+
+
+ResultCache::~ResultCache()
+{
+  pthread_mutex_destroy(&lock);
+}
+
+
+void ResultCache::Remove(map<KEY_T, LRUList::iterator>::iterator e)
+{
+  numbytes-=(*e).first.length+(*(*e).second).second.length+RESULTCACHE_ENTRY_OVERHEAD;
+  lru.erase((*e).second);
+  entries.erase(e);
+}
+
+
+bool ResultCache::Get(const KEY_T &key, VALUE_T &value, SIZE_T &t)
+{
+  pthread_mutex_lock(&lock);
+
+  map<KEY_T, LRUList::iterator>::iterator e=entries.find(key);
+
+  if (e==entries.end() || changing.find(key)!=changing.end()) {
+    nummisses++;
+    t=ticket;
+    pthread_mutex_unlock(&lock);
+    return false;
+  }
+
+  // to the front
+  lru.splice(lru.begin(),lru,(*e).second);
+  value=(*(*e).second).second;
+  numhits++;
+
+  pthread_mutex_unlock(&lock);
+  return true;
+}
+
+
+void ResultCache::Put(const KEY_T &key, const VALUE_T &value, const SIZE_T t)
+{
+  SIZE_T bytes=key.length+value.length+RESULTCACHE_ENTRY_OVERHEAD;
+
+  pthread_mutex_lock(&lock);
+
+  if (t!=ticket || bytes>maxbytes || changing.find(key)!=changing.end()) {
+    // the value may already be out of date, or would never fit
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+
+  map<KEY_T, LRUList::iterator>::iterator e=entries.find(key);
+  if (e!=entries.end()) {
+    Remove(e);
+  }
+  while (numbytes+bytes>maxbytes) {
+    Remove(entries.find(lru.back().first));
+    numevictions++;
+  }
+  lru.push_front(make_pair(key,value));
+  entries[key]=lru.begin();
+  numbytes+=bytes;
+  numputs++;
+
+  pthread_mutex_unlock(&lock);
+}
+
+
+void ResultCache::BeginChange(const KEY_T &key)
+{
+  pthread_mutex_lock(&lock);
+
+  changing[key]++;
+  map<KEY_T, LRUList::iterator>::iterator e=entries.find(key);
+  if (e!=entries.end()) {
+    Remove(e);
+    numinvalidations++;
+  }
+
+  pthread_mutex_unlock(&lock);
+}
+
+
+void ResultCache::EndChange(const KEY_T &key)
+{
+  pthread_mutex_lock(&lock);
+
+  map<KEY_T, SIZE_T>::iterator c=changing.find(key);
+  if (c!=changing.end() && --(*c).second==0) {
+    changing.erase(c);
+  }
+  // lookups that missed before now may have read the old value
+  ticket++;
+
+  pthread_mutex_unlock(&lock);
+}
+
+
+void ResultCache::Clear()
+{
+  pthread_mutex_lock(&lock);
+  lru.clear();
+  entries.clear();
+  numbytes=0;
+  ticket++;
+  pthread_mutex_unlock(&lock);
+}
+
+
+SIZE_T ResultCache::GetNumBytes() const
+{
+  pthread_mutex_lock(&lock);
+  SIZE_T n=numbytes;
+  pthread_mutex_unlock(&lock);
+  return n;
+}
+
+
+SIZE_T ResultCache::GetNumEntries() const
+{
+  pthread_mutex_lock(&lock);
+  SIZE_T n=entries.size();
+  pthread_mutex_unlock(&lock);
+  return n;
+}
+
+
+ostream & ResultCache::Print(ostream &os) const
+{
+  pthread_mutex_lock(&lock);
+  os << "ResultCache(maxbytes="<<maxbytes
+     << ", numbytes="<<numbytes
+     << ", numentries="<<entries.size()
+     << ", numhits="<<numhits
+     << ", nummisses="<<nummisses
+     << ", numevictions="<<numevictions
+     << ", numinvalidations="<<numinvalidations
+     << ")";
+  pthread_mutex_unlock(&lock);
+  return os;
+}
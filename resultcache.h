@@ -0,0 +1,78 @@
+#ifndef _resultcache
+#define _resultcache
+
+#include <iostream>
+#include <list>
+#include <map>
+#include <utility>
+#include <pthread.h>
+
+#include "global.h"
+#include "btree_ds.h"
+
+using namespace std;
+
+// Bytes each cached pair is charged on top of its key and value, for
+// the list and map nodes that hold it
+#define RESULTCACHE_ENTRY_OVERHEAD 64
+
+//
+// Cache of recent lookup results, in front of the tree
+//
+// Maps keys to the values Lookup() last found for them, in LRU order,
+// holding at most maxbytes of keys, values and overhead.  Misses are
+// not cached.
+//
+// A lookup that misses gets a ticket, and may only Put() its result
+// if no change has ended since it was issued, so a value read from
+// the tree before or during a change is never cached after it.  A
+// change brackets itself with BeginChange() and EndChange(); in
+// between, the key is neither served nor cached, so no lookup can see
+// the old value from the cache once another has seen the new one in
+// the tree.
+//
+class ResultCache {
+ private:
+  typedef list<pair<KEY_T, VALUE_T> > LRUList;
+
+  SIZE_T maxbytes;
+  SIZE_T numbytes;
+  SIZE_T ticket;                  // advances with every EndChange()
+  LRUList lru;                    // most recently used first
+  map<KEY_T, LRUList::iterator> entries;
+  map<KEY_T, SIZE_T> changing;    // key -> number of changes under way
+  SIZE_T numhits, nummisses, numputs, numevictions, numinvalidations;
+  mutable pthread_mutex_t lock;
+
+  // Called with the lock held
+  void    Remove(map<KEY_T, LRUList::iterator>::iterator e);
+
+ public:
+  ResultCache(const SIZE_T maxbytes);
+  ResultCache() { throw GenericException(); }
+  ResultCache(const ResultCache &rhs) { throw GenericException(); }
+  ResultCache & operator=(const ResultCache &rhs) { throw GenericException(); return *this; }
+  virtual ~ResultCache();
+
+  // true and the value on a hit, false and a ticket for Put() otherwise
+  bool    Get(const KEY_T &key, VALUE_T &value, SIZE_T &ticket);
+  void    Put(const KEY_T &key, const VALUE_T &value, const SIZE_T ticket);
+  void    BeginChange(const KEY_T &key);
+  void    EndChange(const KEY_T &key);
+  void    Clear();
+
+  SIZE_T  GetMaxBytes() const { return maxbytes; }
+  SIZE_T  GetNumBytes() const;
+  SIZE_T  GetNumEntries() const;
+  SIZE_T  GetNumHits() const { return numhits; }
+  SIZE_T  GetNumMisses() const { return nummisses; }
+  SIZE_T  GetNumPuts() const { return numputs; }
+  SIZE_T  GetNumEvictions() const { return numevictions; }
+  SIZE_T  GetNumInvalidations() const { return numinvalidations; }
+
+  ostream & Print(ostream &os) const;
+};
+
+inline ostream & operator<< (ostream &os, const ResultCache &rhs) { return rhs.Print(os);}
+
+#endif
@@ -3,15 +3,150 @@
 #include <stdio.h>
 #include <string>
 #include <strstream>
+#include <sstream>
 #include <fstream>
+#include <sys/time.h>
+#include <time.h>
 #include "btree.h"
+#include "request.h"
+#include "histogram.h"
 
 
 using namespace std;
 
 void usage()
 {
-  cerr << "usage: sim filestem cachesize < specfile \n";
+  cerr << "usage: sim filestem cachesize [commitbatch [resultcachebytes [statsinterval [tracerate [mrcrate]]]]] < specfile \n";
+}
+
+// If commitbatch is given, every update goes through the write-ahead
+// log in filestem.wal.  With commitbatch=1 each operation is durable
+// before it is acknowledged.  With commitbatch=n, replies are held
+// back and a group of n updates is made durable with one log flush
+// before any of their replies is printed.
+//
+// If resultcachebytes is given, lookups go through a result cache of
+// that many bytes (see BTreeIndex::SetResultCacheSize), and its hit
+// ratio is printed at the end.  Use commitbatch 0 for no log.
+//
+// Requests are text, as ref_impl.pl takes them, or binary if the
+// input starts with REQUEST_BINARY_MAGIC (see request.h and
+// sim2bin.pl).  Replies are text either way.  Without a log they are
+// only written out when the output buffer fills up.
+//
+// The latency of each request that goes to the index is recorded in
+// histograms per operation, in simulated time and in wall clock time,
+// together with the cache hits, disk reads and writes and node splits
+// it caused.  Percentiles are printed at the end.  If statsinterval is
+// given, a JSON line with the latencies of the last statsinterval
+// requests is printed every statsinterval requests, and the whole
+// distributions are written to filestem.hgrm in HdrHistogram's format.
+//
+// If tracerate is given, the cache is traced (see CacheTrace): a heat
+// map of all blocks goes to filestem.heat, and the accesses of that
+// fraction of the blocks to filestem.trace.  tracebuffer reads them.
+//
+// If mrcrate is given, the cache estimates its miss ratio curve from
+// that fraction of the blocks (see MissRatioCurve), and the predicted
+// read hit ratio of every cache size is written to filestem.mrc.  Use
+// 0 for the arguments before it that aren't wanted.
+
+// Replies are only pushed out by commits, or once this much piles up
+#define SIM_OUTPUT_BUFFER_SIZE (1024*1024)
+
+// After ATTACH, the cache hit ratio is taken over windows of this many
+// requests, to see how long a restarted index takes to warm up.  With
+// the WARM option on INIT or ATTACH, DEINIT saves the cached block
+// numbers in filestem.warm, and ATTACH WARM loads them again (see
+// BufferCache::SetWarmFile).  Without it the cache starts cold, so
+// that runs on the same disk take the same simulated time.
+#define SIM_WARMUP_WINDOW 1000
+// A window is warm once its hit ratio is this close to the last one's
+#define SIM_WARMUP_FRACTION 0.95
+
+// Simulated time is recorded in microseconds, wall time in nanoseconds
+#define SIM_SIM_UNITS_PER_MS  1000.0
+
+// cerr is unbuffered, so the message is put together first and goes
+// out in one write
+static void Complain(const char *what, const ERROR_T rc)
+{
+  ostringstream msg;
+  msg << "Can't "<<what<<" due to error "<<rc<<"\n";
+  cerr << msg.str();
+}
+
+// What failed, for each request that goes to the handler
+static const char *verbs[REQUEST_NUM_OPS] = {
+  "", "init", "attach", "insert", "update", "delete", "lookup", "lookup",
+  "count", "select", "sample", "display", "deinit"
+};
+
+// What one kind of operation took, and what it did to the cache
+struct OpStats {
+  Histogram simtime;    // us
+  Histogram walltime;   // ns
+  SIZE_T    count, hits, diskreads, diskwrites, splits;
+
+  OpStats() : count(0), hits(0), diskreads(0), diskwrites(0), splits(0) {}
+
+  void Add(const OpStats &rhs) {
+    simtime.Add(rhs.simtime);
+    walltime.Add(rhs.walltime);
+    count+=rhs.count;
+    hits+=rhs.hits;
+    diskreads+=rhs.diskreads;
+    diskwrites+=rhs.diskwrites;
+    splits+=rhs.splits;
+  }
+  void Reset() {
+    simtime.Reset();
+    walltime.Reset();
+    count=hits=diskreads=diskwrites=splits=0;
+  }
+};
+
+static HISTOGRAM_T NowNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (HISTOGRAM_T)ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+// One JSON line with the latencies of the requests since the last one
+static void PrintInterval(const OpStats *interval, const SIZE_T numops, const double simtime)
+{
+  ostringstream line;
+  line << "{\"ops\":"<<numops<<",\"simtime_ms\":"<<simtime;
+  for (int op=0;op<REQUEST_NUM_OPS;op++) {
+    const OpStats &s=interval[op];
+    if (s.count==0) {
+      continue;
+    }
+    line << ",\""<<RequestReader::GetVerb((RequestOp)op)<<"\":{"
+	 << "\"count\":"<<s.count
+	 << ",\"sim_ms\":{\"p50\":"<<s.simtime.GetPercentile(50)/SIM_SIM_UNITS_PER_MS
+	 << ",\"p99\":"<<s.simtime.GetPercentile(99)/SIM_SIM_UNITS_PER_MS
+	 << ",\"p999\":"<<s.simtime.GetPercentile(99.9)/SIM_SIM_UNITS_PER_MS
+	 << ",\"max\":"<<s.simtime.GetMax()/SIM_SIM_UNITS_PER_MS<<"}"
+	 << ",\"wall_ns\":{\"p50\":"<<s.walltime.GetPercentile(50)
+	 << ",\"p99\":"<<s.walltime.GetPercentile(99)
+	 << ",\"p999\":"<<s.walltime.GetPercentile(99.9)
+	 << ",\"max\":"<<s.walltime.GetMax()<<"}"
+	 << ",\"hits\":"<<s.hits
+	 << ",\"diskreads\":"<<s.diskreads
+	 << ",\"diskwrites\":"<<s.diskwrites
+	 << ",\"splits\":"<<s.splits<<"}";
+  }
+  line << "}\n";
+  cerr << line.str();
+}
+
+static double Now()
+{
+  struct timeval tv;
+  gettimeofday(&tv,0);
+  return tv.tv_sec + tv.tv_usec/1e6;
 }
 
 
@@ -20,107 +155,387 @@ int main(int argc, char *argv[])
 
   // CONFORMS to the interface of ref_impl.pl
 
-  if (argc != 3){
+  if (argc < 3 || argc > 8){
     usage();
     return 1;
   }
 
   char *filestem=argv[1];
   SIZE_T cachesize=atoi(argv[2]);
+  SIZE_T commitbatch=(argc>=4) ? atoi(argv[3]) : 0;
+  SIZE_T resultcachebytes=(argc>=5) ? atoi(argv[4]) : 0;
+  SIZE_T statsinterval=(argc>=6) ? atoi(argv[5]) : 0;
+  double tracerate=(argc>=7) ? atof(argv[6]) : 0;
+  double mrcrate=(argc==8) ? atof(argv[7]) : 0;
   SIZE_T superblocknum;
+  SIZE_T numops=0, numupdates=0, pendingupdates=0;
+  double starttime=0, endtime=0;
+  BTreeBloomStats bloomstats;
+  bool hasbloom=false;
+  SIZE_T resulthits=0, resultmisses=0, resultentries=0, resultbytes=0;
+  SIZE_T resultevictions=0, resultinvalidations=0;
+  string warmfile=string(filestem)+".warm";
+  bool reattached=false;
+  double warmstart=0;
+  SIZE_T windowreads=0, windowdiskreads=0;
+  vector<double> windowratios, windowtimes;
+  static char outbuf[SIM_OUTPUT_BUFFER_SIZE];
+  // requests are recorded in interval, which is added to total and
+  // cleared after each JSON line and at the end
+  OpStats total[REQUEST_NUM_OPS], interval[REQUEST_NUM_OPS];
 
-  FILE *file; 
-  char line[1024];
-  int max = 8192;
   ERROR_T rc;
+  RequestReader requests(0);
+  Request request;
+  RequestHandler handler;
   
   // We'll connect to the btree only once and then
   // run lots of operations
   // so we need to do this outside the loop
   DiskSystem disk(filestem);
+  // declared before the cache, which may still flush it on destruction
+  WriteAheadLog log(filestem);
   BufferCache cache(&disk,cachesize);
   // will be set on init
-  BTreeIndex *btree;
+  BTreeIndex *btree=0;
+
+  ios::sync_with_stdio(false);
+  cout.rdbuf()->pubsetbuf(outbuf,sizeof(outbuf));
+
+  // replies waiting for their group to commit
+  ostringstream held;
+  ostream &out = (commitbatch>1) ? (ostream &)held : cout;
+
+  if (commitbatch>0 && (rc=log.Open())!=ERROR_NOERROR) { 
+    cerr << "Can't open log due to error "<<rc<<"\n";
+    return -1;
+  }
 
 
   if ((rc=cache.Attach())!=ERROR_NOERROR) {
     cerr << "Can't attach cache due to error "<<rc<<"\n";
     return -1;
   }
+
+  cache.SetMissRatioCurve(mrcrate);
+  if (tracerate>0 && (rc=cache.StartTrace(filestem,tracerate))!=ERROR_NOERROR) { 
+    cerr << "Can't trace cache due to error "<<rc<<"\n";
+    return -1;
+  }
   
-  file=stdin;
-
-  //Now simply read each line and call btree functions corresponding to the same
-  while (fgets(line, max, file) != NULL){
-    // foreach line read we will refer to a case switch statement
-    string line2, action, key, value;
-    line2 = line;
-    istrstream is(line2.c_str(),line2.size());
-    is >> action >> key >> value;
-
-    if (action == "INIT") {
-      btree = new BTreeIndex(atoi(key.c_str()),atoi(value.c_str()),&cache);
+  //Now simply read each request and call btree functions corresponding to the same
+  while ((rc=requests.Next(request))==ERROR_NOERROR) {
+    RequestOp op=request.op;
+
+    if (op!=REQUEST_INIT && op!=REQUEST_ATTACH && op!=REQUEST_DEINIT) { 
+      numops++;
+    }
+    if (op==REQUEST_INSERT || op==REQUEST_UPDATE || op==REQUEST_DELETE) { 
+      numupdates++;
+      pendingupdates++;
+    }
+    if (op == REQUEST_INIT) {
+      string args=request.GetKeyString(), keysize, valuesize, format;
+      istrstream is(args.c_str(),args.size());
+      is >> keysize >> valuesize >> format;
+      // INIT keysize valuesize NONUNIQUE lets a key have many values
+      btree = new BTreeIndex(atoi(keysize.c_str()),atoi(valuesize.c_str()),&cache,format!="NONUNIQUE");
+      handler.SetIndex(btree);
+      // INIT keysize valuesize VARIABLE makes those sizes maximums
+      btree->SetVariableLength(format=="VARIABLE");
+      // INIT keysize valuesize COMPRESSED compresses the leaves on disk
+      btree->SetCompressed(format=="COMPRESSED");
+      // INIT keysize valuesize [format] BLOOM numkeys adds a Bloom
+      // filter sized for numkeys keys
+      // INIT keysize valuesize [format] LINEAR|BINARY|INTERPOLATION
+      // picks how nodes are searched
+      // INIT keysize valuesize [format] COUNTED keeps subtree counts
+      // for COUNT, SELECT and SAMPLE
+      // INIT keysize valuesize [format] WARM saves the cached blocks
+      // for ATTACH WARM
+      string opt=format;
+      SIZE_T bloomkeys=0;
+      bool warm=false;
+      while (opt!="") { 
+	if (opt=="BLOOM") { 
+	  is >> bloomkeys;
+	} else if (opt=="LINEAR") { 
+	  btree->SetSearchMode(BTREE_SEARCH_LINEAR);
+	} else if (opt=="BINARY") { 
+	  btree->SetSearchMode(BTREE_SEARCH_BINARY);
+	} else if (opt=="INTERPOLATION") { 
+	  btree->SetSearchMode(BTREE_SEARCH_INTERPOLATION);
+	} else if (opt=="COUNTED") { 
+	  btree->SetSubtreeCounts(true);
+	} else if (opt=="WARM") { 
+	  warm=true;
+	}
+	opt="";
+	is >> opt;
+      }
+      btree->SetBloomFilter(bloomkeys);
+      btree->SetResultCacheSize(resultcachebytes);
+      cache.SetWarmFile(warm ? warmfile : "");
       if ((rc=btree->Attach(0, true))!=ERROR_NOERROR) {
 	cerr << "Can't attach btree with initialization due to error "<<rc<<"\n";
-	cout << "FAIL\n";
+	out << "FAIL\n";
       } else {
-	cout << "OK\n";
+	if (commitbatch>0) { 
+	  // the freshly formatted index is the starting point for the log
+	  cache.SetLog(&log);
+	  cache.Flush();
+	  btree->SetSynchronousCommit(commitbatch==1);
+	}
+	out << "OK\n";
       }
-    } else if (action == "INSERT"){
-      if ((rc=btree->Insert(KEY_T(key.c_str()),VALUE_T(value.c_str())))!=ERROR_NOERROR) { 
-        cout <<"FAIL"<<endl;
-	cerr <<"Can't insert due to error "<<rc<<"\n";
-      } else {
-        cout <<"OK\n";
+      starttime=Now();
+    } else if (op == REQUEST_ATTACH) {
+      // reopen the index left behind by an earlier run, recovering it
+      // from the log if that run crashed
+      // ATTACH WARM starts from the blocks the last DEINIT had cached
+      bool warm=(request.GetKeyString()=="WARM");
+      warmstart=cache.GetCurrentTime();
+      cache.SetWarmFile(warm ? warmfile : "");
+      if (warm) { 
+	cache.LoadWarmFile();
       }
-    } else if (action == "UPDATE"){
-      if ((rc=btree->Update(KEY_T(key.c_str()),VALUE_T(value.c_str())))!=ERROR_NOERROR) { 
-        cout <<"FAIL" <<endl;
-	cerr <<"Can't update due to error "<<rc<<"\n";
-      } else {
-        cout <<"OK\n";
+      btree = new BTreeIndex(0,0,&cache);
+      handler.SetIndex(btree);
+      btree->SetResultCacheSize(resultcachebytes);
+      if (commitbatch>0) { 
+	cache.SetLog(&log);
+	btree->SetSynchronousCommit(commitbatch==1);
       }
-    } else if (action == "DELETE"){
-      if ((rc=btree->Delete(KEY_T(key.c_str())))!=ERROR_NOERROR) { 
-        cout <<"FAIL"<<endl;
-	cerr <<"Can't delete due to error "<<rc<<endl;
+      if ((rc=btree->Attach(0))!=ERROR_NOERROR) {
+	cerr << "Can't attach btree due to error "<<rc<<"\n";
+	out << "FAIL\n";
       } else {
-        cout <<"OK\n";
+	out << "OK\n";
       }
-    } else if (action == "LOOKUP"){
-      VALUE_T lookup_value;
-      if ((rc=btree->Lookup(KEY_T(key.c_str()),lookup_value))!=ERROR_NOERROR) { 
-        cout <<"FAIL"<< endl;
-	cerr <<"Can't lookup due to error "<<rc<<endl;
-      } else {
-        cout <<"OK ";
- 	for (unsigned int k=0; k<lookup_value.length; k++) {
- 	    cout << lookup_value.data[k];
-	}
- 	cout << endl;
+      reattached=true;
+      windowreads=cache.GetNumReads();
+      windowdiskreads=cache.GetNumDiskReads();
+      starttime=Now();
+    } else if (op == REQUEST_DEINIT){
+      endtime=Now();
+      if (commitbatch>1 && pendingupdates>0) { 
+	// the last batch, which may be short
+	log.Commit(log.GetAppendedLSN());
+	pendingupdates=0;
+      }
+      if (commitbatch>1) { 
+	cout << held.str();
+	held.str("");
+      }
+      hasbloom=(btree->GetBloomFilterStats(bloomstats)==ERROR_NOERROR);
+      if (btree->GetResultCache()) { 
+	const ResultCache *r=btree->GetResultCache();
+	resulthits+=r->GetNumHits();
+	resultmisses+=r->GetNumMisses();
+	resultentries=r->GetNumEntries();
+	resultbytes=r->GetNumBytes();
+	resultevictions+=r->GetNumEvictions();
+	resultinvalidations+=r->GetNumInvalidations();
       }
-    } else if (action == "DISPLAY") {
-      // This should always be OK
-      cout <<"OK BEGIN DISPLAY\n";
-      btree->Display(cout,BTREE_SORTED_KEYVAL);
-      cout <<"OK END DISPLAY\n";
-    } else if (action == "DEINIT"){
       if ((rc=btree->Detach(superblocknum))!=ERROR_NOERROR) { 
-	cout << "FAIL"<<endl;
-	cerr << "Can't detach btree due to error "<<rc<<endl;
+	out << "FAIL\n";
+	Complain("detach btree",rc);
       } else {
 	if ((rc=cache.Detach())!=ERROR_NOERROR) { 
-	  cout <<"FAIL"<<endl;
-	  cerr <<"Can't detach cache due to error "<<rc<<endl;
+	  out << "FAIL\n";
+	  Complain("detach cache",rc);
 	} else {
 	  delete btree;
-	  cout << "OK\n";
+	  btree=0;
+	  handler.SetIndex(0);
+	  out << "OK\n";
 	}
       }
+    } else {
+      OpStats &s=interval[op];
+      SIZE_T hits=cache.GetNumHits();
+      SIZE_T diskreads=cache.GetNumDiskReads();
+      SIZE_T diskwrites=cache.GetNumDiskWrites();
+      SIZE_T splits=btree ? btree->GetNumSplits() : 0;
+      double simstart=cache.GetCurrentTime();
+      HISTOGRAM_T wallstart=NowNs();
+
+      rc=handler.Run(request,out);
+
+      s.walltime.Record(NowNs()-wallstart);
+      s.simtime.Record((HISTOGRAM_T)((cache.GetCurrentTime()-simstart)*SIM_SIM_UNITS_PER_MS+0.5));
+      s.count++;
+      s.hits+=cache.GetNumHits()-hits;
+      s.diskreads+=cache.GetNumDiskReads()-diskreads;
+      s.diskwrites+=cache.GetNumDiskWrites()-diskwrites;
+      s.splits+=(btree ? btree->GetNumSplits() : 0)-splits;
+      if (rc!=ERROR_NOERROR) { 
+	Complain(verbs[op],rc);
+      }
+      if (statsinterval>0 && numops%statsinterval==0) { 
+	PrintInterval(interval,numops,cache.GetCurrentTime());
+	for (int i=0;i<REQUEST_NUM_OPS;i++) { 
+	  total[i].Add(interval[i]);
+	  interval[i].Reset();
+	}
+      }
+    }
+
+    if (reattached && op!=REQUEST_ATTACH && numops%SIM_WARMUP_WINDOW==0) { 
+      SIZE_T reads=cache.GetNumReads()-windowreads;
+      SIZE_T diskreads=cache.GetNumDiskReads()-windowdiskreads;
+      windowratios.push_back(reads ? 1-(double)diskreads/reads : 1);
+      windowtimes.push_back(cache.GetCurrentTime()-warmstart);
+      windowreads=cache.GetNumReads();
+      windowdiskreads=cache.GetNumDiskReads();
+    }
+
+    if (commitbatch>1 && pendingupdates>=commitbatch) { 
+      // group commit: one flush makes the whole batch durable
+      log.Commit(log.GetAppendedLSN());
+      pendingupdates=0;
+      cout << held.str();
+      held.str("");
     }
+    if (commitbatch>0) { 
+      // whatever has been printed is durable
+      cout.flush();
+    }
+  }
+
+  if (commitbatch>1 && pendingupdates>0) { 
+    log.Commit(log.GetAppendedLSN());
+  }
+  if (commitbatch>1) { 
+    cout << held.str();
   }
     
-  fclose(file);
+  if (rc!=ERROR_NONEXISTENT) { 
+    cerr << "Can't read request due to error "<<rc<<"\n";
+  }
+
+  if (statsinterval>0 && numops%statsinterval!=0) { 
+    PrintInterval(interval,numops,cache.GetCurrentTime());
+  }
+  for (int op=0;op<REQUEST_NUM_OPS;op++) { 
+    total[op].Add(interval[op]);
+  }
+
+  ofstream hgrm;
+  if (statsinterval>0) { 
+    hgrm.open((string(filestem)+".hgrm").c_str());
+  }
+  char line[256];
+  cerr << "Latency statistics:\n";
+  cerr << "op                count  sim ms: p50      p99     p999      max wall ns: p50      p99     p999      max\n";
+  for (int op=0;op<REQUEST_NUM_OPS;op++) { 
+    const OpStats &s=total[op];
+    if (s.count==0) { 
+      continue;
+    }
+    snprintf(line,sizeof(line),"%-12s %10u %12.3f %8.3f %8.3f %8.3f %12llu %8llu %8llu %8llu\n",
+	     RequestReader::GetVerb((RequestOp)op),s.count,
+	     s.simtime.GetPercentile(50)/SIM_SIM_UNITS_PER_MS,
+	     s.simtime.GetPercentile(99)/SIM_SIM_UNITS_PER_MS,
+	     s.simtime.GetPercentile(99.9)/SIM_SIM_UNITS_PER_MS,
+	     s.simtime.GetMax()/SIM_SIM_UNITS_PER_MS,
+	     s.walltime.GetPercentile(50),s.walltime.GetPercentile(99),
+	     s.walltime.GetPercentile(99.9),s.walltime.GetMax());
+    cerr << line;
+    if (hgrm.is_open()) { 
+      hgrm << "# "<<RequestReader::GetVerb((RequestOp)op)<<", simulated ms\n";
+      s.simtime.PrintPercentiles(hgrm,SIM_SIM_UNITS_PER_MS);
+      hgrm << "\n# "<<RequestReader::GetVerb((RequestOp)op)<<", wall ns\n";
+      s.walltime.PrintPercentiles(hgrm);
+      hgrm << "\n";
+    }
+  }
+  cerr << "Per-op I/O statistics:\n";
+  cerr << "op                count      hits/op diskreads/op diskwrites/op splits/op\n";
+  for (int op=0;op<REQUEST_NUM_OPS;op++) { 
+    const OpStats &s=total[op];
+    if (s.count==0) { 
+      continue;
+    }
+    snprintf(line,sizeof(line),"%-12s %10u %12.3f %12.3f %13.3f %9.4f\n",
+	     RequestReader::GetVerb((RequestOp)op),s.count,
+	     (double)s.hits/s.count,(double)s.diskreads/s.count,
+	     (double)s.diskwrites/s.count,(double)s.splits/s.count);
+    cerr << line;
+  }
+
+  if (tracerate>0) { 
+    if ((rc=cache.StopTrace())!=ERROR_NOERROR) { 
+      Complain("save trace",rc);
+    }
+    cerr << "Trace statistics:\n";
+    cerr << "samplerate      = "<<cache.GetTrace()->GetSampleRate()<<endl;
+    cerr << "numrecords      = "<<cache.GetTrace()->GetNumRecords()<<endl;
+    cerr << "numdropped      = "<<cache.GetTrace()->GetNumDropped()<<endl;
+  }
+
+  if (mrcrate>0) { 
+    const MissRatioCurve *mrc=cache.GetMissRatioCurve();
+    if ((rc=mrc->Save(string(filestem)+".mrc"))!=ERROR_NOERROR) { 
+      Complain("save miss ratio curve",rc);
+    }
+    cerr << "Miss ratio curve:\n";
+    mrc->Print(cerr,cachesize);
+    cerr << "measured        = "<<(cache.GetNumReads() ? (double)cache.GetNumHits()/cache.GetNumReads() : 0)<<" (this cache)"<<endl;
+  }
+
+  cerr << "Disk statistics:\n";
+  cache.GetDiskAccessStats().Print(cerr);
+
+  if (commitbatch>0) { 
+    cerr << "Log statistics:\n";
+    cerr << "numupdates      = "<<numupdates<<endl;
+    cerr << "numlogrecords   = "<<log.GetNumRecords()<<endl;
+    cerr << "numlogbytes     = "<<log.GetNumBytes()<<endl;
+    cerr << "numcommits      = "<<log.GetNumCommits()<<endl;
+    cerr << "numlogsyncs     = "<<log.GetNumSyncs()<<endl;
+    cerr << "numlogtruncates = "<<log.GetNumTruncates()<<endl;
+    cerr << "updates/sync    = "<<(log.GetNumSyncs() ? (double)numupdates/log.GetNumSyncs() : 0)<<endl;
+    cerr << "ops/s           = "<<(endtime>starttime ? numops/(endtime-starttime) : 0)<<endl;
+  }
+
+  if (resultcachebytes>0) { 
+    cerr << "Result cache statistics:\n";
+    cerr << "maxbytes        = "<<resultcachebytes<<endl;
+    cerr << "numbytes        = "<<resultbytes<<endl;
+    cerr << "numentries      = "<<resultentries<<endl;
+    cerr << "numhits         = "<<resulthits<<endl;
+    cerr << "nummisses       = "<<resultmisses<<endl;
+    cerr << "numevictions    = "<<resultevictions<<endl;
+    cerr << "invalidations   = "<<resultinvalidations<<endl;
+    cerr << "hitratio        = "<<(resulthits+resultmisses ? (double)resulthits/(resulthits+resultmisses) : 0)<<endl;
+  }
+
+  if (windowratios.size()>=2) { 
+    // the first window that gets close to where the run ended up
+    SIZE_T warm=0;
+    while (windowratios[warm]<SIM_WARMUP_FRACTION*windowratios.back()) { 
+      warm++;
+    }
+    cerr << "Cache warm-up statistics:\n";
+    cerr << "warmblocks      = "<<cache.GetNumWarmBlocks()<<endl;
+    cerr << "warmrequests    = "<<cache.GetNumWarmRequests()<<endl;
+    cerr << "firsthitratio   = "<<windowratios[0]<<endl;
+    cerr << "lasthitratio    = "<<windowratios.back()<<endl;
+    cerr << "warmupops       = "<<(warm+1)*SIM_WARMUP_WINDOW<<endl;
+    cerr << "warmuptime      = "<<windowtimes[warm]<<endl;
+  }
+
+  if (hasbloom) { 
+    SIZE_T misses=bloomstats.numnegatives+bloomstats.numfalsepositives;
+    cerr << "Bloom filter statistics:\n";
+    cerr << "numbits         = "<<bloomstats.numbits<<endl;
+    cerr << "numbitsset      = "<<bloomstats.numbitsset<<endl;
+    cerr << "numprobes       = "<<bloomstats.numprobes<<endl;
+    cerr << "descentsavoided = "<<bloomstats.numnegatives<<endl;
+    cerr << "falsepositives  = "<<bloomstats.numfalsepositives<<endl;
+    cerr << "fprate          = "<<(misses ? (double)bloomstats.numfalsepositives/misses : 0)<<endl;
+  }
 
   return 0;
 
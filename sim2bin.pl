@@ -0,0 +1,29 @@
+#!/usr/bin/perl -w
+
+$#ARGV==-1 or die "usage: sim2bin.pl < simrequests > binaryrequests\n";
+
+# Converts text requests for sim into its binary request format (see
+# request.h): the magic, then for each request the op byte, the key
+# and value lengths as native 32 bit integers, and the key and value.
+# INIT carries everything after the verb as its key.
+
+%ops=(INIT=>1, ATTACH=>2, INSERT=>3, UPDATE=>4, DELETE=>5, LOOKUP=>6,
+      LOOKUPALL=>7, COUNT=>8, SELECT=>9, SAMPLE=>10, DISPLAY=>11, DEINIT=>12);
+
+binmode(STDOUT);
+print "\0BRQ";
+
+while (<STDIN>) {
+  s/^\s+//;
+  s/\s+$//;
+  my ($verb,$rest)=split(/\s+/,$_,2);
+  next if (!defined $verb || !defined $ops{$verb});
+  my ($key,$value)=("","");
+  if ($verb eq "INIT") {
+    $key=defined $rest ? $rest : "";
+  } elsif (defined $rest) {
+    ($key,$value)=split(/\s+/,$rest);
+    $value="" if (!defined $value);
+  }
+  print pack("CLL",$ops{$verb},length($key),length($value)), $key, $value;
+}
@@ -0,0 +1,201 @@
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "cachetrace.h"
+#include "btree_ds.h"
+
+
+void usage()
+{
+  cerr << "usage: tracebuffer filestem [summary|heat|dump] [n]\n";
+}
+
+//
+// Reads what a traced buffer cache left behind (see CacheTrace):
+//
+// summary  the trace's accesses, hits and misses by node type, and how
+//          the heat map spreads the accesses over the blocks
+// heat     "block reads writes misses" for the n hottest blocks, hottest
+//          first, or for all of them
+// dump     the first n trace records as text, or all of them
+//
+
+#define TRACEBUFFER_NUM_TYPES (BTREE_BLOOM_BLOCK+1)
+
+static const char *types[TRACEBUFFER_NUM_TYPES] = {
+  "other", "superblock", "root", "interior", "leaf", "freespace", "overflow", "bloom"
+};
+
+static const char *TypeName(const BYTE_T type)
+{
+  return type<TRACEBUFFER_NUM_TYPES ? types[type] : "other";
+}
+
+static bool Hotter(const CacheHeatEntry &a, const CacheHeatEntry &b)
+{
+  SIZE_T x=a.reads+a.writes, y=b.reads+b.writes;
+  return x>y || (x==y && a.block<b.block);
+}
+
+static ERROR_T ReadHeat(const string &filestem, vector<CacheHeatEntry> &entries)
+{
+  CacheHeatHeader h;
+  FILE *f;
+
+  if (!(f=fopen((filestem+".heat").c_str(),"r"))) {
+    return ERROR_NOFILE;
+  }
+  if (fread(&h,sizeof(h),1,f)!=1 || h.magic!=CACHEHEAT_MAGIC) {
+    fclose(f);
+    return ERROR_INSANE;
+  }
+  entries.resize(h.count);
+  if (h.count>0 && fread(&entries[0],sizeof(CacheHeatEntry),h.count,f)!=h.count) {
+    fclose(f);
+    return ERROR_INSANE;
+  }
+  fclose(f);
+  return ERROR_NOERROR;
+}
+
+static FILE *OpenTrace(const string &filestem, CacheTraceHeader &h)
+{
+  FILE *f;
+
+  if (!(f=fopen((filestem+".trace").c_str(),"r"))) {
+    return 0;
+  }
+  if (fread(&h,sizeof(h),1,f)!=1 || h.magic!=CACHETRACE_MAGIC) {
+    fclose(f);
+    return 0;
+  }
+  return f;
+}
+
+
+int main(int argc, char *argv[])
+{
+  if (argc<2 || argc>4) {
+    usage();
+    exit(-1);
+  }
+
+  string filestem=argv[1];
+  string what=(argc>=3) ? argv[2] : "summary";
+  unsigned long long limit=(argc==4) ? strtoull(argv[3],0,10) : 0;
+
+  if (what=="heat") {
+    vector<CacheHeatEntry> entries;
+    if (ReadHeat(filestem,entries)!=ERROR_NOERROR) {
+      cerr << "Can't read "<<filestem<<".heat\n";
+      exit(-1);
+    }
+    sort(entries.begin(),entries.end(),Hotter);
+    if (limit>0 && limit<entries.size()) {
+      entries.resize(limit);
+    }
+    cout << "# block reads writes misses\n";
+    for (SIZE_T i=0;i<entries.size();i++) {
+      cout << entries[i].block<<" "<<entries[i].reads<<" "<<entries[i].writes<<" "<<entries[i].misses<<"\n";
+    }
+    return 0;
+  }
+
+  CacheTraceHeader h;
+  FILE *f=OpenTrace(filestem,h);
+  if (!f) {
+    cerr << "Can't read "<<filestem<<".trace\n";
+    exit(-1);
+  }
+
+  if (what=="dump") {
+    CacheTraceRecord r;
+    cout << "# time block op result type\n";
+    for (unsigned long long i=0; (limit==0 || i<limit) && fread(&r,sizeof(r),1,f)==1; i++) {
+      cout << r.time<<" "<<r.block<<" "
+	   << ((r.flags&CACHETRACE_WRITE) ? "write" : "read")<<" "
+	   << ((r.flags&CACHETRACE_PREFETCH) ? "prefetch" : (r.flags&CACHETRACE_MISS) ? "miss" : "hit")<<" "
+	   << TypeName(r.nodetype)<<"\n";
+    }
+    fclose(f);
+    return 0;
+  }
+
+  if (what!="summary") {
+    fclose(f);
+    usage();
+    exit(-1);
+  }
+
+  // accesses and misses by node type, reads then writes
+  unsigned long long accesses[TRACEBUFFER_NUM_TYPES][2]={{0}};
+  unsigned long long missed[TRACEBUFFER_NUM_TYPES][2]={{0}};
+  unsigned long long prefetches=0;
+  vector<bool> seen(h.numblocks,false);
+  SIZE_T distinct=0;
+  vector<CacheTraceRecord> buf(4096);
+  SIZE_T n;
+
+  while ((n=fread(&buf[0],sizeof(CacheTraceRecord),buf.size(),f))>0) {
+    for (SIZE_T i=0;i<n;i++) {
+      const CacheTraceRecord &r=buf[i];
+      BYTE_T t=r.nodetype<TRACEBUFFER_NUM_TYPES ? r.nodetype : 0;
+      int w=(r.flags&CACHETRACE_WRITE) ? 1 : 0;
+      if (r.flags&CACHETRACE_PREFETCH) {
+	prefetches++;
+	continue;
+      }
+      accesses[t][w]++;
+      missed[t][w]+=(r.flags&CACHETRACE_MISS) ? 1 : 0;
+      if (r.block<h.numblocks && !seen[r.block]) {
+	seen[r.block]=true;
+	distinct++;
+      }
+    }
+  }
+  fclose(f);
+
+  cerr << "Trace statistics:\n";
+  cerr << "numblocks       = "<<h.numblocks<<endl;
+  cerr << "blocksize       = "<<h.blocksize<<endl;
+  cerr << "cachesize       = "<<h.cachesize<<endl;
+  cerr << "samplerate      = "<<h.samplerate<<endl;
+  cerr << "numrecords      = "<<h.numrecords<<endl;
+  cerr << "numdropped      = "<<h.numdropped<<endl;
+  cerr << "numprefetches   = "<<prefetches<<endl;
+  cerr << "distinctblocks  = "<<distinct<<endl;
+  cerr << "type             reads  readmiss    writes writemiss\n";
+  for (SIZE_T t=0;t<TRACEBUFFER_NUM_TYPES;t++) {
+    char line[128];
+    if (accesses[t][0]+accesses[t][1]==0) {
+      continue;
+    }
+    snprintf(line,sizeof(line),"%-12s %9llu %8.2f%% %9llu %8.2f%%\n",TypeName(t),
+	     accesses[t][0],accesses[t][0] ? 100.0*missed[t][0]/accesses[t][0] : 0,
+	     accesses[t][1],accesses[t][1] ? 100.0*missed[t][1]/accesses[t][1] : 0);
+    cerr << line;
+  }
+
+  vector<CacheHeatEntry> entries;
+  if (ReadHeat(filestem,entries)==ERROR_NOERROR && !entries.empty()) {
+    unsigned long long all=0, top1=0, top10=0;
+    sort(entries.begin(),entries.end(),Hotter);
+    for (SIZE_T i=0;i<entries.size();i++) {
+      SIZE_T a=entries[i].reads+entries[i].writes;
+      all+=a;
+      top1+=(i<(entries.size()+99)/100) ? a : 0;
+      top10+=(i<(entries.size()+9)/10) ? a : 0;
+    }
+    cerr << "Heat map statistics:\n";
+    cerr << "blocksaccessed  = "<<entries.size()<<endl;
+    cerr << "accesses        = "<<all<<endl;
+    cerr << "hottest block   = "<<entries[0].block<<endl;
+    cerr << "hottest 1%      = "<<100.0*top1/all<<"% of accesses"<<endl;
+    cerr << "hottest 10%     = "<<100.0*top10/all<<"% of accesses"<<endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,419 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "wal.h"
+
+static const char WAL_MAGIC[8] = {'B','T','R','E','E','W','A','L'};
+static const SIZE_T WAL_HEADER_SIZE = sizeof(WAL_MAGIC)+2*sizeof(LSN_T);
+static const LSN_T  WAL_NO_CHECKPOINT = ~(LSN_T)0;
+
+
+static SIZE_T Checksum(const BYTE_T *buf, const SIZE_T len, SIZE_T sum)
+{
+  // FNV-1a
+  for (SIZE_T i=0;i<len;i++) {
+    sum ^= buf[i];
+    sum *= 16777619;
+  }
+  return sum;
+}
+
+
+WriteAheadLog::WriteAheadLog(const string &filestem) :
+  filename(filestem+".wal"),
+  fd(-1),
+  baselsn(0),
+  appendedlsn(0),
+  durablelsn(0),
+  checkpointlsn(WAL_NO_CHECKPOINT),
+  flushing(false),
+  numrecords(0),
+  numcommits(0),
+  numsyncs(0),
+  numtruncates(0),
+  numbytes(0)
+{
+  pthread_mutex_init(&lock,0);
+  pthread_cond_init(&flushed,0);
+}
+
+
+WriteAheadLog::~WriteAheadLog()
+{
+  Close();
+  pthread_cond_destroy(&flushed);
+  pthread_mutex_destroy(&lock);
+}
+
+
+ERROR_T WriteAheadLog::WriteHeader()
+{
+  BYTE_T header[WAL_HEADER_SIZE];
+
+  memcpy(header,WAL_MAGIC,sizeof(WAL_MAGIC));
+  memcpy(header+sizeof(WAL_MAGIC),&baselsn,sizeof(LSN_T));
+  memcpy(header+sizeof(WAL_MAGIC)+sizeof(LSN_T),&checkpointlsn,sizeof(LSN_T));
+
+  if (pwrite(fd,header,WAL_HEADER_SIZE,0)!=(ssize_t)WAL_HEADER_SIZE) {
+    cerr << "WriteAheadLog: can't write header of "<<filename<<endl;
+    return ERROR_IMPLBUG;
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T WriteAheadLog::Open()
+{
+  struct stat s;
+  BYTE_T header[WAL_HEADER_SIZE];
+
+  if ((fd=open(filename.c_str(),O_RDWR|O_CREAT,0644))<0) {
+    return ERROR_NOFILE;
+  }
+
+  if (fstat(fd,&s) || (SIZE_T)s.st_size<WAL_HEADER_SIZE) {
+    // brand new log
+    baselsn=0;
+    checkpointlsn=WAL_NO_CHECKPOINT;
+    if (ftruncate(fd,0) || WriteHeader() || fsync(fd)) {
+      return ERROR_NOFILE;
+    }
+    appendedlsn=durablelsn=baselsn;
+    return ERROR_NOERROR;
+  }
+
+  if (pread(fd,header,WAL_HEADER_SIZE,0)!=(ssize_t)WAL_HEADER_SIZE ||
+      memcmp(header,WAL_MAGIC,sizeof(WAL_MAGIC))) {
+    cerr << "WriteAheadLog: "<<filename<<" is not a log\n";
+    return ERROR_BADCONFIG;
+  }
+  memcpy(&baselsn,header+sizeof(WAL_MAGIC),sizeof(LSN_T));
+  memcpy(&checkpointlsn,header+sizeof(WAL_MAGIC)+sizeof(LSN_T),sizeof(LSN_T));
+  appendedlsn=durablelsn=baselsn+(s.st_size-WAL_HEADER_SIZE);
+
+  // Find the real end of the log.  Everything before the checkpoint
+  // was durable when the header was written, so only the records
+  // after it can be torn.
+  if (checkpointlsn!=WAL_NO_CHECKPOINT && 
+      (checkpointlsn<baselsn || checkpointlsn>=appendedlsn)) {
+    cerr << "WriteAheadLog: "<<filename<<" has a bad checkpoint\n";
+    return ERROR_BADCONFIG;
+  }
+  LSN_T pos=(checkpointlsn!=WAL_NO_CHECKPOINT) ? checkpointlsn : baselsn;
+  WALRecordHeader h;
+  Block payload;
+
+  while (ReadRecordLocked(pos,h,payload)==ERROR_NOERROR) {
+  }
+  if (pos!=appendedlsn) {
+    if (ftruncate(fd,WAL_HEADER_SIZE+(pos-baselsn)) || fsync(fd)) {
+      return ERROR_NOFILE;
+    }
+    appendedlsn=durablelsn=pos;
+  }
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T WriteAheadLog::Close()
+{
+  if (fd<0) {
+    return ERROR_NOERROR;
+  }
+  ERROR_T rc=Flush(GetAppendedLSN());
+  close(fd);
+  fd=-1;
+  return rc;
+}
+
+
+ERROR_T WriteAheadLog::Append(const SIZE_T type,
+			      const SIZE_T blocknum,
+			      const BYTE_T *payload,
+			      const SIZE_T length,
+			      LSN_T &lsn)
+{
+  WALRecordHeader h;
+
+  memset(&h,0,sizeof(h));
+  h.type=type;
+  h.blocknum=blocknum;
+  h.length=length;
+
+  pthread_mutex_lock(&lock);
+
+  h.lsn=appendedlsn+sizeof(h)+length;
+  h.checksum=Checksum(payload,length,Checksum((BYTE_T*)&h,sizeof(h),2166136261u));
+
+  tail.append((const char*)&h,sizeof(h));
+  tail.append((const char*)payload,length);
+  appendedlsn=lsn=h.lsn;
+  numrecords++;
+  numbytes+=sizeof(h)+length;
+
+  pthread_mutex_unlock(&lock);
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T WriteAheadLog::AppendPage(const SIZE_T blocknum, const Block &block, LSN_T &lsn)
+{
+  return Append(WAL_PAGE,blocknum,block.data,block.length,lsn);
+}
+
+
+ERROR_T WriteAheadLog::Flush(const LSN_T lsn)
+{
+  ERROR_T rc=ERROR_NOERROR;
+
+  pthread_mutex_lock(&lock);
+
+  while (durablelsn<lsn && rc==ERROR_NOERROR) {
+    if (flushing) {
+      // Someone else is leading a group, our record may be in it
+      pthread_cond_wait(&flushed,&lock);
+      continue;
+    }
+    // Lead a group consisting of everything appended so far
+    string group;
+    group.swap(tail);
+    LSN_T start=durablelsn;
+    LSN_T end=appendedlsn;
+    flushing=true;
+    pthread_mutex_unlock(&lock);
+
+    if (pwrite(fd,group.data(),group.size(),WAL_HEADER_SIZE+(start-baselsn))!=(ssize_t)group.size() ||
+	fdatasync(fd)) {
+      cerr << "WriteAheadLog: can't write "<<filename<<endl;
+      rc=ERROR_IMPLBUG;
+    }
+
+    pthread_mutex_lock(&lock);
+    if (rc==ERROR_NOERROR) {
+      durablelsn=end;
+      numsyncs++;
+    }
+    flushing=false;
+    pthread_cond_broadcast(&flushed);
+  }
+
+  pthread_mutex_unlock(&lock);
+
+  return rc;
+}
+
+
+ERROR_T WriteAheadLog::Commit(const LSN_T lsn)
+{
+  ERROR_T rc=Flush(lsn);
+
+  pthread_mutex_lock(&lock);
+  numcommits++;
+  pthread_mutex_unlock(&lock);
+
+  return rc;
+}
+
+
+ERROR_T WriteAheadLog::Checkpoint(const BYTE_T *payload, const SIZE_T length, LSN_T &lsn)
+{
+  ERROR_T rc;
+
+  if ((rc=Append(WAL_CHECKPOINT,0,payload,length,lsn)) ||
+      (rc=Flush(lsn))) {
+    return rc;
+  }
+
+  pthread_mutex_lock(&lock);
+  LSN_T old=checkpointlsn;
+  checkpointlsn=lsn-sizeof(WALRecordHeader)-length;
+  if (WriteHeader() || fdatasync(fd)) {
+    checkpointlsn=old;
+    rc=ERROR_IMPLBUG;
+  }
+  pthread_mutex_unlock(&lock);
+
+  return rc;
+}
+
+
+ERROR_T WriteAheadLog::ReadRecordLocked(LSN_T &pos, WALRecordHeader &h, Block &payload) const
+{
+  if (pos<baselsn || pos+sizeof(h)>durablelsn) {
+    return ERROR_NONEXISTENT;
+  }
+  if (pread(fd,&h,sizeof(h),WAL_HEADER_SIZE+(pos-baselsn))!=(ssize_t)sizeof(h) ||
+      h.lsn!=pos+sizeof(h)+h.length ||
+      h.lsn>durablelsn) {
+    return ERROR_NONEXISTENT;
+  }
+
+  payload.Resize(h.length,false);
+  if (h.length>0 &&
+      pread(fd,payload.data,h.length,WAL_HEADER_SIZE+(pos-baselsn)+sizeof(h))!=(ssize_t)h.length) {
+    return ERROR_NONEXISTENT;
+  }
+
+  WALRecordHeader c=h;
+  c.checksum=0;
+  if (Checksum(payload.data,h.length,Checksum((BYTE_T*)&c,sizeof(c),2166136261u))!=h.checksum) {
+    return ERROR_NONEXISTENT;
+  }
+
+  pos=h.lsn;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T WriteAheadLog::ReadRecord(LSN_T &pos, WALRecordHeader &h, Block &payload) const
+{
+  pthread_mutex_lock(&lock);
+  ERROR_T rc=ReadRecordLocked(pos,h,payload);
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+
+ERROR_T WriteAheadLog::Truncate(const LSN_T lsn)
+{
+  string tmp=filename+".tmp";
+  BYTE_T buf[65536];
+  ERROR_T rc=ERROR_NOERROR;
+  int newfd, oldfd;
+  LSN_T oldbase, pos;
+  ssize_t n;
+
+  pthread_mutex_lock(&lock);
+
+  while (flushing) {
+    pthread_cond_wait(&flushed,&lock);
+  }
+  if (lsn<=baselsn || lsn>durablelsn) {
+    pthread_mutex_unlock(&lock);
+    return ERROR_NOERROR;
+  }
+  if ((newfd=open(tmp.c_str(),O_RDWR|O_CREAT|O_TRUNC,0644))<0) {
+    pthread_mutex_unlock(&lock);
+    return ERROR_NOFILE;
+  }
+
+  // the durable records from lsn on, behind a header that starts there
+  for (pos=lsn;pos<durablelsn && rc==ERROR_NOERROR;pos+=n) {
+    n=(durablelsn-pos<sizeof(buf)) ? durablelsn-pos : sizeof(buf);
+    if (pread(fd,buf,n,WAL_HEADER_SIZE+(pos-baselsn))!=n ||
+	pwrite(newfd,buf,n,WAL_HEADER_SIZE+(pos-lsn))!=n) {
+      rc=ERROR_IMPLBUG;
+    }
+  }
+  oldfd=fd;
+  oldbase=baselsn;
+  fd=newfd;
+  baselsn=lsn;
+  // a crash sees either the old log or the whole new one
+  if (rc || WriteHeader() || fdatasync(fd) || rename(tmp.c_str(),filename.c_str())) {
+    cerr << "WriteAheadLog: can't truncate "<<filename<<endl;
+    fd=oldfd;
+    baselsn=oldbase;
+    close(newfd);
+    remove(tmp.c_str());
+    rc=ERROR_IMPLBUG;
+  } else {
+    close(oldfd);
+    numtruncates++;
+  }
+
+  pthread_mutex_unlock(&lock);
+
+  return rc;
+}
+
+
+ERROR_T WriteAheadLog::Reset()
+{
+  ERROR_T rc;
+
+  pthread_mutex_lock(&lock);
+
+  while (flushing) {
+    pthread_cond_wait(&flushed,&lock);
+  }
+  tail.clear();
+  baselsn=appendedlsn;
+  durablelsn=appendedlsn;
+  checkpointlsn=WAL_NO_CHECKPOINT;
+  if (ftruncate(fd,0) || (rc=WriteHeader()) || fsync(fd)) {
+    rc=ERROR_IMPLBUG;
+  } else {
+    rc=ERROR_NOERROR;
+  }
+
+  pthread_mutex_unlock(&lock);
+
+  return rc;
+}
+
+
+LSN_T WriteAheadLog::GetAppendedLSN() const
+{
+  pthread_mutex_lock(&lock);
+  LSN_T l=appendedlsn;
+  pthread_mutex_unlock(&lock);
+  return l;
+}
+
+
+LSN_T WriteAheadLog::GetDurableLSN() const
+{
+  pthread_mutex_lock(&lock);
+  LSN_T l=durablelsn;
+  pthread_mutex_unlock(&lock);
+  return l;
+}
+
+
+LSN_T WriteAheadLog::GetBaseLSN() const
+{
+  pthread_mutex_lock(&lock);
+  LSN_T l=baselsn;
+  pthread_mutex_unlock(&lock);
+  return l;
+}
+
+
+bool WriteAheadLog::HasCheckpoint() const
+{
+  return GetCheckpointLSN()!=WAL_NO_CHECKPOINT;
+}
+
+
+LSN_T WriteAheadLog::GetCheckpointLSN() const
+{
+  pthread_mutex_lock(&lock);
+  LSN_T l=checkpointlsn;
+  pthread_mutex_unlock(&lock);
+  return l;
+}
+
+
+ostream & WriteAheadLog::Print(ostream &os) const
+{
+  os << "WriteAheadLog(filename="<<filename
+     << ", baselsn="<<baselsn
+     << ", appendedlsn="<<appendedlsn
+     << ", durablelsn="<<durablelsn
+     << ", checkpointlsn="<<checkpointlsn
+     << ", numrecords="<<numrecords
+     << ", numcommits="<<numcommits
+     << ", numsyncs="<<numsyncs
+     << ", numtruncates="<<numtruncates
+     << ", numbytes="<<numbytes
+     << ")";
+  return os;
+}
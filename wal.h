@@ -0,0 +1,126 @@
+#ifndef _wal
+#define _wal
+
+#include <string>
+#include <iostream>
+#include <pthread.h>
+
+#include "global.h"
+#include "block.h"
+
+using namespace std;
+
+// Types of log records
+#define WAL_PAGE 1        // after-image of a block
+#define WAL_OPERATION 2   // logical insert/update/delete, ends the operation
+#define WAL_CHECKPOINT 3  // fuzzy checkpoint, payload belongs to the index
+
+struct WALRecordHeader {
+  LSN_T  lsn;       // log position just past this record
+  SIZE_T type;
+  SIZE_T blocknum;  // meaningful only for WAL_PAGE
+  SIZE_T length;    // number of payload bytes that follow
+  SIZE_T checksum;  // over the header (with checksum=0) and payload
+};
+
+//
+// Write-ahead log kept in "filestem.wal"
+//
+// Records are appended to an in-memory tail and made durable by
+// Flush(), which implements group commit: one caller becomes the
+// leader and writes and fsyncs everything appended so far, while any
+// other callers whose records were included just wait for it.
+//
+// An LSN is the log position just past a record, so a record is
+// durable once GetDurableLSN() has reached its LSN.  LSNs keep
+// growing across Reset(), which only discards the log contents.
+//
+// The file header names the most recent checkpoint record, so that
+// Open() and recovery only have to look at the log from there on.
+// Open() validates the records after the checkpoint and cuts the log
+// at the first torn or corrupt one.
+//
+// Truncate() drops the records a checkpoint made unnecessary by
+// copying the rest into a new file that replaces the old one, so the
+// log stays about as long as the checkpoint interval.
+//
+class WriteAheadLog {
+ private:
+  string filename;
+  int    fd;
+  LSN_T  baselsn;     // LSN of the first byte after the file header
+  LSN_T  appendedlsn; // end of the last appended record
+  LSN_T  durablelsn;  // end of the last fsynced record
+  LSN_T  checkpointlsn; // start of the last checkpoint record
+  string tail;        // appended but not yet written
+  bool   flushing;
+  mutable pthread_mutex_t lock;
+  pthread_cond_t  flushed;
+  SIZE_T numrecords, numcommits, numsyncs, numtruncates;
+  LSN_T  numbytes;
+
+  ERROR_T WriteHeader();
+  ERROR_T ReadRecordLocked(LSN_T &pos, WALRecordHeader &h, Block &payload) const;
+
+ public:
+  WriteAheadLog(const string &filestem);
+  WriteAheadLog() { throw GenericException(); }
+  WriteAheadLog(const WriteAheadLog &rhs) { throw GenericException(); }
+  WriteAheadLog & operator=(const WriteAheadLog &rhs) { throw GenericException(); return *this; }
+  virtual ~WriteAheadLog();
+
+  // Opens the log, creating an empty one if there is none
+  ERROR_T Open();
+  ERROR_T Close();
+
+  // Appends a record and returns its LSN.  Nothing is durable yet.
+  ERROR_T Append(const SIZE_T type,
+		 const SIZE_T blocknum,
+		 const BYTE_T *payload,
+		 const SIZE_T length,
+		 LSN_T &lsn);
+
+  ERROR_T AppendPage(const SIZE_T blocknum, const Block &block, LSN_T &lsn);
+
+  // Blocks until everything up to lsn is on stable storage
+  ERROR_T Flush(const LSN_T lsn);
+
+  // Flush on behalf of a completed operation
+  ERROR_T Commit(const LSN_T lsn);
+
+  // Appends a checkpoint record, makes it durable, and then points
+  // the file header at it
+  ERROR_T Checkpoint(const BYTE_T *payload, const SIZE_T length, LSN_T &lsn);
+
+  // Reads the durable record that starts at pos and advances pos to
+  // the next one.  Returns ERROR_NONEXISTENT at the end of the log.
+  ERROR_T ReadRecord(LSN_T &pos, WALRecordHeader &h, Block &payload) const;
+
+  // Throws away the records before lsn.  Only call this once nothing
+  // before lsn is needed for recovery.
+  ERROR_T Truncate(const LSN_T lsn);
+
+  // Throws away the contents.  Only call this once everything the log
+  // describes is durable in the data file.
+  ERROR_T Reset();
+
+  LSN_T  GetAppendedLSN() const;
+  LSN_T  GetDurableLSN() const;
+  // First position in the log
+  LSN_T  GetBaseLSN() const;
+  bool   HasCheckpoint() const;
+  // Position of the last checkpoint record
+  LSN_T  GetCheckpointLSN() const;
+
+  SIZE_T GetNumRecords() const { return numrecords; }
+  SIZE_T GetNumCommits() const { return numcommits; }
+  SIZE_T GetNumSyncs() const { return numsyncs; }
+  SIZE_T GetNumTruncates() const { return numtruncates; }
+  LSN_T  GetNumBytes() const { return numbytes; }
+
+  ostream & Print(ostream &os) const;
+};
+
+inline ostream & operator<< (ostream &os, const WriteAheadLog &rhs) { return rhs.Print(os);}
+
+#endif